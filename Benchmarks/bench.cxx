@@ -0,0 +1,124 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.hxx"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+
+namespace Interject::Bench {
+
+static std::map<std::string, Benchmark, std::less<>> &registry() {
+  static std::map<std::string, Benchmark, std::less<>> benchmarks;
+  return benchmarks;
+}
+
+Registration::Registration(std::string_view name, Benchmark benchmark) {
+  registry().emplace(name, std::move(benchmark));
+}
+
+// Nearest-rank percentile of sorted samples.
+static Duration percentile(const std::vector<Duration> &sorted, double p) {
+  const auto rank = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+void Context::report(std::string_view name, const Params &params,
+                     std::vector<Duration> samples,
+                     std::size_t operationsPerSample) const {
+  if (samples.empty()) {
+    return;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  Duration total{};
+  for (const auto sample : samples) {
+    total += sample;
+  }
+
+  const auto perOperation = [&](Duration duration) {
+    return static_cast<double>(duration.count()) / operationsPerSample;
+  };
+
+  // One JSON object per line so results can be appended to a log and
+  // compared across runs.
+  std::cout << "{\"benchmark\":\"" << name << "\",\"params\":{";
+  for (std::size_t idx = 0; idx < params.size(); idx++) {
+    std::cout << (idx ? "," : "") << "\"" << params[idx].first << "\":\""
+              << params[idx].second << "\"";
+  }
+  std::cout << "},\"unit\":\"ns\",\"samples\":" << samples.size()
+            << std::fixed << std::setprecision(1)
+            << ",\"min\":" << perOperation(samples.front())
+            << ",\"p50\":" << perOperation(percentile(samples, 0.50))
+            << ",\"p90\":" << perOperation(percentile(samples, 0.90))
+            << ",\"p99\":" << perOperation(percentile(samples, 0.99))
+            << ",\"p999\":" << perOperation(percentile(samples, 0.999))
+            << ",\"max\":" << perOperation(samples.back())
+            << ",\"mean\":" << perOperation(total / samples.size()) << "}"
+            << std::endl;
+}
+
+}; // namespace Interject::Bench
+
+using namespace Interject;
+
+static void usage(const char *program) {
+  std::cerr << "usage: " << program << " [--samples N] [--list] [filter]\n"
+            << "Runs every benchmark whose name contains filter and prints "
+               "one JSON object per configuration.\n";
+}
+
+int main(int argc, char **argv) {
+  std::size_t samples = 100;
+  std::string_view filter;
+  bool list = false;
+
+  for (int idx = 1; idx < argc; idx++) {
+    if (std::strcmp(argv[idx], "--samples") == 0 && idx + 1 < argc) {
+      samples = std::strtoul(argv[++idx], nullptr, 10);
+    } else if (std::strcmp(argv[idx], "--list") == 0) {
+      list = true;
+    } else if (argv[idx][0] == '-') {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    } else {
+      filter = argv[idx];
+    }
+  }
+
+  if (samples == 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const Bench::Context context(samples);
+  for (const auto &[name, benchmark] : Bench::registry()) {
+    if (name.find(filter) == std::string::npos) {
+      continue;
+    }
+    if (list) {
+      std::cout << name << std::endl;
+      continue;
+    }
+    benchmark(context);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace Interject::Bench {
+
+using Clock = std::chrono::steady_clock;
+using Duration = std::chrono::nanoseconds;
+
+// Named integer or string parameters identifying one configuration of a
+// benchmark, e.g. {{"threads", "16"}, {"mode", "busy"}}.
+using Params = std::vector<std::pair<std::string, std::string>>;
+
+class Context {
+public:
+  explicit Context(std::size_t samples) : _samples(samples) {}
+
+  // Number of timed samples to collect per configuration.
+  std::size_t samples() const noexcept { return _samples; }
+
+  // Report the samples collected for one configuration of a benchmark as a
+  // single line of JSON on stdout, in nanoseconds per operation. Each sample
+  // may time a batch of operations so very short ones can be measured.
+  void report(std::string_view name, const Params &params,
+              std::vector<Duration> samples,
+              std::size_t operationsPerSample = 1) const;
+
+  // Time samples() runs of fn after a few untimed warmup runs and report
+  // them.
+  template <typename Fn>
+  void measure(std::string_view name, const Params &params, Fn &&fn) const {
+    for (std::size_t run = 0; run < WARMUP_RUNS; run++) {
+      fn();
+    }
+
+    std::vector<Duration> samples;
+    samples.reserve(_samples);
+    for (std::size_t run = 0; run < _samples; run++) {
+      const auto start = Clock::now();
+      fn();
+      samples.push_back(Clock::now() - start);
+    }
+    report(name, params, std::move(samples));
+  }
+
+private:
+  static constexpr std::size_t WARMUP_RUNS = 3;
+
+  std::size_t _samples;
+};
+
+using Benchmark = std::function<void(const Context &)>;
+
+// Register a benchmark at static initialization time. Benchmarks run in name
+// order and can be selected with a substring filter on the command line.
+struct Registration {
+  Registration(std::string_view name, Benchmark benchmark);
+};
+
+}; // namespace Interject::Bench
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.hxx"
+
+#include <tracer.hxx>
+#include <transaction.hxx>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "functions.h"
+
+using namespace Interject;
+
+namespace {
+
+constexpr std::size_t CALLS_PER_SAMPLE = 10000;
+
+size_t (*count_set_bits_trampoline)(size_t) = nullptr;
+size_t (*wide_padded_triple_trampoline)(size_t) = nullptr;
+
+size_t count_set_bits_hook(size_t n) { return count_set_bits_trampoline(n); }
+
+size_t wide_padded_triple_hook(size_t n) {
+  return wide_padded_triple_trampoline(n);
+}
+
+// Report the time per call of fn, averaged over a batch of calls per sample
+// so the clock overhead does not dominate.
+void measureCalls(const Bench::Context &context, const Bench::Params &params,
+                  size_t (*fn)(size_t)) {
+  std::vector<Bench::Duration> samples;
+  volatile size_t sink = 0;
+  for (std::size_t run = 0; run < context.samples(); run++) {
+    const auto start = Bench::Clock::now();
+    for (size_t n = 0; n < CALLS_PER_SAMPLE; n++) {
+      sink = sink + fn(n);
+    }
+    samples.push_back(Bench::Clock::now() - start);
+  }
+  context.report("hook.call", params, std::move(samples), CALLS_PER_SAMPLE);
+}
+
+// Report the time per call of a traced fn. The ring holds a whole sample's
+// records and is drained between samples, so no record is dropped.
+void measureTracedCalls(const Bench::Context &context, const char *name,
+                        size_t (*fn)(size_t)) {
+  Tracer tracer =
+      Tracer::Builder().add(name).ringRecords(2 * CALLS_PER_SAMPLE).build();
+  if (tracer.start() != Transaction::Success) {
+    std::cerr << "failed tracing " << name << std::endl;
+    return;
+  }
+  auto reader = TraceReader::open(tracer.fd());
+  if (!reader) {
+    std::cerr << "failed reading trace of " << name << std::endl;
+    return;
+  }
+
+  std::vector<Bench::Duration> samples;
+  volatile size_t sink = 0;
+  for (std::size_t run = 0; run < context.samples(); run++) {
+    const auto start = Bench::Clock::now();
+    for (size_t n = 0; n < CALLS_PER_SAMPLE; n++) {
+      sink = sink + fn(n);
+    }
+    samples.push_back(Bench::Clock::now() - start);
+    reader->consume([](auto) {});
+  }
+  context.report("hook.call", {{"function", name}, {"hooked", "traced"}},
+                 std::move(samples), CALLS_PER_SAMPLE);
+  (void)tracer.stop();
+}
+
+void benchmarkHookCall(const Bench::Context &context) {
+  // count_set_bits is hooked through a trampoline holding its relocated
+  // prologue, wide_padded_triple through its -fpatchable-function-entry pad.
+  const struct {
+    const char *name;
+    size_t (*fn)(size_t);
+    size_t (*hook)(size_t);
+    size_t (**trampoline)(size_t);
+  } targets[] = {
+      {"count_set_bits", count_set_bits, count_set_bits_hook,
+       &count_set_bits_trampoline},
+      {"wide_padded_triple", wide_padded_triple, wide_padded_triple_hook,
+       &wide_padded_triple_trampoline},
+  };
+
+  for (const auto &target : targets) {
+    measureCalls(context, {{"function", target.name}, {"hooked", "false"}},
+                 target.fn);
+
+    Transaction txn = Transaction::Builder()
+                          .add(target.name, target.hook, target.trampoline)
+                          .build();
+    if (txn.prepare() != Transaction::Success ||
+        txn.commit() != Transaction::Success) {
+      std::cerr << "failed hooking " << target.name << std::endl;
+      continue;
+    }
+    measureCalls(context, {{"function", target.name}, {"hooked", "true"}},
+                 target.fn);
+    (void)txn.rollback();
+
+    measureTracedCalls(context, target.name, target.fn);
+  }
+}
+
+const Bench::Registration registration("hook_call", benchmarkHookCall);
+
+}; // namespace
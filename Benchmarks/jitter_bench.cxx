@@ -0,0 +1,182 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.hxx"
+
+#include <transaction.hxx>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "functions.h"
+
+using namespace Interject;
+
+namespace {
+
+// Measures the pause application threads observe while transactions commit
+// and roll back, as opposed to the duration of the calls themselves. Worker
+// threads call the target in a tight loop, as in the "Multiple threads during
+// transaction" test, timestamping every iteration. Time is divided into
+// epochs that alternate between a commit/rollback cycle and an idle period of
+// the same length, and each worker records the longest gap between two of its
+// iterations overlapping every epoch. The idle epochs give the baseline jitter
+// from scheduling alone.
+
+#if defined(__x86_64__)
+// A single long first instruction lets the breakpoint engine patch it.
+constexpr std::string_view TARGET_NAME = "times_thousand";
+size_t (*const target)(size_t) = times_thousand;
+#else
+constexpr std::string_view TARGET_NAME = "count_set_bits";
+size_t (*const target)(size_t) = count_set_bits;
+#endif
+
+size_t (*trampoline)(size_t) = nullptr;
+
+size_t hook(size_t n) { return trampoline(n); }
+
+constexpr Bench::Duration NO_SAMPLE = Bench::Duration::min();
+constexpr std::size_t WORKER_STACK_SIZE = 64 * 1024;
+
+std::uint32_t epoch = 0;
+bool stopping = false;
+
+struct alignas(64) Worker {
+  pthread_t thread;
+  // Longest gap between iterations overlapping each epoch, or NO_SAMPLE if
+  // none did.
+  std::vector<Bench::Duration> stalls;
+  Bench::Duration maxStall{};
+};
+
+void *runWorker(void *arg) {
+  auto &worker = *static_cast<Worker *>(arg);
+  std::uint32_t current = __atomic_load_n(&epoch, __ATOMIC_RELAXED);
+  auto last = Bench::Clock::now();
+  volatile size_t sink = 0;
+
+  for (size_t n = 0; !__atomic_load_n(&stopping, __ATOMIC_RELAXED); n++) {
+    sink = sink + target(n);
+
+    const auto now = Bench::Clock::now();
+    const Bench::Duration gap = now - last;
+    last = now;
+    worker.maxStall = std::max(worker.maxStall, gap);
+
+    // A gap spanning several epochs, e.g. a thread halted for a whole commit,
+    // counts towards each of them.
+    const auto observed = __atomic_load_n(&epoch, __ATOMIC_RELAXED);
+    for (auto idx = current; idx <= observed && idx < worker.stalls.size();
+         idx++) {
+      worker.stalls[idx] = std::max(worker.stalls[idx], gap);
+    }
+    current = observed;
+  }
+  return nullptr;
+}
+
+void measureJitter(const Bench::Context &context, std::size_t threadCount,
+                   Transaction::Engine engine) {
+  const std::size_t cycles = context.samples();
+  std::vector<Worker> workers(threadCount);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+  __atomic_store_n(&epoch, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stopping, false, __ATOMIC_RELAXED);
+  for (auto &worker : workers) {
+    worker.stalls.assign(2 * cycles + 1, NO_SAMPLE);
+    if (pthread_create(&worker.thread, &attr, runWorker, &worker) != 0) {
+      std::cerr << "failed creating worker thread" << std::endl;
+      std::abort();
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  // Epoch 0 lets the workers start. Odd epochs then hold a commit and
+  // rollback and even epochs an equally long idle period.
+  ::usleep(10000);
+  bool failed = false;
+  for (std::size_t cycle = 0; cycle < cycles && !failed; cycle++) {
+    Transaction txn = Transaction::Builder()
+                          .add(TARGET_NAME, hook, &trampoline)
+                          .engine(engine)
+                          .build();
+    failed = txn.prepare() != Transaction::Success;
+
+    const auto start = Bench::Clock::now();
+    __atomic_store_n(&epoch, 2 * cycle + 1, __ATOMIC_RELAXED);
+    failed = failed || txn.commit() != Transaction::Success ||
+             txn.rollback() != Transaction::Success;
+    const auto elapsed = Bench::Clock::now() - start;
+
+    __atomic_store_n(&epoch, 2 * cycle + 2, __ATOMIC_RELAXED);
+    const auto idle = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::max<Bench::Duration>(elapsed, std::chrono::milliseconds(1)));
+    ::usleep(idle.count());
+  }
+
+  __atomic_store_n(&epoch, 2 * cycles + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+  for (auto &worker : workers) {
+    pthread_join(worker.thread, nullptr);
+  }
+
+  if (failed) {
+    std::cerr << "failed committing transaction" << std::endl;
+    return;
+  }
+
+  std::vector<Bench::Duration> pauses;
+  std::vector<Bench::Duration> baseline;
+  std::vector<Bench::Duration> threadMax;
+  for (const auto &worker : workers) {
+    for (std::size_t idx = 1; idx < worker.stalls.size(); idx++) {
+      if (worker.stalls[idx] != NO_SAMPLE) {
+        (idx % 2 ? pauses : baseline).push_back(worker.stalls[idx]);
+      }
+    }
+    threadMax.push_back(worker.maxStall);
+  }
+
+  const Bench::Params params = {
+      {"threads", std::to_string(threadCount)},
+      {"engine", engine == Transaction::EngineHalting ? "halting"
+                                                       : "breakpoint"}};
+  context.report("jitter.pause", params, std::move(pauses));
+  context.report("jitter.baseline", params, std::move(baseline));
+  context.report("jitter.thread_max", params, std::move(threadMax));
+}
+
+void benchmarkJitter(const Bench::Context &context) {
+  for (const std::size_t threads : {100, 1000}) {
+    measureJitter(context, threads, Transaction::EngineHalting);
+#if defined(__x86_64__)
+    measureJitter(context, threads, Transaction::EngineBreakpoint);
+#endif
+  }
+}
+
+const Bench::Registration registration("jitter", benchmarkJitter);
+
+}; // namespace
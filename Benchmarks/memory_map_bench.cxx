@@ -0,0 +1,100 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.hxx"
+
+#include <memory_map.hxx>
+
+#include <string>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace Interject;
+
+namespace {
+
+// Split a reserved range into count separate mappings by alternating page
+// protections, so the kernel cannot merge them.
+class ExtraRegions {
+public:
+  explicit ExtraRegions(std::size_t count)
+      : _pageSize(::sysconf(_SC_PAGESIZE)), _size(count * _pageSize) {
+    if (count == 0) {
+      return;
+    }
+    _addr = ::mmap(nullptr, _size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (_addr == MAP_FAILED) {
+      _addr = nullptr;
+      return;
+    }
+    for (std::size_t offset = 0; offset < _size; offset += 2 * _pageSize) {
+      ::mprotect(static_cast<char *>(_addr) + offset, _pageSize, PROT_READ);
+    }
+  }
+
+  ~ExtraRegions() {
+    if (_addr != nullptr) {
+      ::munmap(_addr, _size);
+    }
+  }
+
+  void *addr() const noexcept { return _addr; }
+
+private:
+  void *_addr = nullptr;
+  std::size_t _pageSize;
+  std::size_t _size;
+};
+
+void benchmarkMemoryMap(const Bench::Context &context) {
+  for (const std::size_t extra : {0, 1000, 10000}) {
+    const ExtraRegions regions(extra);
+    if (extra != 0 && regions.addr() == nullptr) {
+      continue;
+    }
+
+    MemoryMap map;
+    if (!map.load()) {
+      return;
+    }
+    const Bench::Params params = {
+        {"regions", std::to_string(map.regions().size())}};
+
+    // Loading into a new map allocates its buffers from scratch, while
+    // reloading reuses the buffers of the previous load.
+    context.measure("memory_map.load", params, []() {
+      MemoryMap map;
+      (void)map.load();
+    });
+    context.measure("memory_map.reload", params,
+                    [&]() { (void)map.load(); });
+
+    // The transaction queries individual pages rather than loading the map.
+    const auto addr = reinterpret_cast<std::uintptr_t>(&benchmarkMemoryMap);
+    context.measure("memory_map.query", params, [&]() {
+      MemoryMapQuery query;
+      if (query.open()) {
+        (void)query.find(addr);
+      }
+    });
+  }
+}
+
+const Bench::Registration registration("memory_map", benchmarkMemoryMap);
+
+}; // namespace
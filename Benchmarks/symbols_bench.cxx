@@ -0,0 +1,135 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.hxx"
+
+#include <modules.hxx>
+#include <symbols.hxx>
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <dlfcn.h>
+
+using namespace Interject;
+
+namespace {
+
+// Exported from the C library, plus local functions of this executable that
+// are only found in its .symtab.
+constexpr std::array<std::string_view, 32> NAMES = {
+    "malloc",        "free",          "calloc",        "realloc",
+    "memcpy",        "memmove",       "memset",        "strlen",
+    "strcmp",        "strncmp",       "strchr",        "strstr",
+    "printf",        "fprintf",       "snprintf",      "puts",
+    "fopen",         "fclose",        "fread",         "fwrite",
+    "open",          "close",         "read",          "write",
+    "mmap",          "munmap",        "mprotect",      "pthread_create",
+    "count_set_bits", "fibonacci",    "isqrt",         "factorial",
+};
+
+// Libraries loaded to measure lookup against more modules. Missing ones are
+// skipped.
+constexpr std::array<const char *, 4> EXTRA_MODULES = {
+    "libm.so.6",
+    "libresolv.so.2",
+    "libutil.so.1",
+    "librt.so.1",
+};
+
+std::size_t moduleCount() {
+  std::size_t count = 0;
+  Modules::forEach([&](std::string_view, std::uintptr_t, auto) { count++; });
+  return count;
+}
+
+void measureLookup(const Bench::Context &context, std::size_t moduleCount) {
+  const std::string modules = std::to_string(moduleCount);
+
+  for (const std::size_t count : {1, 8, 32}) {
+    const auto names = std::span(NAMES).first(count);
+    context.measure("symbols.lookup",
+                    {{"names", std::to_string(count)}, {"modules", modules}},
+                    [&]() {
+                      std::vector<Symbols::Descriptor> descriptors(count);
+                      Symbols::lookup(names, descriptors);
+                    });
+  }
+
+  // A name that resolves nowhere visits every module in every pass.
+  const std::string_view missing[] = {"interject_bench_missing"};
+  context.measure("symbols.lookup_missing", {{"modules", modules}}, [&]() {
+    Symbols::Descriptor descriptor;
+    Symbols::lookup(missing, std::span(&descriptor, 1));
+  });
+
+  // The same searches with module files parsed on several threads. Scaling
+  // depends on the cores of the host, so the thread count and the cores are
+  // reported.
+  const std::string cores = std::to_string(std::thread::hardware_concurrency());
+  for (const std::size_t threads : {2, 4}) {
+    const auto executor = Symbols::parallelExecutor(threads);
+    const std::string threadCount = std::to_string(threads);
+    context.measure("symbols.lookup",
+                    {{"names", std::to_string(NAMES.size())},
+                     {"modules", modules},
+                     {"threads", threadCount},
+                     {"cores", cores}},
+                    [&]() {
+                      std::vector<Symbols::Descriptor> descriptors(
+                          NAMES.size());
+                      Symbols::lookup(NAMES, descriptors, nullptr, executor);
+                    });
+    context.measure("symbols.lookup_missing",
+                    {{"modules", modules},
+                     {"threads", threadCount},
+                     {"cores", cores}},
+                    [&]() {
+                      Symbols::Descriptor descriptor;
+                      Symbols::lookup(missing, std::span(&descriptor, 1),
+                                      nullptr, executor);
+                    });
+  }
+}
+
+void benchmarkLookup(const Bench::Context &context) {
+  std::size_t count = moduleCount();
+  measureLookup(context, count);
+
+  // Modules that are already loaded do not change the count and are only
+  // measured once.
+  std::vector<void *> handles;
+  for (const auto module : EXTRA_MODULES) {
+    if (void *handle = ::dlopen(module, RTLD_NOW)) {
+      handles.push_back(handle);
+      if (moduleCount() != count) {
+        count = moduleCount();
+        measureLookup(context, count);
+      }
+    }
+  }
+
+  for (void *handle : handles) {
+    ::dlclose(handle);
+  }
+}
+
+const Bench::Registration registration("symbols", benchmarkLookup);
+
+}; // namespace
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.hxx"
+
+#include <transaction.hxx>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "functions.h"
+
+using namespace Interject;
+
+namespace {
+
+using Function = size_t(size_t);
+
+// Targets in the order hooks are added.
+constexpr std::size_t MAX_HOOKS = 6;
+constexpr std::string_view TARGET_NAMES[MAX_HOOKS] = {
+    "count_set_bits", "fibonacci",      "isqrt",
+    "sum_of_digits",  "reverse_digits", "factorial",
+};
+
+Function *trampolines[MAX_HOOKS];
+
+template <std::size_t I> size_t hook(size_t n) { return trampolines[I](n); }
+
+Function *const HOOKS[MAX_HOOKS] = {hook<0>, hook<1>, hook<2>,
+                                    hook<3>, hook<4>, hook<5>};
+
+// Threads that run while transactions commit: idle threads sleep, while busy
+// threads call the first target in a tight loop like the transaction tests.
+class RunningThreads {
+public:
+  RunningThreads(std::size_t count, bool busy) : _busy(busy) {
+    _threads.resize(count);
+    for (auto &thread : _threads) {
+      if (pthread_create(&thread, nullptr, run, this) != 0) {
+        std::cerr << "failed creating thread" << std::endl;
+        std::abort();
+      }
+    }
+  }
+
+  ~RunningThreads() {
+    __atomic_store_n(&_stop, true, __ATOMIC_RELAXED);
+    for (auto &thread : _threads) {
+      pthread_join(thread, nullptr);
+    }
+  }
+
+private:
+  static void *run(void *arg) {
+    auto *self = static_cast<RunningThreads *>(arg);
+    size_t value = 0;
+    while (!__atomic_load_n(&self->_stop, __ATOMIC_RELAXED)) {
+      if (self->_busy) {
+        value += count_set_bits(value);
+      } else {
+        ::usleep(1000);
+      }
+    }
+    return nullptr;
+  }
+
+  std::vector<pthread_t> _threads;
+  bool _busy;
+  bool _stop = false;
+};
+
+void measureTransaction(const Bench::Context &context, std::size_t threads,
+                        bool busy, std::size_t hooks) {
+  const Bench::Params params = {{"threads", std::to_string(threads)},
+                                {"mode", busy ? "busy" : "idle"},
+                                {"hooks", std::to_string(hooks)}};
+  const RunningThreads running(threads, busy);
+
+  std::vector<Bench::Duration> commits;
+  std::vector<Bench::Duration> rollbacks;
+  for (std::size_t run = 0; run < context.samples(); run++) {
+    Transaction::Builder builder;
+    for (std::size_t idx = 0; idx < hooks; idx++) {
+      builder.add(TARGET_NAMES[idx], HOOKS[idx], &trampolines[idx]);
+    }
+    Transaction txn = builder.build();
+    if (txn.prepare() != Transaction::Success) {
+      std::cerr << "failed preparing transaction" << std::endl;
+      return;
+    }
+
+    auto start = Bench::Clock::now();
+    if (txn.commit() != Transaction::Success) {
+      std::cerr << "failed committing transaction" << std::endl;
+      return;
+    }
+    commits.push_back(Bench::Clock::now() - start);
+
+    start = Bench::Clock::now();
+    if (txn.rollback() != Transaction::Success) {
+      std::cerr << "failed rolling back transaction" << std::endl;
+      return;
+    }
+    rollbacks.push_back(Bench::Clock::now() - start);
+  }
+
+  context.report("transaction.commit", params, std::move(commits));
+  context.report("transaction.rollback", params, std::move(rollbacks));
+}
+
+void benchmarkTransaction(const Bench::Context &context) {
+  for (const bool busy : {false, true}) {
+    for (const std::size_t threads : {0, 4, 16, 64}) {
+      measureTransaction(context, threads, busy, 1);
+    }
+  }
+
+  for (const std::size_t hooks : {std::size_t(3), MAX_HOOKS}) {
+    measureTransaction(context, 4, false, hooks);
+  }
+}
+
+const Bench::Registration registration("transaction", benchmarkTransaction);
+
+// A second hook for the first target to swap with HOOKS[0].
+size_t otherHook(size_t n) { return trampolines[0](n); }
+
+// Swap the hook of a retargetable transaction back and forth while busy
+// threads keep calling it. No thread is halted, so the cost is independent of
+// the thread count.
+void benchmarkRetarget(const Bench::Context &context) {
+  constexpr std::size_t SWAPS_PER_SAMPLE = 1000;
+  for (const std::size_t threads : {0, 16}) {
+    const Bench::Params params = {{"threads", std::to_string(threads)},
+                                  {"mode", "busy"}};
+    Transaction txn = Transaction::Builder()
+                          .add(TARGET_NAMES[0], HOOKS[0], &trampolines[0])
+                          .retargetable()
+                          .build();
+    if (txn.prepare() != Transaction::Success ||
+        txn.commit() != Transaction::Success) {
+      std::cerr << "failed committing transaction" << std::endl;
+      return;
+    }
+
+    const RunningThreads running(threads, true);
+    std::vector<Bench::Duration> samples;
+    for (std::size_t run = 0; run < context.samples(); run++) {
+      const auto start = Bench::Clock::now();
+      for (std::size_t swap = 0; swap < SWAPS_PER_SAMPLE; swap++) {
+        Function *const hook = swap & 1 ? otherHook : HOOKS[0];
+        if (txn.retarget(TARGET_NAMES[0], hook) != Transaction::Success) {
+          std::cerr << "failed retargeting hook" << std::endl;
+          return;
+        }
+      }
+      samples.push_back(Bench::Clock::now() - start);
+    }
+    context.report("transaction.retarget", params, std::move(samples),
+                   SWAPS_PER_SAMPLE);
+
+    if (txn.rollback() != Transaction::Success) {
+      std::cerr << "failed rolling back transaction" << std::endl;
+      return;
+    }
+  }
+}
+
+const Bench::Registration retargetRegistration("retarget", benchmarkRetarget);
+
+}; // namespace
@@ -0,0 +1,171 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "code_writer.hxx"
+
+#include <cstring>
+#include <iostream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Interject {
+
+CodeWriter::CodeWriter(std::span<const PageRange> ranges,
+                       ProtectStats *stats) noexcept
+    : _ranges(ranges), _stats(stats), _writable(false) {
+  _memFd = ::open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+}
+
+CodeWriter::~CodeWriter() {
+  if (_writable) {
+    restorePermissions(_ranges);
+  }
+  if (_memFd != -1) {
+    ::close(_memFd);
+  }
+}
+
+bool CodeWriter::writeMem(std::uintptr_t addr,
+                          std::span<const std::uint8_t> bytes) noexcept {
+  while (!bytes.empty()) {
+    const ssize_t count = ::pwrite(_memFd, bytes.data(), bytes.size(),
+                                   static_cast<off_t>(addr));
+    if (count == -1 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    bytes = bytes.subspan(count);
+    addr += count;
+  }
+  return true;
+}
+
+bool CodeWriter::write(std::uintptr_t addr,
+                       std::span<const std::uint8_t> bytes) noexcept {
+  if (!_writable && _memFd != -1) {
+    if (writeMem(addr, bytes)) {
+      return true;
+    }
+
+    // Writes through /proc/self/mem are not permitted; stop trying.
+    ::close(_memFd);
+    _memFd = -1;
+  }
+
+  if (!_writable && !makeWritable()) {
+    return false;
+  }
+
+  std::memcpy(reinterpret_cast<void *>(addr), bytes.data(), bytes.size());
+  return true;
+}
+
+bool CodeWriter::writeAtomic(std::uintptr_t addr,
+                             std::span<const std::uint8_t> bytes) noexcept {
+  constexpr std::uintptr_t CACHE_LINE_SIZE = 64;
+  if (bytes.size() != sizeof(uint16_t) && bytes.size() != sizeof(uint32_t)) {
+    return false;
+  }
+
+#if defined(__x86_64__) || defined(_M_X64)
+  // x86 stores of up to 8 bytes are atomic as long as they do not cross a
+  // cache line, aligned or not.
+  if ((addr & (CACHE_LINE_SIZE - 1)) + bytes.size() > CACHE_LINE_SIZE) {
+    return false;
+  }
+#else
+  if (addr % bytes.size() != 0) {
+    return false;
+  }
+#endif
+
+  if (!_writable && !makeWritable()) {
+    return false;
+  }
+
+#if defined(__x86_64__) || defined(_M_X64)
+  if (bytes.size() == sizeof(uint16_t)) {
+    uint16_t value;
+    std::memcpy(&value, bytes.data(), sizeof(value));
+    asm volatile("movw %1, %0"
+                 : "=m"(*reinterpret_cast<uint16_t *>(addr))
+                 : "r"(value)
+                 : "memory");
+  } else {
+    uint32_t value;
+    std::memcpy(&value, bytes.data(), sizeof(value));
+    asm volatile("movl %1, %0"
+                 : "=m"(*reinterpret_cast<uint32_t *>(addr))
+                 : "r"(value)
+                 : "memory");
+  }
+#else
+  if (bytes.size() == sizeof(uint16_t)) {
+    uint16_t value;
+    std::memcpy(&value, bytes.data(), sizeof(value));
+    __atomic_store_n(reinterpret_cast<uint16_t *>(addr), value,
+                     __ATOMIC_RELEASE);
+  } else {
+    uint32_t value;
+    std::memcpy(&value, bytes.data(), sizeof(value));
+    __atomic_store_n(reinterpret_cast<uint32_t *>(addr), value,
+                     __ATOMIC_RELEASE);
+  }
+#endif
+  return true;
+}
+
+bool CodeWriter::makeWritable() noexcept {
+  for (size_t idx = 0; idx < _ranges.size(); idx++) {
+    const auto &range = _ranges[idx];
+    if (!protect(range, range.permissions | PROT_WRITE)) {
+      std::cerr << "failed setting PROT_WRITE on page starting at 0x"
+                << std::hex << range.start << std::dec << std::endl;
+      restorePermissions(_ranges.first(idx));
+      return false;
+    }
+  }
+  _writable = true;
+  return true;
+}
+
+void CodeWriter::restorePermissions(
+    std::span<const PageRange> ranges) noexcept {
+  for (const auto &range : ranges) {
+    if (!protect(range, range.permissions)) {
+      std::cerr << "failed to restore permissions on page starting at 0x"
+                << std::hex << range.start << std::dec << std::endl;
+    }
+  }
+}
+
+bool CodeWriter::protect(const PageRange &range, int prot) noexcept {
+  const auto start = std::chrono::steady_clock::now();
+  const bool success =
+      ::mprotect(reinterpret_cast<void *>(range.start), range.size, prot) == 0;
+  if (_stats != nullptr) {
+    _stats->elapsed += std::chrono::steady_clock::now() - start;
+    _stats->calls++;
+  }
+  return success;
+}
+
+}; // namespace Interject
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <span>
+
+namespace Interject {
+
+// Writes instruction bytes over existing code.
+//
+// Writes go through /proc/self/mem, which the kernel permits on read-only
+// mappings, so page protections are never changed and code mappings are not
+// split into separate VMAs. If /proc/self/mem is unavailable or not writable
+// (e.g. proc_mem.force_override=never), the writer falls back to adding
+// PROT_WRITE to the supplied page ranges with mprotect, one call per range,
+// and restores the original protections when destroyed.
+class CodeWriter {
+public:
+  struct PageRange {
+    std::uintptr_t start;
+    std::size_t size;
+    int permissions;
+  };
+
+  // Time spent changing page protections, including restoring them when the
+  // writer is destroyed.
+  struct ProtectStats {
+    std::chrono::nanoseconds elapsed{};
+    std::size_t calls = 0;
+  };
+
+  // The ranges must cover every address that will be written and remain valid
+  // for the lifetime of the writer. If stats is provided, every mprotect call
+  // is accumulated into it; it must outlive the writer.
+  explicit CodeWriter(std::span<const PageRange> ranges,
+                      ProtectStats *stats = nullptr) noexcept;
+  ~CodeWriter();
+
+  CodeWriter(const CodeWriter &) = delete;
+  CodeWriter &operator=(const CodeWriter &) = delete;
+
+  // Write bytes at addr. Safe to call while other threads are halted; it does
+  // not allocate.
+  [[nodiscard]]
+  bool write(std::uintptr_t addr, std::span<const std::uint8_t> bytes) noexcept;
+
+  // Replace the instruction at addr with a single atomic store, so threads
+  // executing it concurrently observe either the old or the new instruction.
+  // Only 2 and 4 byte stores are supported, and they must not cross a cache
+  // line (x86_64) or be misaligned (arm64). Atomic stores always go through
+  // the mprotect fallback since writes through /proc/self/mem are not atomic.
+  [[nodiscard]]
+  bool writeAtomic(std::uintptr_t addr,
+                   std::span<const std::uint8_t> bytes) noexcept;
+
+  // Return true if the writer fell back to changing page protections.
+  [[nodiscard]]
+  bool changedPermissions() const noexcept {
+    return _writable;
+  }
+
+private:
+  bool writeMem(std::uintptr_t addr,
+                std::span<const std::uint8_t> bytes) noexcept;
+
+  bool makeWritable() noexcept;
+
+  void restorePermissions(std::span<const PageRange> ranges) noexcept;
+
+  bool protect(const PageRange &range, int prot) noexcept;
+
+  std::span<const PageRange> _ranges;
+  ProtectStats *_stats;
+  int _memFd;
+  bool _writable;
+};
+
+}; // namespace Interject
@@ -16,16 +16,842 @@
 
 #include "disassembler.hxx"
 
-#include <iostream>
+#include <array>
+#include <cstring>
 #include <format>
+#include <iostream>
+#include <limits>
 
 namespace Interject::Disassembler {
 
+namespace {
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+constexpr std::size_t MAX_INSTR_SIZE = 15;
+
+// Operands that follow an opcode, used to compute instruction lengths.
+enum Operands : uint8_t {
+  None = 0,
+  ModRM = 1 << 0,
+  Imm8 = 1 << 1,
+  Imm16 = 1 << 2,
+  ImmZ = 1 << 3, // 16 or 32 bits depending on operand size
+  ImmV = 1 << 4, // 16, 32 or 64 bits depending on operand size
+  Rel8 = 1 << 5,
+  Rel32 = 1 << 6,
+  Invalid = 1 << 7,
+};
+
+// Operands of the one-byte opcode map. Prefixes and escapes (0F, VEX, EVEX)
+// are handled before the table is consulted.
+constexpr auto ONE_BYTE_MAP = [] {
+  std::array<uint8_t, 256> map{};
+
+  // add, or, adc, sbb, and, sub, xor, cmp
+  for (unsigned op = 0x00; op < 0x40; op += 0x08) {
+    map[op + 0] = map[op + 1] = map[op + 2] = map[op + 3] = ModRM;
+    map[op + 4] = Imm8;
+    map[op + 5] = ImmZ;
+  }
+  for (auto op : {0x06, 0x07, 0x0e, 0x16, 0x17, 0x1e, 0x1f, 0x27, 0x2f, 0x37,
+                  0x3f, 0x60, 0x61, 0x62, 0x82, 0x9a, 0xc4, 0xc5, 0xce, 0xd4,
+                  0xd5, 0xd6, 0xea}) {
+    map[op] = Invalid;
+  }
+
+  map[0x63] = ModRM;
+  map[0x68] = ImmZ;
+  map[0x69] = ModRM | ImmZ;
+  map[0x6a] = Imm8;
+  map[0x6b] = ModRM | Imm8;
+  for (unsigned op = 0x70; op <= 0x7f; op++) {
+    map[op] = Rel8;
+  }
+  map[0x80] = ModRM | Imm8;
+  map[0x81] = ModRM | ImmZ;
+  map[0x83] = ModRM | Imm8;
+  for (unsigned op = 0x84; op <= 0x8f; op++) {
+    map[op] = ModRM;
+  }
+  map[0xa8] = Imm8;
+  map[0xa9] = ImmZ;
+  for (unsigned op = 0xb0; op <= 0xb7; op++) {
+    map[op] = Imm8;
+  }
+  for (unsigned op = 0xb8; op <= 0xbf; op++) {
+    map[op] = ImmV;
+  }
+  map[0xc0] = map[0xc1] = ModRM | Imm8;
+  map[0xc2] = Imm16;
+  map[0xc6] = ModRM | Imm8;
+  map[0xc7] = ModRM | ImmZ;
+  map[0xc8] = Imm16 | Imm8;
+  map[0xca] = Imm16;
+  map[0xcd] = Imm8;
+  for (unsigned op = 0xd0; op <= 0xd3; op++) {
+    map[op] = ModRM;
+  }
+  for (unsigned op = 0xd8; op <= 0xdf; op++) {
+    map[op] = ModRM;
+  }
+  for (unsigned op = 0xe0; op <= 0xe3; op++) {
+    map[op] = Rel8;
+  }
+  for (unsigned op = 0xe4; op <= 0xe7; op++) {
+    map[op] = Imm8;
+  }
+  map[0xe8] = map[0xe9] = Rel32;
+  map[0xeb] = Rel8;
+  map[0xf6] = map[0xf7] = ModRM;
+  map[0xfe] = map[0xff] = ModRM;
+  return map;
+}();
+
+// Operands of the two-byte (0F) opcode map, also used for VEX and EVEX
+// encoded instructions in the same map.
+constexpr auto TWO_BYTE_MAP = [] {
+  std::array<uint8_t, 256> map{};
+  map.fill(ModRM);
+
+  for (auto op : {0x05, 0x06, 0x07, 0x08, 0x09, 0x0b, 0x0e, 0x30, 0x31, 0x32,
+                  0x33, 0x34, 0x35, 0x37, 0x77, 0xa0, 0xa1, 0xa2, 0xa8, 0xa9,
+                  0xaa}) {
+    map[op] = None;
+  }
+  for (auto op : {0x04, 0x0a, 0x0c, 0x36, 0x39, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f}) {
+    map[op] = Invalid;
+  }
+  for (auto op : {0x0f, 0x70, 0x71, 0x72, 0x73, 0xa4, 0xac, 0xba, 0xc2, 0xc4,
+                  0xc5, 0xc6}) {
+    map[op] = ModRM | Imm8;
+  }
+  for (unsigned op = 0x80; op <= 0x8f; op++) {
+    map[op] = Rel32;
+  }
+  for (unsigned op = 0xc8; op <= 0xcf; op++) {
+    map[op] = None;
+  }
+  return map;
+}();
+
+struct Instr {
+  uint8_t length;
+  uint8_t opcodeOffset; // offset of the first opcode byte after any prefixes
+  uint8_t fieldOffset;  // offset of the RIP-relative displacement or branch
+  uint8_t relSize;      // size of the branch offset, zero if not a branch
+  bool ripRelative;
+  bool relocatable;
+};
+
+// Decode the length and PC-relative operands of the instruction at code
+// without reading more than avail bytes.
+std::optional<Instr> decode(const uint8_t *code, std::size_t avail) {
+  const std::size_t limit = std::min(avail, MAX_INSTR_SIZE);
+  std::size_t off = 0;
+  bool opSize16 = false;
+  bool addrSize32 = false;
+  uint8_t rex = 0;
+
+  for (;; off++) {
+    if (off >= limit) {
+      return std::nullopt;
+    }
+
+    const uint8_t byte = code[off];
+    if ((byte & 0xf0) == 0x40) {
+      rex = byte;
+      continue;
+    }
+
+    switch (byte) {
+    case 0x66:
+      opSize16 = true;
+      break;
+    case 0x67:
+      addrSize32 = true;
+      break;
+    case 0xf0: case 0xf2: case 0xf3:
+    case 0x26: case 0x2e: case 0x36: case 0x3e: case 0x64: case 0x65:
+      break;
+    default:
+      goto prefixesDone;
+    }
+
+    // A REX prefix only applies when it immediately precedes the opcode.
+    rex = 0;
+  }
+prefixesDone:
+
+  Instr instr{};
+  instr.opcodeOffset = off;
+  instr.relocatable = true;
+
+  const bool rexW = (rex & 0x08) != 0;
+  const uint8_t opcode = code[off++];
+  uint8_t operands;
+
+  if (opcode == 0xc4 || opcode == 0xc5 || opcode == 0x62) {
+    // VEX and EVEX prefixes select the opcode map in their payload and every
+    // instruction they encode has a ModRM byte.
+    std::size_t payload = opcode == 0xc5 ? 1 : opcode == 0xc4 ? 2 : 3;
+    if (off + payload >= limit) {
+      return std::nullopt;
+    }
+    unsigned map = opcode == 0xc5 ? 1 : code[off] & (opcode == 0xc4 ? 0x1f : 0x07);
+    off += payload;
+    const uint8_t vexOpcode = code[off++];
+
+    switch (map) {
+    case 1:
+      operands = TWO_BYTE_MAP[vexOpcode];
+      if (operands & Rel32) {
+        operands = Invalid;
+      } else if (vexOpcode != 0x77) {
+        operands |= ModRM;
+      }
+      break;
+    case 2:
+    case 5:
+    case 6:
+      operands = ModRM;
+      break;
+    case 3:
+      operands = ModRM | Imm8;
+      break;
+    default:
+      operands = Invalid;
+      break;
+    }
+  } else if (opcode == 0x0f) {
+    if (off >= limit) {
+      return std::nullopt;
+    }
+    const uint8_t opcode2 = code[off++];
+    if (opcode2 == 0x38 || opcode2 == 0x3a) {
+      if (off >= limit) {
+        return std::nullopt;
+      }
+      off++;
+      operands = opcode2 == 0x38 ? ModRM : ModRM | Imm8;
+    } else {
+      operands = TWO_BYTE_MAP[opcode2];
+    }
+  } else {
+    operands = ONE_BYTE_MAP[opcode];
+    if (opcode >= 0xa0 && opcode <= 0xa3) {
+      // mov with a 64-bit absolute memory offset
+      off += addrSize32 ? 4 : 8;
+    } else if (opcode >= 0xe0 && opcode <= 0xe3) {
+      // loop and jrcxz have no rel32 form to widen to
+      instr.relocatable = false;
+    }
+  }
+
+  if (operands & Invalid) {
+    return std::nullopt;
+  }
+
+  if (operands & ModRM) {
+    if (off >= limit) {
+      return std::nullopt;
+    }
+    const uint8_t modrm = code[off++];
+    const uint8_t mod = modrm >> 6;
+    const uint8_t reg = (modrm >> 3) & 7;
+    const uint8_t rm = modrm & 7;
+
+    if (opcode == 0xf6 && reg < 2) {
+      operands |= Imm8;
+    } else if (opcode == 0xf7 && reg < 2) {
+      operands |= ImmZ;
+    } else if (opcode == 0xc7 && modrm == 0xf8) {
+      // xbegin takes a rel32 fallback address
+      instr.relocatable = false;
+    }
+
+    if (mod != 3) {
+      if (rm == 4) {
+        if (off >= limit) {
+          return std::nullopt;
+        }
+        const uint8_t sib = code[off++];
+        if (mod == 0 && (sib & 7) == 5) {
+          off += 4;
+        }
+      } else if (mod == 0 && rm == 5) {
+        instr.ripRelative = true;
+        instr.fieldOffset = off;
+        if (addrSize32) {
+          instr.relocatable = false;
+        }
+        off += 4;
+      }
+      if (mod == 1) {
+        off += 1;
+      } else if (mod == 2) {
+        off += 4;
+      }
+    }
+  }
+
+  const std::size_t immZ = opSize16 ? 2 : 4;
+  if (operands & Imm8) {
+    off += 1;
+  }
+  if (operands & Imm16) {
+    off += 2;
+  }
+  if (operands & ImmZ) {
+    off += rexW ? 4 : immZ;
+  }
+  if (operands & ImmV) {
+    off += rexW ? 8 : immZ;
+  }
+  if (operands & (Rel8 | Rel32)) {
+    instr.fieldOffset = off;
+    instr.relSize = (operands & Rel8) ? 1 : 4;
+    off += instr.relSize;
+  }
+
+  if (off > limit) {
+    return std::nullopt;
+  }
+  instr.length = off;
+  return instr;
+}
+
+// Return the address targeted by the PC-relative branch instruction at code
+// when it executes at addr.
+std::uintptr_t branchTarget(const uint8_t *code, std::uintptr_t addr,
+                            const Instr &instr) {
+  const uint8_t *field = code + instr.fieldOffset;
+  int32_t rel;
+  if (instr.relSize == 1) {
+    rel = static_cast<int8_t>(*field);
+  } else {
+    std::memcpy(&rel, field, sizeof(rel));
+  }
+  return addr + instr.length + rel;
+}
+
+// The length of the instruction at code once relocated, where short branches
+// are widened to their rel32 forms.
+std::size_t relocatedLength(const uint8_t *code, const Instr &instr) {
+  if (instr.relSize == 1) {
+    return instr.opcodeOffset + (code[instr.opcodeOffset] == 0xeb ? 5 : 6);
+  }
+  return instr.length;
+}
+
+bool fitsRel32(int64_t value) {
+  return value >= std::numeric_limits<int32_t>::min() &&
+         value <= std::numeric_limits<int32_t>::max();
+}
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+
+constexpr std::size_t INSTR_SIZE = 4;
+
+uint32_t readInstr(const uint8_t *code) {
+  uint32_t instr;
+  std::memcpy(&instr, code, sizeof(instr));
+  return instr;
+}
+
+int64_t signExtend(uint32_t value, unsigned bits) {
+  const unsigned shift = 64 - bits;
+  return static_cast<int64_t>(static_cast<uint64_t>(value) << shift) >> shift;
+}
+
+// Return the target of a PC-relative branch, or nothing if instr is not one.
+std::optional<std::uintptr_t> branchTarget(std::uintptr_t addr, uint32_t instr) {
+  if ((instr & 0x7c000000) == 0x14000000) { // b, bl
+    return addr + signExtend(instr & 0x03ffffff, 26) * 4;
+  }
+  if ((instr & 0xff000010) == 0x54000000 || // b.cond
+      (instr & 0x7e000000) == 0x34000000) { // cbz, cbnz
+    return addr + signExtend((instr >> 5) & 0x7ffff, 19) * 4;
+  }
+  if ((instr & 0x7e000000) == 0x36000000) { // tbz, tbnz
+    return addr + signExtend((instr >> 5) & 0x3fff, 14) * 4;
+  }
+  return std::nullopt;
+}
+
+bool isAdr(uint32_t instr) { // adr, adrp
+  return (instr & 0x1f000000) == 0x10000000;
+}
+
+bool isLoadLiteral(uint32_t instr) { // ldr, ldrsw, prfm (literal)
+  return (instr & 0x3b000000) == 0x18000000;
+}
+
+// b and bl, along with b.al and b.nv, which are always taken.
+bool isUnconditionalBranch(uint32_t instr) {
+  return (instr & 0x7c000000) == 0x14000000 ||
+         ((instr & 0xff000010) == 0x54000000 && (instr & 0xe) == 0xe);
+}
+
+// The address computed by adr or adrp.
+std::uintptr_t adrTarget(std::uintptr_t addr, uint32_t instr) {
+  const int64_t imm =
+      signExtend((((instr >> 5) & 0x7ffff) << 2) | ((instr >> 29) & 3), 21);
+  if (instr & 0x80000000) { // adrp
+    return (addr & ~std::uintptr_t(0xfff)) + imm * 4096;
+  }
+  return addr + imm;
+}
+
+// The address read by a literal load.
+std::uintptr_t literalTarget(std::uintptr_t addr, uint32_t instr) {
+  return addr + signExtend((instr >> 5) & 0x7ffff, 19) * 4;
+}
+
+// PC-relative instructions are rewritten into sequences that build the
+// absolute address in a register. Branches go through x16, the
+// intra-procedure-call scratch register that the jumps into and out of
+// trampolines clobber as well, and literal loads into a SIMD register or
+// prefetches through x17. Loads into a general register build the address in
+// that register.
+constexpr uint32_t BRANCH_REG = 16;
+constexpr uint32_t LOAD_REG = 17;
+
+// movz reg, #imm16 and movk reg, #imm16, lsl #16 * hw for each hw.
+constexpr std::size_t MOV_ADDR_SIZE = 4 * INSTR_SIZE;
+
+// A branch over the absolute branch that follows it.
+constexpr uint32_t SKIP_ABSOLUTE_BRANCH = (MOV_ADDR_SIZE + 2 * INSTR_SIZE) / 4;
+
+// The length of instr once relocated.
+std::size_t relocatedLength(uint32_t instr) {
+  if (isAdr(instr)) {
+    return MOV_ADDR_SIZE;
+  }
+  if (isLoadLiteral(instr) || isUnconditionalBranch(instr)) {
+    return MOV_ADDR_SIZE + INSTR_SIZE;
+  }
+  if (branchTarget(0, instr)) {
+    return MOV_ADDR_SIZE + 2 * INSTR_SIZE;
+  }
+  return INSTR_SIZE;
+}
+
+// Whether instr can be relocated. A register loaded with a PC-relative
+// address must survive the jump back to the original function, which
+// clobbers x16.
+bool isRelocatable(uint32_t instr) {
+  if (isAdr(instr)) {
+    return (instr & 0x1f) != BRANCH_REG;
+  }
+  if (isLoadLiteral(instr)) {
+    const uint32_t opc = instr >> 30;
+    const bool simd = (instr >> 26) & 1;
+    if (simd) {
+      return opc != 3;
+    }
+    return opc == 3 || (instr & 0x1f) != BRANCH_REG;
+  }
+  return true;
+}
+
+uint8_t *writeInstr(uint8_t *dst, uint32_t instr) {
+  std::memcpy(dst, &instr, sizeof(instr));
+  return dst + sizeof(instr);
+}
+
+uint8_t *writeMovAddr(uint8_t *dst, uint32_t reg, std::uintptr_t addr) {
+  dst = writeInstr(dst, 0xd2800000 | ((addr & 0xffff) << 5) | reg);
+  for (uint32_t hw = 1; hw < 4; hw++) {
+    const uint32_t imm16 = (addr >> (16 * hw)) & 0xffff;
+    dst = writeInstr(dst, 0xf2800000 | (hw << 21) | (imm16 << 5) | reg);
+  }
+  return dst;
+}
+
+// Write instr, found at srcAddr, relocated. out must hold relocatedLength
+// bytes.
+void relocateInstr(std::uintptr_t srcAddr, uint32_t instr, uint8_t *out) {
+  if (isAdr(instr)) {
+    writeMovAddr(out, instr & 0x1f, adrTarget(srcAddr, instr));
+    return;
+  }
+
+  if (isLoadLiteral(instr)) {
+    // The same load from [reg] with an unsigned offset of 0.
+    const uint32_t opc = instr >> 30;
+    const uint32_t rt = instr & 0x1f;
+    uint32_t load;
+    uint32_t reg = LOAD_REG;
+    if ((instr >> 26) & 1) {
+      constexpr uint32_t SIMD_LOADS[] = {0xbd400000, 0xfd400000, 0x3dc00000};
+      load = SIMD_LOADS[opc];
+    } else {
+      constexpr uint32_t LOADS[] = {0xb9400000, 0xf9400000, 0xb9800000,
+                                    0xf9800000};
+      load = LOADS[opc];
+      if (opc != 3) {
+        reg = rt; // not a prefetch
+      }
+    }
+    out = writeMovAddr(out, reg, literalTarget(srcAddr, instr));
+    writeInstr(out, load | (reg << 5) | rt);
+    return;
+  }
+
+  const auto target = branchTarget(srcAddr, instr);
+  if (!target) {
+    writeInstr(out, instr);
+    return;
+  }
+
+  // A conditional branch becomes its inverse branching over an absolute
+  // branch to the original target.
+  if (!isUnconditionalBranch(instr)) {
+    uint32_t inverse;
+    if ((instr & 0xff000010) == 0x54000000) { // b.cond
+      inverse = (instr & 0xff00000f) ^ 1;
+    } else if ((instr & 0x7e000000) == 0x34000000) { // cbz, cbnz
+      inverse = (instr & 0xff00001f) ^ 0x01000000;
+    } else { // tbz, tbnz
+      inverse = (instr & 0xfff8001f) ^ 0x01000000;
+    }
+    out = writeInstr(out, inverse | (SKIP_ABSOLUTE_BRANCH << 5));
+  }
+
+  out = writeMovAddr(out, BRANCH_REG, *target);
+  const bool link = (instr & 0xfc000000) == 0x94000000; // bl
+  writeInstr(out, (link ? 0xd63f0000 : 0xd61f0000) | (BRANCH_REG << 5));
+}
+
+#endif
+
+} // namespace
+
 std::optional<std::span<const uint8_t>> copyInstrs(std::uintptr_t startAddr,
                                                    std::size_t codeSize,
                                                    std::size_t minCopySize) {
-  const uint8_t *codeStart = reinterpret_cast<const uint8_t*>(startAddr);
-  return std::span<const uint8_t>(codeStart, minCopySize);
+  return copyInstrs(
+      std::span(reinterpret_cast<const uint8_t *>(startAddr), codeSize),
+      startAddr, minCopySize);
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+std::optional<std::span<const uint8_t>> copyInstrs(std::span<const uint8_t> code,
+                                                   std::uintptr_t startAddr,
+                                                   std::size_t minCopySize) {
+  const uint8_t *codeStart = code.data();
+  const std::size_t codeSize = code.size();
+
+  std::size_t copySize = 0;
+  while (copySize < minCopySize) {
+    if (copySize >= codeSize) {
+      std::cerr << std::format("function at {:#x} too small to patch\n",
+                               startAddr);
+      return std::nullopt;
+    }
+    const auto instr = decode(codeStart + copySize, codeSize - copySize);
+    if (!instr) {
+      std::cerr << std::format("failed decoding instruction at {:#x}\n",
+                               startAddr + copySize);
+      return std::nullopt;
+    }
+    if (!instr->relocatable) {
+      std::cerr << std::format("cannot relocate instruction at {:#x}\n",
+                               startAddr + copySize);
+      return std::nullopt;
+    }
+    copySize += instr->length;
+  }
+
+  // Any branch into the displaced instructions would land in the middle of the
+  // patch. Branches within them are checked when they are relocated. Decoding
+  // stops at the first byte that is not a known instruction, such as padding
+  // or data following the function body.
+  std::size_t offset = copySize;
+  while (offset < codeSize) {
+    const auto instr = decode(codeStart + offset, codeSize - offset);
+    if (!instr) {
+      break;
+    }
+    if (instr->relSize != 0) {
+      const auto target = branchTarget(codeStart + offset, startAddr + offset,
+                                       *instr);
+      if (target > startAddr && target < startAddr + copySize) {
+        std::cerr << std::format("branch at {:#x} targets patched instructions\n",
+                                 startAddr + offset);
+        return std::nullopt;
+      }
+    }
+    offset += instr->length;
+  }
+
+  return std::span<const uint8_t>(codeStart, copySize);
 }
 
+std::optional<std::size_t> relocateInstrs(std::uintptr_t startAddr,
+                                          std::span<const uint8_t> instrs,
+                                          std::uintptr_t dstAddr,
+                                          std::span<uint8_t> out) {
+  const std::uintptr_t endAddr = startAddr + instrs.size();
+  std::size_t srcOffset = 0;
+  std::size_t dstOffset = 0;
+
+  while (srcOffset < instrs.size()) {
+    const auto instr = decode(instrs.data() + srcOffset, instrs.size() - srcOffset);
+    if (!instr || !instr->relocatable) {
+      return std::nullopt;
+    }
+
+    const uint8_t *src = instrs.data() + srcOffset;
+    const std::uintptr_t srcAddr = startAddr + srcOffset;
+    const std::uintptr_t dstPc = dstAddr + dstOffset;
+
+    // Short branches are widened to their rel32 forms since the original
+    // target is almost certainly out of rel8 range of the new location.
+    const std::size_t length = relocatedLength(src, *instr);
+    if (dstOffset + length > out.size()) {
+      return std::nullopt;
+    }
+    uint8_t *dst = out.data() + dstOffset;
+
+    if (instr->relSize != 0) {
+      const auto target = branchTarget(src, srcAddr, *instr);
+      if (target >= startAddr && target < endAddr) {
+        return std::nullopt;
+      }
+
+      std::size_t fieldOffset = instr->fieldOffset;
+      std::memcpy(dst, src, instr->opcodeOffset);
+      if (instr->relSize == 1) {
+        const uint8_t opcode = src[instr->opcodeOffset];
+        uint8_t *opcodeDst = dst + instr->opcodeOffset;
+        if (opcode == 0xeb) {
+          opcodeDst[0] = 0xe9; // jmp rel32
+          fieldOffset = instr->opcodeOffset + 1;
+        } else {
+          opcodeDst[0] = 0x0f; // jcc rel32
+          opcodeDst[1] = 0x80 | (opcode & 0x0f);
+          fieldOffset = instr->opcodeOffset + 2;
+        }
+      } else {
+        std::memcpy(dst, src, instr->length);
+      }
+
+      const int64_t rel = static_cast<int64_t>(target - (dstPc + length));
+      if (!fitsRel32(rel)) {
+        return std::nullopt;
+      }
+      const int32_t rel32 = static_cast<int32_t>(rel);
+      std::memcpy(dst + fieldOffset, &rel32, sizeof(rel32));
+    } else {
+      std::memcpy(dst, src, instr->length);
+
+      if (instr->ripRelative) {
+        int32_t disp;
+        std::memcpy(&disp, src + instr->fieldOffset, sizeof(disp));
+        const int64_t newDisp =
+            disp + static_cast<int64_t>(srcAddr - dstPc);
+        if (!fitsRel32(newDisp)) {
+          return std::nullopt;
+        }
+        disp = static_cast<int32_t>(newDisp);
+        std::memcpy(dst + instr->fieldOffset, &disp, sizeof(disp));
+      }
+    }
+
+    srcOffset += instr->length;
+    dstOffset += length;
+  }
+
+  return dstOffset;
+}
+
+std::optional<std::size_t> relocatedOffset(std::span<const uint8_t> instrs,
+                                           std::size_t offset) {
+  if (offset > instrs.size()) {
+    return std::nullopt;
+  }
+
+  std::size_t srcOffset = 0;
+  std::size_t dstOffset = 0;
+  while (srcOffset < offset) {
+    const auto instr =
+        decode(instrs.data() + srcOffset, instrs.size() - srcOffset);
+    if (!instr) {
+      return std::nullopt;
+    }
+    dstOffset += relocatedLength(instrs.data() + srcOffset, *instr);
+    srcOffset += instr->length;
+  }
+
+  if (srcOffset != offset) {
+    return std::nullopt; // in the middle of an instruction
+  }
+  return dstOffset;
+}
+
+bool containsCalls(std::span<const uint8_t> instrs) {
+  std::size_t offset = 0;
+  while (offset < instrs.size()) {
+    const auto instr = decode(instrs.data() + offset, instrs.size() - offset);
+    if (!instr) {
+      return false;
+    }
+
+    // call rel32 is E8, and the indirect forms are FF /2 and FF /3.
+    const uint8_t *opcode = instrs.data() + offset + instr->opcodeOffset;
+    if (opcode[0] == 0xe8 ||
+        (opcode[0] == 0xff && ((opcode[1] >> 3) & 7) >= 2 &&
+         ((opcode[1] >> 3) & 7) <= 3)) {
+      return true;
+    }
+    offset += instr->length;
+  }
+  return false;
+}
+
+bool isNops(std::uintptr_t addr, std::size_t size) {
+  const uint8_t *code = reinterpret_cast<const uint8_t *>(addr);
+  std::size_t offset = 0;
+  while (offset < size) {
+    const auto instr = decode(code + offset, size - offset);
+    if (!instr) {
+      return false;
+    }
+
+    // nop and xchg ax, ax are 90; the multi-byte forms are 0F 1F /0. Only the
+    // operand size and CS prefixes appear in the recommended NOP sequences.
+    // A REX prefix would turn 90 into xchg with r8.
+    const uint8_t *instrCode = code + offset;
+    for (std::size_t idx = 0; idx < instr->opcodeOffset; idx++) {
+      if (instrCode[idx] != 0x66 && instrCode[idx] != 0x2e) {
+        return false;
+      }
+    }
+    const uint8_t *opcode = instrCode + instr->opcodeOffset;
+    const bool isNop = opcode[0] == 0x90 ||
+                       (opcode[0] == 0x0f && opcode[1] == 0x1f &&
+                        ((opcode[2] >> 3) & 7) == 0);
+    if (!isNop) {
+      return false;
+    }
+    offset += instr->length;
+  }
+  return true;
+}
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+
+std::optional<std::span<const uint8_t>> copyInstrs(std::span<const uint8_t> code,
+                                                   std::uintptr_t startAddr,
+                                                   std::size_t minCopySize) {
+  const std::size_t codeSize = code.size();
+  const std::size_t copySize = (minCopySize + INSTR_SIZE - 1) & ~(INSTR_SIZE - 1);
+  if (copySize > codeSize) {
+    return std::nullopt;
+  }
+
+  for (std::size_t offset = 0; offset < copySize; offset += INSTR_SIZE) {
+    if (!isRelocatable(readInstr(code.data() + offset))) {
+      std::cerr << std::format("cannot relocate instruction at {:#x}\n",
+                               startAddr + offset);
+      return std::nullopt;
+    }
+  }
+
+  // Any branch into the displaced instructions would land in the middle of the
+  // patch. Branches within them are checked when they are relocated.
+  for (std::size_t offset = copySize; offset + INSTR_SIZE <= codeSize;
+       offset += INSTR_SIZE) {
+    const auto target = branchTarget(startAddr + offset,
+                                     readInstr(code.data() + offset));
+    if (target && *target > startAddr && *target < startAddr + copySize) {
+      std::cerr << std::format("branch at {:#x} targets patched instructions\n",
+                               startAddr + offset);
+      return std::nullopt;
+    }
+  }
+
+  return code.first(copySize);
+}
+
+std::optional<std::size_t> relocateInstrs(std::uintptr_t startAddr,
+                                          std::span<const uint8_t> instrs,
+                                          std::uintptr_t dstAddr,
+                                          std::span<uint8_t> out) {
+  // dstAddr is not needed since every relocated instruction addresses its
+  // target absolutely.
+  (void)dstAddr;
+  if (instrs.size() % INSTR_SIZE != 0) {
+    return std::nullopt;
+  }
+
+  const std::uintptr_t endAddr = startAddr + instrs.size();
+  std::size_t dstOffset = 0;
+  for (std::size_t offset = 0; offset < instrs.size(); offset += INSTR_SIZE) {
+    const uint32_t instr = readInstr(instrs.data() + offset);
+    const std::uintptr_t srcAddr = startAddr + offset;
+    if (!isRelocatable(instr)) {
+      return std::nullopt;
+    }
+
+    const auto target = branchTarget(srcAddr, instr);
+    if (target && *target >= startAddr && *target < endAddr) {
+      return std::nullopt;
+    }
+
+    const std::size_t length = relocatedLength(instr);
+    if (dstOffset + length > out.size()) {
+      return std::nullopt;
+    }
+    relocateInstr(srcAddr, instr, out.data() + dstOffset);
+    dstOffset += length;
+  }
+  return dstOffset;
+}
+
+std::optional<std::size_t> relocatedOffset(std::span<const uint8_t> instrs,
+                                           std::size_t offset) {
+  if (offset > instrs.size() || offset % INSTR_SIZE != 0) {
+    return std::nullopt;
+  }
+
+  std::size_t dstOffset = 0;
+  for (std::size_t srcOffset = 0; srcOffset < offset;
+       srcOffset += INSTR_SIZE) {
+    dstOffset += relocatedLength(readInstr(instrs.data() + srcOffset));
+  }
+  return dstOffset;
+}
+
+bool containsCalls(std::span<const uint8_t> instrs) {
+  // bl, blr and the pointer authentication forms of blr.
+  for (std::size_t offset = 0; offset + INSTR_SIZE <= instrs.size();
+       offset += INSTR_SIZE) {
+    const uint32_t instr = readInstr(instrs.data() + offset);
+    if ((instr & 0xfc000000) == 0x94000000 ||
+        (instr & 0xfefff000) == 0xd63f0000) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool isNops(std::uintptr_t addr, std::size_t size) {
+  constexpr uint32_t NOP = 0xd503201f;
+  if (size % INSTR_SIZE != 0) {
+    return false;
+  }
+  for (std::size_t offset = 0; offset < size; offset += INSTR_SIZE) {
+    if (readInstr(reinterpret_cast<const uint8_t *>(addr + offset)) != NOP) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif
+
 }; // namespace Interject::Disassembler
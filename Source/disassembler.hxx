@@ -22,7 +22,44 @@
 
 namespace Interject::Disassembler {
 
+// Return the whole instructions at the start of the codeSize byte function at
+// startAddr that must be displaced to overwrite at least minCopySize bytes.
+// Fails if the instructions extend past the end of the function, cannot be
+// decoded or relocated, or if any branch in the function targets the middle
+// of the displaced instructions.
 std::optional<std::span<const uint8_t>> copyInstrs(std::uintptr_t startAddr,
                                                    std::size_t codeSize,
                                                    std::size_t minCopySize);
+
+// Like copyInstrs for a copy of the function at startAddr held in code, such
+// as one read from another process. The returned span points into code.
+std::optional<std::span<const uint8_t>> copyInstrs(std::span<const uint8_t> code,
+                                                   std::uintptr_t startAddr,
+                                                   std::size_t minCopySize);
+
+// Re-encode instructions returned by copyInstrs for startAddr so they execute
+// identically at dstAddr, writing them to out. PC-relative operands are
+// adjusted for the new location and short branches are widened. Returns the
+// number of bytes written, or nothing if the instructions cannot be relocated
+// to dstAddr or do not fit in out.
+std::optional<std::size_t> relocateInstrs(std::uintptr_t startAddr,
+                                          std::span<const uint8_t> instrs,
+                                          std::uintptr_t dstAddr,
+                                          std::span<uint8_t> out);
+
+// Return where the instruction offset bytes into instrs, as returned by
+// copyInstrs, starts once relocated by relocateInstrs, or nothing if no
+// instruction starts there. An offset of instrs.size() gives the size of the
+// relocated instructions.
+std::optional<std::size_t> relocatedOffset(std::span<const uint8_t> instrs,
+                                           std::size_t offset);
+
+// Return true if instructions returned by copyInstrs include a call. A thread
+// inside the callee then has a return address within the displaced
+// instructions.
+bool containsCalls(std::span<const uint8_t> instrs);
+
+// Return true if the size bytes at addr hold only whole NOP instructions, such
+// as the padding emitted by -fpatchable-function-entry.
+bool isNops(std::uintptr_t addr, std::size_t size);
 }; // namespace Interject::Disassembler
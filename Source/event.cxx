@@ -16,6 +16,7 @@
 
 #include "event.hxx"
 
+#include <algorithm>
 #include <cassert>
 #include <errno.h>
 #include <limits.h>
@@ -26,40 +27,150 @@
 
 namespace Interject {
 
+// Spinning only pays off when the thread that ends the wait can run meanwhile.
+static const bool MULTI_CORE = ::sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+static constexpr std::uint32_t MIN_SPINS = 16;
+static constexpr std::uint32_t MAX_SPINS = 512;
+
+static inline void cpuRelax() noexcept {
+#if defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Spin until ready() holds or the spin budget runs out. The budget follows how
+// long recent waits on the same object spun before succeeding, and shrinks
+// whenever spinning fails, so waits that usually end up sleeping barely spin.
+// The budget is only a hint and is updated without synchronization.
+template <typename Ready>
+static bool spinUntil(std::uint32_t &spins, Ready &&ready) noexcept {
+  if (!MULTI_CORE) {
+    return ready();
+  }
+
+  const std::uint32_t budget = __atomic_load_n(&spins, __ATOMIC_RELAXED);
+  const std::uint32_t limit = std::min(MAX_SPINS, budget * 2 + MIN_SPINS);
+  for (std::uint32_t count = 0; count < limit; count++) {
+    if (ready()) {
+      const std::int64_t delta =
+          (static_cast<std::int64_t>(count) - budget) / 8;
+      __atomic_store_n(&spins, static_cast<std::uint32_t>(budget + delta),
+                       __ATOMIC_RELAXED);
+      return true;
+    }
+    cpuRelax();
+  }
+
+  __atomic_store_n(&spins, budget - budget / 8, __ATOMIC_RELAXED);
+  return false;
+}
+
+static void wakeAll(std::uint32_t *addr) noexcept {
+  if (::syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr,
+                0) == -1) {
+    assert(!"FUTEX_WAKE_PRIVATE failed unexpectedly");
+  }
+}
+
 Event::Event() {
   __atomic_store_n(&_value, EVENT_VALUE_UNSET, __ATOMIC_RELEASE);
 }
 
 void Event::Reset() noexcept {
-  __atomic_store_n(&this->_value, EVENT_VALUE_UNSET, __ATOMIC_RELEASE);
+  // Only a set event is reset so the mark left by a sleeping waiter survives.
+  std::uint32_t expected = EVENT_VALUE_SET;
+  __atomic_compare_exchange_n(&this->_value, &expected, EVENT_VALUE_UNSET,
+                              false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
 }
 
 void Event::Set() noexcept {
   const uint32_t value =
       __atomic_exchange_n(&this->_value, EVENT_VALUE_SET, __ATOMIC_RELEASE);
-  if (value == EVENT_VALUE_UNSET) {
-    // If the value was previously unset, wake any waiters.
-    if (::syscall(SYS_futex, &this->_value, FUTEX_WAKE_PRIVATE, INT_MAX,
-                  nullptr, nullptr, 0) == -1) {
-      assert(!"FUTEX_WAKE_PRIVATE failed unexpectedly");
-    }
+  if (value == EVENT_VALUE_UNSET_WAITERS) {
+    // Only wake the kernel when a waiter went to sleep.
+    wakeAll(&this->_value);
   }
 }
 
 [[nodiscard]]
 bool Event::Wait(struct timespec *timeout) const noexcept {
+  if (spinUntil(_spins, [this]() {
+        return __atomic_load_n(&this->_value, __ATOMIC_ACQUIRE) ==
+               EVENT_VALUE_SET;
+      })) {
+    return true;
+  }
+
   for (;;) {
-    const uint32_t value = __atomic_load_n(&this->_value, __ATOMIC_ACQUIRE);
+    uint32_t value = __atomic_load_n(&this->_value, __ATOMIC_ACQUIRE);
     if (value == EVENT_VALUE_SET) {
       break;
     }
 
-    assert(value == EVENT_VALUE_UNSET);
+    if (value == EVENT_VALUE_UNSET) {
+      // Mark the event so Set() knows to wake us.
+      if (!__atomic_compare_exchange_n(&this->_value, &value,
+                                       EVENT_VALUE_UNSET_WAITERS, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        continue;
+      }
+    }
 
-    if (::syscall(SYS_futex, &this->_value, FUTEX_WAIT_PRIVATE, value, timeout,
+    if (::syscall(SYS_futex, &this->_value, FUTEX_WAIT_PRIVATE,
+                  EVENT_VALUE_UNSET_WAITERS, timeout, nullptr, 0) == -1) {
+      switch (errno) {
+      case EAGAIN:
+      case EINTR:
+        continue;
+      case ETIMEDOUT:
+        return false;
+      default:
+        assert(!"FUTEX_WAIT_PRIVATE failed unexpectedly");
+      }
+    }
+  }
+  return true;
+}
+
+CountdownLatch::CountdownLatch(std::uint32_t count) noexcept {
+  __atomic_store_n(&_count, count, __ATOMIC_RELEASE);
+}
+
+void CountdownLatch::Reset(std::uint32_t count) noexcept {
+  __atomic_store_n(&_count, count, __ATOMIC_RELEASE);
+}
+
+void CountdownLatch::CountDown() noexcept {
+  if (__atomic_sub_fetch(&_count, 1, __ATOMIC_ACQ_REL) == 0) {
+    // Only the last acknowledgement wakes the waiters.
+    wakeAll(&_count);
+  }
+}
+
+[[nodiscard]]
+bool CountdownLatch::Wait(struct timespec *timeout) const noexcept {
+  if (spinUntil(_spins, [this]() {
+        return __atomic_load_n(&_count, __ATOMIC_ACQUIRE) == 0;
+      })) {
+    return true;
+  }
+
+  for (;;) {
+    const std::uint32_t count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+    if (count == 0) {
+      break;
+    }
+
+    // Intermediate counts do not wake us; the futex word changing before we
+    // sleep just makes us look again.
+    if (::syscall(SYS_futex, &_count, FUTEX_WAIT_PRIVATE, count, timeout,
                   nullptr, 0) == -1) {
       switch (errno) {
       case EAGAIN:
+      case EINTR:
         continue;
       case ETIMEDOUT:
         return false;
@@ -71,4 +182,42 @@ bool Event::Wait(struct timespec *timeout) const noexcept {
   return true;
 }
 
+std::uint32_t Generation::Current() const noexcept {
+  return __atomic_load_n(&_value, __ATOMIC_ACQUIRE);
+}
+
+void Generation::Advance() noexcept {
+  // Sequentially consistent with the sleeper count in WaitPast() so either the
+  // waiter sees the new generation or we see the waiter.
+  __atomic_add_fetch(&_value, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&_sleepers, __ATOMIC_SEQ_CST) != 0) {
+    wakeAll(&_value);
+  }
+}
+
+[[nodiscard]]
+bool Generation::WaitPast(std::uint32_t observed,
+                          struct timespec *timeout) const noexcept {
+  if (spinUntil(_spins, [&]() {
+        return __atomic_load_n(&_value, __ATOMIC_ACQUIRE) != observed;
+      })) {
+    return true;
+  }
+
+  bool result = true;
+  __atomic_add_fetch(&_sleepers, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&_value, __ATOMIC_SEQ_CST) == observed) {
+    if (::syscall(SYS_futex, &_value, FUTEX_WAIT_PRIVATE, observed, timeout,
+                  nullptr, 0) == -1) {
+      if (errno == ETIMEDOUT) {
+        result = false;
+        break;
+      }
+      assert(errno == EAGAIN || errno == EINTR);
+    }
+  }
+  __atomic_sub_fetch(&_sleepers, 1, __ATOMIC_SEQ_CST);
+  return result;
+}
+
 }; // namespace Interject
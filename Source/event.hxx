@@ -23,6 +23,9 @@ namespace Interject {
 
 // A simple futex-based synchronization primitive similar to a Win32 manual-
 // reset event.
+//
+// Waiters spin briefly before sleeping in the kernel, and Set() only issues a
+// wake when a waiter is actually asleep.
 class Event final {
 public:
   Event();
@@ -43,7 +46,61 @@ public:
 private:
   static constexpr std::uint32_t EVENT_VALUE_UNSET = 0;
   static constexpr std::uint32_t EVENT_VALUE_SET = 1;
-  uint32_t _value;
+  static constexpr std::uint32_t EVENT_VALUE_UNSET_WAITERS = 2;
+  mutable uint32_t _value;
+  mutable std::uint32_t _spins = 0;
+};
+
+// Lets one thread wait for a number of acknowledgements from others with a
+// single wake, rather than one event per acknowledging thread.
+class CountdownLatch final {
+public:
+  explicit CountdownLatch(std::uint32_t count = 0) noexcept;
+
+  // Re-arm the latch. No thread may be waiting or counting down.
+  void Reset(std::uint32_t count) noexcept;
+
+  // Count one acknowledgement and wake the waiters once the count reaches zero.
+  // Safe to call from a signal handler.
+  void CountDown() noexcept;
+
+  // Wait for the count to reach zero. Returns false on timeout.
+  [[nodiscard]] bool Wait(struct timespec *timeout) const noexcept;
+
+  // Wait with infinite timeout.
+  void Wait() const noexcept { (void)Wait(nullptr); }
+
+private:
+  std::uint32_t _count;
+  mutable std::uint32_t _spins = 0;
+};
+
+// A counter that threads wait on to move past a value they observed. Advancing
+// it wakes every waiter with a single FUTEX_WAKE, so many threads can be
+// released at once by one store and at most one syscall.
+class Generation final {
+public:
+  // The current generation. Observe it before checking the condition being
+  // waited for so an advance in between is not missed.
+  std::uint32_t Current() const noexcept;
+
+  // Move to the next generation and wake every waiter. Safe to call from a
+  // signal handler.
+  void Advance() noexcept;
+
+  // Wait for the generation to differ from observed. Returns false on timeout.
+  [[nodiscard]] bool WaitPast(std::uint32_t observed,
+                              struct timespec *timeout) const noexcept;
+
+  // Wait with infinite timeout.
+  void WaitPast(std::uint32_t observed) const noexcept {
+    (void)WaitPast(observed, nullptr);
+  }
+
+private:
+  std::uint32_t _value = 0;
+  mutable std::uint32_t _sleepers = 0;
+  mutable std::uint32_t _spins = 0;
 };
 
 }; // namespace Interject
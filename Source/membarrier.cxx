@@ -0,0 +1,51 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "membarrier.hxx"
+
+#include <mutex>
+
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Interject::Membarrier {
+
+static long membarrier(int command) noexcept {
+  return ::syscall(SYS_membarrier, command, 0, 0);
+}
+
+bool registerSyncCore() noexcept {
+  static std::once_flag once;
+  static bool registered = false;
+
+  std::call_once(once, []() {
+    const long commands = membarrier(MEMBARRIER_CMD_QUERY);
+    if (commands == -1 ||
+        (commands & MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE) == 0) {
+      return;
+    }
+    registered =
+        membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE) == 0;
+  });
+  return registered;
+}
+
+bool syncCore() noexcept {
+  return membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE) == 0;
+}
+
+}; // namespace Interject::Membarrier
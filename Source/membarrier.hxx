@@ -0,0 +1,31 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+namespace Interject::Membarrier {
+
+// Register the process for core-serializing membarriers. Returns false if the
+// kernel does not support them. Registration happens once; later calls return
+// the cached result.
+bool registerSyncCore() noexcept;
+
+// Make every running thread of the process execute a core-serializing
+// instruction before returning, so instructions modified before the call are
+// observed by all threads. registerSyncCore must have succeeded.
+bool syncCore() noexcept;
+
+}; // namespace Interject::Membarrier
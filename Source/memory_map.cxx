@@ -14,76 +14,310 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <charconv>
+#include <cstring>
 #include <format>
-#include <fstream>
 #include <iostream>
 #include <optional>
-#include <sstream>
 
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "memory_map.hxx"
+#include "scope_guard.hxx"
+
+#if !defined(PROCMAP_QUERY)
+// Definitions from <linux/fs.h> for kernel headers predating Linux 6.11.
+enum procmap_query_flags {
+  PROCMAP_QUERY_VMA_READABLE = 0x01,
+  PROCMAP_QUERY_VMA_WRITABLE = 0x02,
+  PROCMAP_QUERY_VMA_EXECUTABLE = 0x04,
+  PROCMAP_QUERY_VMA_SHARED = 0x08,
+  PROCMAP_QUERY_COVERING_OR_NEXT_VMA = 0x10,
+  PROCMAP_QUERY_FILE_BACKED_VMA = 0x20,
+};
+
+struct procmap_query {
+  __u64 size;
+  __u64 query_flags;
+  __u64 query_addr;
+  __u64 vma_start;
+  __u64 vma_end;
+  __u64 vma_flags;
+  __u64 vma_page_size;
+  __u64 vma_offset;
+  __u64 inode;
+  __u32 dev_major;
+  __u32 dev_minor;
+  __u32 vma_name_size;
+  __u32 build_id_size;
+  __u64 vma_name_addr;
+  __u64 build_id_addr;
+};
+
+#define PROCFS_IOCTL_MAGIC 'f'
+#define PROCMAP_QUERY _IOWR(PROCFS_IOCTL_MAGIC, 17, struct procmap_query)
+#endif
 
 namespace Interject {
 
 bool MemoryMap::load(const std::string_view &file_name) {
-  std::ifstream mapsFile(file_name.data());
-  if (!mapsFile.is_open()) {
+  // A failed load leaves the map empty rather than holding a stale or partial
+  // list of regions.
+  _regions.clear();
+
+  char path[PATH_MAX];
+  if (file_name.size() >= sizeof(path)) {
+    std::cerr << std::format("Path too long {}", file_name) << std::endl;
+    return false;
+  }
+  std::memcpy(path, file_name.data(), file_name.size());
+  path[file_name.size()] = '\0';
+
+  const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
     std::cerr << std::format("Failed to open file {}", file_name) << std::endl;
     return false;
   }
+  const auto fdGuard = ScopeGuard::create([&]() { ::close(fd); });
 
-  _regions.clear();
-  std::string line;
-  while (std::getline(mapsFile, line)) {
-    std::string_view lineView(line);
-
-    const auto addrEnd = lineView.find(' ');
-    const std::string_view addrRange = lineView.substr(0, addrEnd);
-    const std::string_view permissions = lineView.substr(addrEnd + 1, 4);
-
-    const int perms = (permissions[0] == 'r' ? PROT_READ : 0) |
-                      (permissions[1] == 'w' ? PROT_WRITE : 0) |
-                      (permissions[2] == 'x' ? PROT_EXEC : 0);
-
-    const auto dashPos = addrRange.find('-');
-    const std::string_view startAddr = addrRange.substr(0, dashPos);
-    const std::string_view endAddr = addrRange.substr(dashPos + 1);
-
-    const auto parseAddr = [](std::string_view str,
-                              std::uintptr_t &addr) -> bool {
-      auto [ptr, ec] =
-          std::from_chars(str.data(), str.data() + str.size(), addr, 16);
-      return (ec == std::errc()) ? true : false;
-    };
-
-    std::uintptr_t start, end;
-    if (!parseAddr(startAddr, start) || !parseAddr(endAddr, end)) {
-      std::cerr << std::format("failed to parse address range {}", addrRange)
+  // Read the whole file with as few read() calls as possible. The buffer is
+  // retained between loads so re-loading a map of similar size does not
+  // allocate.
+  constexpr std::size_t MIN_BUFFER_SIZE = 64 * 1024;
+  if (_buffer.size() < MIN_BUFFER_SIZE) {
+    _buffer.resize(MIN_BUFFER_SIZE);
+  }
+
+  std::size_t length = 0;
+  for (;;) {
+    if (length == _buffer.size()) {
+      _buffer.resize(_buffer.size() * 2);
+    }
+
+    const ssize_t count =
+        ::read(fd, _buffer.data() + length, _buffer.size() - length);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << std::format("Failed to read file {}", file_name)
+                << std::endl;
+      return false;
+    }
+
+    if (count == 0) {
+      break;
+    }
+    length += static_cast<std::size_t>(count);
+  }
+
+  if (!parse(std::string_view(_buffer.data(), length))) {
+    _regions.clear();
+    return false;
+  }
+  return true;
+}
+
+bool MemoryMap::parse(std::string_view contents) {
+  const auto parseHex = [](std::string_view &str, char delimiter,
+                           std::uint64_t &value) -> bool {
+    auto [ptr, ec] =
+        std::from_chars(str.data(), str.data() + str.size(), value, 16);
+    if (ec != std::errc() || ptr == str.data() + str.size() ||
+        *ptr != delimiter) {
+      return false;
+    }
+    str.remove_prefix(ptr - str.data() + 1);
+    return true;
+  };
+
+  const auto skipField = [](std::string_view &str) -> bool {
+    const auto pos = str.find(' ');
+    if (pos == std::string_view::npos) {
+      return false;
+    }
+    str.remove_prefix(pos + 1);
+    return true;
+  };
+
+  // Each line has the form:
+  //   start-end perms offset dev:dev inode    pathname
+  while (!contents.empty()) {
+    auto lineEnd = contents.find('\n');
+    if (lineEnd == std::string_view::npos) {
+      lineEnd = contents.size();
+    }
+    std::string_view line = contents.substr(0, lineEnd);
+    contents.remove_prefix(std::min(lineEnd + 1, contents.size()));
+
+    if (line.empty()) {
+      continue;
+    }
+
+    const std::string_view original = line;
+    std::uint64_t start, end, offset, inode;
+    if (!parseHex(line, '-', start) || !parseHex(line, ' ', end) ||
+        line.size() < 5 || line[4] != ' ') {
+      std::cerr << std::format("failed to parse memory map entry {}", original)
+                << std::endl;
+      return false;
+    }
+
+    const int perms = (line[0] == 'r' ? PROT_READ : 0) |
+                      (line[1] == 'w' ? PROT_WRITE : 0) |
+                      (line[2] == 'x' ? PROT_EXEC : 0);
+    line.remove_prefix(5);
+
+    if (!parseHex(line, ' ', offset) || !skipField(line)) {
+      std::cerr << std::format("failed to parse memory map entry {}", original)
+                << std::endl;
+      return false;
+    }
+
+    auto [ptr, ec] =
+        std::from_chars(line.data(), line.data() + line.size(), inode, 10);
+    if (ec != std::errc()) {
+      std::cerr << std::format("failed to parse memory map entry {}", original)
                 << std::endl;
       return false;
     }
+    line.remove_prefix(ptr - line.data());
 
-    _regions.emplace_back((Region){start, end, perms});
+    const auto pathStart = line.find_first_not_of(' ');
+    const std::string_view pathname = pathStart == std::string_view::npos
+                                          ? std::string_view()
+                                          : line.substr(pathStart);
+
+    _regions.emplace_back(Region{static_cast<std::uintptr_t>(start),
+                                 static_cast<std::uintptr_t>(end), perms,
+                                 offset, inode, pathname});
   }
 
   return true;
 }
 
 std::optional<MemoryMap::Region> MemoryMap::find(std::uintptr_t addr) const {
-  for (const auto &region : regions()) {
-    if (addr < region.start) {
-      // regions are sorted in address order, so if the requested addr falls
-      // before this region, it won't exist in any subsequent region either.
-      break;
+  // Regions are sorted in address order, so find the last region starting at
+  // or before addr and check whether it contains addr.
+  const auto it = std::upper_bound(
+      _regions.begin(), _regions.end(), addr,
+      [](std::uintptr_t value, const Region &region) {
+        return value < region.start;
+      });
+  if (it == _regions.begin()) {
+    return std::nullopt;
+  }
+
+  const auto &region = *(it - 1);
+  if (addr >= region.end) {
+    return std::nullopt;
+  }
+  return region;
+}
+
+void MemoryMap::findAll(std::span<const std::uintptr_t> addrs,
+                        std::span<const Region *> results) const {
+  // Both the addresses and the regions are sorted, so resolve them all with a
+  // single merge pass.
+  std::size_t regionIdx = 0;
+  for (std::size_t idx = 0; idx < addrs.size(); idx++) {
+    const auto addr = addrs[idx];
+    while (regionIdx < _regions.size() && _regions[regionIdx].end <= addr) {
+      regionIdx++;
+    }
+
+    const bool found =
+        regionIdx < _regions.size() && _regions[regionIdx].start <= addr;
+    results[idx] = found ? &_regions[regionIdx] : nullptr;
+  }
+}
+
+bool MemoryMapQuery::open(const std::string_view &file_name) {
+  close();
+
+  _fileName = file_name;
+  _fd = ::open(_fileName.c_str(), O_RDONLY | O_CLOEXEC);
+  if (_fd == -1) {
+    std::cerr << std::format("Failed to open file {}", file_name) << std::endl;
+    return false;
+  }
+
+  _useIoctl = true;
+  _fallbackLoaded = false;
+  return true;
+}
+
+void MemoryMapQuery::close() noexcept {
+  if (_fd != -1) {
+    ::close(_fd);
+    _fd = -1;
+  }
+  _last.reset();
+}
+
+std::optional<MemoryMap::Region>
+MemoryMapQuery::queryVma(std::uintptr_t addr) {
+  struct procmap_query query = {};
+  query.size = sizeof(query);
+  query.query_addr = addr;
+  query.vma_name_addr = reinterpret_cast<std::uintptr_t>(_pathname);
+  query.vma_name_size = sizeof(_pathname);
+
+  if (::ioctl(_fd, PROCMAP_QUERY, &query) == -1) {
+    if (errno != ENOENT) {
+      // Anything other than "no VMA covers addr" means the kernel does not
+      // support the ioctl.
+      _useIoctl = false;
+    }
+    return std::nullopt;
+  }
+
+  const int perms =
+      ((query.vma_flags & PROCMAP_QUERY_VMA_READABLE) ? PROT_READ : 0) |
+      ((query.vma_flags & PROCMAP_QUERY_VMA_WRITABLE) ? PROT_WRITE : 0) |
+      ((query.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE) ? PROT_EXEC : 0);
+
+  // vma_name_size includes the NUL terminator when a name is present.
+  const std::string_view pathname(
+      _pathname, query.vma_name_size > 0 ? query.vma_name_size - 1 : 0);
+
+  return MemoryMap::Region{static_cast<std::uintptr_t>(query.vma_start),
+                           static_cast<std::uintptr_t>(query.vma_end),
+                           perms,
+                           query.vma_offset,
+                           query.inode,
+                           pathname};
+}
+
+std::optional<MemoryMap::Region> MemoryMapQuery::find(std::uintptr_t addr) {
+  if (_last && addr >= _last->start && addr < _last->end) {
+    return _last;
+  }
+
+  if (_useIoctl && _fd != -1) {
+    _last = queryVma(addr);
+    if (_useIoctl) {
+      return _last;
     }
+  }
 
-    if (addr >= region.start && addr < region.end) {
-      return region;
+  // Older kernel; read and parse the whole map once and answer every query
+  // from it.
+  if (!_fallbackLoaded) {
+    if (!_fallback.load(_fileName)) {
+      return std::nullopt;
     }
+    _fallbackLoaded = true;
   }
-  return std::nullopt;
+
+  _last = _fallback.find(addr);
+  return _last;
 }
 
 }; // namespace Interject
@@ -19,9 +19,12 @@
 #include <cstdint>
 #include <optional>
 #include <span>
+#include <string>
 #include <string_view>
 #include <vector>
 
+#include <limits.h>
+
 namespace Interject {
 
 class MemoryMap {
@@ -30,8 +33,22 @@ public:
     std::uintptr_t start;
     std::uintptr_t end;
     int permissions;
+    std::uint64_t offset;
+    std::uint64_t inode;
+    // View into the buffer owned by the MemoryMap the region came from. Only
+    // valid until that map is re-loaded or destroyed.
+    std::string_view pathname;
   };
 
+  MemoryMap() = default;
+
+  // Region pathnames point into _buffer, so a copy would refer to the source
+  // map's storage. A move takes the buffer's heap allocation with it.
+  MemoryMap(const MemoryMap &) = delete;
+  MemoryMap &operator=(const MemoryMap &) = delete;
+  MemoryMap(MemoryMap &&) = default;
+  MemoryMap &operator=(MemoryMap &&) = default;
+
   // load or re-load memory mapping for the current process
   bool load() { return load("/proc/self/maps"); }
 
@@ -44,8 +61,60 @@ public:
 
   std::optional<Region> find(std::uintptr_t addr) const;
 
+  // Resolve many addresses in a single pass. The addresses must be sorted in
+  // ascending order. On return, each entry of results points to the region
+  // containing the corresponding address or is nullptr if there is none.
+  void findAll(std::span<const std::uintptr_t> addrs,
+               std::span<const Region *> results) const;
+
 private:
+  bool parse(std::string_view contents);
+
+  std::vector<char> _buffer;
   std::vector<Region> _regions;
 };
 
+// Answers point queries for the region containing an address. Uses the
+// PROCMAP_QUERY ioctl (Linux 6.11+), which looks up a single VMA without
+// reading and parsing the whole map, and falls back to loading a MemoryMap on
+// kernels without support.
+class MemoryMapQuery {
+public:
+  MemoryMapQuery() : _fd(-1), _useIoctl(true), _fallbackLoaded(false) {}
+  ~MemoryMapQuery() { close(); }
+
+  MemoryMapQuery(const MemoryMapQuery &) = delete;
+  MemoryMapQuery &operator=(const MemoryMapQuery &) = delete;
+
+  // open the memory mapping for the current process
+  bool open() { return open("/proc/self/maps"); }
+
+  // open the specified memory mapping
+  bool open(const std::string_view &file_name);
+
+  void close() noexcept;
+
+  // Return the region containing addr. Consecutive queries falling in the same
+  // region are answered without another lookup. The pathname of a returned
+  // region is only valid until the next query.
+  std::optional<MemoryMap::Region> find(std::uintptr_t addr);
+
+  // Return true if queries are answered by the PROCMAP_QUERY ioctl.
+  [[nodiscard]]
+  bool usingIoctl() const {
+    return _useIoctl;
+  }
+
+private:
+  std::optional<MemoryMap::Region> queryVma(std::uintptr_t addr);
+
+  int _fd;
+  bool _useIoctl;
+  bool _fallbackLoaded;
+  std::string _fileName;
+  std::optional<MemoryMap::Region> _last;
+  char _pathname[PATH_MAX];
+  MemoryMap _fallback;
+};
+
 }; // namespace Interject
@@ -49,13 +49,14 @@ static int dl_iterate_phdr_callback(struct dl_phdr_info *info, size_t size,
   }
 
   auto &func = *static_cast<Callback *>(context);
+  const std::span<const ElfW(Phdr)> phdrs(info->dlpi_phdr, info->dlpi_phnum);
   if (info->dlpi_name == nullptr || info->dlpi_name[0] == '\0') {
     // The name of the entry is not populated, indicating this is the main
     // executable.
-    func(getExecutablePath(), static_cast<uintptr_t>(info->dlpi_addr));
+    func(getExecutablePath(), static_cast<uintptr_t>(info->dlpi_addr), phdrs);
   } else {
     func(static_cast<std::string_view>(info->dlpi_name),
-         static_cast<uintptr_t>(info->dlpi_addr));
+         static_cast<uintptr_t>(info->dlpi_addr), phdrs);
   }
 
   return 0;
@@ -17,14 +17,19 @@
 
 #include <cstdint>
 #include <functional>
+#include <span>
+#include <string>
 #include <string_view>
 
+#include <link.h>
+
 namespace Interject::Modules {
 using Callback =
-    std::function<void(std::string_view obj_name, std::uintptr_t base_addr)>;
+    std::function<void(std::string_view obj_name, std::uintptr_t base_addr,
+                       std::span<const ElfW(Phdr)> phdrs)>;
 
 // Iterate the current process linkmap and invoke a callback for each loaded
-// module.
+// module. The program headers are those of the loaded image in memory.
 void forEach(Callback);
 
 // Return the executable file path for the current process.
@@ -14,9 +14,12 @@
  * limitations under the License.
  */
 
+#pragma once
+
 #include <array>
 #include <cstdint>
 #include <cstring>
+#include <optional>
 
 namespace Interject::Patch {
 
@@ -30,6 +33,14 @@ constexpr uint8_t JUMP_INSTRS[] = {
 };
 constexpr std::size_t JUMP_ADDR_BYTE_OFFSET = 2;
 
+// x86_64 machine code for: jmp [rip+0]. Unlike JUMP_INSTRS it clobbers no
+// registers so it can resume execution in the middle of a function.
+constexpr uint8_t RESUME_INSTRS[] = {
+    0xFF, 0x25, 0, 0, 0, 0,       // jmp [rip+0]
+    0,    0,    0, 0, 0, 0, 0, 0, // target address (filled below)
+};
+constexpr std::size_t RESUME_ADDR_BYTE_OFFSET = 6;
+
 #elif defined(__aarch64__) || defined(_M_ARM64)
 
 // AArch64 machine code for: mov x16, target; br x16
@@ -41,6 +52,11 @@ constexpr uint32_t JUMP_INSTRS[] = {
 };
 constexpr std::size_t JUMP_ADDR_BYTE_OFFSET = 8;
 
+// x16 is the intra-procedure-call scratch register, so the same sequence is
+// used to resume execution in the middle of a function.
+constexpr const uint32_t (&RESUME_INSTRS)[4] = JUMP_INSTRS;
+constexpr std::size_t RESUME_ADDR_BYTE_OFFSET = JUMP_ADDR_BYTE_OFFSET;
+
 #else
 #error "only arm64 and x86_64 archtectures are supported"
 #endif
@@ -56,4 +72,138 @@ createJumpTo(std::uintptr_t targetAddr) {
   return patch;
 }
 
+static inline constexpr size_t resumeAtSize() { return sizeof(RESUME_INSTRS); }
+
+// Create an instruction sequence that jumps to targetAddr without clobbering
+// any registers, used to return from a trampoline to the original function.
+static inline std::array<uint8_t, resumeAtSize()>
+createResumeAt(std::uintptr_t targetAddr) {
+  std::array<uint8_t, sizeof(RESUME_INSTRS)> patch;
+  std::memcpy(patch.data(), RESUME_INSTRS, sizeof(RESUME_INSTRS));
+  std::memcpy(patch.data() + RESUME_ADDR_BYTE_OFFSET, &targetAddr,
+              sizeof(targetAddr));
+  return patch;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+// x86_64 machine code for: jmp rel8
+constexpr std::size_t SHORT_JUMP_SIZE = 2;
+constexpr int64_t SHORT_JUMP_RANGE = INT8_MAX;
+
+// x86_64 machine code for: jmp rel32
+constexpr std::size_t NEAR_JUMP_SIZE = 5;
+constexpr int64_t NEAR_JUMP_RANGE = INT32_MAX;
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+
+// AArch64 machine code for: b imm26. It serves as both the short and the near
+// jump.
+constexpr std::size_t SHORT_JUMP_SIZE = 4;
+constexpr int64_t SHORT_JUMP_RANGE = (1 << 27) - 4;
+constexpr std::size_t NEAR_JUMP_SIZE = SHORT_JUMP_SIZE;
+constexpr int64_t NEAR_JUMP_RANGE = SHORT_JUMP_RANGE;
+
+#endif
+
+static inline constexpr size_t shortJumpSize() { return SHORT_JUMP_SIZE; }
+
+// Create the smallest jump from fromAddr to targetAddr, or nothing if the
+// target is out of its range. On x86_64 it is small enough to be written over
+// live code with a single atomic store.
+static inline std::optional<std::array<uint8_t, shortJumpSize()>>
+createShortJump(std::uintptr_t fromAddr, std::uintptr_t targetAddr) {
+  const int64_t offset = static_cast<int64_t>(targetAddr - fromAddr);
+  std::array<uint8_t, SHORT_JUMP_SIZE> patch;
+#if defined(__x86_64__) || defined(_M_X64)
+  const int64_t rel = offset - static_cast<int64_t>(SHORT_JUMP_SIZE);
+  if (rel < -SHORT_JUMP_RANGE - 1 || rel > SHORT_JUMP_RANGE) {
+    return std::nullopt;
+  }
+  patch = {0xEB, static_cast<uint8_t>(rel)};
+#else
+  if (offset < -SHORT_JUMP_RANGE - 4 || offset > SHORT_JUMP_RANGE ||
+      offset % 4 != 0) {
+    return std::nullopt;
+  }
+  const uint32_t instr = 0x14000000 | ((offset >> 2) & 0x03ffffff);
+  std::memcpy(patch.data(), &instr, sizeof(instr));
+#endif
+  return patch;
+}
+
+static inline constexpr size_t nearJumpSize() { return NEAR_JUMP_SIZE; }
+
+// Create a PC-relative jump from fromAddr to targetAddr, or nothing if the
+// target is out of range.
+static inline std::optional<std::array<uint8_t, nearJumpSize()>>
+createNearJump(std::uintptr_t fromAddr, std::uintptr_t targetAddr) {
+#if defined(__x86_64__) || defined(_M_X64)
+  const int64_t rel = static_cast<int64_t>(targetAddr - fromAddr) -
+                      static_cast<int64_t>(NEAR_JUMP_SIZE);
+  if (rel < -NEAR_JUMP_RANGE - 1 || rel > NEAR_JUMP_RANGE) {
+    return std::nullopt;
+  }
+  const int32_t rel32 = static_cast<int32_t>(rel);
+  std::array<uint8_t, NEAR_JUMP_SIZE> patch = {0xE9};
+  std::memcpy(patch.data() + 1, &rel32, sizeof(rel32));
+  return patch;
+#else
+  return createShortJump(fromAddr, targetAddr);
+#endif
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+// x86_64 machine code for: jmp [rip+rel32]
+constexpr std::size_t JUMP_THROUGH_SIZE = 6;
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+
+// AArch64 machine code for: adrp x16, slot; ldr x16, [x16, :lo12:slot]; br x16
+constexpr std::size_t JUMP_THROUGH_SIZE = 12;
+
+#endif
+
+static inline constexpr size_t jumpThroughSize() { return JUMP_THROUGH_SIZE; }
+
+// Create a jump from fromAddr to the address stored in the pointer slot at
+// slotAddr, or nothing if the slot is out of range. The slot is read every
+// time the jump executes, so the destination can be changed by storing to the
+// slot without modifying any code.
+static inline std::optional<std::array<uint8_t, jumpThroughSize()>>
+createJumpThrough(std::uintptr_t fromAddr, std::uintptr_t slotAddr) {
+  std::array<uint8_t, JUMP_THROUGH_SIZE> patch;
+#if defined(__x86_64__) || defined(_M_X64)
+  const int64_t rel = static_cast<int64_t>(slotAddr - fromAddr) -
+                      static_cast<int64_t>(JUMP_THROUGH_SIZE);
+  if (rel < -NEAR_JUMP_RANGE - 1 || rel > NEAR_JUMP_RANGE) {
+    return std::nullopt;
+  }
+  const int32_t rel32 = static_cast<int32_t>(rel);
+  patch[0] = 0xFF;
+  patch[1] = 0x25;
+  std::memcpy(patch.data() + 2, &rel32, sizeof(rel32));
+#else
+  constexpr std::uintptr_t PAGE_MASK = ~std::uintptr_t(0xfff);
+  const int64_t pages = (static_cast<int64_t>(slotAddr & PAGE_MASK) -
+                         static_cast<int64_t>(fromAddr & PAGE_MASK)) >>
+                        12;
+  if (pages < -(int64_t(1) << 20) || pages >= (int64_t(1) << 20) ||
+      slotAddr % sizeof(std::uintptr_t) != 0) {
+    return std::nullopt;
+  }
+  const uint32_t immlo = static_cast<uint32_t>(pages) & 0x3;
+  const uint32_t immhi = (static_cast<uint32_t>(pages) >> 2) & 0x7ffff;
+  const uint32_t offset = static_cast<uint32_t>(slotAddr & 0xfff) / 8;
+  const uint32_t instrs[] = {
+      0x90000000 | (immlo << 29) | (immhi << 5) | 16, // adrp x16, slot
+      0xF9400000 | (offset << 10) | (16 << 5) | 16,   // ldr x16, [x16, #off]
+      0xD61F0000 | (16 << 5),                          // br x16
+  };
+  std::memcpy(patch.data(), instrs, sizeof(instrs));
+#endif
+  return patch;
+}
+
 }; // namespace Interject::Patch
@@ -0,0 +1,897 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "remote.hxx"
+#include "disassembler.hxx"
+#include "memory_map.hxx"
+#include "patch.hxx"
+#include "scope_guard.hxx"
+#include "symbols.hxx"
+#include "threads.hxx"
+#include "trampolines.hxx"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <iostream>
+#include <optional>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace Interject {
+
+namespace {
+
+// A function hooked in another process.
+struct Target {
+  std::uintptr_t addr;
+  std::uintptr_t hook;
+  std::uintptr_t trampolineVar; // holds the trampoline while hooked
+  std::uintptr_t trampoline = 0;
+  std::vector<std::uint8_t> instrs; // the displaced original instructions
+};
+
+} // namespace
+
+struct RemoteTransaction::Process {
+  enum State {
+    Initialized = 0,
+    Prepared,
+    Committed,
+    RolledBack,
+  };
+
+  explicit Process(pid_t pid) : pid(pid) {}
+
+  pid_t pid;
+  State state = Initialized;
+  std::vector<Target> targets;
+  // Some displaced instructions call out, so a thread anywhere in the callee
+  // returns into them.
+  bool displacesCalls = false;
+};
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+namespace {
+
+// Largest function body read from a process to be disassembled.
+constexpr std::size_t MAX_CODE_SIZE = 64 * 1024;
+
+// Offset of the register jump in Patch::JUMP_INSTRS. A thread stopped there
+// already has the hook address in the register.
+constexpr std::size_t JUMP_REGISTER_OFFSET =
+    Patch::JUMP_ADDR_BYTE_OFFSET + sizeof(std::uintptr_t);
+
+constexpr std::uint8_t SYSCALL_INSTR[] = {0x0F, 0x05};
+
+bool readMemory(pid_t pid, std::uintptr_t addr, void *out, std::size_t size) {
+  struct iovec local = {out, size};
+  struct iovec remote = {reinterpret_cast<void *>(addr), size};
+  return ::process_vm_readv(pid, &local, 1, &remote, 1, 0) ==
+         static_cast<ssize_t>(size);
+}
+
+// The threads of another process, stopped with ptrace. The kernel ties a
+// tracee to the thread that attached it, so a Tracee must only be used from
+// the thread that created it.
+class Tracee {
+public:
+  struct Thread {
+    pid_t tid;
+    bool stopped = false;
+    bool exited = false;
+  };
+
+  explicit Tracee(pid_t pid) : _pid(pid), _memFd(-1) {}
+
+  ~Tracee() {
+    detach();
+    if (_memFd != -1) {
+      ::close(_memFd);
+    }
+  }
+
+  Tracee(const Tracee &) = delete;
+  Tracee &operator=(const Tracee &) = delete;
+
+  // Attach to every thread and wait for all of them to stop. Threads started
+  // by attached threads are attached by the kernel and stopped as well.
+  [[nodiscard]]
+  bool stop();
+
+  // Let every thread run for delay, then stop them all again.
+  [[nodiscard]]
+  bool restart(std::chrono::microseconds delay);
+
+  void detach() noexcept;
+
+  std::span<const Thread> threads() const noexcept { return _threads; }
+
+  [[nodiscard]]
+  bool getRegs(const Thread &thread, user_regs_struct &regs) const noexcept {
+    return ::ptrace(PTRACE_GETREGS, thread.tid, nullptr, &regs) == 0;
+  }
+
+  [[nodiscard]]
+  bool setRegs(const Thread &thread, const user_regs_struct &regs) const noexcept {
+    return ::ptrace(PTRACE_SETREGS, thread.tid, nullptr, &regs) == 0;
+  }
+
+  [[nodiscard]]
+  bool read(std::uintptr_t addr, void *out, std::size_t size) const noexcept {
+    return readMemory(_pid, addr, out, size);
+  }
+
+  // Write to writable memory such as a variable.
+  [[nodiscard]]
+  bool writeData(std::uintptr_t addr, const void *data,
+                 std::size_t size) const noexcept {
+    struct iovec local = {const_cast<void *>(data), size};
+    struct iovec remote = {reinterpret_cast<void *>(addr), size};
+    return ::process_vm_writev(_pid, &local, 1, &remote, 1, 0) ==
+           static_cast<ssize_t>(size);
+  }
+
+  // Write to code. process_vm_writev honors page protections, so code is
+  // written through /proc/<pid>/mem, which writes read-only private mappings
+  // the way a debugger sets breakpoints.
+  [[nodiscard]]
+  bool writeCode(std::uintptr_t addr, std::span<const std::uint8_t> code);
+
+  // Have the first thread make a system call from the code at site, which is
+  // briefly overwritten, and return its result.
+  [[nodiscard]]
+  std::optional<long> syscall(std::uintptr_t site, long number,
+                              std::array<std::uint64_t, 6> args);
+
+private:
+  [[nodiscard]]
+  bool waitStopped(std::size_t idx);
+
+  [[nodiscard]]
+  bool isAttached(pid_t tid) const noexcept {
+    return std::any_of(_threads.begin(), _threads.end(),
+                       [tid](const Thread &thread) { return thread.tid == tid; });
+  }
+
+  pid_t _pid;
+  int _memFd;
+  std::vector<Thread> _threads;
+};
+
+bool Tracee::stop() {
+  // Threads started before their creator was attached show up in the task
+  // listing, so it is read again until every thread listed is stopped.
+  for (;;) {
+    bool attached = false;
+    bool failed = false;
+    if (!Threads::forEach(_pid, [&](pid_t tid) {
+          if (failed || isAttached(tid)) {
+            return;
+          }
+          if (::ptrace(PTRACE_SEIZE, tid, nullptr, PTRACE_O_TRACECLONE) != 0) {
+            if (errno == ESRCH) {
+              return; // exited
+            }
+            if (errno == EPERM && !_threads.empty()) {
+              // Started by an attached thread and attached by the kernel, but
+              // not reported yet. Waiting for it fails if it is not ours.
+              _threads.push_back({tid});
+              attached = true;
+              return;
+            }
+            std::cerr << std::format("failed attaching to thread {}: {}\n",
+                                     tid, ::strerror(errno));
+            failed = true;
+            return;
+          }
+          _threads.push_back({tid});
+          attached = true;
+        })) {
+      std::cerr << std::format("failed enumerating threads of process {}\n",
+                               _pid);
+      return false;
+    }
+    if (failed) {
+      return false;
+    }
+
+    for (std::size_t idx = 0; idx < _threads.size(); idx++) {
+      const pid_t tid = _threads[idx].tid;
+      if (_threads[idx].stopped || _threads[idx].exited) {
+        continue;
+      }
+      if (::ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr) != 0 &&
+          errno != ESRCH) {
+        return false;
+      }
+      if (!waitStopped(idx)) {
+        std::cerr << std::format("failed stopping thread {}\n", tid);
+        return false;
+      }
+    }
+
+    if (!attached) {
+      break;
+    }
+  }
+
+  if (std::all_of(_threads.begin(), _threads.end(),
+                  [](const Thread &thread) { return thread.exited; })) {
+    std::cerr << std::format("process {} exited\n", _pid);
+    return false;
+  }
+  return true;
+}
+
+bool Tracee::waitStopped(std::size_t idx) {
+  const pid_t tid = _threads[idx].tid;
+  for (;;) {
+    int status;
+    if (::waitpid(tid, &status, __WALL) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      _threads[idx].exited = true;
+      return true;
+    }
+    if (!WIFSTOPPED(status)) {
+      continue;
+    }
+
+    const int event = status >> 16;
+    if (event == PTRACE_EVENT_STOP) {
+      _threads[idx].stopped = true;
+      return true;
+    }
+
+    int signal = 0;
+    if (event == PTRACE_EVENT_CLONE) {
+      // The new thread starts stopped and is waited for like the others.
+      unsigned long child = 0;
+      if (::ptrace(PTRACE_GETEVENTMSG, tid, nullptr, &child) == 0 &&
+          !isAttached(static_cast<pid_t>(child))) {
+        _threads.push_back({static_cast<pid_t>(child)});
+      }
+    } else if (event == 0) {
+      // A signal arrived before the interrupt. Deliver it; the interrupt is
+      // still pending.
+      signal = WSTOPSIG(status);
+    }
+    if (::ptrace(PTRACE_CONT, tid, nullptr, signal) != 0) {
+      return false;
+    }
+  }
+}
+
+bool Tracee::restart(std::chrono::microseconds delay) {
+  for (auto &thread : _threads) {
+    if (thread.stopped &&
+        ::ptrace(PTRACE_CONT, thread.tid, nullptr, nullptr) == 0) {
+      thread.stopped = false;
+    }
+  }
+  ::usleep(delay.count());
+  return stop();
+}
+
+void Tracee::detach() noexcept {
+  for (std::size_t idx = 0; idx < _threads.size(); idx++) {
+    const pid_t tid = _threads[idx].tid;
+    if (_threads[idx].exited) {
+      continue;
+    }
+    // Only a stopped thread can be detached.
+    if (!_threads[idx].stopped &&
+        (::ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr) != 0 ||
+         !waitStopped(idx) || _threads[idx].exited)) {
+      continue;
+    }
+    ::ptrace(PTRACE_DETACH, tid, nullptr, nullptr);
+  }
+  _threads.clear();
+}
+
+bool Tracee::writeCode(std::uintptr_t addr,
+                       std::span<const std::uint8_t> code) {
+  if (_memFd == -1) {
+    _memFd = ::open(std::format("/proc/{}/mem", _pid).c_str(),
+                    O_RDWR | O_CLOEXEC);
+    if (_memFd == -1) {
+      return false;
+    }
+  }
+  return ::pwrite(_memFd, code.data(), code.size(), static_cast<off_t>(addr)) ==
+         static_cast<ssize_t>(code.size());
+}
+
+std::optional<long> Tracee::syscall(std::uintptr_t site, long number,
+                                    std::array<std::uint64_t, 6> args) {
+  const auto thread =
+      std::find_if(_threads.begin(), _threads.end(),
+                   [](const Thread &thread) { return !thread.exited; });
+  user_regs_struct saved;
+  std::uint8_t savedCode[sizeof(SYSCALL_INSTR)];
+  std::uint64_t savedMask;
+  if (thread == _threads.end() || !getRegs(*thread, saved) ||
+      !read(site, savedCode, sizeof(savedCode)) ||
+      ::ptrace(PTRACE_GETSIGMASK, thread->tid, sizeof(savedMask),
+               &savedMask) != 0) {
+    return std::nullopt;
+  }
+
+  // Signals are blocked so the single step stops after the system call and
+  // not in a handler. orig_rax is cleared so a system call the thread was
+  // stopped in is not restarted with these registers; it is restarted with
+  // the saved ones instead.
+  const std::uint64_t blocked = ~std::uint64_t(0);
+  if (::ptrace(PTRACE_SETSIGMASK, thread->tid, sizeof(blocked), &blocked) !=
+      0) {
+    return std::nullopt;
+  }
+  const auto restoreGuard = ScopeGuard::create([&]() {
+    (void)writeCode(site, savedCode);
+    (void)setRegs(*thread, saved);
+    ::ptrace(PTRACE_SETSIGMASK, thread->tid, sizeof(savedMask), &savedMask);
+  });
+
+  user_regs_struct regs = saved;
+  regs.rip = site;
+  regs.rax = number;
+  regs.orig_rax = -1;
+  regs.rdi = args[0];
+  regs.rsi = args[1];
+  regs.rdx = args[2];
+  regs.r10 = args[3];
+  regs.r8 = args[4];
+  regs.r9 = args[5];
+  if (!writeCode(site, SYSCALL_INSTR) || !setRegs(*thread, regs) ||
+      ::ptrace(PTRACE_SINGLESTEP, thread->tid, nullptr, nullptr) != 0) {
+    return std::nullopt;
+  }
+
+  int status;
+  while (::waitpid(thread->tid, &status, __WALL) == -1) {
+    if (errno != EINTR) {
+      return std::nullopt;
+    }
+  }
+  if (!WIFSTOPPED(status) || WSTOPSIG(status) != SIGTRAP ||
+      !getRegs(*thread, regs)) {
+    return std::nullopt;
+  }
+  return static_cast<long>(regs.rax);
+}
+
+// Map a page of trampolines in the gap between mappings closest to nearAddr,
+// if one is within reach of it.
+std::optional<std::uintptr_t> mapTrampolines(Tracee &tracee, pid_t pid,
+                                             std::uintptr_t site,
+                                             std::uintptr_t nearAddr,
+                                             std::size_t pageSize) {
+  MemoryMap map;
+  if (!map.load(std::format("/proc/{}/maps", pid))) {
+    return std::nullopt;
+  }
+
+  std::optional<std::uintptr_t> best;
+  std::uintptr_t bestDistance = Trampolines::MAX_DISTANCE;
+  const auto consider = [&](std::uintptr_t addr) {
+    const auto distance =
+        addr > nearAddr ? addr + pageSize - nearAddr : nearAddr - addr;
+    if (distance < bestDistance) {
+      best = addr;
+      bestDistance = distance;
+    }
+  };
+
+  // nearAddr is mapped, so the closest page of a gap is at one of its ends.
+  const auto regions = map.regions();
+  for (std::size_t idx = 1; idx < regions.size(); idx++) {
+    const auto gapStart = regions[idx - 1].end;
+    const auto gapEnd = regions[idx].start;
+    if (gapEnd - gapStart >= pageSize) {
+      consider(gapStart);
+      consider(gapEnd - pageSize);
+    }
+  }
+  if (!best) {
+    return std::nullopt;
+  }
+
+  const auto result = tracee.syscall(
+      site, SYS_mmap,
+      {*best, pageSize, PROT_READ | PROT_EXEC,
+       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+       static_cast<std::uint64_t>(-1), 0});
+  if (!result || static_cast<std::uintptr_t>(*result) != *best) {
+    if (result && *result > 0) {
+      // A kernel without MAP_FIXED_NOREPLACE took the address as a hint.
+      (void)tracee.syscall(site, SYS_munmap, {std::uint64_t(*result), pageSize});
+    }
+    return std::nullopt;
+  }
+  return *best;
+}
+
+} // namespace
+
+RemoteTransaction::ResultCode
+RemoteTransaction::prepareProcess(Process &process) {
+  if (process.state != Process::Initialized) {
+    return Transaction::ErrorInvalidState;
+  }
+
+  // Targets, hooks and trampoline variables are resolved together.
+  std::vector<std::string_view> names;
+  names.insert(names.end(), _names.begin(), _names.end());
+  names.insert(names.end(), _hooks.begin(), _hooks.end());
+  names.insert(names.end(), _trampolines.begin(), _trampolines.end());
+  std::vector<Symbols::RemoteSymbol> symbols(names.size());
+  if (!Symbols::lookupRemote(process.pid, names, symbols)) {
+    std::cerr << std::format("failed reading memory map of process {}\n",
+                             process.pid);
+    return Transaction::ErrorUnexpected;
+  }
+
+  for (size_t idx = 0; idx < names.size(); idx++) {
+    if (symbols[idx].addr == 0) {
+      std::cerr << std::format("symbol {} not found in process {}\n",
+                               names[idx], process.pid);
+      return Transaction::ErrorSymbolNotFound;
+    }
+  }
+
+  const std::size_t count = _names.size();
+  std::vector<Target> targets(count);
+  for (size_t idx = 0; idx < count; idx++) {
+    const auto &function = symbols[idx];
+    if (function.size < Patch::jumpToSize()) {
+      std::cerr << std::format("function {} too small to patch ({} < {} bytes)\n",
+                               _names[idx], function.size,
+                               Patch::jumpToSize());
+      return Transaction::ErrorFunctionBodyTooSmall;
+    }
+
+    std::vector<std::uint8_t> code(std::min(function.size, MAX_CODE_SIZE));
+    if (!readMemory(process.pid, function.addr, code.data(), code.size())) {
+      std::cerr << std::format("failed reading function {} in process {}\n",
+                               _names[idx], process.pid);
+      return Transaction::ErrorUnexpected;
+    }
+
+    const auto instrs =
+        Disassembler::copyInstrs(code, function.addr, Patch::jumpToSize());
+    if (!instrs) {
+      std::cerr << std::format("failed disassembling function {}\n",
+                               _names[idx]);
+      return Transaction::ErrorUnsupportedInstructions;
+    }
+
+    auto &target = targets[idx];
+    target.addr = function.addr;
+    target.hook = symbols[count + idx].addr;
+    target.trampolineVar = symbols[count * 2 + idx].addr;
+    target.instrs.assign(instrs->begin(), instrs->end());
+    process.displacesCalls |= Disassembler::containsCalls(*instrs);
+  }
+
+  for (size_t idx = 0; idx < count; idx++) {
+    for (size_t other = 0; other < idx; other++) {
+      const auto &lhs = targets[idx];
+      const auto &rhs = targets[other];
+      if (lhs.addr < rhs.addr + rhs.instrs.size() &&
+          rhs.addr < lhs.addr + lhs.instrs.size()) {
+        std::cerr << std::format("functions {} and {} overlap\n", _names[idx],
+                                 _names[other]);
+        return Transaction::ErrorConflictingTargets;
+      }
+    }
+  }
+
+  process.targets = std::move(targets);
+  process.state = Process::Prepared;
+  return Transaction::Success;
+}
+
+namespace {
+
+enum PatchCommand {
+  Apply = 0,
+  Restore,
+};
+
+// Where a thread stopped at pc resumes once the command is applied: pc itself
+// if it is outside every target, and the same instruction in the trampoline
+// when hooking. Unhooking leaves the trampolines mapped, so a thread in one is
+// left there. Returns nothing if it cannot be moved.
+std::optional<std::uintptr_t> resumeAt(std::span<const Target> targets,
+                                       PatchCommand command, std::uintptr_t pc) {
+  for (const auto &target : targets) {
+    const auto addr = target.addr;
+    const auto &instrs = target.instrs;
+    if (pc <= addr || pc >= addr + instrs.size()) {
+      continue;
+    }
+
+    if (command == Restore) {
+      // Only the jump to the hook has yet to run.
+      if (pc == addr + JUMP_REGISTER_OFFSET) {
+        return target.hook;
+      }
+      return std::nullopt;
+    }
+
+    const auto offset = Disassembler::relocatedOffset(instrs, pc - addr);
+    if (!offset) {
+      return std::nullopt;
+    }
+    return target.trampoline + *offset;
+  }
+  return pc;
+}
+
+// Return true if a return address on the stack of a thread points into a
+// target, whose code the command replaces. Trampolines are never unmapped, so
+// returning into one is safe either way. Only the top of the stack is read
+// unless displaced instructions make calls, when the whole live stack is
+// searched. Anything that looks like such an address counts.
+bool returnsIntoTargets(const Tracee &tracee, const MemoryMap &map,
+                        std::span<const Target> targets, bool displacesCalls,
+                        const user_regs_struct &regs) {
+  const auto isReplaced = [&](std::uintptr_t addr) {
+    return std::any_of(targets.begin(), targets.end(), [&](const auto &target) {
+      return addr > target.addr && addr < target.addr + target.instrs.size();
+    });
+  };
+
+  std::size_t size = sizeof(std::uintptr_t);
+  if (displacesCalls) {
+    const auto stack = map.find(regs.rsp);
+    if (stack) {
+      size = stack->end - regs.rsp;
+    }
+  }
+
+  std::vector<std::uintptr_t> words(size / sizeof(std::uintptr_t));
+  if (!tracee.read(regs.rsp, words.data(),
+                   words.size() * sizeof(std::uintptr_t))) {
+    return false;
+  }
+  return std::any_of(words.begin(), words.end(), isReplaced);
+}
+
+using ThreadMove = std::pair<Tracee::Thread, user_regs_struct>;
+
+// Find where to move every thread stopped inside code the command replaces,
+// letting them all run for a while and stopping them again whenever one of
+// them cannot be moved. The moves are made by the caller along with the
+// patch, before the threads run again.
+RemoteTransaction::ResultCode planMoves(Tracee &tracee, pid_t pid,
+                                        std::span<const Target> targets,
+                                        bool displacesCalls,
+                                        PatchCommand command,
+                                        std::vector<ThreadMove> &moves) {
+  for (std::chrono::microseconds retryWait(1);; retryWait *= 2) {
+    MemoryMap map;
+    if (displacesCalls && !map.load(std::format("/proc/{}/maps", pid))) {
+      return Transaction::ErrorUnexpected;
+    }
+
+    moves.clear();
+    bool retry = false;
+    for (const auto &thread : tracee.threads()) {
+      user_regs_struct regs;
+      if (thread.exited || !tracee.getRegs(thread, regs)) {
+        continue;
+      }
+
+      const auto pc = resumeAt(targets, command, regs.rip);
+      if (!pc ||
+          returnsIntoTargets(tracee, map, targets, displacesCalls, regs)) {
+        retry = true;
+        break;
+      }
+      if (*pc != regs.rip) {
+        regs.rip = *pc;
+        moves.emplace_back(thread, regs);
+      }
+    }
+
+    if (!retry) {
+      return Transaction::Success;
+    }
+
+    // Same exponential backoff (up to 1s) as halting threads in process.
+    if (retryWait > std::chrono::seconds(1)) {
+      return Transaction::ErrorTimedOut;
+    }
+    if (!tracee.restart(retryWait)) {
+      return Transaction::ErrorUnexpected;
+    }
+  }
+}
+
+// Write code over each target, undoing the writes already made if one fails.
+bool writeTargets(Tracee &tracee, std::span<const Target> targets,
+                  PatchCommand command) {
+  const auto codeFor = [](const Target &target, PatchCommand wanted)
+      -> std::vector<std::uint8_t> {
+    if (wanted == Apply) {
+      const auto jump = Patch::createJumpTo(target.hook);
+      return {jump.begin(), jump.end()};
+    }
+    return target.instrs;
+  };
+  const PatchCommand undo = command == Apply ? Restore : Apply;
+
+  for (size_t idx = 0; idx < targets.size(); idx++) {
+    if (!tracee.writeCode(targets[idx].addr, codeFor(targets[idx], command))) {
+      while (idx-- > 0) {
+        (void)tracee.writeCode(targets[idx].addr, codeFor(targets[idx], undo));
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+RemoteTransaction::ResultCode
+RemoteTransaction::commitProcess(Process &process) {
+  if (process.state != Process::Prepared) {
+    return Transaction::ErrorInvalidState;
+  }
+
+  Tracee tracee(process.pid);
+  if (!tracee.stop()) {
+    return Transaction::ErrorUnexpected;
+  }
+
+  // Trampolines are mapped now rather than in prepare(), since a system call
+  // can only be made in a stopped process. Every process that fails is left
+  // as it was.
+  const std::size_t pageSize = ::sysconf(_SC_PAGESIZE);
+  const auto site = process.targets.front().addr;
+  bool committed = false;
+  std::vector<std::uintptr_t> pages;
+  std::vector<std::uintptr_t> savedVars;
+  const auto cleanupGuard = ScopeGuard::create([&]() {
+    if (committed) {
+      return;
+    }
+    for (size_t idx = 0; idx < savedVars.size(); idx++) {
+      (void)tracee.writeData(process.targets[idx].trampolineVar,
+                             &savedVars[idx], sizeof(std::uintptr_t));
+    }
+    for (const auto page : pages) {
+      (void)tracee.syscall(site, SYS_munmap, {page, pageSize});
+    }
+  });
+
+  std::vector<std::size_t> pageUse;
+  for (auto &target : process.targets) {
+    const auto reachable = [&](std::uintptr_t page) {
+      const auto distance =
+          page > target.addr ? page + pageSize - target.addr : target.addr - page;
+      return distance < Trampolines::MAX_DISTANCE;
+    };
+
+    std::size_t page = 0;
+    while (page < pages.size() &&
+           (pageUse[page] + Trampolines::SLOT_SIZE > pageSize ||
+            !reachable(pages[page]))) {
+      page++;
+    }
+    if (page == pages.size()) {
+      const auto addr =
+          mapTrampolines(tracee, process.pid, site, target.addr, pageSize);
+      if (!addr) {
+        std::cerr << std::format("failed mapping trampolines in process {}\n",
+                                 process.pid);
+        return Transaction::ErrorTrampolineAllocationFailure;
+      }
+      pages.push_back(*addr);
+      pageUse.push_back(0);
+    }
+    target.trampoline = pages[page] + pageUse[page];
+    pageUse[page] += Trampolines::SLOT_SIZE;
+  }
+
+  // Fill each trampoline with the displaced instructions followed by a jump
+  // back to the rest of the function, and point the trampoline variable at
+  // it, before the hook goes live.
+  for (const auto &target : process.targets) {
+    std::array<std::uint8_t, Trampolines::SLOT_SIZE> code;
+    const auto size = Disassembler::relocateInstrs(
+        target.addr, target.instrs, target.trampoline, code);
+    const auto resume = Patch::createResumeAt(target.addr + target.instrs.size());
+    if (!size || *size + resume.size() > code.size()) {
+      return Transaction::ErrorUnsupportedInstructions;
+    }
+    std::copy(resume.begin(), resume.end(), code.begin() + *size);
+    if (!tracee.writeCode(target.trampoline,
+                          std::span(code).first(*size + resume.size()))) {
+      return Transaction::ErrorMemoryProtectionFailure;
+    }
+
+    std::uintptr_t saved;
+    if (!tracee.read(target.trampolineVar, &saved, sizeof(saved))) {
+      return Transaction::ErrorUnexpected;
+    }
+    savedVars.push_back(saved);
+    if (!tracee.writeData(target.trampolineVar, &target.trampoline,
+                          sizeof(target.trampoline))) {
+      return Transaction::ErrorMemoryProtectionFailure;
+    }
+  }
+
+  std::vector<ThreadMove> moves;
+  const auto result = planMoves(tracee, process.pid, process.targets,
+                                process.displacesCalls, Apply, moves);
+  if (result != Transaction::Success) {
+    return result;
+  }
+
+  if (!writeTargets(tracee, process.targets, Apply)) {
+    std::cerr << std::format("failed patching process {}\n", process.pid);
+    return Transaction::ErrorMemoryProtectionFailure;
+  }
+  for (const auto &[thread, regs] : moves) {
+    (void)tracee.setRegs(thread, regs);
+  }
+
+  committed = true;
+  process.state = Process::Committed;
+  return Transaction::Success;
+}
+
+RemoteTransaction::ResultCode
+RemoteTransaction::rollbackProcess(Process &process) {
+  if (process.state != Process::Committed) {
+    return Transaction::ErrorInvalidState;
+  }
+
+  Tracee tracee(process.pid);
+  if (!tracee.stop()) {
+    return Transaction::ErrorUnexpected;
+  }
+
+  std::vector<ThreadMove> moves;
+  const auto result = planMoves(tracee, process.pid, process.targets,
+                                process.displacesCalls, Restore, moves);
+  if (result != Transaction::Success) {
+    return result;
+  }
+
+  if (!writeTargets(tracee, process.targets, Restore)) {
+    std::cerr << std::format("failed restoring process {}\n", process.pid);
+    return Transaction::ErrorMemoryProtectionFailure;
+  }
+  for (const auto &[thread, regs] : moves) {
+    (void)tracee.setRegs(thread, regs);
+  }
+  for (const auto &target : process.targets) {
+    (void)tracee.writeData(target.trampolineVar, &target.addr,
+                           sizeof(target.addr));
+  }
+  process.state = Process::RolledBack;
+  return Transaction::Success;
+}
+
+#else
+
+RemoteTransaction::ResultCode RemoteTransaction::prepareProcess(Process &) {
+  return Transaction::ErrorNotImplemented;
+}
+
+RemoteTransaction::ResultCode RemoteTransaction::commitProcess(Process &) {
+  return Transaction::ErrorNotImplemented;
+}
+
+RemoteTransaction::ResultCode RemoteTransaction::rollbackProcess(Process &) {
+  return Transaction::ErrorNotImplemented;
+}
+
+#endif
+
+RemoteTransaction::RemoteTransaction(std::vector<std::string_view> names,
+                                     std::vector<std::string_view> hooks,
+                                     std::vector<std::string_view> trampolines,
+                                     std::span<const pid_t> pids,
+                                     std::size_t concurrency)
+    : _names(std::move(names)), _hooks(std::move(hooks)),
+      _trampolines(std::move(trampolines)),
+      _concurrency(concurrency != 0
+                       ? concurrency
+                       : std::max(1u, std::thread::hardware_concurrency())) {
+  for (const auto pid : pids) {
+    _processes.push_back(std::make_unique<Process>(pid));
+    _results.push_back({pid, Transaction::Success});
+  }
+}
+
+RemoteTransaction::RemoteTransaction(RemoteTransaction &&) noexcept = default;
+
+RemoteTransaction::~RemoteTransaction() = default;
+
+template <typename Fn>
+RemoteTransaction::ResultCode RemoteTransaction::forEachProcess(Fn &&fn) {
+  if (_names.empty()) {
+    return Transaction::ErrorInvalidState;
+  }
+
+  // ptrace ties each process to the thread that attached it, so a process is
+  // handled by one thread from start to end.
+  std::size_t next = 0;
+  const auto work = [&]() {
+    for (;;) {
+      const auto idx = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+      if (idx >= _processes.size()) {
+        return;
+      }
+      _results[idx].result = (this->*fn)(*_processes[idx]);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  const auto workerCount = std::min(_concurrency, _processes.size());
+  for (std::size_t idx = 1; idx < workerCount; idx++) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  for (const auto &result : _results) {
+    if (result.result != Transaction::Success) {
+      return result.result;
+    }
+  }
+  return Transaction::Success;
+}
+
+RemoteTransaction::ResultCode RemoteTransaction::prepare() {
+  return forEachProcess(&RemoteTransaction::prepareProcess);
+}
+
+RemoteTransaction::ResultCode RemoteTransaction::commit() {
+  return forEachProcess(&RemoteTransaction::commitProcess);
+}
+
+RemoteTransaction::ResultCode RemoteTransaction::rollback() {
+  return forEachProcess(&RemoteTransaction::rollbackProcess);
+}
+
+}; // namespace Interject
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "transaction.hxx"
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+
+namespace Interject {
+
+// Hooks functions in other processes, which do not need to link Interject.
+//
+// Targets, hooks and the pointer variables that receive the trampolines are
+// all found by name in each process, so the hooks must already be loaded
+// there, e.g. from a preloaded library. Processes are patched concurrently,
+// each by a thread of ours that stops all of its threads with PTRACE_SEIZE and
+// PTRACE_INTERRUPT, moves any thread stopped inside the patched instructions,
+// and writes the patch before letting them run again. The caller needs ptrace
+// access to every process. x86_64 only.
+class RemoteTransaction {
+public:
+  using ResultCode = Transaction::ResultCode;
+
+  struct ProcessResult {
+    pid_t pid;
+    ResultCode result;
+  };
+
+  class Builder {
+  public:
+    // Hook the function name with the function hook. The variable trampoline
+    // is set to a trampoline that calls the original function before the hook
+    // goes live.
+    Builder &add(const std::string_view &name, const std::string_view &hook,
+                 const std::string_view &trampoline) {
+      names.emplace_back(name);
+      hooks.emplace_back(hook);
+      trampolines.emplace_back(trampoline);
+      return *this;
+    }
+
+    Builder &process(pid_t pid) {
+      pids.push_back(pid);
+      return *this;
+    }
+
+    Builder &processes(std::span<const pid_t> processes) {
+      pids.insert(pids.end(), processes.begin(), processes.end());
+      return *this;
+    }
+
+    // Processes patched at the same time. Defaults to the number of cores.
+    Builder &concurrency(std::size_t count) {
+      max_concurrency = count;
+      return *this;
+    }
+
+    RemoteTransaction build() const {
+      return RemoteTransaction(names, hooks, trampolines, pids,
+                               max_concurrency);
+    }
+
+  private:
+    std::vector<std::string_view> names;
+    std::vector<std::string_view> hooks;
+    std::vector<std::string_view> trampolines;
+    std::vector<pid_t> pids;
+    std::size_t max_concurrency = 0;
+  };
+
+  RemoteTransaction(RemoteTransaction &&) noexcept;
+
+  // Hooks that are committed stay installed, along with their trampolines.
+  ~RemoteTransaction();
+
+  // Resolve every name in each process and disassemble the targets. Nothing
+  // is written to the processes.
+  ResultCode prepare();
+
+  // Apply every hook in each prepared process.
+  ResultCode commit();
+
+  // Restore every hooked function in each committed process. Trampoline
+  // pointers are reset to the original function address. The trampolines stay
+  // mapped, since a thread in a hook may have read a pointer and not yet
+  // called through it.
+  ResultCode rollback();
+
+  // The outcome of the most recent operation in every process. Operations are
+  // carried out in every process even if they fail in others, and return the
+  // first failure in the order the processes were added. A process that fails
+  // to prepare fails every later operation with ErrorInvalidState. One that
+  // fails to commit or roll back is left as it was and can be tried again.
+  std::span<const ProcessResult> results() const noexcept { return _results; }
+
+private:
+  struct Process;
+
+  RemoteTransaction(std::vector<std::string_view> names,
+                    std::vector<std::string_view> hooks,
+                    std::vector<std::string_view> trampolines,
+                    std::span<const pid_t> pids, std::size_t concurrency);
+
+  // Run fn for each process, concurrently on up to _concurrency threads.
+  template <typename Fn> ResultCode forEachProcess(Fn &&fn);
+
+  ResultCode prepareProcess(Process &process);
+
+  ResultCode commitProcess(Process &process);
+
+  ResultCode rollbackProcess(Process &process);
+
+  RemoteTransaction(const RemoteTransaction &) = delete;
+  RemoteTransaction &operator=(const RemoteTransaction &) = delete;
+
+  std::vector<std::string_view> _names;
+  std::vector<std::string_view> _hooks;
+  std::vector<std::string_view> _trampolines;
+  std::size_t _concurrency;
+  std::vector<std::unique_ptr<Process>> _processes;
+  std::vector<ProcessResult> _results;
+};
+
+}; // namespace Interject
@@ -62,6 +62,12 @@ public:
     return _error;
   }
 
+  // The action that was installed before this one.
+  [[nodiscard]]
+  const struct sigaction &original() const {
+    return _origAction;
+  }
+
   SignalAction(const SignalAction &) = delete;
   SignalAction &operator=(const SignalAction &) = delete;
 
@@ -15,93 +15,1337 @@
  */
 
 #include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <bit>
+#include <condition_variable>
+#include <cstring>
 #include <format>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
-#include <elfio/elfio.hpp>
+#if defined(INTERJECT_HAVE_LZMA)
+#include <lzma.h>
+#endif
 
+#include "memory_map.hxx"
 #include "modules.hxx"
+#include "scope_guard.hxx"
 #include "symbols.hxx"
 
 namespace Interject::Symbols {
 
-static void
-lookupInSymbolSection(const std::string file_name,
-                      const ELFIO::const_symbol_section_accessor &symbols,
-                      uintptr_t base_addr,
-                      std::span<const std::string_view> names,
-                      std::span<Symbols::Descriptor> descriptors) {
-
-  const ELFIO::Elf_Xword symbol_count = symbols.get_symbols_num();
-  for (ELFIO::Elf_Xword i = 0; i < symbol_count; i++) {
-    std::string name;
-    ELFIO::Elf64_Addr value;
-    ELFIO::Elf_Xword size;
-    ELFIO::Elf_Half section_index;
-    unsigned char bind, type, other;
-    if (!symbols.get_symbol(i, name, value, size, bind, type, section_index,
-                            other)) {
-      std::cerr << "failed loading symbol" << std::endl;
+namespace {
+
+// Transparent hash so the index can be probed with a std::string_view without
+// materializing a std::string for every requested name.
+struct NameHash {
+  using is_transparent = void;
+  std::size_t operator()(std::string_view name) const noexcept {
+    return std::hash<std::string_view>{}(name);
+  }
+};
+
+// Identifies a specific version of a module file on disk. If any of these
+// change, the file has been replaced and its index must be rebuilt.
+struct FileIdentity {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+
+  bool operator==(const FileIdentity &other) const noexcept {
+    return dev == other.dev && ino == other.ino && size == other.size &&
+           mtime.tv_sec == other.mtime.tv_sec &&
+           mtime.tv_nsec == other.mtime.tv_nsec;
+  }
+
+  static std::optional<FileIdentity> of(const std::string &file_name) {
+    struct stat st;
+    if (::stat(file_name.c_str(), &st) != 0) {
+      return std::nullopt;
+    }
+    return FileIdentity{st.st_dev, st.st_ino, st.st_size, st.st_mtim};
+  }
+};
+
+// Minimal read-only ELF reader. The file is mapped rather than read so only
+// the pages backing the section headers, symbol tables and string tables are
+// ever faulted in, no matter how large the rest of the file is. Only ELF files
+// of the native class and byte order are supported.
+class ElfFile {
+public:
+  ElfFile() : _data(nullptr), _size(0), _mapped(false) {}
+  ~ElfFile() { close(); }
+
+  ElfFile(const ElfFile &) = delete;
+  ElfFile &operator=(const ElfFile &) = delete;
+
+  // Map and parse the specified file.
+  bool open(const std::string &file_name);
+
+  // Take ownership of and parse an ELF image already in memory.
+  bool open(std::vector<std::uint8_t> &&image);
+
+  void close() noexcept {
+    if (_mapped) {
+      ::munmap(const_cast<std::uint8_t *>(_data), _size);
+    }
+    _image.clear();
+    _data = nullptr;
+    _size = 0;
+    _mapped = false;
+    _sections = {};
+  }
+
+  std::span<const ElfW(Shdr)> sections() const noexcept { return _sections; }
+
+  // Return the contents of a section, or an empty span if the section does
+  // not fit within the file.
+  std::span<const std::uint8_t>
+  sectionData(const ElfW(Shdr) &section) const noexcept {
+    if (section.sh_type == SHT_NOBITS || section.sh_offset > _size ||
+        section.sh_size > _size - section.sh_offset) {
+      return {};
+    }
+    return {_data + section.sh_offset, section.sh_size};
+  }
+
+  // Return the first section with the specified name, if any.
+  const ElfW(Shdr) *findSection(std::string_view name) const noexcept;
+
+  // Return the GNU build-id note contents, or an empty span if there is none.
+  std::span<const std::uint8_t> buildId() const noexcept;
+
+  // Invoke callback(name, symbol) for every entry in a symbol table section.
+  // Names are views into the mapped file.
+  template <typename F>
+  void forEachSymbol(const ElfW(Shdr) &section, F &&callback) const;
+
+private:
+  bool parse() noexcept;
+
+  const std::uint8_t *_data;
+  std::size_t _size;
+  bool _mapped;
+  std::vector<std::uint8_t> _image;
+  std::span<const ElfW(Shdr)> _sections;
+  std::span<const char> _sectionNames;
+};
+
+bool ElfFile::open(const std::string &file_name) {
+  close();
+
+  const int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ElfW(Ehdr))) {
+    ::close(fd);
+    return false;
+  }
+
+  void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  _data = static_cast<const std::uint8_t *>(data);
+  _size = static_cast<std::size_t>(st.st_size);
+  _mapped = true;
+  return parse();
+}
+
+bool ElfFile::open(std::vector<std::uint8_t> &&image) {
+  close();
+
+  _image = std::move(image);
+  _data = _image.data();
+  _size = _image.size();
+  return parse();
+}
+
+bool ElfFile::parse() noexcept {
+  if (_size < sizeof(ElfW(Ehdr))) {
+    close();
+    return false;
+  }
+
+  const auto &header = *reinterpret_cast<const ElfW(Ehdr) *>(_data);
+  constexpr unsigned char nativeClass =
+      sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32;
+  constexpr unsigned char nativeData =
+      std::endian::native == std::endian::little ? ELFDATA2LSB : ELFDATA2MSB;
+  if (std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 ||
+      header.e_ident[EI_CLASS] != nativeClass ||
+      header.e_ident[EI_DATA] != nativeData ||
+      header.e_shentsize != sizeof(ElfW(Shdr)) || header.e_shoff == 0 ||
+      header.e_shoff > _size) {
+    close();
+    return false;
+  }
+
+  const auto *sections =
+      reinterpret_cast<const ElfW(Shdr) *>(_data + header.e_shoff);
+  const bool haveFirstSection =
+      _size - header.e_shoff >= sizeof(ElfW(Shdr));
+  std::size_t sectionCount = header.e_shnum;
+  if (sectionCount == 0 && haveFirstSection) {
+    // Files with more than SHN_LORESERVE sections store the real count in the
+    // size field of the first section header.
+    sectionCount = sections[0].sh_size;
+  }
+
+  if (sectionCount > (_size - header.e_shoff) / sizeof(ElfW(Shdr))) {
+    close();
+    return false;
+  }
+
+  _sections = {sections, sectionCount};
+
+  std::size_t namesIndex = header.e_shstrndx;
+  if (namesIndex == SHN_XINDEX && haveFirstSection) {
+    namesIndex = sections[0].sh_link;
+  }
+  if (namesIndex != SHN_UNDEF && namesIndex < sectionCount) {
+    const auto names = sectionData(sections[namesIndex]);
+    _sectionNames = {reinterpret_cast<const char *>(names.data()),
+                     names.size()};
+  }
+  return true;
+}
+
+const ElfW(Shdr) *ElfFile::findSection(std::string_view name) const noexcept {
+  for (const auto &section : _sections) {
+    if (section.sh_name >= _sectionNames.size()) {
       continue;
     }
 
-    if (section_index == ELFIO::SHN_UNDEF || value == 0 || size == 0) {
-      // skip undefined and empty symbols
+    const char *sectionName = _sectionNames.data() + section.sh_name;
+    const std::size_t remaining = _sectionNames.size() - section.sh_name;
+    if (std::string_view(sectionName, ::strnlen(sectionName, remaining)) ==
+        name) {
+      return &section;
+    }
+  }
+  return nullptr;
+}
+
+// Return the GNU build-id in a run of ELF notes, or an empty span if there is
+// none.
+static std::span<const std::uint8_t>
+findBuildId(std::span<const std::uint8_t> notes) noexcept {
+  std::size_t offset = 0;
+  while (notes.size() - offset >= sizeof(ElfW(Nhdr))) {
+    ElfW(Nhdr) note;
+    std::memcpy(&note, notes.data() + offset, sizeof(note));
+    offset += sizeof(note);
+
+    const std::size_t nameSize = (note.n_namesz + 3) & ~std::size_t(3);
+    const std::size_t descSize = (note.n_descsz + 3) & ~std::size_t(3);
+    if (nameSize > notes.size() - offset ||
+        descSize > notes.size() - offset - nameSize) {
+      break;
+    }
+
+    if (note.n_type == NT_GNU_BUILD_ID && note.n_namesz == sizeof(ELF_NOTE_GNU) &&
+        std::memcmp(notes.data() + offset, ELF_NOTE_GNU,
+                    sizeof(ELF_NOTE_GNU)) == 0) {
+      return notes.subspan(offset + nameSize, note.n_descsz);
+    }
+    offset += nameSize + descSize;
+  }
+  return {};
+}
+
+std::span<const std::uint8_t> ElfFile::buildId() const noexcept {
+  for (const auto &section : _sections) {
+    if (section.sh_type != SHT_NOTE) {
       continue;
     }
 
-    for (size_t idx = 0; idx < names.size(); idx++) {
-      if (names[idx] == name) {
-        auto &descriptor = descriptors[idx];
-        descriptor.addr = base_addr + value;
-        descriptor.size = size;
-        // Add a reference to the loaded module to ensure it does not get
-        // unloaded once we've returned the symbol address to the caller. The
-        // reference is released with dlclose in the Descriptor destructor.
-        descriptor.module_handle = ::dlopen(file_name.c_str(), RTLD_NOW);
-        break;
+    const auto buildId = findBuildId(sectionData(section));
+    if (!buildId.empty()) {
+      return buildId;
+    }
+  }
+  return {};
+}
+
+template <typename F>
+void ElfFile::forEachSymbol(const ElfW(Shdr) &section, F &&callback) const {
+  if (section.sh_entsize != sizeof(ElfW(Sym)) ||
+      section.sh_link >= _sections.size()) {
+    return;
+  }
+
+  const auto symbolData = sectionData(section);
+  const auto stringData = sectionData(_sections[section.sh_link]);
+  const auto *symbols = reinterpret_cast<const ElfW(Sym) *>(symbolData.data());
+  const std::size_t symbolCount = symbolData.size() / sizeof(ElfW(Sym));
+  const char *strings = reinterpret_cast<const char *>(stringData.data());
+
+  for (std::size_t idx = 0; idx < symbolCount; idx++) {
+    const auto &symbol = symbols[idx];
+    if (symbol.st_name >= stringData.size()) {
+      continue;
+    }
+
+    const char *name = strings + symbol.st_name;
+    const std::size_t nameLength =
+        ::strnlen(name, stringData.size() - symbol.st_name);
+    callback(std::string_view(name, nameLength), symbol);
+  }
+}
+
+// Resolves names exported by a loaded module directly from the symbol and
+// hash tables referenced by its PT_DYNAMIC segment, without touching the file
+// on disk. DT_GNU_HASH is preferred and DT_HASH used when it is absent.
+class DynamicSymbols {
+public:
+  DynamicSymbols(std::uintptr_t base_addr,
+                 std::span<const ElfW(Phdr)> phdrs) noexcept;
+
+  const ElfW(Sym) *find(std::string_view name) const noexcept;
+
+private:
+  bool matches(std::uint32_t idx, std::string_view name) const noexcept;
+
+  const ElfW(Sym) *findGnu(std::string_view name) const noexcept;
+
+  const ElfW(Sym) *findSysV(std::string_view name) const noexcept;
+
+  const ElfW(Sym) *_symtab;
+  const char *_strtab;
+  std::size_t _strsz;
+  const ElfW(Half) *_versym;
+  const std::uint32_t *_gnuHash;
+  const std::uint32_t *_sysvHash;
+};
+
+DynamicSymbols::DynamicSymbols(std::uintptr_t base_addr,
+                               std::span<const ElfW(Phdr)> phdrs) noexcept
+    : _symtab(nullptr), _strtab(nullptr), _strsz(0), _versym(nullptr),
+      _gnuHash(nullptr), _sysvHash(nullptr) {
+  const ElfW(Dyn) *dynamic = nullptr;
+  for (const auto &phdr : phdrs) {
+    if (phdr.p_type == PT_DYNAMIC) {
+      dynamic = reinterpret_cast<const ElfW(Dyn) *>(base_addr + phdr.p_vaddr);
+      break;
+    }
+  }
+
+  if (dynamic == nullptr) {
+    return;
+  }
+
+  // glibc relocates the address entries of the dynamic section in place, but
+  // other loaders (and the vdso) leave them as offsets from the load base.
+  const auto toAddr = [base_addr](ElfW(Addr) ptr) -> std::uintptr_t {
+    return ptr < base_addr ? base_addr + ptr : ptr;
+  };
+
+  for (const ElfW(Dyn) *entry = dynamic; entry->d_tag != DT_NULL; entry++) {
+    switch (entry->d_tag) {
+    case DT_SYMTAB:
+      _symtab = reinterpret_cast<const ElfW(Sym) *>(toAddr(entry->d_un.d_ptr));
+      break;
+    case DT_STRTAB:
+      _strtab = reinterpret_cast<const char *>(toAddr(entry->d_un.d_ptr));
+      break;
+    case DT_STRSZ:
+      _strsz = entry->d_un.d_val;
+      break;
+    case DT_VERSYM:
+      _versym = reinterpret_cast<const ElfW(Half) *>(toAddr(entry->d_un.d_ptr));
+      break;
+    case DT_GNU_HASH:
+      _gnuHash =
+          reinterpret_cast<const std::uint32_t *>(toAddr(entry->d_un.d_ptr));
+      break;
+    case DT_HASH:
+      _sysvHash =
+          reinterpret_cast<const std::uint32_t *>(toAddr(entry->d_un.d_ptr));
+      break;
+    }
+  }
+}
+
+bool DynamicSymbols::matches(std::uint32_t idx,
+                             std::string_view name) const noexcept {
+  const auto &symbol = _symtab[idx];
+  if (symbol.st_shndx == SHN_UNDEF || symbol.st_value == 0 ||
+      symbol.st_size == 0 || symbol.st_name >= _strsz) {
+    return false;
+  }
+
+  // Skip non-default symbol versions (e.g. memcpy@GLIBC_2.2.5) so the
+  // default version is the one that resolves, matching dlsym.
+  if (_versym != nullptr && (_versym[idx] & 0x8000) != 0) {
+    return false;
+  }
+
+  const char *symbolName = _strtab + symbol.st_name;
+  return name.size() < _strsz - symbol.st_name &&
+         std::memcmp(symbolName, name.data(), name.size()) == 0 &&
+         symbolName[name.size()] == '\0';
+}
+
+const ElfW(Sym) *
+DynamicSymbols::findGnu(std::string_view name) const noexcept {
+  std::uint32_t hash = 5381;
+  for (const char c : name) {
+    hash = hash * 33 + static_cast<unsigned char>(c);
+  }
+
+  const std::uint32_t bucketCount = _gnuHash[0];
+  const std::uint32_t symbolOffset = _gnuHash[1];
+  const std::uint32_t bloomSize = _gnuHash[2];
+  const std::uint32_t bloomShift = _gnuHash[3];
+  if (bucketCount == 0 || bloomSize == 0) {
+    return nullptr;
+  }
+
+  const auto *bloom = reinterpret_cast<const ElfW(Addr) *>(&_gnuHash[4]);
+  const auto *buckets = reinterpret_cast<const std::uint32_t *>(&bloom[bloomSize]);
+  const auto *chain = &buckets[bucketCount];
+
+  // The bloom filter rejects most names not defined by this module without
+  // touching the buckets or the symbol table.
+  constexpr std::uint32_t wordBits = sizeof(ElfW(Addr)) * 8;
+  const ElfW(Addr) word = bloom[(hash / wordBits) % bloomSize];
+  const ElfW(Addr) mask = (ElfW(Addr)(1) << (hash % wordBits)) |
+                          (ElfW(Addr)(1) << ((hash >> bloomShift) % wordBits));
+  if ((word & mask) != mask) {
+    return nullptr;
+  }
+
+  std::uint32_t idx = buckets[hash % bucketCount];
+  if (idx < symbolOffset) {
+    return nullptr;
+  }
+
+  for (;; idx++) {
+    const std::uint32_t chainHash = chain[idx - symbolOffset];
+    if ((chainHash | 1) == (hash | 1) && matches(idx, name)) {
+      return &_symtab[idx];
+    }
+    if (chainHash & 1) {
+      return nullptr; // end of chain
+    }
+  }
+}
+
+const ElfW(Sym) *
+DynamicSymbols::findSysV(std::string_view name) const noexcept {
+  std::uint32_t hash = 0;
+  for (const char c : name) {
+    hash = (hash << 4) + static_cast<unsigned char>(c);
+    const std::uint32_t high = hash & 0xf0000000;
+    hash ^= high >> 24;
+    hash &= ~high;
+  }
+
+  const std::uint32_t bucketCount = _sysvHash[0];
+  const std::uint32_t chainCount = _sysvHash[1];
+  if (bucketCount == 0) {
+    return nullptr;
+  }
+
+  const auto *buckets = &_sysvHash[2];
+  const auto *chain = &buckets[bucketCount];
+  for (std::uint32_t idx = buckets[hash % bucketCount];
+       idx != STN_UNDEF && idx < chainCount; idx = chain[idx]) {
+    if (matches(idx, name)) {
+      return &_symtab[idx];
+    }
+  }
+  return nullptr;
+}
+
+const ElfW(Sym) *DynamicSymbols::find(std::string_view name) const noexcept {
+  if (_symtab == nullptr || _strtab == nullptr) {
+    return nullptr;
+  }
+  if (_gnuHash != nullptr) {
+    return findGnu(name);
+  }
+  if (_sysvHash != nullptr) {
+    return findSysV(name);
+  }
+  return nullptr;
+}
+
+// Hashed name -> (offset, size) index of every defined symbol in an ELF
+// file's symbol tables.
+//
+// The index is an open-addressed table whose keys are views into the mapped
+// file, so building it performs a single allocation regardless of how many
+// symbols the file defines.
+class SymbolTable {
+public:
+  struct Symbol {
+    std::uintptr_t offset;
+    std::size_t size;
+  };
+
+  // Load and index the specified ELF file.
+  bool load(const std::string &file_name) {
+    return _file.open(file_name) && build();
+  }
+
+  // Load and index an ELF image already in memory.
+  bool load(std::vector<std::uint8_t> &&image) {
+    return _file.open(std::move(image)) && build();
+  }
+
+  const ElfFile &file() const noexcept { return _file; }
+
+  // Return true if the file has a full (non-dynamic) symbol table.
+  bool hasSymtab() const noexcept {
+    for (const auto &section : _file.sections()) {
+      if (section.sh_type == SHT_SYMTAB) {
+        return true;
       }
     }
+    return false;
+  }
+
+  const Symbol *find(std::string_view name) const noexcept;
+
+private:
+  struct Slot {
+    std::string_view name;
+    std::size_t hash;
+    Symbol symbol;
+  };
+
+  bool build();
+
+  void insert(std::string_view name, const Symbol &symbol) noexcept;
+
+  ElfFile _file;
+  std::vector<Slot> _slots;
+};
+
+const SymbolTable::Symbol *
+SymbolTable::find(std::string_view name) const noexcept {
+  if (_slots.empty()) {
+    return nullptr;
+  }
+
+  const std::size_t mask = _slots.size() - 1;
+  const std::size_t hash = NameHash{}(name);
+  for (std::size_t pos = hash & mask;; pos = (pos + 1) & mask) {
+    const auto &slot = _slots[pos];
+    if (slot.name.empty()) {
+      return nullptr;
+    }
+    if (slot.hash == hash && slot.name == name) {
+      return &slot.symbol;
+    }
+  }
+}
+
+void SymbolTable::insert(std::string_view name,
+                         const Symbol &symbol) noexcept {
+  const std::size_t mask = _slots.size() - 1;
+  const std::size_t hash = NameHash{}(name);
+  for (std::size_t pos = hash & mask;; pos = (pos + 1) & mask) {
+    auto &slot = _slots[pos];
+    if (slot.name.empty()) {
+      slot = Slot{name, hash, symbol};
+      return;
+    }
+    if (slot.hash == hash && slot.name == name) {
+      // The first definition of a name within a file wins.
+      return;
+    }
   }
 }
 
-static void lookupInELFFile(const std::string &file_name,
-                            const ELFIO::elfio &reader, uintptr_t base_addr,
-                            std::span<const std::string_view> names,
-                            std::span<Symbols::Descriptor> descriptors) {
+bool SymbolTable::build() {
+  const auto isSymbolTable = [](const ElfW(Shdr) &section) {
+    return section.sh_type == SHT_SYMTAB || section.sh_type == SHT_DYNSYM;
+  };
+
+  // Size the table up front so it is never more than half full.
+  std::size_t symbolCount = 0;
+  for (const auto &section : _file.sections()) {
+    if (isSymbolTable(section)) {
+      symbolCount += _file.sectionData(section).size() / sizeof(ElfW(Sym));
+    }
+  }
+
+  _slots.clear();
+  if (symbolCount == 0) {
+    return true;
+  }
+
+  _slots.resize(std::bit_ceil(symbolCount * 2));
 
-  const auto section_count = reader.sections.size();
-  for (ELFIO::Elf_Half i = 0; i < section_count; i++) {
-    const ELFIO::section *section = reader.sections[i];
-    if (section->get_type() != ELFIO::SHT_SYMTAB &&
-        section->get_type() != ELFIO::SHT_DYNSYM) {
+  for (const auto &section : _file.sections()) {
+    if (!isSymbolTable(section)) {
       continue;
     }
 
-    const ELFIO::const_symbol_section_accessor symbols(reader, section);
-    lookupInSymbolSection(file_name, symbols, base_addr, names, descriptors);
+    _file.forEachSymbol(section, [&](std::string_view name,
+                                     const ElfW(Sym) &symbol) {
+      if (symbol.st_shndx == SHN_UNDEF || symbol.st_value == 0 ||
+          symbol.st_size == 0 || name.empty()) {
+        // skip undefined and empty symbols
+        return;
+      }
+      insert(name, Symbol{symbol.st_value, symbol.st_size});
+    });
+  }
+  return true;
+}
+
+#if defined(INTERJECT_HAVE_LZMA)
+// Decompress an xz stream such as the MiniDebugInfo in .gnu_debugdata.
+static std::optional<std::vector<std::uint8_t>>
+decompressXz(std::span<const std::uint8_t> input) {
+  lzma_stream stream = LZMA_STREAM_INIT;
+  if (::lzma_stream_decoder(&stream, UINT64_MAX, 0) != LZMA_OK) {
+    return std::nullopt;
+  }
+  const auto streamGuard = ScopeGuard::create([&]() { ::lzma_end(&stream); });
+
+  if (input.empty()) {
+    return std::nullopt;
+  }
+
+  constexpr std::size_t MIN_OUTPUT_SIZE = 4096;
+  std::vector<std::uint8_t> output(
+      std::max(input.size() * 4, MIN_OUTPUT_SIZE));
+  stream.next_in = input.data();
+  stream.avail_in = input.size();
+  for (;;) {
+    stream.next_out = output.data() + stream.total_out;
+    stream.avail_out = output.size() - stream.total_out;
+
+    const auto totalIn = stream.total_in;
+    const auto totalOut = stream.total_out;
+    const lzma_ret ret = ::lzma_code(&stream, LZMA_FINISH);
+    if (ret == LZMA_STREAM_END) {
+      output.resize(stream.total_out);
+      return output;
+    }
+
+    // A pass that consumes and produces nothing will never finish the
+    // stream, e.g. one that is truncated.
+    if ((ret != LZMA_OK && ret != LZMA_BUF_ERROR) || stream.avail_out != 0 ||
+        (stream.total_in == totalIn && stream.total_out == totalOut)) {
+      return std::nullopt;
+    }
+
+    output.resize(output.size() * 2);
+  }
+}
+#endif
+
+// The directory holding separate debug information, as set by setDebugRoot.
+std::mutex debugRootLock;
+
+std::string &debugRoot() {
+  static std::string root = "/usr/lib/debug";
+  return root;
+}
+
+// Symbol index for a module file. Built once per module file and shared by
+// all lookups.
+//
+// Stripped modules only carry .dynsym, so a second index over separate debug
+// information is consulted for names the module itself does not define. It is
+// located and loaded the first time it is needed, then cached with the rest of
+// the index.
+class ModuleIndex {
+public:
+  using Symbol = SymbolTable::Symbol;
+
+  // Return the index for the specified module file, building it if it is not
+  // cached or the file changed since it was cached.
+  static std::shared_ptr<const ModuleIndex> get(const std::string &file_name);
+
+  // Return the index for the module with the specified build-id, building it
+  // from file_name if no module with that build-id is cached. Fails if the
+  // file holds a different build.
+  static std::shared_ptr<const ModuleIndex>
+  get(const std::string &file_name, std::span<const std::uint8_t> build_id);
+
+  std::span<const std::uint8_t> buildId() const noexcept {
+    return _symbols.file().buildId();
+  }
+
+  const Symbol *find(std::string_view name) const noexcept {
+    return _symbols.find(name);
+  }
+
+  // Search the module's separate debug information, loading it on first use.
+  const Symbol *findDebug(std::string_view name) const {
+    std::call_once(_debugSymbolsOnce, [this]() { loadDebugSymbols(); });
+    return _debugSymbols.find(name);
+  }
+
+  // Return the sorted offsets of the NOP pads recorded in the module's
+  // __patchable_function_entries section. The section holds relocated
+  // addresses, so it is read from the loaded image on first use.
+  std::span<const std::uintptr_t>
+  patchableEntries(std::uintptr_t base_addr,
+                   std::span<const ElfW(Phdr)> phdrs) const {
+    std::call_once(_patchableEntriesOnce, [&]() {
+      loadPatchableEntries(base_addr, phdrs);
+    });
+    return _patchableEntries;
+  }
+
+private:
+  ModuleIndex(const std::string &file_name, const FileIdentity &identity)
+      : _fileName(file_name), _identity(identity) {}
+
+  void loadDebugSymbols() const;
+
+  bool loadDebugFile(const std::string &file_name) const;
+
+  void loadPatchableEntries(std::uintptr_t base_addr,
+                            std::span<const ElfW(Phdr)> phdrs) const;
+
+  std::string _fileName;
+  FileIdentity _identity;
+  SymbolTable _symbols;
+  mutable std::once_flag _debugSymbolsOnce;
+  mutable SymbolTable _debugSymbols;
+  mutable std::once_flag _patchableEntriesOnce;
+  mutable std::vector<std::uintptr_t> _patchableEntries;
+};
+
+bool ModuleIndex::loadDebugFile(const std::string &file_name) const {
+  if (file_name == _fileName || !_debugSymbols.load(file_name) ||
+      !_debugSymbols.hasSymtab()) {
+    return false;
+  }
+
+  // Reject a debug file built from a different version of the module.
+  const auto buildId = _symbols.file().buildId();
+  const auto debugBuildId = _debugSymbols.file().buildId();
+  if (!buildId.empty() && !debugBuildId.empty() &&
+      !std::equal(buildId.begin(), buildId.end(), debugBuildId.begin(),
+                  debugBuildId.end())) {
+    return false;
+  }
+  return true;
+}
+
+void ModuleIndex::loadDebugSymbols() const {
+  const ElfFile &file = _symbols.file();
+  if (_symbols.hasSymtab()) {
+    return; // not stripped; there is nothing more to find
+  }
+
+  std::string root;
+  {
+    std::lock_guard<std::mutex> guard(debugRootLock);
+    root = debugRoot();
+  }
+
+  // /usr/lib/debug/.build-id/xx/yyyy.debug
+  const auto buildId = file.buildId();
+  if (buildId.size() >= 2) {
+    std::string path = std::format("{}/.build-id/", root);
+    for (std::size_t idx = 0; idx < buildId.size(); idx++) {
+      path += std::format("{:02x}", buildId[idx]);
+      if (idx == 0) {
+        path += '/';
+      }
+    }
+    path += ".debug";
+
+    if (loadDebugFile(path)) {
+      return;
+    }
+  }
+
+  // .gnu_debuglink names a file to search for next to the module, in a .debug
+  // subdirectory, and under the global debug directory.
+  if (const auto section = file.findSection(".gnu_debuglink")) {
+    const auto data = file.sectionData(*section);
+    const char *name = reinterpret_cast<const char *>(data.data());
+    const std::string_view link(name, ::strnlen(name, data.size()));
+    const std::string_view dir =
+        std::string_view(_fileName).substr(0, _fileName.rfind('/'));
+
+    if (!link.empty() &&
+        (loadDebugFile(std::format("{}/{}", dir, link)) ||
+         loadDebugFile(std::format("{}/.debug/{}", dir, link)) ||
+         loadDebugFile(std::format("{}{}/{}", root, dir, link)))) {
+      return;
+    }
+  }
+
+#if defined(INTERJECT_HAVE_LZMA)
+  // MiniDebugInfo: an xz-compressed ELF image holding a reduced .symtab.
+  if (const auto section = file.findSection(".gnu_debugdata")) {
+    auto image = decompressXz(file.sectionData(*section));
+    if (image && _debugSymbols.load(std::move(*image))) {
+      return;
+    }
+  }
+#endif
+
+  _debugSymbols.load(std::vector<std::uint8_t>());
+}
+
+void ModuleIndex::loadPatchableEntries(
+    std::uintptr_t base_addr, std::span<const ElfW(Phdr)> phdrs) const {
+  const auto section =
+      _symbols.file().findSection("__patchable_function_entries");
+  if (section == nullptr || (section->sh_flags & SHF_ALLOC) == 0 ||
+      section->sh_size % sizeof(std::uintptr_t) != 0) {
+    return;
+  }
+
+  // Only read the section if it is part of a loaded segment.
+  const bool loaded = std::any_of(
+      phdrs.begin(), phdrs.end(), [&](const ElfW(Phdr) &phdr) {
+        return phdr.p_type == PT_LOAD && section->sh_addr >= phdr.p_vaddr &&
+               section->sh_addr + section->sh_size <=
+                   phdr.p_vaddr + phdr.p_memsz;
+      });
+  if (!loaded) {
+    return;
+  }
+
+  const auto *entries =
+      reinterpret_cast<const std::uintptr_t *>(base_addr + section->sh_addr);
+  const std::size_t count = section->sh_size / sizeof(std::uintptr_t);
+  _patchableEntries.reserve(count);
+  for (std::size_t idx = 0; idx < count; idx++) {
+    if (entries[idx] >= base_addr) {
+      _patchableEntries.push_back(entries[idx] - base_addr);
+    }
+  }
+  std::sort(_patchableEntries.begin(), _patchableEntries.end());
+}
+
+std::shared_ptr<const ModuleIndex>
+ModuleIndex::get(const std::string &file_name) {
+  static std::mutex cacheLock;
+  static std::unordered_map<std::string, std::shared_ptr<const ModuleIndex>,
+                            NameHash, std::equal_to<>>
+      cache;
+
+  const auto identity = FileIdentity::of(file_name);
+  if (!identity) {
+    std::cerr << std::format("failed to stat {}", file_name) << std::endl;
+    return nullptr;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(cacheLock);
+    const auto entry = cache.find(file_name);
+    if (entry != cache.end() && entry->second->_identity == *identity) {
+      return entry->second;
+    }
+  }
+
+  // The file is parsed without holding the lock so modules can be indexed in
+  // parallel. Failures to parse are cached as an empty index so they are not
+  // retried until the file changes.
+  std::shared_ptr<ModuleIndex> index(new ModuleIndex(file_name, *identity));
+  if (!index->_symbols.load(file_name)) {
+    std::cerr << std::format("failed to load {} as an ELF file", file_name)
+              << std::endl;
+  }
+
+  // Keep the index of a thread that got here first, so that every caller
+  // shares one.
+  std::lock_guard<std::mutex> guard(cacheLock);
+  auto &entry = cache[file_name];
+  if (!entry || entry->_identity != *identity) {
+    entry = std::move(index);
+  }
+  return entry;
+}
+
+std::shared_ptr<const ModuleIndex>
+ModuleIndex::get(const std::string &file_name,
+                 std::span<const std::uint8_t> build_id) {
+  static std::mutex cacheLock;
+  static std::unordered_map<std::string, std::shared_ptr<const ModuleIndex>>
+      cache;
+
+  const std::string key(build_id.begin(), build_id.end());
+  {
+    std::lock_guard<std::mutex> guard(cacheLock);
+    if (const auto entry = cache.find(key); entry != cache.end()) {
+      return entry->second;
+    }
+  }
+
+  const auto identity = FileIdentity::of(file_name);
+  if (!identity) {
+    std::cerr << std::format("failed to stat {}", file_name) << std::endl;
+    return nullptr;
+  }
+
+  std::shared_ptr<ModuleIndex> index(new ModuleIndex(file_name, *identity));
+  if (!index->_symbols.load(file_name)) {
+    std::cerr << std::format("failed to load {} as an ELF file", file_name)
+              << std::endl;
+    return nullptr;
+  }
+
+  // The file may have been replaced since the module was mapped.
+  const auto fileBuildId = index->buildId();
+  if (!std::equal(build_id.begin(), build_id.end(), fileBuildId.begin(),
+                  fileBuildId.end())) {
+    std::cerr << std::format("{} is not the build that is mapped", file_name)
+              << std::endl;
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> guard(cacheLock);
+  return cache.emplace(key, std::move(index)).first->second;
+}
+
+// A module of this process whose file is searched by lookup(), and the symbols
+// found in it by the search in progress, by name index.
+struct ModuleSearch {
+  std::string obj_name;
+  std::uintptr_t base_addr = 0;
+  std::shared_ptr<const ModuleIndex> index{};
+  std::vector<const ModuleIndex::Symbol *> symbols{};
+  std::chrono::nanoseconds elapsed{};
+  bool searched = false;
+};
+
+// A module mapped into another process, as described by its image in that
+// process's memory.
+struct RemoteModule {
+  std::string_view file_name;
+  std::uintptr_t base_addr;
+  std::vector<std::uint8_t> build_id;
+};
+
+static bool readRemote(pid_t pid, std::uintptr_t addr, void *out,
+                       std::size_t size) noexcept {
+  struct iovec local = {out, size};
+  struct iovec remote = {reinterpret_cast<void *>(addr), size};
+  return ::process_vm_readv(pid, &local, 1, &remote, 1, 0) ==
+         static_cast<ssize_t>(size);
+}
+
+// Describe the module mapped from the start of its file at region, if the
+// region holds an ELF image of the native class loaded by the dynamic linker.
+static std::optional<RemoteModule>
+readRemoteModule(pid_t pid, const MemoryMap &map,
+                 const MemoryMap::Region &region) {
+  ElfW(Ehdr) header;
+  constexpr unsigned char nativeClass =
+      sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32;
+  if (!readRemote(pid, region.start, &header, sizeof(header)) ||
+      std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 ||
+      header.e_ident[EI_CLASS] != nativeClass ||
+      header.e_phentsize != sizeof(ElfW(Phdr)) || header.e_phnum == 0 ||
+      header.e_phoff + header.e_phnum * sizeof(ElfW(Phdr)) >
+          region.end - region.start) {
+    return std::nullopt;
+  }
+
+  std::vector<ElfW(Phdr)> phdrs(header.e_phnum);
+  if (!readRemote(pid, region.start + header.e_phoff, phdrs.data(),
+                  phdrs.size() * sizeof(ElfW(Phdr)))) {
+    return std::nullopt;
+  }
+
+  // The region maps the start of the file, which the first loadable segment
+  // places at its address less its file offset.
+  const auto first =
+      std::find_if(phdrs.begin(), phdrs.end(), [](const ElfW(Phdr) &phdr) {
+        return phdr.p_type == PT_LOAD;
+      });
+  if (first == phdrs.end()) {
+    return std::nullopt;
+  }
+
+  RemoteModule module{region.pathname,
+                      region.start - (first->p_vaddr - first->p_offset), {}};
+
+  // A file mapped whole, e.g. by an ElfFile, starts with an ELF header too,
+  // but only a loaded module has its code where its segments place it.
+  const bool loaded =
+      std::any_of(phdrs.begin(), phdrs.end(), [&](const ElfW(Phdr) &phdr) {
+        if (phdr.p_type != PT_LOAD || (phdr.p_flags & PF_X) == 0) {
+          return false;
+        }
+        const auto code = map.find(module.base_addr + phdr.p_vaddr);
+        return code && (code->permissions & PROT_EXEC) != 0 &&
+               code->pathname == region.pathname;
+      });
+  if (!loaded) {
+    return std::nullopt;
+  }
+
+  for (const auto &phdr : phdrs) {
+    if (phdr.p_type != PT_NOTE) {
+      continue;
+    }
+
+    std::vector<std::uint8_t> notes(std::min<std::size_t>(phdr.p_filesz, 4096));
+    if (!readRemote(pid, module.base_addr + phdr.p_vaddr, notes.data(),
+                    notes.size())) {
+      continue;
+    }
+
+    const auto buildId = findBuildId(notes);
+    if (!buildId.empty()) {
+      module.build_id.assign(buildId.begin(), buildId.end());
+      break;
+    }
+  }
+  return module;
+}
+
+}; // namespace
+
+static void resolve(Descriptor &descriptor, std::string_view obj_name,
+                    std::uintptr_t addr, std::size_t size) {
+  descriptor.addr = addr;
+  descriptor.size = size;
+  // Add a reference to the loaded module to ensure it does not get unloaded
+  // once we've returned the symbol address to the caller. The reference is
+  // released with dlclose in the Descriptor destructor.
+  descriptor.module_handle = ::dlopen(std::string(obj_name).c_str(), RTLD_NOW);
+}
+
+namespace {
+
+// Threads started once and kept for every batch of tasks run on them, so a
+// batch costs a wake-up rather than creating and joining threads. Every worker
+// checks in for every batch, whether or not any task is left for it, so a
+// batch is done once all of them have.
+class WorkerPool {
+public:
+  explicit WorkerPool(std::size_t workers) : _pid(::getpid()) {
+    for (std::size_t idx = 0; idx < workers; idx++) {
+      _workers.emplace_back([this]() { serve(); });
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      _stopping = true;
+    }
+    _wake.notify_all();
+    for (auto &worker : _workers) {
+      worker.join();
+    }
+  }
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  // Run task(idx) for every idx in [0, count) on the workers and the calling
+  // thread. Returns false without running anything if the pool is already
+  // running a batch, e.g. for a task that runs tasks of its own, or if the
+  // process forked since the workers were started.
+  bool run(std::size_t count, const std::function<void(std::size_t)> &task) {
+    std::unique_lock<std::mutex> batch(_batchLock, std::try_to_lock);
+    if (!batch.owns_lock() || ::getpid() != _pid) {
+      return false;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      _task = &task;
+      _count = count;
+      _next = 0;
+      _pending = _workers.size();
+      _batch++;
+    }
+    _wake.notify_all();
+    work();
+
+    std::unique_lock<std::mutex> guard(_lock);
+    _done.wait(guard, [this]() { return _pending == 0; });
+    _task = nullptr;
+    return true;
+  }
+
+private:
+  void work() {
+    for (auto idx = __atomic_fetch_add(&_next, 1, __ATOMIC_RELAXED);
+         idx < _count; idx = __atomic_fetch_add(&_next, 1, __ATOMIC_RELAXED)) {
+      (*_task)(idx);
+    }
+  }
+
+  void serve() {
+    std::size_t served = 0;
+    std::unique_lock<std::mutex> guard(_lock);
+    for (;;) {
+      _wake.wait(guard, [&]() { return _stopping || _batch != served; });
+      if (_stopping) {
+        return;
+      }
+
+      served = _batch;
+      guard.unlock();
+      work();
+      guard.lock();
+      if (--_pending == 0) {
+        _done.notify_one();
+      }
+    }
+  }
+
+  const pid_t _pid;
+  std::vector<std::thread> _workers;
+  std::mutex _batchLock; // held while a batch runs
+  std::mutex _lock;
+  std::condition_variable _wake;
+  std::condition_variable _done;
+  const std::function<void(std::size_t)> *_task = nullptr;
+  std::size_t _count = 0;
+  std::size_t _next = 0;
+  std::size_t _pending = 0;
+  std::size_t _batch = 0;
+  bool _stopping = false;
+};
+
+// Fewer tasks than this run on the calling thread, where waking the workers
+// would cost more than the tasks save.
+constexpr std::size_t minParallelTasks = 4;
+
+}; // namespace
+
+Executor parallelExecutor(std::size_t threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // The pool is shared by every copy of the executor and stopped with the
+  // last one.
+  std::shared_ptr<WorkerPool> pool =
+      threads > 1 ? std::make_shared<WorkerPool>(threads - 1) : nullptr;
+  return [pool](std::size_t count,
+                const std::function<void(std::size_t)> &task) {
+    if (pool && count >= minParallelTasks && pool->run(count, task)) {
+      return;
+    }
+    for (std::size_t idx = 0; idx < count; idx++) {
+      task(idx);
+    }
+  };
+}
+
+void setDebugRoot(std::string_view root) {
+  std::lock_guard<std::mutex> guard(debugRootLock);
+  debugRoot() = root;
+}
+
+// Search the module files for the names that are still unresolved. Each
+// module is searched by a task of its own, which records what it finds in the
+// module's slot, and the slots are merged in module order afterwards so the
+// first module defining a name wins however the tasks were scheduled. A task
+// skips its module if every name it could still provide is already defined by
+// an earlier module, so modules searched one at a time stop being parsed once
+// everything is resolved.
+template <typename Find>
+static void searchFiles(std::span<const std::string_view> names,
+                        std::span<Descriptor> descriptors,
+                        std::span<ModuleSearch> modules,
+                        const ModuleTimer &timer, const Executor &executor,
+                        Find &&find) {
+  std::vector<std::size_t> pending;
+  for (size_t idx = 0; idx < names.size(); idx++) {
+    if (descriptors[idx].addr == 0) {
+      pending.push_back(idx);
+    }
+  }
+  if (pending.empty()) {
+    return;
+  }
+
+  // first[idx] is the earliest module found so far to define names[idx].
+  std::vector<std::size_t> first(names.size(), modules.size());
+  const auto search = [&](std::size_t moduleIdx) {
+    auto &module = modules[moduleIdx];
+    module.searched = false;
+    module.symbols.assign(names.size(), nullptr);
+
+    const auto wanted = [&](std::size_t idx) {
+      return __atomic_load_n(&first[idx], __ATOMIC_RELAXED) > moduleIdx;
+    };
+    if (std::none_of(pending.begin(), pending.end(), wanted)) {
+      return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    if (!module.index) {
+      module.index = ModuleIndex::get(module.obj_name);
+    }
+    for (const auto idx : pending) {
+      if (!module.index || !wanted(idx)) {
+        continue;
+      }
+
+      const auto symbol = find(*module.index, names[idx]);
+      if (symbol == nullptr) {
+        continue;
+      }
+
+      module.symbols[idx] = symbol;
+      auto current = __atomic_load_n(&first[idx], __ATOMIC_RELAXED);
+      while (current > moduleIdx &&
+             !__atomic_compare_exchange_n(&first[idx], &current, moduleIdx,
+                                          true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED)) {
+      }
+    }
+    module.elapsed = std::chrono::steady_clock::now() - start;
+    module.searched = true;
+  };
+
+  if (executor) {
+    executor(modules.size(), search);
+  } else {
+    for (size_t moduleIdx = 0; moduleIdx < modules.size(); moduleIdx++) {
+      search(moduleIdx);
+    }
+  }
+
+  for (const auto &module : modules) {
+    if (timer && module.searched) {
+      timer(module.obj_name, module.elapsed);
+    }
+  }
+
+  for (const auto idx : pending) {
+    if (first[idx] == modules.size()) {
+      continue;
+    }
+
+    const auto &module = modules[first[idx]];
+    const auto symbol = module.symbols[idx];
+    auto &descriptor = descriptors[idx];
+    resolve(descriptor, module.obj_name, module.base_addr + symbol->offset,
+            symbol->size);
+
+    // The module is no longer held by the link map lock, so it may have been
+    // unloaded since it was listed and loaded again elsewhere by dlopen.
+    struct link_map *map = nullptr;
+    if (descriptor.module_handle != nullptr &&
+        ::dlinfo(descriptor.module_handle, RTLD_DI_LINKMAP, &map) == 0 &&
+        map->l_addr != module.base_addr) {
+      ::dlclose(descriptor.module_handle);
+      descriptor.addr = 0;
+      descriptor.size = 0;
+      descriptor.module_handle = nullptr;
+    }
   }
 }
 
 void lookup(std::span<const std::string_view> names,
-            std::span<Descriptor> descriptors) {
+            std::span<Descriptor> descriptors, const ModuleTimer &timer,
+            const Executor &executor) {
+  std::size_t unresolved = 0;
+  for (const auto &descriptor : descriptors) {
+    unresolved += descriptor.addr == 0 ? 1 : 0;
+  }
 
-  Modules::forEach([&](std::string_view obj_name, uintptr_t base_addr) {
+  // Wrap a per-module search so modules that are searched are timed for the
+  // caller. Once everything is resolved the remaining modules are skipped.
+  const auto timed = [&](auto &&search) {
+    return [&, search](std::string_view obj_name, uintptr_t base_addr,
+               std::span<const ElfW(Phdr)> phdrs) {
+      if (unresolved == 0) {
+        return; // everything is resolved; no need to search remaining modules
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      search(obj_name, base_addr, phdrs);
+      if (timer) {
+        timer(obj_name, std::chrono::steady_clock::now() - start);
+      }
+    };
+  };
+
+  // Modules are searched in link map order and the first module defining a
+  // name wins. Exported names are resolved first from the dynamic symbol
+  // tables already loaded in memory, which requires no file I/O. Only names
+  // still unresolved after that fall back to parsing .symtab from the module
+  // files, so an exported definition takes precedence over a local one, as it
+  // does for the dynamic linker.
+  Modules::forEach(timed([&](std::string_view obj_name, uintptr_t base_addr,
+                             std::span<const ElfW(Phdr)> phdrs) {
     if (obj_name.find("vdso") != std::string_view::npos) {
       return; // ignore vdso since it is not backed by a file we can load/parse
     }
 
-    std::string file_name(obj_name);
-    ELFIO::elfio reader;
-    if (!reader.load(file_name)) {
-      std::cerr << std::format("failed to load {} as an ELF file", file_name)
-                << std::endl;
-      return;
+    const DynamicSymbols dynamicSymbols(base_addr, phdrs);
+    for (size_t idx = 0; idx < names.size(); idx++) {
+      auto &descriptor = descriptors[idx];
+      if (descriptor.addr != 0) {
+        continue;
+      }
+
+      const auto symbol = dynamicSymbols.find(names[idx]);
+      if (symbol == nullptr) {
+        continue;
+      }
+
+      resolve(descriptor, obj_name, base_addr + symbol->st_value,
+              symbol->st_size);
+      unresolved--;
     }
+  }));
+
+  if (unresolved == 0) {
+    return;
+  }
 
-    lookupInELFFile(file_name, reader, base_addr, names, descriptors);
+  std::vector<ModuleSearch> modules;
+  Modules::forEach([&](std::string_view obj_name, uintptr_t base_addr,
+                       std::span<const ElfW(Phdr)>) {
+    if (obj_name.find("vdso") == std::string_view::npos) {
+      modules.push_back(
+          {.obj_name = std::string(obj_name), .base_addr = base_addr});
+    }
   });
+
+  searchFiles(names, descriptors, modules, timer, executor,
+              [](const ModuleIndex &index, std::string_view name) {
+                return index.find(name);
+              });
+
+  // Finally, search separate debug information for names that remain
+  // unresolved, e.g. internal functions of stripped modules. Debug files are
+  // only located and loaded on such a miss.
+  searchFiles(names, descriptors, modules, timer, executor,
+              [](const ModuleIndex &index, std::string_view name) {
+                return index.findDebug(name);
+              });
 }
 
 Descriptor::~Descriptor() {
@@ -110,4 +1354,141 @@ Descriptor::~Descriptor() {
   }
 }
 
+void findPatchableEntries(std::span<const Descriptor> descriptors,
+                          std::span<std::uintptr_t> pads) {
+  std::fill(pads.begin(), pads.end(), 0);
+
+  Modules::forEach([&](std::string_view obj_name, uintptr_t base_addr,
+                       std::span<const ElfW(Phdr)> phdrs) {
+    if (obj_name.find("vdso") != std::string_view::npos) {
+      return;
+    }
+
+    const auto contains = [&](std::uintptr_t addr) {
+      return std::any_of(
+          phdrs.begin(), phdrs.end(), [&](const ElfW(Phdr) &phdr) {
+            return phdr.p_type == PT_LOAD && addr >= base_addr + phdr.p_vaddr &&
+                   addr < base_addr + phdr.p_vaddr + phdr.p_memsz;
+          });
+    };
+
+    // The module file is only indexed if it contains one of the functions.
+    std::shared_ptr<const ModuleIndex> index;
+    for (size_t idx = 0; idx < descriptors.size(); idx++) {
+      const auto addr = descriptors[idx].addr;
+      if (addr == 0 || !contains(addr)) {
+        continue;
+      }
+
+      if (!index) {
+        index = ModuleIndex::get(std::string(obj_name));
+        if (!index) {
+          return;
+        }
+      }
+
+      const auto entries = index->patchableEntries(base_addr, phdrs);
+      const auto entry = std::upper_bound(entries.begin(), entries.end(),
+                                          addr - base_addr);
+      if (entry != entries.begin()) {
+        pads[idx] = base_addr + *std::prev(entry);
+      }
+    }
+  });
+}
+
+bool lookupRemote(pid_t pid, std::span<const std::string_view> names,
+                  std::span<RemoteSymbol> symbols, const ModuleTimer &timer,
+                  const Executor &executor) {
+  std::fill(symbols.begin(), symbols.end(), RemoteSymbol{});
+
+  MemoryMap map;
+  if (!map.load(std::format("/proc/{}/maps", pid))) {
+    return false;
+  }
+
+  // Module files are opened through the root of the target unless it shares
+  // ours, so modules without a build-id are cached under their own names.
+  const auto root = std::format("/proc/{}/root", pid);
+  const auto rootIdentity = FileIdentity::of(root);
+  const auto ownRootIdentity = FileIdentity::of("/");
+  const std::string_view prefix =
+      rootIdentity && ownRootIdentity && *rootIdentity == *ownRootIdentity
+          ? std::string_view()
+          : std::string_view(root);
+
+  struct Module {
+    RemoteModule image;
+    std::shared_ptr<const ModuleIndex> index;
+    std::chrono::nanoseconds elapsed{};
+  };
+
+  // The images are read from the target one at a time, and the module files
+  // are then indexed by a task each.
+  std::vector<Module> modules;
+  for (const auto &region : map.regions()) {
+    if (region.offset != 0 || !region.pathname.starts_with('/')) {
+      continue;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto image = readRemoteModule(pid, map, region);
+    if (!image) {
+      continue; // not a loaded module, such as a mapped data file
+    }
+    modules.push_back({std::move(*image), nullptr,
+                       std::chrono::steady_clock::now() - start});
+  }
+
+  const auto index = [&](std::size_t moduleIdx) {
+    auto &module = modules[moduleIdx];
+    const auto start = std::chrono::steady_clock::now();
+    const auto fileName = std::format("{}{}", prefix, module.image.file_name);
+    module.index = module.image.build_id.empty()
+                       ? ModuleIndex::get(fileName)
+                       : ModuleIndex::get(fileName, module.image.build_id);
+    module.elapsed += std::chrono::steady_clock::now() - start;
+  };
+  if (executor) {
+    executor(modules.size(), index);
+  } else {
+    for (size_t moduleIdx = 0; moduleIdx < modules.size(); moduleIdx++) {
+      index(moduleIdx);
+    }
+  }
+
+  std::erase_if(modules, [&](const Module &module) {
+    if (timer) {
+      timer(module.image.file_name, module.elapsed);
+    }
+    return !module.index;
+  });
+
+  // As for lookup(), separate debug information is only searched for names
+  // no module defines.
+  std::size_t unresolved = names.size();
+  const auto search = [&](auto &&find) {
+    for (const auto &module : modules) {
+      for (size_t idx = 0; unresolved != 0 && idx < names.size(); idx++) {
+        auto &symbol = symbols[idx];
+        if (symbol.addr != 0) {
+          continue;
+        }
+
+        if (const auto found = find(*module.index, names[idx])) {
+          symbol = {module.image.base_addr + found->offset, found->size};
+          unresolved--;
+        }
+      }
+    }
+  };
+  search([](const ModuleIndex &index, std::string_view name) {
+    return index.find(name);
+  });
+  search([](const ModuleIndex &index, std::string_view name) {
+    return index.findDebug(name);
+  });
+  return true;
+}
+
 }; // namespace Interject::Symbols
@@ -16,10 +16,14 @@
 
 #pragma once
 
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <span>
 #include <string_view>
 
+#include <unistd.h>
+
 namespace Interject::Symbols {
 
 struct Descriptor {
@@ -30,7 +34,62 @@ struct Descriptor {
   ~Descriptor();
 };
 
+// Receives the time spent searching a module. A module may be searched more
+// than once, e.g. its dynamic symbols first and its .symtab later.
+using ModuleTimer =
+    std::function<void(std::string_view obj_name, std::chrono::nanoseconds)>;
+
+// Runs task(idx) for every idx in [0, count) and returns once all of them
+// have returned. The tasks are independent and may run concurrently.
+using Executor = std::function<void(
+    std::size_t count, const std::function<void(std::size_t idx)> &task)>;
+
+// An Executor that runs tasks on up to threads threads, the calling thread
+// among them. Zero uses one thread per core. The other threads are started
+// once and shared by every copy of the executor; a handful of tasks, or tasks
+// run while the threads are busy, run on the calling thread.
+Executor parallelExecutor(std::size_t threads = 0);
+
+// Search root for separate debug information in place of /usr/lib/debug,
+// both by build-id and for the files named by .gnu_debuglink. Modules whose
+// debug information was already searched keep what they found.
+void setDebugRoot(std::string_view root);
+
+// Resolve names in the modules of this process. Modules are searched in link
+// map order and the first module defining a name wins. Module files that must
+// be parsed are handed to executor, one task per module, when one is given;
+// the results are the same either way, and timer is always called on the
+// calling thread in module order.
 void lookup(std::span<const std::string_view> names,
-            std::span<Descriptor> descriptors);
+            std::span<Descriptor> descriptors,
+            const ModuleTimer &timer = nullptr,
+            const Executor &executor = nullptr);
+
+// Find the NOP pads emitted before functions built with
+// -fpatchable-function-entry, as recorded in the __patchable_function_entries
+// section of their modules. pads[idx] is set to the start of the closest pad
+// at or before descriptors[idx].addr, or to zero if there is none.
+void findPatchableEntries(std::span<const Descriptor> descriptors,
+                          std::span<std::uintptr_t> pads);
+
+// A symbol resolved in another process.
+struct RemoteSymbol {
+  std::uintptr_t addr = 0;
+  std::size_t size = 0;
+};
+
+// Resolve names in process pid from the modules it has mapped, searched in
+// address order with the first module defining a name winning. Module files
+// are read through /proc/<pid>/root, so a process in another mount namespace
+// is searched in its own files. A module is identified by the build-id in the
+// target's memory and its index is shared by every process mapping the same
+// build, so each module is parsed once however many processes are searched.
+// Module files are handed to executor, one task per module, when one is given.
+// Names left at zero were not found. Returns false if the memory map of pid
+// cannot be read.
+bool lookupRemote(pid_t pid, std::span<const std::string_view> names,
+                  std::span<RemoteSymbol> symbols,
+                  const ModuleTimer &timer = nullptr,
+                  const Executor &executor = nullptr);
 
 }; // namespace Interject::Symbols
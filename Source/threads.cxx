@@ -15,33 +15,74 @@
  */
 
 #include <dirent.h>
-#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
+#include <format>
+
 #include "threads.hxx"
 
 namespace Interject::Threads {
 
-bool forEach(Callback callback) {
-  DIR *dir;
-  if ((dir = opendir("/proc/self/task")) == nullptr) {
+namespace {
+
+// Layout of the records returned by getdents64, which glibc only declares
+// with _GNU_SOURCE and LFS.
+struct LinuxDirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Read a task directory such as /proc/self/task with raw getdents64 into a
+// stack buffer rather than opendir/readdir, which allocate the DIR stream from
+// the heap.
+template <typename Fn> bool forEachTask(const char *path, Fn &&fn) noexcept {
+  const int fd = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
     return false;
   }
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != nullptr) {
-    if (entry->d_name[0] == '.') {
-      continue;
+  alignas(LinuxDirent64) char buffer[4096];
+  bool success = true;
+  for (;;) {
+    const long bytes = ::syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+    if (bytes <= 0) {
+      success = bytes == 0;
+      break;
     }
 
-    if (entry->d_type == DT_DIR) {
-      pid_t tid = atoi(entry->d_name);
-      callback(tid);
+    for (long offset = 0; offset < bytes;) {
+      const auto entry = reinterpret_cast<LinuxDirent64 *>(buffer + offset);
+      offset += entry->d_reclen;
+      if (entry->d_type != DT_DIR || entry->d_name[0] == '.') {
+        continue;
+      }
+
+      pid_t tid = 0;
+      for (const char *c = entry->d_name; *c >= '0' && *c <= '9'; c++) {
+        tid = tid * 10 + (*c - '0');
+      }
+      fn(tid);
     }
   }
 
-  closedir(dir);
-  return true;
+  ::close(fd);
+  return success;
+}
+
+}; // namespace
+
+bool forEach(Callback callback) {
+  return forEachTask("/proc/self/task", [&](pid_t tid) { callback(tid); });
+}
+
+bool forEach(pid_t pid, Callback callback) {
+  const auto path = std::format("/proc/{}/task", pid);
+  return forEachTask(path.c_str(), [&](pid_t tid) { callback(tid); });
 }
 
 std::optional<std::vector<pid_t>> all() {
@@ -53,4 +94,18 @@ std::optional<std::vector<pid_t>> all() {
   return std::move(threads);
 }
 
+std::optional<size_t> snapshot(std::span<pid_t> tids) noexcept {
+  size_t count = 0;
+  if (!forEachTask("/proc/self/task", [&](pid_t tid) {
+        if (count < tids.size()) {
+          tids[count] = tid;
+        }
+        count++;
+      })) {
+    return std::nullopt;
+  }
+
+  return count;
+}
+
 }; // namespace Interject::Threads
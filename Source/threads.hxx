@@ -18,6 +18,7 @@
 
 #include <functional>
 #include <optional>
+#include <span>
 
 #include <unistd.h>
 
@@ -27,6 +28,15 @@ using Callback = std::function<void(pid_t pid)>;
 // Iterate all threads in the current process.
 bool forEach(Callback);
 
+// Iterate all threads in process pid.
+bool forEach(pid_t pid, Callback);
+
 std::optional<std::vector<pid_t>> all();
 
+// Store the tids of all threads in the current process in tids without
+// allocating, so it is safe to call while other threads are halted. Returns
+// the total number of threads, which may exceed tids.size(); only the first
+// tids.size() are stored in that case.
+std::optional<size_t> snapshot(std::span<pid_t> tids) noexcept;
+
 }; // namespace Interject::Threads
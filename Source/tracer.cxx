@@ -0,0 +1,675 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracer.hxx"
+#include "patch.hxx"
+#include "trampolines.hxx"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Interject {
+
+namespace {
+
+// Layout of the memfd shared with readers: a RegionHeader followed by one
+// ring per thread, each a RingHeader followed by its records.
+constexpr std::uint32_t REGION_MAGIC = 0x43525449; // "ITRC"
+constexpr std::uint32_t REGION_VERSION = 1;
+constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+struct RegionHeader {
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint32_t ringCount;
+  std::uint32_t ringRecords;
+  std::uint64_t ringStride;
+  std::uint64_t ringsOffset;
+  alignas(CACHE_LINE_SIZE) std::uint32_t ringsClaimed;
+  std::uint64_t unclaimedDrops; // records from threads without a ring
+};
+
+// The traced thread and the reader each write to a cache line of their own.
+struct RingHeader {
+  // Written by the traced thread only.
+  alignas(CACHE_LINE_SIZE) std::uint64_t head;
+  std::uint64_t cachedTail; // last tail seen, to avoid reading it every time
+  std::uint64_t dropped;
+  std::uint64_t mask;
+  pid_t tid;
+  std::uint32_t depth; // traced calls that have yet to return
+
+  // Written by the reader only.
+  alignas(CACHE_LINE_SIZE) std::uint64_t tail;
+};
+
+static_assert(sizeof(Tracer::Record) == 24);
+static_assert(sizeof(RingHeader) % CACHE_LINE_SIZE == 0);
+
+std::size_t alignUp(std::size_t size, std::size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+RingHeader *ringAt(void *base, std::uint64_t ringsOffset,
+                   std::uint64_t ringStride, std::size_t idx) {
+  return reinterpret_cast<RingHeader *>(reinterpret_cast<std::uintptr_t>(base) +
+                                        ringsOffset + idx * ringStride);
+}
+
+RingHeader *ringAt(RegionHeader *region, std::size_t idx) {
+  return ringAt(region, region->ringsOffset, region->ringStride, idx);
+}
+
+Tracer::Record *recordsOf(RingHeader *ring) {
+  return reinterpret_cast<Tracer::Record *>(ring + 1);
+}
+
+// The return address a traced call replaced with the exit thunk.
+struct ShadowFrame {
+  std::uintptr_t returnAddr;
+  RingHeader *ring;
+  std::uint16_t target;
+};
+
+constexpr std::size_t MAX_SHADOW_DEPTH = 256;
+
+// What a target's stub passes to the entry thunk.
+struct Target {
+  std::uintptr_t original; // set by the transaction before the hook is live
+  RegionHeader *region;
+  ShadowFrame *shadowStacks; // MAX_SHADOW_DEPTH frames for each ring
+  std::uint64_t serial;
+  std::uint16_t index;
+  bool active;
+};
+
+// Per-thread tracing state. It is zero-initialized so accessing it never
+// allocates or runs a constructor. The shadow stack belongs to the ring, so
+// threads that never record cost only this much.
+struct ThreadState {
+  std::uint64_t serial; // of the session ring belongs to
+  RingHeader *ring;
+  ShadowFrame *frames; // the shadow stack of ring
+  pid_t tid;
+  std::uint32_t depth;
+};
+
+static_assert(sizeof(ThreadState) <= CACHE_LINE_SIZE);
+
+thread_local ThreadState threadState;
+
+// Distinguishes sessions so a thread never writes to the ring it claimed in a
+// previous one.
+std::uint64_t nextSerial = 1;
+
+std::uint64_t timestamp() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void push(RingHeader *ring, const Tracer::Record &record) noexcept {
+  const std::uint64_t head = ring->head;
+  if (head - ring->cachedTail > ring->mask) {
+    ring->cachedTail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - ring->cachedTail > ring->mask) {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  recordsOf(ring)[head & ring->mask] = record;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void claimRing(ThreadState &state, const Target &target) noexcept {
+  if (state.tid == 0) {
+    state.tid = ::gettid();
+  }
+  state.serial = target.serial;
+  state.ring = nullptr;
+  state.frames = nullptr;
+
+  RegionHeader *region = target.region;
+  const std::uint32_t idx =
+      __atomic_fetch_add(&region->ringsClaimed, 1, __ATOMIC_RELAXED);
+  if (idx < region->ringCount) {
+    state.ring = ringAt(region, idx);
+    state.frames = target.shadowStacks + idx * MAX_SHADOW_DEPTH;
+    __atomic_store_n(&state.ring->tid, state.tid, __ATOMIC_RELEASE);
+    return;
+  }
+
+  // Every ring has been claimed, so take over one whose thread has exited
+  // outside any traced call. Its unread records stay in place for the reader
+  // and carry the tid of the thread that wrote them. A tid that was reused is
+  // not taken over, which only costs the new thread its ring.
+  const int savedErrno = errno;
+  for (std::uint32_t ringIdx = 0; ringIdx < region->ringCount; ringIdx++) {
+    RingHeader *ring = ringAt(region, ringIdx);
+    pid_t owner = __atomic_load_n(&ring->tid, __ATOMIC_ACQUIRE);
+    if (owner == 0 || __atomic_load_n(&ring->depth, __ATOMIC_ACQUIRE) != 0) {
+      continue;
+    }
+    if (::syscall(SYS_tgkill, ::getpid(), owner, 0) != -1 || errno != ESRCH) {
+      continue;
+    }
+    if (__atomic_compare_exchange_n(&ring->tid, &owner, state.tid, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      state.ring = ring;
+      state.frames = target.shadowStacks + ringIdx * MAX_SHADOW_DEPTH;
+      break;
+    }
+  }
+  errno = savedErrno;
+}
+
+}; // namespace
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+// Called by the entry thunk with the stub's target, the first integer argument
+// and where the return address of the traced call is stored. Returns where the
+// call continues.
+extern "C" __attribute__((visibility("hidden"))) std::uintptr_t
+interject_trace_on_entry(void *context, std::uint64_t arg,
+                         std::uintptr_t *returnAddr) noexcept;
+
+// Called by the exit thunk with the integer return value. Returns the address
+// the traced call returns to.
+extern "C" __attribute__((visibility("hidden"))) std::uintptr_t
+interject_trace_on_exit(std::uint64_t value) noexcept;
+
+extern "C" void interject_trace_entry();
+extern "C" void interject_trace_exit();
+
+std::uintptr_t interject_trace_on_entry(void *context, std::uint64_t arg,
+                                        std::uintptr_t *returnAddr) noexcept {
+  const auto target = static_cast<const Target *>(context);
+  const std::uintptr_t original =
+      __atomic_load_n(&target->original, __ATOMIC_ACQUIRE);
+  if (!__atomic_load_n(&target->active, __ATOMIC_ACQUIRE)) {
+    return original; // the tracer is going away
+  }
+
+  auto &state = threadState;
+  if (state.serial != target->serial) {
+    // A thread still inside calls traced by another session keeps that
+    // session's shadow stack until they return, and records nothing here.
+    if (state.depth != 0) {
+      __atomic_add_fetch(&target->region->unclaimedDrops, 1, __ATOMIC_RELAXED);
+      return original;
+    }
+    claimRing(state, *target);
+  }
+
+  // Threads without a ring only count their records as dropped, and their
+  // exits are not traced.
+  RingHeader *ring = state.ring;
+  if (ring == nullptr) {
+    __atomic_add_fetch(&target->region->unclaimedDrops, 1, __ATOMIC_RELAXED);
+    return original;
+  }
+
+  push(ring, {timestamp(), arg, state.tid, target->index, Tracer::KindEntry, 0});
+
+  if (state.depth < MAX_SHADOW_DEPTH) {
+    state.frames[state.depth++] = {*returnAddr, ring, target->index};
+    __atomic_store_n(&ring->depth, ring->depth + 1, __ATOMIC_RELAXED);
+    *returnAddr = reinterpret_cast<std::uintptr_t>(interject_trace_exit);
+  }
+  return original;
+}
+
+std::uintptr_t interject_trace_on_exit(std::uint64_t value) noexcept {
+  auto &state = threadState;
+  const ShadowFrame &frame = state.frames[--state.depth];
+  RingHeader *ring = frame.ring;
+  push(ring, {timestamp(), value, state.tid, frame.target, Tracer::KindExit, 0});
+  __atomic_store_n(&ring->depth, ring->depth - 1, __ATOMIC_RELEASE);
+  return frame.returnAddr;
+}
+
+// Each target's stub loads its Target into r11 and jumps to the entry thunk.
+// The thunk preserves every argument register around the call to
+// interject_trace_on_entry, then continues into the original function with
+// its return address pointing at the exit thunk. The exit thunk preserves the
+// return value registers around interject_trace_on_exit and returns to the
+// original return address. The exit thunk has no return address on its stack
+// for an unwinder to follow, so unwinding stops there.
+asm(R"(
+  .text
+  .p2align 4
+  .globl interject_trace_entry
+  .hidden interject_trace_entry
+  .type interject_trace_entry, @function
+interject_trace_entry:
+  .cfi_startproc
+  pushq %rdi
+  .cfi_adjust_cfa_offset 8
+  pushq %rsi
+  .cfi_adjust_cfa_offset 8
+  pushq %rdx
+  .cfi_adjust_cfa_offset 8
+  pushq %rcx
+  .cfi_adjust_cfa_offset 8
+  pushq %r8
+  .cfi_adjust_cfa_offset 8
+  pushq %r9
+  .cfi_adjust_cfa_offset 8
+  pushq %r10
+  .cfi_adjust_cfa_offset 8
+  pushq %rax
+  .cfi_adjust_cfa_offset 8
+  subq $136, %rsp
+  .cfi_adjust_cfa_offset 136
+  movdqu %xmm0, 0(%rsp)
+  movdqu %xmm1, 16(%rsp)
+  movdqu %xmm2, 32(%rsp)
+  movdqu %xmm3, 48(%rsp)
+  movdqu %xmm4, 64(%rsp)
+  movdqu %xmm5, 80(%rsp)
+  movdqu %xmm6, 96(%rsp)
+  movdqu %xmm7, 112(%rsp)
+  movq %r11, %rdi
+  movq 192(%rsp), %rsi
+  leaq 200(%rsp), %rdx
+  call interject_trace_on_entry
+  movq %rax, %r11
+  movdqu 0(%rsp), %xmm0
+  movdqu 16(%rsp), %xmm1
+  movdqu 32(%rsp), %xmm2
+  movdqu 48(%rsp), %xmm3
+  movdqu 64(%rsp), %xmm4
+  movdqu 80(%rsp), %xmm5
+  movdqu 96(%rsp), %xmm6
+  movdqu 112(%rsp), %xmm7
+  addq $136, %rsp
+  .cfi_adjust_cfa_offset -136
+  popq %rax
+  .cfi_adjust_cfa_offset -8
+  popq %r10
+  .cfi_adjust_cfa_offset -8
+  popq %r9
+  .cfi_adjust_cfa_offset -8
+  popq %r8
+  .cfi_adjust_cfa_offset -8
+  popq %rcx
+  .cfi_adjust_cfa_offset -8
+  popq %rdx
+  .cfi_adjust_cfa_offset -8
+  popq %rsi
+  .cfi_adjust_cfa_offset -8
+  popq %rdi
+  .cfi_adjust_cfa_offset -8
+  jmpq *%r11
+  .cfi_endproc
+  .size interject_trace_entry, .-interject_trace_entry
+
+  .p2align 4
+  .globl interject_trace_exit
+  .hidden interject_trace_exit
+  .type interject_trace_exit, @function
+interject_trace_exit:
+  .cfi_startproc
+  .cfi_undefined rip
+  pushq %rax
+  .cfi_adjust_cfa_offset 8
+  pushq %rdx
+  .cfi_adjust_cfa_offset 8
+  subq $32, %rsp
+  .cfi_adjust_cfa_offset 32
+  movdqu %xmm0, 0(%rsp)
+  movdqu %xmm1, 16(%rsp)
+  movq %rax, %rdi
+  call interject_trace_on_exit
+  movq %rax, %r11
+  movdqu 0(%rsp), %xmm0
+  movdqu 16(%rsp), %xmm1
+  addq $32, %rsp
+  .cfi_adjust_cfa_offset -32
+  popq %rdx
+  .cfi_adjust_cfa_offset -8
+  popq %rax
+  .cfi_adjust_cfa_offset -8
+  jmpq *%r11
+  .cfi_endproc
+  .size interject_trace_exit, .-interject_trace_exit
+)");
+
+// Create the stub hooking a target: mov r11, target; jmp interject_trace_entry
+static std::array<uint8_t, 10 + Patch::resumeAtSize()>
+createStub(const Target *target) {
+  std::array<uint8_t, 10 + Patch::resumeAtSize()> stub = {0x49, 0xBB};
+  const auto targetAddr = reinterpret_cast<std::uintptr_t>(target);
+  std::memcpy(stub.data() + 2, &targetAddr, sizeof(targetAddr));
+  const auto jump = Patch::createResumeAt(
+      reinterpret_cast<std::uintptr_t>(interject_trace_entry));
+  std::copy(jump.begin(), jump.end(), stub.begin() + 10);
+  return stub;
+}
+
+#endif
+
+struct Tracer::Session {
+  ~Session();
+
+  int fd = -1;
+  void *base = MAP_FAILED;
+  std::size_t size = 0;
+  void *shadowStacks = MAP_FAILED; // private, since it holds return addresses
+  std::size_t shadowSize = 0;
+  std::unique_ptr<Target[]> targets;
+  std::vector<std::uintptr_t> stubs;
+  std::unique_ptr<Transaction> txn;
+  bool committed = false; // hooks were installed at some point
+  bool tracing = false;
+};
+
+Tracer::Session::~Session() {
+  if (committed) {
+    // A thread may still be on its way through a stub, so stubs and targets
+    // are never freed once hooks were installed. Stop recording, give threads
+    // about to record a moment to finish, then wait for traced calls to
+    // return before unmapping the rings they write to. If some do not return
+    // in time the rings are left mapped.
+    for (std::size_t idx = 0; idx < stubs.size(); idx++) {
+      __atomic_store_n(&targets[idx].active, false, __ATOMIC_RELEASE);
+    }
+
+    const auto region = static_cast<RegionHeader *>(base);
+    bool quiescent = false;
+    for (size_t attempt = 0; !quiescent && attempt < 100; attempt++) {
+      ::usleep(1000);
+      const std::uint32_t claimed = std::min(
+          __atomic_load_n(&region->ringsClaimed, __ATOMIC_ACQUIRE),
+          region->ringCount);
+      quiescent = true;
+      for (std::uint32_t idx = 0; idx < claimed; idx++) {
+        if (__atomic_load_n(&ringAt(region, idx)->depth, __ATOMIC_ACQUIRE)) {
+          quiescent = false;
+          break;
+        }
+      }
+    }
+
+    (void)targets.release();
+    if (!quiescent) {
+      base = MAP_FAILED;
+      shadowStacks = MAP_FAILED;
+    }
+  } else {
+    for (const auto stub : stubs) {
+      Trampolines::release(stub);
+    }
+  }
+
+  if (base != MAP_FAILED) {
+    ::munmap(base, size);
+  }
+  if (shadowStacks != MAP_FAILED) {
+    ::munmap(shadowStacks, shadowSize);
+  }
+  if (fd != -1) {
+    ::close(fd);
+  }
+}
+
+Tracer::Tracer(std::vector<std::string_view> names, std::size_t maxThreads,
+               std::size_t ringRecords, Transaction::Engine engine)
+    : _names(std::move(names)), _maxThreads(maxThreads),
+      _ringRecords(ringRecords), _engine(engine) {}
+
+Tracer::Tracer(Tracer &&) noexcept = default;
+
+Tracer::~Tracer() {
+  if (_session && _session->tracing) {
+    (void)stop();
+  }
+}
+
+int Tracer::fd() const noexcept { return _session ? _session->fd : -1; }
+
+Transaction::ResultCode Tracer::start() {
+  if (_session && _session->tracing) {
+    return Transaction::ErrorInvalidState;
+  }
+
+#if !defined(__x86_64__) && !defined(_M_X64)
+  return Transaction::ErrorNotImplemented;
+#else
+  // Records from the previous run are discarded.
+  _session.reset();
+
+  auto session = std::make_unique<Session>();
+  const std::size_t ringRecords = std::bit_ceil(std::max<size_t>(_ringRecords, 2));
+  const std::size_t ringStride = alignUp(
+      sizeof(RingHeader) + ringRecords * sizeof(Record), CACHE_LINE_SIZE);
+  const std::size_t ringsOffset = alignUp(sizeof(RegionHeader), CACHE_LINE_SIZE);
+  session->size = ringsOffset + _maxThreads * ringStride;
+
+  session->fd = ::memfd_create("interject-trace", MFD_CLOEXEC);
+  if (session->fd == -1 ||
+      ::ftruncate(session->fd, static_cast<off_t>(session->size)) == -1) {
+    std::cerr << "failed creating trace buffer" << std::endl;
+    return Transaction::ErrorUnexpected;
+  }
+  session->base = ::mmap(nullptr, session->size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, session->fd, 0);
+  if (session->base == MAP_FAILED) {
+    std::cerr << "failed mapping trace buffer" << std::endl;
+    return Transaction::ErrorUnexpected;
+  }
+
+  // Pages of a shadow stack are only backed once a thread claims its ring and
+  // calls that deep.
+  session->shadowSize = std::max<std::size_t>(_maxThreads, 1) *
+                        MAX_SHADOW_DEPTH * sizeof(ShadowFrame);
+  session->shadowStacks =
+      ::mmap(nullptr, session->shadowSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (session->shadowStacks == MAP_FAILED) {
+    std::cerr << "failed mapping shadow stacks" << std::endl;
+    return Transaction::ErrorUnexpected;
+  }
+
+  // The memfd starts zeroed, so only the fixed fields need to be written.
+  const auto region = static_cast<RegionHeader *>(session->base);
+  region->version = REGION_VERSION;
+  region->ringCount = static_cast<std::uint32_t>(_maxThreads);
+  region->ringRecords = static_cast<std::uint32_t>(ringRecords);
+  region->ringStride = ringStride;
+  region->ringsOffset = ringsOffset;
+  for (std::size_t idx = 0; idx < _maxThreads; idx++) {
+    ringAt(region, idx)->mask = ringRecords - 1;
+  }
+  __atomic_store_n(&region->magic, REGION_MAGIC, __ATOMIC_RELEASE);
+
+  const std::uint64_t serial =
+      __atomic_fetch_add(&nextSerial, 1, __ATOMIC_RELAXED);
+  session->targets.reset(new Target[_names.size()]);
+  for (std::size_t idx = 0; idx < _names.size(); idx++) {
+    session->targets[idx] = {
+        0, region, static_cast<ShadowFrame *>(session->shadowStacks), serial,
+        static_cast<std::uint16_t>(idx), true};
+  }
+
+  Transaction::Builder builder;
+  builder.engine(_engine);
+  const auto nearAddr = reinterpret_cast<std::uintptr_t>(interject_trace_entry);
+  for (std::size_t idx = 0; idx < _names.size(); idx++) {
+    auto &target = session->targets[idx];
+    const auto stub = Trampolines::allocate(nearAddr);
+    if (!stub) {
+      return Transaction::ErrorTrampolineAllocationFailure;
+    }
+    session->stubs.push_back(*stub);
+    if (!Trampolines::write(*stub, createStub(&target))) {
+      return Transaction::ErrorTrampolineAllocationFailure;
+    }
+
+    builder.add(_names[idx], reinterpret_cast<void (*)()>(*stub),
+                reinterpret_cast<void (**)()>(&target.original));
+  }
+
+  session->txn.reset(new Transaction(builder.build()));
+  Transaction::ResultCode result = session->txn->prepare();
+  if (result != Transaction::Success) {
+    return result;
+  }
+
+  result = session->txn->commit();
+  if (result != Transaction::Success) {
+    return result;
+  }
+
+  session->committed = true;
+  session->tracing = true;
+  _session = std::move(session);
+  return Transaction::Success;
+#endif
+}
+
+Transaction::ResultCode Tracer::stop() {
+  if (!_session || !_session->tracing) {
+    return Transaction::ErrorInvalidState;
+  }
+
+  const Transaction::ResultCode result = _session->txn->rollback();
+  if (result == Transaction::Success) {
+    _session->tracing = false;
+  }
+  return result;
+}
+
+std::optional<TraceReader> TraceReader::open(int fd) {
+  struct stat info;
+  if (::fstat(fd, &info) == -1 ||
+      static_cast<std::size_t>(info.st_size) < sizeof(RegionHeader)) {
+    return std::nullopt;
+  }
+
+  const auto size = static_cast<std::size_t>(info.st_size);
+  void *base =
+      ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    return std::nullopt;
+  }
+
+  // The layout is read once and checked so that every ring lies within the
+  // mapping and holds its records. The writer may be another process, so the
+  // header is not consulted again.
+  const auto region = static_cast<const RegionHeader *>(base);
+  const Layout layout = {region->ringCount, region->ringRecords,
+                         region->ringStride, region->ringsOffset};
+  const auto validLayout = [&]() {
+    if (layout.ringsOffset < sizeof(RegionHeader) ||
+        layout.ringsOffset > size ||
+        layout.ringsOffset % alignof(RingHeader) != 0 ||
+        layout.ringStride < sizeof(RingHeader) ||
+        layout.ringStride % alignof(RingHeader) != 0) {
+      return false;
+    }
+    if (layout.ringCount > (size - layout.ringsOffset) / layout.ringStride) {
+      return false;
+    }
+    return layout.ringRecords != 0 && std::has_single_bit(layout.ringRecords) &&
+           layout.ringRecords <= (layout.ringStride - sizeof(RingHeader)) /
+                                     sizeof(Tracer::Record);
+  };
+  if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != REGION_MAGIC ||
+      region->version != REGION_VERSION || !validLayout()) {
+    ::munmap(base, size);
+    return std::nullopt;
+  }
+  return TraceReader(base, size, layout);
+}
+
+TraceReader::TraceReader(TraceReader &&other) noexcept
+    : _base(other._base), _size(other._size), _layout(other._layout) {
+  other._base = nullptr;
+}
+
+TraceReader::~TraceReader() {
+  if (_base != nullptr) {
+    ::munmap(_base, _size);
+  }
+}
+
+std::size_t TraceReader::consume(
+    const std::function<void(std::span<const Tracer::Record>)> &fn) {
+  const auto region = static_cast<RegionHeader *>(_base);
+  const std::uint32_t claimed =
+      std::min(__atomic_load_n(&region->ringsClaimed, __ATOMIC_ACQUIRE),
+               _layout.ringCount);
+
+  std::size_t consumed = 0;
+  for (std::uint32_t idx = 0; idx < claimed; idx++) {
+    RingHeader *ring =
+        ringAt(_base, _layout.ringsOffset, _layout.ringStride, idx);
+    const std::uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    const std::uint64_t tail = ring->tail;
+    if (head == tail) {
+      continue;
+    }
+
+    // A ring never holds more than it has room for. If head says otherwise,
+    // only the most recent records are read.
+    const Tracer::Record *records = recordsOf(ring);
+    const std::size_t count =
+        std::min<std::uint64_t>(head - tail, _layout.ringRecords);
+    const std::size_t first = (head - count) & (_layout.ringRecords - 1);
+    const std::size_t untilWrap =
+        std::min<std::size_t>(count, _layout.ringRecords - first);
+    fn(std::span(records + first, untilWrap));
+    if (count > untilWrap) {
+      fn(std::span(records, count - untilWrap));
+    }
+
+    // Hand the slots back to the traced thread only once fn is done with them.
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    consumed += count;
+  }
+  return consumed;
+}
+
+std::uint64_t TraceReader::dropped() const noexcept {
+  const auto region = static_cast<RegionHeader *>(_base);
+  const std::uint32_t claimed =
+      std::min(__atomic_load_n(&region->ringsClaimed, __ATOMIC_ACQUIRE),
+               _layout.ringCount);
+
+  std::uint64_t dropped =
+      __atomic_load_n(&region->unclaimedDrops, __ATOMIC_RELAXED);
+  for (std::uint32_t idx = 0; idx < claimed; idx++) {
+    const RingHeader *ring =
+        ringAt(_base, _layout.ringsOffset, _layout.ringStride, idx);
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+  return dropped;
+}
+
+}; // namespace Interject
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "transaction.hxx"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace Interject {
+
+// Records the entry and exit of functions found by name into per-thread ring
+// buffers, without recompiling them.
+//
+// Each target is hooked with a small stub that records the entry and swaps the
+// return address for one that records the exit. Each thread writes to a ring
+// of its own, so recording takes no lock and touches no shared cache line. A
+// full ring drops records and counts them rather than blocking the traced
+// thread. The rings live in a memfd so a reader, possibly in another process,
+// can map them and consume records in place with TraceReader.
+//
+// Traced functions must not be left by an exception or longjmp, which would
+// skip the exit record and its return address. x86_64 only.
+class Tracer {
+public:
+  enum Kind : std::uint8_t {
+    KindEntry = 0,
+    KindExit,
+  };
+
+  struct Record {
+    std::uint64_t timestamp; // steady clock, in nanoseconds
+    // The first integer argument on entry and the integer return value on
+    // exit.
+    std::uint64_t value;
+    pid_t tid;
+    std::uint16_t target; // index in the order targets were added
+    Kind kind;
+    std::uint8_t reserved;
+  };
+
+  class Builder {
+  public:
+    Builder &add(const std::string_view &name) {
+      names.emplace_back(name);
+      return *this;
+    }
+
+    // Threads that can record at the same time. The ring of a thread that
+    // has exited is handed to the next thread that needs one. Records from
+    // threads beyond this are dropped.
+    Builder &maxThreads(std::size_t count) {
+      max_threads = count;
+      return *this;
+    }
+
+    // Records per thread, rounded up to a power of two.
+    Builder &ringRecords(std::size_t count) {
+      ring_records = count;
+      return *this;
+    }
+
+    Builder &engine(Transaction::Engine engine) {
+      patch_engine = engine;
+      return *this;
+    }
+
+    Tracer build() const {
+      return Tracer(names, max_threads, ring_records, patch_engine);
+    }
+
+  private:
+    std::vector<std::string_view> names;
+    std::size_t max_threads = 64;
+    std::size_t ring_records = 4096;
+    Transaction::Engine patch_engine = Transaction::EngineHalting;
+  };
+
+  Tracer(Tracer &&) noexcept;
+  ~Tracer();
+
+  // Create the rings and hook every target.
+  Transaction::ResultCode start();
+
+  // Unhook every target. Records already written stay readable.
+  Transaction::ResultCode stop();
+
+  // The memfd holding the rings, valid once started. It can be passed to
+  // another process to read the records.
+  int fd() const noexcept;
+
+private:
+  struct Session;
+
+  Tracer(std::vector<std::string_view> names, std::size_t maxThreads,
+         std::size_t ringRecords, Transaction::Engine engine);
+
+  std::vector<std::string_view> _names;
+  std::size_t _maxThreads;
+  std::size_t _ringRecords;
+  Transaction::Engine _engine;
+  std::unique_ptr<Session> _session;
+};
+
+// Reads the records of a Tracer from its memfd.
+class TraceReader {
+public:
+  // Map the rings in fd. Fails if fd does not hold rings of a Tracer.
+  static std::optional<TraceReader> open(int fd);
+
+  TraceReader(TraceReader &&other) noexcept;
+  TraceReader &operator=(TraceReader &&) = delete;
+  ~TraceReader();
+
+  // Pass the unread records of each thread to fn, in order, straight from the
+  // shared mapping. A thread's records may be split over two calls where its
+  // ring wraps. They are marked read once fn returns. Returns the number of
+  // records read.
+  std::size_t consume(
+      const std::function<void(std::span<const Tracer::Record>)> &fn);
+
+  // Records dropped so far because a ring was full or a thread had no ring.
+  std::uint64_t dropped() const noexcept;
+
+private:
+  // Where the rings are in the mapping, as checked by open.
+  struct Layout {
+    std::uint32_t ringCount;
+    std::uint32_t ringRecords;
+    std::uint64_t ringStride;
+    std::uint64_t ringsOffset;
+  };
+
+  TraceReader(void *base, std::size_t size, Layout layout)
+      : _base(base), _size(size), _layout(layout) {}
+
+  void *_base;
+  std::size_t _size;
+  Layout _layout;
+};
+
+}; // namespace Interject
@@ -0,0 +1,247 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trampolines.hxx"
+#include "code_writer.hxx"
+#include "memory_map.hxx"
+
+#include <algorithm>
+#include <bit>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+namespace Interject::Trampolines {
+
+namespace {
+
+// Slots live in single-page slabs. Trampoline slabs are mapped read+execute
+// and written through CodeWriter so a page is never made non-executable while
+// other slots in it may be running. Pointer slabs are mapped read+write.
+struct Slab {
+  std::uintptr_t start;
+  std::uint64_t used; // bitmap of allocated slots
+};
+
+struct Pool {
+  int permissions;
+  std::size_t slotSize;
+  std::vector<Slab> slabs;
+};
+
+const std::size_t pageSize = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+
+std::size_t slotsPerSlab(const Pool &pool) {
+  const std::size_t count = pageSize / pool.slotSize;
+  return count < 64 ? count : 64;
+}
+
+// Bounds of the addresses considered for new slabs, excluding the pages below
+// the usual vm.mmap_min_addr.
+constexpr std::uintptr_t MIN_SLAB_ADDR = 0x10000;
+constexpr std::uintptr_t MAX_SLAB_ADDR = ~std::uintptr_t(0) >> 1;
+
+std::mutex poolLock;
+Pool trampolines{PROT_READ | PROT_EXEC, SLOT_SIZE, {}};
+Pool pointers{PROT_READ | PROT_WRITE, POINTER_SLOT_SIZE, {}};
+
+// Retired trampoline slots by the address they serve. There is at most one
+// idle slot per site and key unless several transactions held one at once.
+struct Retired {
+  std::vector<std::uint8_t> key;
+  std::uintptr_t slot;
+};
+
+std::multimap<std::uintptr_t, Retired> retired;
+
+bool inRange(std::uintptr_t addr, std::uintptr_t nearAddr) {
+  const std::uintptr_t distance =
+      addr > nearAddr ? addr - nearAddr : nearAddr - addr;
+  return distance < MAX_DISTANCE - pageSize;
+}
+
+std::optional<std::uintptr_t> mapSlabAt(std::uintptr_t addr,
+                                        std::uintptr_t nearAddr,
+                                        int permissions) {
+  void *page = ::mmap(reinterpret_cast<void *>(addr), pageSize, permissions,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (page == MAP_FAILED) {
+    return std::nullopt;
+  }
+
+  // Kernels predating MAP_FIXED_NOREPLACE treat the address as a hint and may
+  // place the mapping elsewhere.
+  const auto start = reinterpret_cast<std::uintptr_t>(page);
+  if (!inRange(start, nearAddr)) {
+    ::munmap(page, pageSize);
+    return std::nullopt;
+  }
+  return start;
+}
+
+// Map a new slab in an unmapped gap as close to nearAddr as possible.
+std::optional<std::uintptr_t> mapSlabNear(std::uintptr_t nearAddr,
+                                          int permissions) {
+  MemoryMap map;
+  if (!map.load()) {
+    return std::nullopt;
+  }
+
+  // Candidate pages are the first and last page of every gap between regions,
+  // plus the page at nearAddr when it falls within a gap.
+  std::vector<std::uintptr_t> candidates;
+  const auto consider = [&](std::uintptr_t addr) {
+    if (inRange(addr, nearAddr)) {
+      candidates.push_back(addr);
+    }
+  };
+
+  const auto regions = map.regions();
+  const std::uintptr_t pageMask = ~(pageSize - 1);
+  std::uintptr_t gapStart = MIN_SLAB_ADDR;
+  for (std::size_t idx = 0; idx <= regions.size(); idx++) {
+    const std::uintptr_t gapEnd =
+        idx < regions.size() ? regions[idx].start : MAX_SLAB_ADDR;
+    if (gapEnd > gapStart && gapEnd - gapStart >= pageSize) {
+      consider(gapStart);
+      consider(gapEnd - pageSize);
+      if (nearAddr > gapStart && nearAddr < gapEnd - pageSize) {
+        consider(nearAddr & pageMask);
+      }
+    }
+    if (idx < regions.size()) {
+      gapStart = std::max(gapStart, regions[idx].end);
+    }
+  }
+
+  const auto distance = [nearAddr](std::uintptr_t addr) {
+    return addr > nearAddr ? addr - nearAddr : nearAddr - addr;
+  };
+  std::sort(candidates.begin(), candidates.end(),
+            [&](std::uintptr_t lhs, std::uintptr_t rhs) {
+              return distance(lhs) < distance(rhs);
+            });
+
+  for (const auto candidate : candidates) {
+    if (const auto start = mapSlabAt(candidate, nearAddr, permissions)) {
+      return start;
+    }
+  }
+  return std::nullopt;
+}
+
+std::optional<std::uintptr_t> allocateFrom(Pool &pool,
+                                           std::uintptr_t nearAddr) {
+  std::lock_guard<std::mutex> guard(poolLock);
+
+  const std::uint64_t full =
+      slotsPerSlab(pool) == 64 ? ~std::uint64_t(0)
+                               : (std::uint64_t(1) << slotsPerSlab(pool)) - 1;
+  for (auto &slab : pool.slabs) {
+    if (slab.used == full || !inRange(slab.start, nearAddr)) {
+      continue;
+    }
+
+    const int slot = std::countr_one(slab.used);
+    slab.used |= std::uint64_t(1) << slot;
+    return slab.start + slot * pool.slotSize;
+  }
+
+  const auto start = mapSlabNear(nearAddr, pool.permissions);
+  if (!start) {
+    return std::nullopt;
+  }
+
+  pool.slabs.push_back({*start, 1});
+  return *start;
+}
+
+void releaseTo(Pool &pool, std::uintptr_t slot) {
+  std::lock_guard<std::mutex> guard(poolLock);
+
+  for (auto &slab : pool.slabs) {
+    if (slot >= slab.start && slot < slab.start + pageSize) {
+      slab.used &= ~(std::uint64_t(1) << ((slot - slab.start) / pool.slotSize));
+      return;
+    }
+  }
+}
+
+}; // namespace
+
+std::optional<std::uintptr_t> allocate(std::uintptr_t nearAddr) {
+  return allocateFrom(trampolines, nearAddr);
+}
+
+void release(std::uintptr_t slot) { releaseTo(trampolines, slot); }
+
+std::optional<std::uintptr_t> allocatePointer(std::uintptr_t nearAddr) {
+  return allocateFrom(pointers, nearAddr);
+}
+
+void releasePointer(std::uintptr_t slot) { releaseTo(pointers, slot); }
+
+void retire(std::uintptr_t site, std::span<const std::uint8_t> key,
+            std::uintptr_t slot) noexcept {
+  std::lock_guard<std::mutex> guard(poolLock);
+  try {
+    retired.emplace(site, Retired{{key.begin(), key.end()}, slot});
+  } catch (...) {
+    // Without room to record it the slot stays allocated and unused.
+  }
+}
+
+std::optional<std::uintptr_t> reuse(std::uintptr_t site,
+                                    std::span<const std::uint8_t> key) {
+  std::lock_guard<std::mutex> guard(poolLock);
+
+  const auto [first, last] = retired.equal_range(site);
+  for (auto it = first; it != last; ++it) {
+    if (std::equal(key.begin(), key.end(), it->second.key.begin(),
+                   it->second.key.end())) {
+      const auto slot = it->second.slot;
+      retired.erase(it);
+      return slot;
+    }
+  }
+  return std::nullopt;
+}
+
+bool write(std::uintptr_t slot, std::span<const std::uint8_t> code) {
+  if (code.size() > SLOT_SIZE) {
+    return false;
+  }
+
+  const CodeWriter::PageRange range = {slot & ~(pageSize - 1), pageSize,
+                                       PROT_READ | PROT_EXEC};
+  CodeWriter writer(std::span(&range, 1));
+  if (!writer.write(slot, code)) {
+    return false;
+  }
+
+  __builtin___clear_cache(reinterpret_cast<char *>(slot),
+                          reinterpret_cast<char *>(slot + code.size()));
+  return true;
+}
+
+}; // namespace Interject::Trampolines
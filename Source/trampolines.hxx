@@ -0,0 +1,69 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+
+namespace Interject::Trampolines {
+
+// Size in bytes of every trampoline slot.
+constexpr std::size_t SLOT_SIZE = 128;
+
+// Maximum distance between a trampoline and the address it was allocated
+// near. Well inside the +/-2GB reach of rel32 displacements so relocated
+// instructions can still reach anything in the target's module.
+constexpr std::uintptr_t MAX_DISTANCE = std::uintptr_t(1) << 30;
+
+// Allocate an executable trampoline slot within MAX_DISTANCE of nearAddr.
+// Slots are packed into shared pages and freed slots are reused.
+std::optional<std::uintptr_t> allocate(std::uintptr_t nearAddr);
+
+// Return a slot to the pool.
+void release(std::uintptr_t slot);
+
+// Write code into an allocated slot. The slot must not be executing.
+[[nodiscard]]
+bool write(std::uintptr_t slot, std::span<const std::uint8_t> code);
+
+// A slot that other threads could once reach can never go back to the pool,
+// since a thread may still be about to run it. Retire it instead, under the
+// address it serves and a key describing its code. It is then handed out again
+// only for the same address and key, which would write the same code, so it
+// never needs to be rewritten.
+void retire(std::uintptr_t site, std::span<const std::uint8_t> key,
+            std::uintptr_t slot) noexcept;
+
+// Take back a slot retired with the same site and key, if there is one. Its
+// code is already in place.
+std::optional<std::uintptr_t> reuse(std::uintptr_t site,
+                                    std::span<const std::uint8_t> key);
+
+// Size in bytes of every pointer slot. Each one has a cache line to itself so
+// storing to one never invalidates the line holding another.
+constexpr std::size_t POINTER_SLOT_SIZE = 64;
+
+// Allocate a read+write slot holding a code address within MAX_DISTANCE of
+// nearAddr, for code near it to jump through. Slots are packed into their own
+// non-executable pages.
+std::optional<std::uintptr_t> allocatePointer(std::uintptr_t nearAddr);
+
+// Return a pointer slot to the pool.
+void releasePointer(std::uintptr_t slot);
+
+}; // namespace Interject::Trampolines
@@ -15,22 +15,33 @@
  */
 
 #include "transaction.hxx"
+#include "code_writer.hxx"
 #include "disassembler.hxx"
+#include "membarrier.hxx"
 #include "memory_map.hxx"
 #include "patch.hxx"
 #include "scope_guard.hxx"
 #include "signal_action.hxx"
 #include "symbols.hxx"
 #include "threads.hxx"
+#include "trampolines.hxx"
 #include "unwind.hxx"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <format>
 #include <iostream>
+#include <mutex>
+#include <numeric>
 
+#include <sched.h>
 #include <signal.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 namespace Interject {
@@ -38,83 +49,598 @@ namespace Interject {
 std::size_t Transaction::_pageSize =
     static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
 
-Transaction::ResultCode Transaction::prepare() {
+// Keys that tell apart the code of retired trampolines and stubs serving the
+// same address. A trampoline's code follows from the instructions it
+// displaced, and a stub's from the address it jumps to.
+static std::vector<uint8_t> trampolineKey(std::span<const uint8_t> instrs) {
+  std::vector<uint8_t> key = {0};
+  key.insert(key.end(), instrs.begin(), instrs.end());
+  return key;
+}
+
+static std::vector<uint8_t> stubKey(std::uintptr_t dest) {
+  std::vector<uint8_t> key(1 + sizeof(dest), 1);
+  std::memcpy(key.data() + 1, &dest, sizeof(dest));
+  return key;
+}
+
+// Keep the trampoline and stub of the target at addr for reuse by a later
+// prepare of the same target. Either is 0 if the target has none.
+static void retireTarget(std::uintptr_t addr, std::span<const uint8_t> instrs,
+                         std::uintptr_t trampoline, std::uintptr_t stubSite,
+                         std::uintptr_t stubDest,
+                         std::uintptr_t stub) noexcept {
+  try {
+    if (trampoline != 0) {
+      Trampolines::retire(addr, trampolineKey(instrs), trampoline);
+    }
+    if (stub != 0) {
+      Trampolines::retire(stubSite, stubKey(stubDest), stub);
+    }
+  } catch (...) {
+    // Without room for the key the slots stay allocated and unused.
+  }
+}
+
+// Return true if the pad at padAddr recorded for the function at addr can be
+// patched without halting threads. The pad itself is only ever executed once
+// the entry jumps to it, so only the entry is required to be untouched NOPs.
+// The entry must be a single NOP covering the whole jump. A thread can stop
+// between two shorter NOPs, e.g. the one-byte NOPs GCC pads x86_64 entries
+// with, and would then resume in the middle of the jump.
+static bool isUsableEntryPad(std::uintptr_t addr, std::size_t size,
+                             std::uintptr_t padAddr) {
+  if (padAddr == 0 || padAddr >= addr ||
+      addr - padAddr < Patch::nearJumpSize() ||
+      size < Patch::shortJumpSize() ||
+      !Patch::createShortJump(addr, padAddr)) {
+    return false;
+  }
+
+#if defined(__x86_64__) || defined(_M_X64)
+  // The entry jump must be written by a single store within one cache line.
+  constexpr std::uintptr_t CACHE_LINE_SIZE = 64;
+  if ((addr & (CACHE_LINE_SIZE - 1)) + Patch::shortJumpSize() >
+      CACHE_LINE_SIZE) {
+    return false;
+  }
+#endif
+
+  const auto first = Disassembler::copyInstrs(addr, size, 1);
+  return first && first->size() >= Patch::shortJumpSize() &&
+         Disassembler::isNops(addr, first->size());
+}
+
+Transaction::ResultCode Transaction::prepareTargets() {
   if (_state != TxnInitialized) {
     return ErrorInvalidState;
   }
 
+#if !defined(__x86_64__) && !defined(_M_X64)
+  if (_engine == EngineBreakpoint) {
+    return ErrorNotImplemented;
+  }
+#endif
+
   std::vector<Symbols::Descriptor> descriptors(_names.size());
-  Symbols::lookup(_names, descriptors);
+  Symbols::lookup(_names, descriptors,
+                  [&](std::string_view obj_name, Stats::Duration elapsed) {
+                    auto &lookups = _stats.symbolLookup;
+                    const auto it = std::find_if(
+                        lookups.begin(), lookups.end(),
+                        [&](const auto &l) { return l.name == obj_name; });
+                    if (it != lookups.end()) {
+                      it->elapsed += elapsed;
+                    } else {
+                      lookups.push_back({std::string(obj_name), elapsed});
+                    }
+                  },
+                  _lookupExecutor);
+
+  // Entry pads and breakpoints can only be patched while threads run if every
+  // core can be made to observe the modified instructions.
+  const bool syncCore = Membarrier::registerSyncCore();
+  const bool useBreakpoints = syncCore && _engine == EngineBreakpoint;
+  std::vector<uintptr_t> padAddrs(_names.size());
+  if (syncCore) {
+    Symbols::findPatchableEntries(descriptors, padAddrs);
+  }
 
-  MemoryMap map;
-  if (!map.load()) {
-    std::cerr << "Failed loading memory map\n";
+  // Only the pages containing patch targets are of interest, so query them
+  // individually rather than loading the whole memory map.
+  const auto mapStart = std::chrono::steady_clock::now();
+  MemoryMapQuery map;
+  const bool mapOpened = map.open();
+  _stats.memoryMap += std::chrono::steady_clock::now() - mapStart;
+  if (!mapOpened) {
+    std::cerr << "Failed opening memory map\n";
     return ErrorUnexpected;
   }
 
-  std::unordered_map<uintptr_t, int> pagePermissions;
+  // A retargetable hook is reached through a jump that reads its slot, which
+  // is shorter than an absolute jump on x86_64.
+  const std::size_t hookJumpSize =
+      _retargetable ? Patch::jumpThroughSize() : Patch::jumpToSize();
+
+  // A halting target only needs its displaced instructions relocated into a
+  // trampoline if its original is called through one, either by the hook or
+  // once the target is disabled.
+  const auto needsTrampoline = [&](size_t idx) {
+    return _trampolineAddrs[idx] != nullptr || _retargetable;
+  };
+
+  std::vector<uintptr_t> pageAddrs;
   std::vector<std::vector<uint8_t>> origInstrs;
+  std::vector<PatchMode> modes(_names.size(), ModeHalting);
+  std::vector<EntryPad> entryPads(_names.size());
 
   for (size_t idx = 0; idx < _names.size(); idx++) {
-    auto descriptor = descriptors[idx];
+    const auto &descriptor = descriptors[idx];
+    const auto addr = descriptor.addr;
 
-    if (Patch::jumpToSize() > descriptor.size) {
-      std::cerr << std::format("function {} too small to patch ({} < {} bytes)\n", _names[idx], descriptor.size, Patch::jumpToSize());
-      return ErrorFunctionBodyTooSmall;
+    std::uintptr_t firstAddr = addr;
+    std::span<const uint8_t> instrs;
+    if (isUsableEntryPad(addr, descriptor.size, padAddrs[idx])) {
+      // Only the entry NOPs are replaced, and the pad before them is written.
+      modes[idx] = ModeEntryPad;
+      entryPads[idx].addr = padAddrs[idx];
+      firstAddr = padAddrs[idx];
+      instrs = std::span(reinterpret_cast<const uint8_t *>(addr),
+                         Patch::shortJumpSize());
+    } else if (useBreakpoints && addr != 0) {
+      // The breakpoint protocol is only safe when a single instruction is
+      // replaced, since no thread can be stopped part way through it.
+      const auto first = Disassembler::copyInstrs(addr, descriptor.size, 1);
+      if (first && first->size() >= Patch::nearJumpSize()) {
+        modes[idx] = ModeBreakpoint;
+        instrs = *first;
+      }
     }
 
-    const auto addr = descriptor.addr;
-    if (addr == 0) {
-      return ErrorSymbolNotFound;
-    }
+    if (modes[idx] == ModeHalting) {
+      if (hookJumpSize > descriptor.size) {
+        std::cerr << std::format("function {} too small to patch ({} < {} bytes)\n", _names[idx], descriptor.size, hookJumpSize);
+        return ErrorFunctionBodyTooSmall;
+      }
 
-    auto instrs = Disassembler::copyInstrs(descriptor.addr, descriptor.size,
-                                           Patch::jumpToSize());
-    if (!instrs) {
-      std::cerr << "Failed disassembling function\n";
-      return ErrorUnexpected;
+      if (addr == 0) {
+        return ErrorSymbolNotFound;
+      }
+
+      // Even without a trampoline the displaced instructions are copied, so
+      // functions that branch back into them are refused: a thread released
+      // after such a branch would land inside the jump.
+      auto copied = Disassembler::copyInstrs(descriptor.addr, descriptor.size,
+                                             hookJumpSize);
+      if (!copied) {
+        std::cerr << std::format("failed disassembling function {}\n", _names[idx]);
+        return ErrorUnsupportedInstructions;
+      }
+      instrs = *copied;
     }
 
-    origInstrs.emplace_back(std::vector<uint8_t>(instrs->begin(), instrs->end()));
+    origInstrs.emplace_back(std::vector<uint8_t>(instrs.begin(), instrs.end()));
 
+    // Only the pages holding the bytes that get overwritten need to be made
+    // writable, not every page of the function.
     const auto pageMask = ~(_pageSize - 1);
-    const auto firstPageAddr = addr & pageMask;
-    const auto lastPageAddr = (addr + descriptor.size - 1) & pageMask;
+    const auto firstPageAddr = firstAddr & pageMask;
+    const auto lastPageAddr = (addr + instrs.size() - 1) & pageMask;
 
     for (auto pageAddr = firstPageAddr; pageAddr <= lastPageAddr; pageAddr += _pageSize) {
-      if (pagePermissions.find(pageAddr) != pagePermissions.end()) {
-        continue;
+      pageAddrs.push_back(pageAddr);
+    }
+
+  }
+
+  // Allocate a trampoline for each target near the target itself and fill it
+  // with the overwritten instructions followed by a jump back to the rest of
+  // the original function. This happens here rather than in commit() so no
+  // memory is allocated while threads are halted.
+  std::vector<uintptr_t> trampolines(_names.size());
+  std::vector<uintptr_t> stubs(_names.size());
+  std::vector<uintptr_t> slots(_names.size());
+
+  // Where the stub of a target jumps to, and where it is jumped to from.
+  const auto stubDest = [&](size_t idx) {
+    return slots[idx] != 0 ? slots[idx] : _hooks[idx];
+  };
+  const auto stubSite = [&](size_t idx) {
+    return modes[idx] == ModeEntryPad ? entryPads[idx].addr
+                                      : descriptors[idx].addr;
+  };
+
+  // Trampolines and stubs are only recorded once their code is in place, and
+  // are then retired rather than released since they may have been reused.
+  auto trampolinesGuard = ScopeGuard::create([&]() {
+    for (size_t idx = 0; idx < trampolines.size(); idx++) {
+      retireTarget(descriptors[idx].addr, origInstrs[idx], trampolines[idx],
+                   stubSite(idx), stubDest(idx), stubs[idx]);
+    }
+    for (const auto slot : slots) {
+      if (slot != 0) {
+        Trampolines::releasePointer(slot);
       }
+    }
+  });
 
-      const auto region = map.find(pageAddr);
-      if (!region) {
-        return ErrorSymbolNotFound;
+  // Each retargetable hook gets a slot near its target holding the hook
+  // address.
+  for (size_t idx = 0; _retargetable && idx < _names.size(); idx++) {
+    const auto slot = Trampolines::allocatePointer(descriptors[idx].addr);
+    if (!slot) {
+      std::cerr << std::format("failed allocating slot for {}\n",
+                               _names[idx]);
+      return ErrorTrampolineAllocationFailure;
+    }
+    slots[idx] = *slot;
+    __atomic_store_n(reinterpret_cast<std::uintptr_t *>(*slot), _hooks[idx],
+                     __ATOMIC_RELEASE);
+  }
+
+  // Create a jump at from straight to the hook, or through its slot.
+  const auto createDirectJump =
+      [&](size_t idx,
+          std::uintptr_t from) -> std::optional<std::vector<uint8_t>> {
+    if (slots[idx] != 0) {
+      const auto jump = Patch::createJumpThrough(from, slots[idx]);
+      if (!jump) {
+        return std::nullopt;
+      }
+      return std::vector<uint8_t>(jump->begin(), jump->end());
+    }
+    const auto jump = Patch::createJumpTo(_hooks[idx]);
+    return std::vector<uint8_t>(jump.begin(), jump.end());
+  };
+
+  // Create a jump to the hook that fits in size bytes at addr: a direct jump
+  // if there is room, otherwise a near jump, through a stub if the hook is out
+  // of range or must be reached through its slot.
+  const auto createHookJump =
+      [&](size_t idx, std::uintptr_t addr,
+          std::size_t size) -> std::optional<std::vector<uint8_t>> {
+    if (size >= hookJumpSize) {
+      return createDirectJump(idx, addr);
+    }
+
+    std::optional<std::array<uint8_t, Patch::nearJumpSize()>> jump;
+    if (slots[idx] == 0) {
+      jump = Patch::createNearJump(addr, _hooks[idx]);
+    }
+    if (!jump) {
+      auto stub = Trampolines::reuse(addr, stubKey(stubDest(idx)));
+      if (!stub) {
+        stub = Trampolines::allocate(addr);
+        if (!stub) {
+          return std::nullopt;
+        }
+        const auto stubJump = createDirectJump(idx, *stub);
+        if (!stubJump || !Trampolines::write(*stub, *stubJump)) {
+          Trampolines::release(*stub);
+          return std::nullopt;
+        }
+      }
+      stubs[idx] = *stub;
+      jump = Patch::createNearJump(addr, *stub);
+    }
+    return std::vector<uint8_t>(jump->begin(), jump->end());
+  };
+
+  std::vector<uintptr_t> originals(_names.size());
+  std::vector<std::vector<uint8_t>> patchInstrs(_names.size());
+  std::vector<BreakpointSite> breakpointSites;
+  for (size_t idx = 0; idx < _names.size(); idx++) {
+    const auto addr = descriptors[idx].addr;
+    const auto &instrs = origInstrs[idx];
+
+    if (auto &pad = entryPads[idx]; modes[idx] == ModeEntryPad) {
+      auto jump = createHookJump(idx, pad.addr, addr - pad.addr);
+      if (!jump) {
+        std::cerr << std::format("failed allocating stub for {}\n",
+                                 _names[idx]);
+        return ErrorTrampolineAllocationFailure;
+      }
+      pad.code = std::move(*jump);
+
+      const auto entryJump = Patch::createShortJump(addr, pad.addr);
+      patchInstrs[idx].assign(entryJump->begin(), entryJump->end());
+
+      // The entry NOPs do nothing, so the original function is called by
+      // jumping past them.
+      originals[idx] = addr + Patch::shortJumpSize();
+      continue;
+    }
+
+    // Halting targets always have room for a direct jump.
+    auto jump = createHookJump(idx, addr, instrs.size());
+    if (!jump) {
+      std::cerr << std::format("failed allocating stub for {}\n",
+                               _names[idx]);
+      return ErrorTrampolineAllocationFailure;
+    }
+    patchInstrs[idx] = std::move(*jump);
+    if (modes[idx] == ModeHalting && !needsTrampoline(idx)) {
+      continue;
+    }
+
+    // A trampoline retired by an earlier rollback of the same target already
+    // holds the code that would be written.
+    auto trampoline = Trampolines::reuse(addr, trampolineKey(instrs));
+    if (!trampoline) {
+      trampoline = Trampolines::allocate(addr);
+      if (!trampoline) {
+        std::cerr << std::format("failed allocating trampoline for {}\n",
+                                 _names[idx]);
+        return ErrorTrampolineAllocationFailure;
+      }
+      bool written = false;
+      const auto trampolineGuard = ScopeGuard::create([&]() {
+        if (!written) {
+          Trampolines::release(*trampoline);
+        }
+      });
+
+      std::array<uint8_t, Trampolines::SLOT_SIZE> code;
+      const auto resume = Patch::createResumeAt(addr + instrs.size());
+      const auto codeSize = Disassembler::relocateInstrs(
+          addr, instrs, *trampoline,
+          std::span(code).first(code.size() - resume.size()));
+      if (!codeSize) {
+        std::cerr << std::format("failed relocating instructions of {}\n",
+                                 _names[idx]);
+        return ErrorUnsupportedInstructions;
+      }
+      std::copy(resume.begin(), resume.end(), code.begin() + *codeSize);
+
+      if (!Trampolines::write(
+              *trampoline, std::span(code).first(*codeSize + resume.size()))) {
+        std::cerr << std::format("failed writing trampoline for {}\n",
+                                 _names[idx]);
+        return ErrorTrampolineAllocationFailure;
       }
+      written = true;
+    }
+    trampolines[idx] = *trampoline;
+    originals[idx] = *trampoline;
+
+    if (modes[idx] == ModeBreakpoint) {
+      breakpointSites.push_back({addr, _hooks[idx], *trampoline});
+    }
+  }
 
-      pagePermissions[pageAddr] = region->permissions;
+  // Resolve the permissions of every page in address order so consecutive
+  // pages in the same region are answered by a single query.
+  std::sort(pageAddrs.begin(), pageAddrs.end());
+  pageAddrs.erase(std::unique(pageAddrs.begin(), pageAddrs.end()),
+                  pageAddrs.end());
+
+  // Coalesce contiguous pages with identical permissions into ranges so any
+  // mprotect fallback issues one call per range rather than one per page.
+  std::vector<CodeWriter::PageRange> pageRanges;
+  for (const auto pageAddr : pageAddrs) {
+    const auto findStart = std::chrono::steady_clock::now();
+    const auto region = map.find(pageAddr);
+    _stats.memoryMap += std::chrono::steady_clock::now() - findStart;
+    if (!region) {
+      return ErrorSymbolNotFound;
     }
 
-    // TODO: allocate trampoline and copy minimal instruction sequence from
-    // the target function to the trampoline location.
+    if (!pageRanges.empty()) {
+      auto &last = pageRanges.back();
+      if (last.start + last.size == pageAddr &&
+          last.permissions == region->permissions) {
+        last.size += _pageSize;
+        continue;
+      }
+    }
+    pageRanges.push_back({pageAddr, _pageSize, region->permissions});
   }
 
   _state = TxnPrepared;
   _descriptors = std::move(descriptors);
-  _pagePermissions = std::move(pagePermissions);
+  _pageRanges = std::move(pageRanges);
   _origInstrs = std::move(origInstrs);
+  _patchInstrs = std::move(patchInstrs);
+  _modes = std::move(modes);
+  _entryPads = std::move(entryPads);
+  _breakpointSites = std::move(breakpointSites);
+  _originals = std::move(originals);
+  _trampolines = std::move(trampolines);
+  trampolines.clear();
+  _stubs = std::move(stubs);
+  stubs.clear();
+  _slots = std::move(slots);
+  slots.clear();
   return Success;
 }
 
+Transaction::~Transaction() {
+  // Trampolines of a committed transaction remain reachable from the hooks
+  // that are still installed, so they are intentionally never freed.
+  if (_state == TxnPrepared) {
+    retireTrampolines();
+    releaseSlots();
+  }
+}
+
+void Transaction::retireTrampolines() noexcept {
+  // Cleared rather than erased so they stay aligned with the targets.
+  for (size_t idx = 0; idx < _trampolines.size(); idx++) {
+    const auto addr = _descriptors[idx].addr;
+    retireTarget(addr, _origInstrs[idx], _trampolines[idx],
+                 _modes[idx] == ModeEntryPad ? _entryPads[idx].addr : addr,
+                 _slots[idx] != 0 ? _slots[idx] : _hooks[idx], _stubs[idx]);
+    _trampolines[idx] = 0;
+    _stubs[idx] = 0;
+  }
+}
+
+void Transaction::releaseSlots() noexcept {
+  // Cleared rather than erased so the slots stay aligned with the targets.
+  for (auto &slot : _slots) {
+    if (slot != 0) {
+      Trampolines::releasePointer(slot);
+      slot = 0;
+    }
+  }
+}
+
+// The program counter a signal handler returns to.
+static std::uintptr_t interruptedPc(const ucontext_t &context) noexcept {
+#if defined(__x86_64__)
+  return context.uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+  return context.uc_mcontext.pc;
+#endif
+}
+
+static void setInterruptedPc(ucontext_t &context, std::uintptr_t pc) noexcept {
+#if defined(__x86_64__)
+  context.uc_mcontext.gregs[REG_RIP] = pc;
+#elif defined(__aarch64__)
+  context.uc_mcontext.pc = pc;
+#endif
+}
+
+// Pass a signal on to the action that was installed before ours.
+static void chainSignal(const struct sigaction *action, int signal,
+                        siginfo_t *info, void *context) noexcept {
+  if (action != nullptr && (action->sa_flags & SA_SIGINFO) != 0) {
+    if (action->sa_sigaction != nullptr) {
+      action->sa_sigaction(signal, info, context);
+    }
+  } else if (action == nullptr || action->sa_handler == SIG_DFL) {
+    // Take the default action, which ends the process, once this handler
+    // returns and the signal is unblocked.
+    struct sigaction defaultAction = {};
+    defaultAction.sa_handler = SIG_DFL;
+    ::sigaction(signal, &defaultAction, nullptr);
+    ::raise(signal);
+  } else if (action->sa_handler != SIG_IGN) {
+    action->sa_handler(signal);
+  }
+}
+
+Transaction::HaltState *Transaction::_activeHalt = nullptr;
+unsigned Transaction::_haltHandlers = 0;
+std::uint32_t Transaction::_haltGeneration = 0;
+const struct sigaction *Transaction::_previousHaltAction = nullptr;
+
+bool Transaction::installHaltHandler() noexcept {
+  // The handler stays installed for the life of the process, since a thread
+  // can take a signal long after the halt that sent it failed, e.g. once it
+  // unblocks SIGUSR1. Signals that are not ours go to the action it replaced.
+  static SignalAction *action = []() {
+    auto action =
+        new SignalAction(SIGUSR1, backtraceHandler, SA_SIGINFO | SA_RESTART);
+    if (!action->failed()) {
+      __atomic_store_n(&_previousHaltAction, &action->original(),
+                       __ATOMIC_RELEASE);
+    }
+    return action;
+  }();
+  return !action->failed();
+}
+
+// A halt signal carries a tag rather than a pointer: a magic value in the top
+// 16 bits, the generation of the halt in the next 24 and the index of its
+// control block in the low 24. No user space pointer has those top bits set,
+// so a pointer the application queues with SIGUSR1 is never taken for one.
+static constexpr std::uintptr_t haltTagMagic = 0x4A54;
+static constexpr std::uint32_t haltTagMask = (1u << 24) - 1;
+
+static std::uintptr_t haltTag(std::uint32_t generation,
+                              std::size_t idx) noexcept {
+  return (haltTagMagic << 48) |
+         (static_cast<std::uintptr_t>(generation & haltTagMask) << 24) |
+         (idx & haltTagMask);
+}
+
+bool Transaction::isHaltSignal(const siginfo_t &info,
+                               std::uint32_t &generation,
+                               std::size_t &idx) noexcept {
+  if (info.si_code != SI_QUEUE || info.si_pid != ::getpid()) {
+    return false;
+  }
+
+  const auto tag = reinterpret_cast<std::uintptr_t>(info.si_value.sival_ptr);
+  if ((tag >> 48) != haltTagMagic) {
+    return false;
+  }
+  generation = (tag >> 24) & haltTagMask;
+  idx = tag & haltTagMask;
+
+  // Only the generations of the last recentHalts halts are ours. A signal
+  // stays pending at most until its thread unblocks SIGUSR1, so anything
+  // older was queued by someone else.
+  const std::uint32_t current =
+      __atomic_load_n(&_haltGeneration, __ATOMIC_ACQUIRE);
+  return generation != 0 &&
+         ((current - generation) & haltTagMask) < recentHalts;
+}
+
+Transaction::ThreadControlBlock *
+Transaction::haltControlBlock(const siginfo_t &info) noexcept {
+  std::uint32_t generation;
+  std::size_t idx;
+  if (!isHaltSignal(info, generation, idx)) {
+    return nullptr;
+  }
+
+  const auto halt = __atomic_load_n(&_activeHalt, __ATOMIC_SEQ_CST);
+  if (halt == nullptr) {
+    return nullptr;
+  }
+
+  ThreadControlBlock *controlBlock = nullptr;
+  if (generation == halt->generation && idx < halt->controlBlocks.size()) {
+    controlBlock = &halt->controlBlocks[idx];
+  } else {
+    // Pending instances of a standard signal coalesce, so a signal left
+    // pending by an earlier halt stands in for the one this halt sent the
+    // same thread.
+    const pid_t tid = ::gettid();
+    for (auto &block : halt->controlBlocks) {
+      if (__atomic_load_n(&block.tid, __ATOMIC_ACQUIRE) == tid &&
+          __atomic_load_n(&block.signalled, __ATOMIC_ACQUIRE) != 0) {
+        controlBlock = &block;
+        break;
+      }
+    }
+  }
+
+  // A signal whose halt already heard from the thread is a duplicate.
+  if (controlBlock == nullptr ||
+      __atomic_load_n(&controlBlock->acknowledged, __ATOMIC_ACQUIRE)) {
+    return nullptr;
+  }
+  return controlBlock;
+}
+
 void Transaction::backtraceHandler(int signal, siginfo_t *info,
                                    void *context) noexcept {
   const pid_t tid = ::gettid();
-  if (info->si_signo != SIGUSR1) {
-    // Received an unexpected signal. This should never happen.
+
+  // The signaller waits for every handler to stop reading the active halt
+  // before it frees the control blocks.
+  __atomic_add_fetch(&_haltHandlers, 1, __ATOMIC_SEQ_CST);
+  ThreadControlBlock *controlBlock = haltControlBlock(*info);
+  if (controlBlock == nullptr) {
+    __atomic_sub_fetch(&_haltHandlers, 1, __ATOMIC_SEQ_CST);
+
+    // A signal left pending by a halt that failed is dropped. Any other is
+    // not ours.
+    std::uint32_t generation;
+    std::size_t idx;
+    if (!isHaltSignal(*info, generation, idx)) {
+      chainSignal(__atomic_load_n(&_previousHaltAction, __ATOMIC_ACQUIRE),
+                  signal, info, context);
+    }
     return;
   }
 
-  ThreadControlBlock *controlBlock =
-      reinterpret_cast<ThreadControlBlock *>(info->si_value.sival_ptr);
+  const std::uint32_t signalled =
+      __atomic_load_n(&controlBlock->signalled, __ATOMIC_ACQUIRE);
   const pid_t targetTid = __atomic_load_n(&controlBlock->tid, __ATOMIC_ACQUIRE);
   __atomic_store_n(&controlBlock->tid, tid, __ATOMIC_RELEASE);
   if (targetTid != tid) {
@@ -124,11 +650,31 @@ void Transaction::backtraceHandler(int signal, siginfo_t *info,
     // and don't block before returning. The signaller is responsible for
     // checking the memoized tid against the tid it expected to run the handler
     // and to retry if necessary.
-    controlBlock->handlerWork.Set();
+    controlBlock->acknowledgeTime = std::chrono::steady_clock::now();
+    acknowledge(*controlBlock);
+    __atomic_sub_fetch(&_haltHandlers, 1, __ATOMIC_SEQ_CST);
     return;
   }
 
-  const size_t frameCount = Unwind::backtrace(std::span(controlBlock->frames));
+  // Only the interrupted PC and a return address not yet saved in a frame can
+  // be inside a patch target unless a displaced instruction is a call, so the
+  // stack is rarely unwound.
+  const auto frames = std::span(controlBlock->frames);
+  auto &interrupted = *reinterpret_cast<ucontext_t *>(context);
+  controlBlock->pc = interruptedPc(interrupted);
+  size_t frameCount = 0;
+  switch (controlBlock->check) {
+  case HaltCheckContext:
+    frameCount = Unwind::fromContext(interrupted, frames);
+    break;
+  case HaltCheckFramePointers:
+    frameCount = Unwind::fromContext(interrupted, frames,
+                                     ThreadControlBlock::MAX_FRAME_POINTERS);
+    break;
+  case HaltCheckBacktrace:
+    frameCount = Unwind::backtrace(frames);
+    break;
+  }
   for (size_t idx = 0; idx < frameCount; idx++) {
     // Force memory barrier on all of the stack frames to ensure they can be
     // properly ready by the signaller.
@@ -136,42 +682,41 @@ void Transaction::backtraceHandler(int signal, siginfo_t *info,
     __atomic_store_n(&controlBlock->frames[idx], frame, __ATOMIC_RELEASE);
   }
   __atomic_store_n(&controlBlock->frameCount, frameCount, __ATOMIC_RELEASE);
-  controlBlock->handlerExit.Reset();
-  controlBlock->handlerWork
-      .Set(); // let the signaller know we're done capturing backtrace
-  controlBlock->handlerExit
-      .Wait(); // wait for the signaller to release us before returning
-}
-
-Transaction::ResultCode Transaction::preparePagesForWrite() const noexcept {
-  for (const auto &pair : _pagePermissions) {
-    const int prot = pair.second | PROT_WRITE;
-    if (::mprotect(reinterpret_cast<void *>(pair.first), _pageSize, prot) !=
-        0) {
-      std::cerr << "failed setting PROT_EXEC on page starting at 0x" << std::hex
-                << pair.first << std::endl;
-      return ErrorMemoryProtectionFailure;
+  controlBlock->acknowledgeTime = std::chrono::steady_clock::now();
+  acknowledge(*controlBlock); // let the signaller know we're done capturing
+
+  // Wait for the signaller to release us before returning. Every halted thread
+  // sleeps on the same generation, so releasing all of them takes a single
+  // wake. Threads woken while still held go back to sleep.
+  Generation &releases = *controlBlock->releases;
+  for (;;) {
+    const std::uint32_t generation = releases.Current();
+    const std::uint32_t released =
+        __atomic_load_n(&controlBlock->released, __ATOMIC_ACQUIRE);
+    if (static_cast<std::int32_t>(released - signalled) >= 0) {
+      break;
     }
+    releases.WaitPast(generation);
   }
-  return Success;
-}
 
-Transaction::ResultCode Transaction::restorePagePermissions() const noexcept {
-  for (const auto &pair : _pagePermissions) {
-    if (::mprotect(reinterpret_cast<void *>(pair.first), _pageSize,
-                   pair.second) != 0) {
-      std::cerr << "failed to restore permissions on page starting at 0x"
-                << std::hex << pair.first << std::endl;
-      return ErrorMemoryProtectionFailure;
-    }
+  // The signaller may have moved us out of a target instead of retrying.
+  if (controlBlock->resumeAt != 0) {
+    setInterruptedPc(interrupted, controlBlock->resumeAt);
   }
-  return Success;
+
+  // The signaller may free the control block as soon as this is observed, so
+  // it must be the last access.
+  __atomic_sub_fetch(&_haltHandlers, 1, __ATOMIC_SEQ_CST);
 }
 
 bool Transaction::isPatchTarget(std::uintptr_t addr) const noexcept {
-  const std::size_t patchSize = Patch::jumpToSize();
-  for (auto &descriptor : _descriptors) {
-    if (addr < descriptor.addr || addr >= descriptor.addr + patchSize) {
+  for (size_t idx = 0; idx < _descriptors.size(); idx++) {
+    const auto &descriptor = _descriptors[idx];
+    if (_modes[idx] != ModeHalting) {
+      continue; // patched without halting threads
+    }
+    if (addr < descriptor.addr ||
+        addr >= descriptor.addr + _patchInstrs[idx].size()) {
       continue;
     }
     return true;
@@ -179,177 +724,1355 @@ bool Transaction::isPatchTarget(std::uintptr_t addr) const noexcept {
   return false;
 }
 
-Transaction::ResultCode Transaction::haltThread(
-    pid_t targetTid,
-    Transaction::ThreadControlBlock &controlBlock) const noexcept {
-  size_t retryWaitUs = 1;
-  struct timespec timeout = {.tv_sec = 1};
-
-  SignalAction action(SIGUSR1, backtraceHandler, SA_SIGINFO);
-  if (action.failed()) {
-    return ErrorSignalActionFailure;
+std::optional<std::uintptr_t>
+Transaction::resumeAt(PatchCommand command, std::uintptr_t pc) const noexcept {
+  if (!_relocateThreads) {
+    return std::nullopt;
   }
 
-  const union sigval sigval = {.sival_ptr = &controlBlock};
-
-  for (;;) {
-    __atomic_store_n(&controlBlock.tid, targetTid, __ATOMIC_RELEASE);
-    controlBlock.handlerWork.Reset();
+  for (size_t idx = 0; idx < _descriptors.size(); idx++) {
+    if (_modes[idx] != ModeHalting) {
+      continue;
+    }
 
-    if (::sigqueue(targetTid, SIGUSR1, sigval) == -1) {
-      std::cerr << std::format("failed to signal tid:{:#x} errno:{} ({})\n",
-                               targetTid, errno, ::strerror(errno));
-      return ErrorSignalActionFailure;
+    // Trampolines are never freed once live, so a thread running one is left
+    // there; it jumps back to an instruction of the restored target.
+    const auto addr = _descriptors[idx].addr;
+    const auto &instrs = _origInstrs[idx];
+    const auto trampoline = _trampolines[idx];
+    if (pc < addr || pc >= addr + _patchInstrs[idx].size()) {
+      continue;
     }
 
-    if (!controlBlock.handlerWork.Wait(&timeout)) {
-      std::cerr << std::format(
-          "timed out waiting for tid:{:#x} to be signalled\n", targetTid);
-      return ErrorTimedOut;
+    // Nothing at the entry has run yet, and a whole instruction starts there
+    // before and after patching.
+    if (pc == addr) {
+      return pc;
     }
 
-    const pid_t actualTid =
-        __atomic_load_n(&controlBlock.tid, __ATOMIC_ACQUIRE);
+    // The instructions of a hook's jump have no equivalent in the original,
+    // and a target without a trampoline has nowhere else to run them.
+    if (command != Apply || trampoline == 0) {
+      return std::nullopt;
+    }
 
-    // If the handler ran on a different thread than we expected (most likely
-    // on this thread), the handler exited without capturing a backtrace. In
-    // this situation we need to retry.
-    bool needRetry = actualTid != targetTid;
-    for (size_t jdx = 0; !needRetry && jdx < controlBlock.frameCount; jdx++) {
-      const auto frame =
-          __atomic_load_n(&controlBlock.frames[jdx], __ATOMIC_ACQUIRE);
-      needRetry = isPatchTarget(reinterpret_cast<uintptr_t>(frame));
+    const auto offset = Disassembler::relocatedOffset(instrs, pc - addr);
+    if (!offset) {
+      return std::nullopt;
     }
+    return trampoline + *offset;
+  }
+  return std::nullopt;
+}
 
-    if (!needRetry) {
-      // The thread is not executing in a target instruction sequence and is
-      // halted in the signal handler.
-      break;
+bool Transaction::isPatchTarget(Batch txns, std::uintptr_t addr) noexcept {
+  return std::any_of(txns.begin(), txns.end(), [addr](const auto txn) {
+    return txn->isPatchTarget(addr);
+  });
+}
+
+bool Transaction::hasHaltingTargets() const noexcept {
+  return std::find(_modes.begin(), _modes.end(), ModeHalting) != _modes.end();
+}
+
+Transaction::HaltCheck Transaction::haltCheck(Batch txns) noexcept {
+  HaltCheck check = HaltCheckContext;
+  for (const auto *txn : txns) {
+    check = std::max(check, txn->_haltCheck);
+    for (size_t idx = 0; idx < txn->_origInstrs.size(); idx++) {
+      if (txn->_modes[idx] == ModeHalting &&
+          Disassembler::containsCalls(txn->_origInstrs[idx])) {
+        return HaltCheckBacktrace;
+      }
     }
+  }
+  return check;
+}
 
-    // Let the handler exit immediately so we can signal it again and try to
-    // capture it executing in a different location.
-    controlBlock.handlerExit.Set();
+bool Transaction::hasConflicts(Batch txns) {
+  // The bytes each target's patch overwrites, tagged with the transaction
+  // that writes them.
+  struct Written {
+    std::uintptr_t start;
+    std::uintptr_t end;
+    std::size_t txn;
+  };
 
-    // Expontntial backoff (up to 1s) on retry to give the handler a chance
-    // to exit and the thread a chance to run past the patch target
-    // instructions.
-    if (retryWaitUs > 1000000) {
-      return ErrorTimedOut;
+  std::vector<Written> written;
+  for (size_t txn = 0; txn < txns.size(); txn++) {
+    for (size_t idx = 0; idx < txns[txn]->_descriptors.size(); idx++) {
+      const auto [start, end] = txns[txn]->patchedBytes(idx);
+      written.push_back({start, end, txn});
     }
+  }
 
-    ::usleep(retryWaitUs);
-    retryWaitUs <<= 1;
+  std::sort(written.begin(), written.end(),
+            [](const auto &a, const auto &b) { return a.start < b.start; });
+
+  // Track the furthest write so far so a long patch overlapping several later
+  // ones is caught too.
+  for (size_t idx = 1, furthest = 0; idx < written.size(); idx++) {
+    const auto &prev = written[furthest];
+    const auto &next = written[idx];
+    if (next.start < prev.end && next.txn != prev.txn) {
+      std::cerr << std::format(
+          "transactions {} and {} both patch code at {:#x}\n", prev.txn,
+          next.txn, next.start);
+      return true;
+    }
+    if (next.end > prev.end) {
+      furthest = idx;
+    }
   }
+  return false;
+}
 
-  return Success;
+std::pair<std::uintptr_t, std::uintptr_t>
+Transaction::patchedBytes(std::size_t idx) const noexcept {
+  const auto addr = _descriptors[idx].addr;
+  const auto end = addr + _patchInstrs[idx].size();
+  return {_modes[idx] == ModeEntryPad ? _entryPads[idx].addr : addr, end};
 }
 
-Transaction::ResultCode Transaction::patch(PatchCommand command) {
-  // First, prepare the first page of every hooked function to be writable so
-  // we can overwrite the first few instructions with a jump to the replacement
-  // function.
-  ResultCode result = preparePagesForWrite();
-  if (result != Success) {
-    return result;
+std::vector<CodeWriter::PageRange> Transaction::targetPageRanges(
+    std::span<const CodeWriter::PageRange> known) const {
+  const auto pageMask = ~(_pageSize - 1);
+  std::vector<std::uintptr_t> pageAddrs;
+  for (size_t idx = 0; idx < _descriptors.size(); idx++) {
+    const auto [start, end] = patchedBytes(idx);
+    for (auto pageAddr = start & pageMask; pageAddr <= ((end - 1) & pageMask);
+         pageAddr += _pageSize) {
+      pageAddrs.push_back(pageAddr);
+    }
   }
+  std::sort(pageAddrs.begin(), pageAddrs.end());
+  pageAddrs.erase(std::unique(pageAddrs.begin(), pageAddrs.end()),
+                  pageAddrs.end());
 
-  // Ensure the original page permissions are unconditionally restored on
-  // success or failure.
-  const auto pagePermissionsGuard =
-      ScopeGuard::create([&]() { (void)restorePagePermissions(); });
-
-  // We have to do a bit of a complex dance when patching the target instruction
-  // sequence with a new instruction sequence. The primary issue is that any
-  // other thread in the process may be concurrently executing the target
-  // instruction sequence, and modifying it mid-execution will result in
-  // undefined behavior.
-  //
-  // The solution is to interrupt every other thread in the process with a
-  // user-defined signal and custom signal handler. The signal handler captures
-  // a backtrace which is used to determine if the thread is executing within a
-  // target instruction sequence. The handler then prevents the thread from
-  // resuming until patches are applied. In the (unlikely) case that a thread IS
-  // concurrently executing in a target instruction sequence, we exit the signal
-  // handler to resume thread execution, sleep briefly, and try again.
+  std::vector<CodeWriter::PageRange> ranges;
+  for (const auto pageAddr : pageAddrs) {
+    // known is sorted and its ranges do not overlap.
+    auto it = std::upper_bound(
+        known.begin(), known.end(), pageAddr,
+        [](std::uintptr_t addr, const auto &range) {
+          return addr < range.start;
+        });
+    if (it == known.begin() || pageAddr >= (it - 1)->start + (it - 1)->size) {
+      continue;
+    }
+    const int permissions = (it - 1)->permissions;
 
-  // TODO: there is still a race condition where threads created after capturing
-  // this thread snapshot will not be accounted for. While unlikely to cause a
-  // problem in practice, we need to handle this case to be completely correct.
-  std::optional<std::vector<pid_t>> threadSnapshot = Threads::all();
-  if (!threadSnapshot) {
-    std::cerr << "failed enumerating all threads" << std::endl;
-    return ErrorUnexpected;
+    if (!ranges.empty()) {
+      auto &last = ranges.back();
+      if (last.start + last.size == pageAddr &&
+          last.permissions == permissions) {
+        last.size += _pageSize;
+        continue;
+      }
+    }
+    ranges.push_back({pageAddr, _pageSize, permissions});
   }
+  return ranges;
+}
 
-  // Now that we know how many threads we have, dynamically allocate a vector
-  // of control structures, one for each thread. We preallocate here to avoid
-  // heap allocations while halting threads.
-  std::vector<ThreadControlBlock> threadControlBlocks(threadSnapshot->size());
+std::vector<CodeWriter::PageRange> Transaction::mergePageRanges(Batch txns) {
+  std::vector<CodeWriter::PageRange> ranges;
+  for (const auto txn : txns) {
+    ranges.insert(ranges.end(), txn->_pageRanges.begin(),
+                  txn->_pageRanges.end());
+  }
+  std::sort(ranges.begin(), ranges.end(),
+            [](const auto &a, const auto &b) { return a.start < b.start; });
 
-  // Unconditionally set all thread exit events on success or failure to ensure
-  // any interruped threads exit their signal handlers and resume.
-  const auto threadReleaseGuard = ScopeGuard::create([&]() {
-    for (auto &controlBlock : threadControlBlocks) {
-      controlBlock.handlerExit.Set();
+  // Transactions may share pages. Coalesce overlapping and contiguous ranges
+  // with identical permissions so the writer still issues one mprotect call
+  // per range if it falls back to changing protections.
+  std::vector<CodeWriter::PageRange> merged;
+  for (const auto &range : ranges) {
+    if (!merged.empty()) {
+      auto &last = merged.back();
+      const auto lastEnd = last.start + last.size;
+      if (range.start <= lastEnd && last.permissions == range.permissions) {
+        last.size = std::max(lastEnd, range.start + range.size) - last.start;
+        continue;
+      }
     }
-  });
+    merged.push_back(range);
+  }
+  return merged;
+}
 
-  // Iterate over the thread list halting each thread and ensuring it is not
-  // executing a target instruction sequence.
-  //
-  // Once we start halting threads, we need to take care to not perform any
-  // operation that could deadlock. For example, a thread could be halted mid
-  // resource acquisition while holding a mutex. If we attempt an operation that
-  // acquires the same mutex on the current thread, we'll deadlock. Allocating
-  // from the heap is one such example so we even avoid heap allocations.
-  for (size_t idx = 0; idx < threadSnapshot->size(); idx++) {
-    const pid_t targetTid = (*threadSnapshot)[idx];
-    if (targetTid == ::gettid()) {
-      // Skip the current thread to avoid deadlock. We know it isn't executing
-      // the target code so this is fine.
-      continue;
-    }
+Transaction::ResultCode Transaction::signalThread(
+    pid_t targetTid, Transaction::ThreadControlBlock &controlBlock) noexcept {
+  __atomic_store_n(&controlBlock.tid, targetTid, __ATOMIC_RELEASE);
+  __atomic_store_n(&controlBlock.acknowledged, false, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&controlBlock.signalled, 1, __ATOMIC_RELEASE);
+  controlBlock.signalTime = std::chrono::steady_clock::now();
 
-    result = haltThread(targetTid, threadControlBlocks[idx]);
-    if (result != Success) {
-      return result;
+  // sigqueue() sends a process-directed signal which may be delivered to any
+  // thread, and pending instances of a standard signal coalesce. Since every
+  // thread is signalled at once, direct the signal at the target thread so
+  // each one is guaranteed its own delivery.
+  siginfo_t info = {};
+  info.si_signo = SIGUSR1;
+  info.si_code = SI_QUEUE;
+  info.si_pid = ::getpid();
+  info.si_uid = ::getuid();
+  // Name the halt and the control block rather than pointing at it, since the
+  // signal may only be delivered once the block is gone.
+  const auto halt = _activeHalt;
+  const std::uintptr_t idx = &controlBlock - halt->controlBlocks.data();
+  info.si_value.sival_ptr =
+      reinterpret_cast<void *>(haltTag(halt->generation, idx));
+
+  if (::syscall(SYS_rt_tgsigqueueinfo, ::getpid(), targetTid, SIGUSR1,
+                &info) == -1) {
+    if (errno == ESRCH) {
+      // The thread exited after it was enumerated. Clear the tid so the
+      // signaller knows not to wait for it.
+      __atomic_store_n(&controlBlock.tid, 0, __ATOMIC_RELEASE);
+      acknowledge(controlBlock);
+      return Success;
     }
+
+    std::cerr << std::format("failed to signal tid:{:#x} errno:{} ({})\n",
+                             targetTid, errno, ::strerror(errno));
+    return ErrorSignalActionFailure;
   }
 
-  // Patch each function with jump to hook location.
-  for (size_t idx = 0; idx < _descriptors.size(); idx++) {
-    const auto &descriptor = _descriptors[idx];
-    const auto targetAddr = reinterpret_cast<char*>(descriptor.addr);
-    const uintptr_t hookAddr = _hooks[idx];
+  return Success;
+}
+
+bool Transaction::acknowledge(
+    Transaction::ThreadControlBlock &controlBlock) noexcept {
+  if (__atomic_exchange_n(&controlBlock.acknowledged, true,
+                          __ATOMIC_ACQ_REL)) {
+    return false;
+  }
+  controlBlock.acknowledgements->CountDown();
+  return true;
+}
 
-    if (command == Apply) {
-      // Generate an instruction sequence that jumps to the hook address to
-      // patch over the existing function.
-      auto instrBytes = Patch::createJumpTo(hookAddr);
+void Transaction::release(
+    Transaction::ThreadControlBlock &controlBlock) noexcept {
+  // Takes effect once the shared generation advances.
+  const std::uint32_t signalled =
+      __atomic_load_n(&controlBlock.signalled, __ATOMIC_RELAXED);
+  __atomic_store_n(&controlBlock.released, signalled, __ATOMIC_RELEASE);
+}
 
-      std::memcpy(targetAddr, instrBytes.data(), instrBytes.size());
+Transaction::ResultCode Transaction::awaitThreads(
+    std::span<const pid_t> targetTids,
+    std::span<Transaction::ThreadControlBlock> controlBlocks,
+    CountdownLatch &acknowledgements) noexcept {
+  // A thread that is exiting has every signal blocked by the C library and
+  // never runs the handler. Wait in slices (up to 1s in total) and count a
+  // thread as acknowledged once it is gone.
+  for (size_t slice = 0;; slice++) {
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = 10000000};
+    if (acknowledgements.Wait(&timeout)) {
+      return Success;
+    }
 
-      // Flush the instruction cache after patching.
-      __builtin___clear_cache(targetAddr, targetAddr + instrBytes.size());
+    for (size_t idx = 0; idx < targetTids.size(); idx++) {
+      auto &controlBlock = controlBlocks[idx];
+      if (__atomic_load_n(&controlBlock.acknowledged, __ATOMIC_ACQUIRE)) {
+        continue;
+      }
 
-    } else if (command == Restore) {
-      auto &instrBytes = _origInstrs[idx];
-      std::memcpy(targetAddr, instrBytes.data(), instrBytes.size());
+      if (::syscall(SYS_tgkill, ::getpid(), targetTids[idx], 0) == -1 &&
+          errno == ESRCH && acknowledge(controlBlock)) {
+        __atomic_store_n(&controlBlock.tid, 0, __ATOMIC_RELEASE);
+      } else if (slice == 100) {
+        std::cerr << std::format(
+            "timed out waiting for tid:{:#x} to be signalled\n",
+            targetTids[idx]);
+      }
+    }
 
-      // Flush the instruction cache after patching.
-      __builtin___clear_cache(targetAddr, targetAddr + instrBytes.size());
+    if (slice == 100) {
+      return ErrorTimedOut;
     }
   }
-  return Success;
 }
 
-Transaction::ResultCode Transaction::commit() {
-  return patch(Apply);
+bool Transaction::needsRetry(
+    Batch txns, std::span<const PatchCommand> commands, pid_t targetTid,
+    Transaction::ThreadControlBlock &controlBlock) noexcept {
+  const pid_t actualTid = __atomic_load_n(&controlBlock.tid, __ATOMIC_ACQUIRE);
+  if (actualTid == 0) {
+    return false; // exited before it could be halted
+  }
+  controlBlock.latency = controlBlock.acknowledgeTime - controlBlock.signalTime;
+
+  // If the handler ran on a different thread than we expected (most likely
+  // on this thread), the handler exited without capturing a backtrace. In
+  // this situation we need to retry.
+  bool needRetry = actualTid != targetTid;
+  controlBlock.resumeAt = 0;
+  const size_t frameCount =
+      __atomic_load_n(&controlBlock.frameCount, __ATOMIC_ACQUIRE);
+  for (size_t jdx = 0; !needRetry && jdx < frameCount; jdx++) {
+    const auto frame = reinterpret_cast<uintptr_t>(
+        __atomic_load_n(&controlBlock.frames[jdx], __ATOMIC_ACQUIRE));
+    if (!isPatchTarget(txns, frame)) {
+      continue;
+    }
+
+    // The interrupted PC can sometimes be moved out of the target. Any other
+    // frame in a target is a return address, which cannot.
+    std::optional<std::uintptr_t> resumeAt;
+    for (size_t idx = 0;
+         frame == controlBlock.pc && !resumeAt && idx < txns.size(); idx++) {
+      resumeAt = txns[idx]->resumeAt(commands[idx], frame);
+    }
+    needRetry = !resumeAt;
+    if (resumeAt && *resumeAt != frame) {
+      controlBlock.resumeAt = *resumeAt;
+    }
+  }
+
+  // A thread released to be retried runs on from where it was, since nothing
+  // has been written yet.
+  if (needRetry) {
+    controlBlock.resumeAt = 0;
+  }
+  return needRetry;
 }
 
-Transaction::ResultCode Transaction::rollback() {
-  return patch(Restore);
+Transaction::ResultCode Transaction::haltThread(
+    Batch txns, std::span<const PatchCommand> commands, pid_t targetTid,
+    Transaction::ThreadControlBlock &controlBlock) noexcept {
+  size_t retryWaitUs = 1;
+
+  for (;;) {
+    controlBlock.acknowledgements->Reset(1);
+    ResultCode result = signalThread(targetTid, controlBlock);
+    if (result != Success) {
+      return result;
+    }
+
+    result = awaitThreads(std::span(&targetTid, 1),
+                          std::span(&controlBlock, 1),
+                          *controlBlock.acknowledgements);
+    if (result != Success) {
+      return result;
+    }
+
+    if (!needsRetry(txns, commands, targetTid, controlBlock)) {
+      // The thread is not executing in a target instruction sequence and is
+      // halted in the signal handler.
+      break;
+    }
+
+    // Let the handler exit immediately so we can signal it again and try to
+    // capture it executing in a different location.
+    release(controlBlock);
+    controlBlock.releases->Advance();
+    controlBlock.retries++;
+
+    // Expontntial backoff (up to 1s) on retry to give the handler a chance
+    // to exit and the thread a chance to run past the patch target
+    // instructions.
+    if (retryWaitUs > 1000000) {
+      return ErrorTimedOut;
+    }
+
+    ::usleep(retryWaitUs);
+    retryWaitUs <<= 1;
+  }
+
+  return Success;
+}
+
+Transaction::ResultCode Transaction::haltThreads(
+    Batch txns, std::span<const PatchCommand> commands,
+    std::span<const pid_t> targetTids,
+    std::span<Transaction::ThreadControlBlock> controlBlocks) noexcept {
+  if (targetTids.empty()) {
+    return Success;
+  }
+
+  const pid_t currentTid = ::gettid();
+
+  // Every handler counts down the same latch, so the signaller sleeps once for
+  // the whole batch rather than once per thread. It is armed before any
+  // signal goes out since handlers count down as soon as they run.
+  CountdownLatch &acknowledgements = *controlBlocks[0].acknowledgements;
+  std::uint32_t count = 0;
+  for (size_t idx = 0; idx < targetTids.size(); idx++) {
+    if (targetTids[idx] == currentTid) {
+      // Skip the current thread to avoid deadlock. We know it isn't executing
+      // the target code so this is fine.
+      __atomic_store_n(&controlBlocks[idx].acknowledged, true,
+                       __ATOMIC_RELEASE);
+      continue;
+    }
+    count++;
+  }
+  acknowledgements.Reset(count);
+
+  // Signal every thread up front so they all enter the handler concurrently.
+  // The total pause then tracks the slowest thread to respond rather than the
+  // sum of every thread's response time.
+  for (size_t idx = 0; idx < targetTids.size(); idx++) {
+    if (targetTids[idx] == currentTid) {
+      continue;
+    }
+
+    ResultCode result = signalThread(targetTids[idx], controlBlocks[idx]);
+    if (result != Success) {
+      return result;
+    }
+  }
+
+  ResultCode result =
+      awaitThreads(targetTids, controlBlocks, acknowledgements);
+  if (result != Success) {
+    return result;
+  }
+
+  // Threads found executing a target instruction sequence are released
+  // together, with one wake, so they can make progress before being retried.
+  bool anyRetry = false;
+  for (size_t idx = 0; idx < targetTids.size(); idx++) {
+    if (targetTids[idx] == currentTid) {
+      continue;
+    }
+
+    auto &controlBlock = controlBlocks[idx];
+    controlBlock.needRetry =
+        needsRetry(txns, commands, targetTids[idx], controlBlock);
+    if (controlBlock.needRetry) {
+      release(controlBlock);
+      controlBlock.retries++;
+      anyRetry = true;
+    }
+  }
+
+  if (!anyRetry) {
+    return Success;
+  }
+  controlBlocks[0].releases->Advance();
+
+  // Only the threads caught inside a patch target get the retry and backoff
+  // treatment.
+  for (size_t idx = 0; idx < targetTids.size(); idx++) {
+    auto &controlBlock = controlBlocks[idx];
+    if (!controlBlock.needRetry) {
+      continue;
+    }
+
+    result = haltThread(txns, commands, targetTids[idx], controlBlock);
+    if (result != Success) {
+      return result;
+    }
+  }
+
+  return Success;
+}
+
+Transaction::ResultCode Transaction::haltAllThreads(
+    Batch txns, std::span<const PatchCommand> commands,
+    std::span<pid_t> snapshotTids, std::span<pid_t> haltedTids,
+    std::span<Transaction::ThreadControlBlock> controlBlocks,
+    bool &overflow) noexcept {
+  if (!installHaltHandler()) {
+    return ErrorSignalActionFailure;
+  }
+
+  const pid_t currentTid = ::gettid();
+
+  // haltedTids[0, haltedCount) is kept sorted for lookup. Control blocks are
+  // never reused or moved since a halted thread waits on its own block.
+  size_t haltedCount = 0;
+  size_t blockCount = 0;
+  for (;;) {
+    const std::optional<size_t> count = Threads::snapshot(snapshotTids);
+    if (!count) {
+      return ErrorUnexpected;
+    }
+    if (*count > snapshotTids.size()) {
+      overflow = true;
+      return ErrorUnexpected;
+    }
+
+    // Collect the threads that are not yet halted after the halted ones.
+    const auto halted = haltedTids.first(haltedCount);
+    size_t newCount = 0;
+    for (const pid_t tid : snapshotTids.first(*count)) {
+      if (tid == currentTid ||
+          std::binary_search(halted.begin(), halted.end(), tid)) {
+        continue;
+      }
+      if (blockCount + newCount == controlBlocks.size()) {
+        overflow = true;
+        return ErrorUnexpected;
+      }
+      haltedTids[haltedCount + newCount++] = tid;
+    }
+
+    if (newCount == 0) {
+      return Success;
+    }
+
+    const auto batchBlocks = controlBlocks.subspan(blockCount, newCount);
+    ResultCode result =
+        haltThreads(txns, commands, haltedTids.subspan(haltedCount, newCount),
+                    batchBlocks);
+    blockCount += newCount;
+    if (result != Success) {
+      return result;
+    }
+
+    // Drop threads that exited before they were signalled. Their tids may be
+    // reused by new threads, which must then be halted too.
+    const size_t batchStart = haltedCount;
+    for (size_t idx = 0; idx < newCount; idx++) {
+      if (__atomic_load_n(&batchBlocks[idx].tid, __ATOMIC_ACQUIRE) != 0) {
+        haltedTids[haltedCount++] = haltedTids[batchStart + idx];
+      }
+    }
+    std::sort(haltedTids.begin(), haltedTids.begin() + haltedCount);
+  }
+}
+
+Transaction::ResultCode Transaction::patchHalting(
+    Batch txns, std::span<const PatchCommand> commands, CodeWriter &writer,
+    Stats &stats) {
+  // We have to do a bit of a complex dance when patching the target instruction
+  // sequence with a new instruction sequence. The primary issue is that any
+  // other thread in the process may be concurrently executing the target
+  // instruction sequence, and modifying it mid-execution will result in
+  // undefined behavior.
+  //
+  // The solution is to interrupt every other thread in the process with a
+  // user-defined signal and custom signal handler. The signal handler captures
+  // the interrupted PC, and a backtrace when needed, which is used to
+  // determine if the thread is executing within a target instruction
+  // sequence. The handler then prevents the thread from
+  // resuming until patches are applied. In the (unlikely) case that a thread IS
+  // concurrently executing in a target instruction sequence, we exit the signal
+  // handler to resume thread execution, sleep briefly, and try again.
+
+  // Threads created while others are being halted are caught by enumerating
+  // again once every known thread is halted, until no new tid appears. A
+  // halted thread cannot create more threads, and a thread that is in the
+  // middle of clone() is visible in the listing once clone() returns to
+  // deliver the signal, so the set only grows by threads that are still
+  // running and the loop converges.
+  //
+  // Everything used while threads are halted is allocated up front, sized
+  // with headroom for threads created along the way. If that is not enough,
+  // every thread is released and the whole halt is retried with more room.
+  //
+  // Only one halt can be active at a time, since the handler finds its
+  // control block through the active halt.
+  static std::mutex haltLock;
+  std::lock_guard<std::mutex> guard(haltLock);
+
+  const std::optional<size_t> threadCount = Threads::snapshot({});
+  if (!threadCount) {
+    std::cerr << "failed enumerating all threads" << std::endl;
+    return ErrorUnexpected;
+  }
+  const HaltCheck check = haltCheck(txns);
+
+  for (size_t capacity = *threadCount * 2 + 16;; capacity *= 2) {
+    std::vector<pid_t> snapshotTids(capacity);
+    std::vector<pid_t> haltedTids(capacity);
+    // Every halted thread acknowledges through one latch and waits on one
+    // release generation, so halting and releasing N threads costs a single
+    // sleep and a single wake rather than N of each.
+    CountdownLatch acknowledgements;
+    Generation releases;
+    std::vector<ThreadControlBlock> threadControlBlocks(capacity);
+    for (auto &controlBlock : threadControlBlocks) {
+      controlBlock.acknowledgements = &acknowledgements;
+      controlBlock.releases = &releases;
+      controlBlock.check = check;
+    }
+    // Generation 0 is never issued, so a zeroed tag is not taken for one.
+    std::uint32_t generation = (_haltGeneration + 1) & haltTagMask;
+    if (generation == 0) {
+      generation = 1;
+    }
+    __atomic_store_n(&_haltGeneration, generation, __ATOMIC_RELEASE);
+    HaltState halt{generation, threadControlBlocks};
+    __atomic_store_n(&_activeHalt, &halt, __ATOMIC_SEQ_CST);
+    stats.threadHalts.clear();
+    stats.threadHalts.reserve(capacity);
+    const auto haltStart = std::chrono::steady_clock::now();
+
+    // Unconditionally release all threads on success or failure to ensure
+    // any interruped threads exit their signal handlers and resume. A
+    // released thread may not be scheduled until well after the generation
+    // advances, so retire the halt and wait for every handler to stop
+    // touching it before the blocks are freed. A signal that arrives later
+    // finds no active halt, or a newer one, and leaves the blocks alone.
+    //
+    // Threads are only moved once every patch is written. Otherwise the code
+    // is unchanged and a moved thread would land in a trampoline that is
+    // about to be freed, or inside the jump still written over a target.
+    bool patched = false;
+    const auto threadReleaseGuard = ScopeGuard::create([&]() {
+      for (auto &controlBlock : threadControlBlocks) {
+        if (!patched) {
+          controlBlock.resumeAt = 0;
+        }
+        release(controlBlock);
+      }
+      releases.Advance();
+      stats.stopped = std::chrono::steady_clock::now() - haltStart;
+      __atomic_store_n(&_activeHalt, nullptr, __ATOMIC_SEQ_CST);
+      while (__atomic_load_n(&_haltHandlers, __ATOMIC_SEQ_CST) != 0) {
+        ::sched_yield();
+      }
+    });
+
+    // Halt every thread and ensure none are executing a target instruction
+    // sequence.
+    //
+    // Once we start halting threads, we need to take care to not perform any
+    // operation that could deadlock. For example, a thread could be halted mid
+    // resource acquisition while holding a mutex. If we attempt an operation
+    // that acquires the same mutex on the current thread, we'll deadlock.
+    // Allocating from the heap is one such example so we even avoid heap
+    // allocations.
+    bool overflow = false;
+    ResultCode result = haltAllThreads(txns, commands, snapshotTids,
+                                       haltedTids, threadControlBlocks,
+                                       overflow);
+    if (overflow) {
+      continue;
+    }
+    if (result != Success) {
+      return result;
+    }
+
+    // Room for every control block was reserved before halting, so this does
+    // not allocate.
+    for (const auto &controlBlock : threadControlBlocks) {
+      const pid_t tid = __atomic_load_n(&controlBlock.tid, __ATOMIC_ACQUIRE);
+      if (tid != 0) {
+        stats.threadHalts.push_back({tid, controlBlock.latency,
+                                     controlBlock.retries,
+                                     controlBlock.resumeAt != 0});
+      }
+    }
+
+    // Every transaction is patched under the same halt. A failure puts back
+    // the transactions already written, so none of them changes.
+    for (size_t idx = 0; idx < txns.size(); idx++) {
+      result = txns[idx]->writeHaltingPatches(writer, commands[idx]);
+      if (result != Success) {
+        while (idx-- > 0) {
+          (void)txns[idx]->writeHaltingPatches(
+              writer, commands[idx] == Apply ? Restore : Apply);
+        }
+        return result;
+      }
+    }
+
+    patched = true;
+    return Success;
+  }
+}
+
+Transaction::ResultCode Transaction::writeHaltingPatches(CodeWriter &writer,
+                                                         PatchCommand command) {
+  const auto write = [&](size_t idx, PatchCommand command) {
+    // The instruction sequence that jumps to the hook address was generated
+    // in prepare() to patch over the existing function.
+    const auto &instrBytes =
+        command == Apply ? _patchInstrs[idx] : _origInstrs[idx];
+    const auto addr = _descriptors[idx].addr;
+    if (!writer.write(addr, instrBytes)) {
+      return false;
+    }
+
+    // Flush the instruction cache after patching.
+    flushInstructionCache(addr, instrBytes.size());
+    return true;
+  };
+
+  // Patch each function with jump to hook location.
+  for (size_t idx = 0; idx < _descriptors.size(); idx++) {
+    if (_modes[idx] != ModeHalting || write(idx, command)) {
+      continue;
+    }
+
+    // Put back the targets already written, so that a failure leaves the code
+    // of every target as it was.
+    const auto undo = command == Apply ? Restore : Apply;
+    while (idx-- > 0) {
+      if (_modes[idx] == ModeHalting) {
+        write(idx, undo);
+      }
+    }
+    return ErrorMemoryProtectionFailure;
+  }
+
+  return Success;
+}
+
+Transaction::ResultCode Transaction::patchEntryPads(CodeWriter &writer,
+                                                    PatchCommand command) {
+  bool anyEntryPads = false;
+
+  if (command == Apply) {
+    // Nothing executes the pads yet, so they can be written in any order.
+    for (size_t idx = 0; idx < _entryPads.size(); idx++) {
+      if (_modes[idx] != ModeEntryPad) {
+        continue;
+      }
+
+      const auto &pad = _entryPads[idx];
+      if (!writer.write(pad.addr, pad.code)) {
+        return ErrorMemoryProtectionFailure;
+      }
+      flushInstructionCache(pad.addr, pad.code.size());
+      anyEntryPads = true;
+    }
+
+    // Every core must observe the pads before any entry can jump to them.
+    if (anyEntryPads && !syncCores()) {
+      return ErrorUnexpected;
+    }
+  }
+
+  for (size_t idx = 0; idx < _entryPads.size(); idx++) {
+    if (_modes[idx] != ModeEntryPad) {
+      continue;
+    }
+
+    // On restore the pad keeps the jump to the hook. A thread may have taken
+    // the entry jump just before it was restored and has yet to execute it.
+    const auto addr = _descriptors[idx].addr;
+    const auto &instrBytes =
+        command == Apply ? _patchInstrs[idx] : _origInstrs[idx];
+    if (!writer.writeAtomic(addr, instrBytes)) {
+      return ErrorMemoryProtectionFailure;
+    }
+
+    flushInstructionCache(addr, instrBytes.size());
+    anyEntryPads = true;
+  }
+
+  if (anyEntryPads && !syncCores()) {
+    return ErrorUnexpected;
+  }
+  return Success;
+}
+
+Transaction::BreakpointTable *Transaction::_activeBreakpoints = nullptr;
+unsigned Transaction::_breakpointHandlers = 0;
+const Transaction::BreakpointHistory *Transaction::_breakpointHistory =
+    nullptr;
+const struct sigaction *Transaction::_previousTrapAction = nullptr;
+
+bool Transaction::isBreakpointSite(std::uintptr_t addr) noexcept {
+  for (auto history = __atomic_load_n(&_breakpointHistory, __ATOMIC_ACQUIRE);
+       history != nullptr; history = history->next) {
+    if (std::find(history->addrs.begin(), history->addrs.end(), addr) !=
+        history->addrs.end()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Transaction::breakpointHandler(int signal, siginfo_t *info,
+                                    void *context) noexcept {
+#if defined(__x86_64__) || defined(_M_X64)
+  // Only an int3 reports SI_KERNEL. Single steps, hardware breakpoints and
+  // signals sent with kill() are never ours.
+  if (info->si_code == SI_KERNEL) {
+    auto &pc =
+        reinterpret_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_RIP];
+    const auto addr = static_cast<std::uintptr_t>(pc) - 1;
+
+    // Emulate the instruction being written: jump to the hook while patching
+    // and run the original instruction from the trampoline while restoring.
+    // The patcher waits for handlers to stop reading the table before it
+    // retires it.
+    bool redirected = false;
+    __atomic_add_fetch(&_breakpointHandlers, 1, __ATOMIC_SEQ_CST);
+    const auto table = __atomic_load_n(&_activeBreakpoints, __ATOMIC_SEQ_CST);
+    if (table != nullptr) {
+      for (const auto &site : table->sites) {
+        if (site.addr == addr) {
+          pc = __atomic_load_n(&table->command, __ATOMIC_SEQ_CST) == Apply
+                   ? site.hook
+                   : site.original;
+          redirected = true;
+          break;
+        }
+      }
+    }
+    __atomic_sub_fetch(&_breakpointHandlers, 1, __ATOMIC_RELEASE);
+    if (redirected) {
+      return;
+    }
+
+    // The trap may be delivered after the breakpoint was already replaced, in
+    // which case the instruction that replaced it is simply executed.
+    if (isBreakpointSite(addr) &&
+        *reinterpret_cast<const volatile uint8_t *>(addr) != 0xCC) {
+      pc = addr;
+      return;
+    }
+  }
+#endif
+
+  // Not one of our breakpoints.
+  chainSignal(__atomic_load_n(&_previousTrapAction, __ATOMIC_ACQUIRE), signal,
+              info, context);
+}
+
+Transaction::ResultCode Transaction::patchBreakpoints(CodeWriter &writer,
+                                                      PatchCommand command) {
+  if (_breakpointSites.empty()) {
+    return Success;
+  }
+
+  // The handler stays installed for the life of the process since a trap can
+  // be delivered to a thread after patching completes. Traps that are not ours
+  // go to the action it replaced.
+  static SignalAction *action = []() {
+    auto action = new SignalAction(SIGTRAP, breakpointHandler, SA_SIGINFO);
+    if (!action->failed()) {
+      __atomic_store_n(&_previousTrapAction, &action->original(),
+                       __ATOMIC_RELEASE);
+    }
+    return action;
+  }();
+  if (action->failed()) {
+    return ErrorSignalActionFailure;
+  }
+
+  // Only one table of breakpoints can be active at a time.
+  static std::mutex breakpointsLock;
+  std::lock_guard<std::mutex> guard(breakpointsLock);
+
+  // Record the sites before any breakpoint is written to them.
+  std::vector<std::uintptr_t> newSites;
+  for (const auto &site : _breakpointSites) {
+    if (!isBreakpointSite(site.addr)) {
+      newSites.push_back(site.addr);
+    }
+  }
+  if (!newSites.empty()) {
+    __atomic_store_n(&_breakpointHistory,
+                     new BreakpointHistory{std::move(newSites),
+                                           _breakpointHistory},
+                     __ATOMIC_RELEASE);
+  }
+
+  // A handler that loaded the table just before it is retired may still be
+  // reading it, so wait for every handler to finish with it before it goes out
+  // of scope.
+  BreakpointTable table{_breakpointSites, command};
+  __atomic_store_n(&_activeBreakpoints, &table, __ATOMIC_SEQ_CST);
+  const auto tableGuard = ScopeGuard::create([]() {
+    __atomic_store_n(&_activeBreakpoints, nullptr, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&_breakpointHandlers, __ATOMIC_SEQ_CST) != 0) {
+      ::sched_yield();
+    }
+  });
+
+  const uint8_t breakpoint[] = {0xCC};
+  const auto forEachSite = [&](auto &&write) -> ResultCode {
+    for (size_t idx = 0; idx < _descriptors.size(); idx++) {
+      if (_modes[idx] != ModeBreakpoint) {
+        continue;
+      }
+
+      const auto addr = _descriptors[idx].addr;
+      const std::span<const uint8_t> instrBytes =
+          command == Apply ? _patchInstrs[idx] : _origInstrs[idx];
+      if (!write(addr, instrBytes)) {
+        return ErrorMemoryProtectionFailure;
+      }
+
+      flushInstructionCache(addr, instrBytes.size());
+    }
+
+    // Serialize every core so no thread can execute a stale copy of the
+    // instruction past this point.
+    return syncCores() ? Success : ErrorUnexpected;
+  };
+
+  // A failure before the last step leaves breakpoints at the sites, and
+  // trapping threads would spin once the table is retired. Put the bytes from
+  // before the command back over every site, breakpoint last, while trapping
+  // threads are sent where the undone command leaves them. Sites that were not
+  // reached yet already hold those bytes.
+  const auto undo = [&](ResultCode result) {
+    const auto undoCommand = command == Apply ? Restore : Apply;
+    __atomic_store_n(&table.command, undoCommand, __ATOMIC_SEQ_CST);
+    for (size_t idx = 0; idx < _descriptors.size(); idx++) {
+      if (_modes[idx] != ModeBreakpoint) {
+        continue;
+      }
+
+      const auto addr = _descriptors[idx].addr;
+      const std::span<const uint8_t> instrBytes =
+          command == Apply ? _origInstrs[idx] : _patchInstrs[idx];
+      (void)writer.write(addr + 1, instrBytes.subspan(1));
+      (void)writer.write(addr, instrBytes.first(1));
+      flushInstructionCache(addr, instrBytes.size());
+    }
+    (void)syncCores();
+    return result;
+  };
+
+  // 1. Trap any thread reaching a target from now on.
+  ResultCode result = forEachSite([&](std::uintptr_t addr, auto) {
+    return writer.write(addr, breakpoint);
+  });
+  if (result != Success) {
+    return undo(result);
+  }
+
+  // 2. Write everything but the first byte, which only trapping threads see.
+  result = forEachSite([&](std::uintptr_t addr, auto instrBytes) {
+    return writer.write(addr + 1, instrBytes.subspan(1));
+  });
+  if (result != Success) {
+    return undo(result);
+  }
+
+  // 3. Replace the breakpoint with the first byte of the new instruction.
+  return forEachSite([&](std::uintptr_t addr, auto instrBytes) {
+    return writer.write(addr, instrBytes.first(1));
+  });
+}
+
+void Transaction::flushInstructionCache(std::uintptr_t addr,
+                                        std::size_t size) noexcept {
+  const auto start = std::chrono::steady_clock::now();
+  const auto begin = reinterpret_cast<char *>(addr);
+  __builtin___clear_cache(begin, begin + size);
+  _stats.icacheFlush += std::chrono::steady_clock::now() - start;
+}
+
+bool Transaction::syncCores() noexcept {
+  const auto start = std::chrono::steady_clock::now();
+  const bool success = Membarrier::syncCore();
+  _stats.icacheFlush += std::chrono::steady_clock::now() - start;
+  return success;
+}
+
+Transaction::ResultCode Transaction::patch(
+    Batch txns, std::span<const PatchCommand> commands, Stats &stats) {
+  // Code is written through /proc/self/mem so page protections normally stay
+  // untouched. If that is not possible, the writer falls back to making the
+  // target pages writable and unconditionally restores the original
+  // protections on success or failure. It is declared before the thread
+  // release guard so protections are restored after threads are released.
+  const auto pageRanges = mergePageRanges(txns);
+  CodeWriter writer(pageRanges, &stats.protect);
+
+  // Targets patched without halting threads are patched last so a failure to
+  // halt threads leaves them untouched. When no target needs halting, no
+  // thread is signalled.
+  const bool halting =
+      std::any_of(txns.begin(), txns.end(),
+                  [](const auto txn) { return txn->hasHaltingTargets(); });
+  if (halting) {
+    const ResultCode result = patchHalting(txns, commands, writer, stats);
+    if (result != Success) {
+      return result;
+    }
+  }
+
+  // A stage that fails puts back the stages already written, so the batch is
+  // either fully patched or left as it was. Halting targets are put back under
+  // a new halt.
+  std::vector<PatchCommand> undoCommands(commands.size());
+  std::transform(commands.begin(), commands.end(), undoCommands.begin(),
+                 [](PatchCommand command) {
+                   return command == Apply ? Restore : Apply;
+                 });
+  const auto undo = [&](ResultCode result, size_t entryPadCount,
+                        size_t breakpointCount) {
+    for (size_t idx = breakpointCount; idx-- > 0;) {
+      if (txns[idx]->patchBreakpoints(writer, undoCommands[idx]) != Success) {
+        std::cerr << "failed restoring breakpoint targets" << std::endl;
+      }
+    }
+    for (size_t idx = entryPadCount; idx-- > 0;) {
+      if (txns[idx]->patchEntryPads(writer, undoCommands[idx]) != Success) {
+        std::cerr << "failed restoring entry pad targets" << std::endl;
+      }
+    }
+    Stats undoStats;
+    if (halting &&
+        patchHalting(txns, undoCommands, writer, undoStats) != Success) {
+      std::cerr << "failed restoring halting targets" << std::endl;
+    }
+    return result;
+  };
+
+  // Entries of a transaction that failed partway are written back as well;
+  // those it did not reach already hold the bytes being written.
+  for (size_t idx = 0; idx < txns.size(); idx++) {
+    const ResultCode result =
+        txns[idx]->patchEntryPads(writer, commands[idx]);
+    if (result != Success) {
+      return undo(result, idx + 1, 0);
+    }
+  }
+
+  // A transaction whose breakpoints fail puts its own sites back.
+  for (size_t idx = 0; idx < txns.size(); idx++) {
+    const ResultCode result =
+        txns[idx]->patchBreakpoints(writer, commands[idx]);
+    if (result != Success) {
+      return undo(result, txns.size(), idx);
+    }
+  }
+  return Success;
+}
+
+Transaction::ResultCode Transaction::patch(Batch txns, PatchCommand command,
+                                           Stats &stats) {
+  const std::vector<PatchCommand> commands(txns.size(), command);
+  return patch(txns, commands, stats);
+}
+
+void Transaction::publishOriginals() noexcept {
+  // Publish the trampolines before any hook can be reached.
+  for (size_t idx = 0; idx < _trampolineAddrs.size(); idx++) {
+    if (_trampolineAddrs[idx] != nullptr) {
+      __atomic_store_n(_trampolineAddrs[idx], _originals[idx],
+                       __ATOMIC_RELEASE);
+    }
+  }
+}
+
+void Transaction::finishRollback() noexcept {
+  // Now that the original functions are restored they can be called directly,
+  // so point any hook still holding a trampoline pointer back at them.
+  for (size_t idx = 0; idx < _trampolineAddrs.size(); idx++) {
+    if (_trampolineAddrs[idx] != nullptr) {
+      __atomic_store_n(_trampolineAddrs[idx], _descriptors[idx].addr,
+                       __ATOMIC_RELEASE);
+    }
+  }
+
+  // Trampolines and stubs are not returned to the pool. A thread inside a hook
+  // may have loaded the trampoline pointer before it was reset and not yet
+  // called through it, and no halt can tell, so a reused slot could be
+  // rewritten under it. They are retired instead and only handed out again to
+  // the same target with the same code, so each distinct target holds at most
+  // one of each.
+  retireTrampolines();
+
+  // A thread that took an entry jump just before it was restored may still
+  // read the slot from the pad, so only slots of halting targets are reused.
+  if (std::all_of(_modes.begin(), _modes.end(),
+                  [](auto mode) { return mode == ModeHalting; })) {
+    releaseSlots();
+  }
+  _state = TxnAborted;
+}
+
+Transaction::ResultCode Transaction::applyHooks() {
+  if (_state != TxnPrepared) {
+    return ErrorInvalidState;
+  }
+
+  publishOriginals();
+
+  Transaction *const self = this;
+  const ResultCode result = patch(Batch(&self, 1), Apply, _stats);
+  if (result == Success) {
+    _state = TxnCommitted;
+  }
+  return result;
+}
+
+Transaction::ResultCode Transaction::restoreTargets() {
+  if (_state != TxnCommitted) {
+    return ErrorInvalidState;
+  }
+
+  Transaction *const self = this;
+  const ResultCode result = patch(Batch(&self, 1), Restore, _stats);
+  if (result != Success) {
+    return result;
+  }
+
+  finishRollback();
+  return Success;
+}
+
+void Transaction::takeTargets(Transaction &from,
+                              std::span<const std::size_t> indices) {
+  for (const auto idx : indices) {
+    _names.push_back(from._names[idx]);
+    _hooks.push_back(from._hooks[idx]);
+    _trampolineAddrs.push_back(from._trampolineAddrs[idx]);
+    _originals.push_back(from._originals[idx]);
+    _slots.push_back(from._slots[idx]);
+    _trampolines.push_back(from._trampolines[idx]);
+    _stubs.push_back(from._stubs[idx]);
+    _modes.push_back(from._modes[idx]);
+    _entryPads.push_back(std::move(from._entryPads[idx]));
+    _descriptors.push_back(from._descriptors[idx]);
+    _origInstrs.push_back(std::move(from._origInstrs[idx]));
+    _patchInstrs.push_back(std::move(from._patchInstrs[idx]));
+
+    if (from._modes[idx] == ModeBreakpoint) {
+      auto &sites = from._breakpointSites;
+      const auto it = std::find_if(sites.begin(), sites.end(), [&](auto &site) {
+        return site.addr == from._descriptors[idx].addr;
+      });
+      _breakpointSites.push_back(*it);
+      sites.erase(it);
+    }
+  }
+
+  std::vector<std::size_t> sorted(indices.begin(), indices.end());
+  std::sort(sorted.rbegin(), sorted.rend());
+  const auto eraseAt = [&](auto &targets) {
+    for (const auto idx : sorted) {
+      targets.erase(targets.begin() + idx);
+    }
+  };
+  eraseAt(from._names);
+  eraseAt(from._hooks);
+  eraseAt(from._trampolineAddrs);
+  eraseAt(from._originals);
+  eraseAt(from._slots);
+  eraseAt(from._trampolines);
+  eraseAt(from._stubs);
+  eraseAt(from._modes);
+  eraseAt(from._entryPads);
+  eraseAt(from._descriptors);
+  eraseAt(from._origInstrs);
+  eraseAt(from._patchInstrs);
+}
+
+Transaction::ResultCode
+Transaction::updateTargets(Transaction *additions,
+                           std::span<const std::string_view> removals) {
+  if (_state != TxnCommitted || additions == this ||
+      (additions != nullptr && additions->_state != TxnPrepared)) {
+    return ErrorInvalidState;
+  }
+
+  std::vector<std::size_t> removedIdxs;
+  for (const auto name : removals) {
+    const auto it = std::find(_names.begin(), _names.end(), name);
+    if (it == _names.end()) {
+      std::cerr << std::format("no hook installed for {}\n", name);
+      return ErrorSymbolNotFound;
+    }
+    const std::size_t idx = it - _names.begin();
+    if (std::find(removedIdxs.begin(), removedIdxs.end(), idx) ==
+        removedIdxs.end()) {
+      removedIdxs.push_back(idx);
+    }
+  }
+
+  if (additions != nullptr) {
+    Transaction *const pair[] = {this, additions};
+    if (hasConflicts(pair)) {
+      return ErrorConflictingTargets;
+    }
+  }
+
+  // Split the removed targets into a committed transaction of their own so
+  // they can be restored alongside the additions while every other target
+  // keeps its hook. Only the changed targets are checked when threads halt.
+  Transaction removed({}, {}, {}, _engine, _haltCheck, _relocateThreads,
+                      _retargetable, nullptr, nullptr);
+  removed.takeTargets(*this, removedIdxs);
+  removed._state = TxnCommitted;
+  removed._pageRanges = removed.targetPageRanges(_pageRanges);
+
+  std::vector<Transaction *> txns = {&removed};
+  std::vector<PatchCommand> commands = {Restore};
+  if (additions != nullptr) {
+    additions->publishOriginals();
+    txns.push_back(additions);
+    commands.push_back(Apply);
+  }
+
+  const ResultCode result = patch(txns, commands, _stats);
+  if (result != Success) {
+    // Nothing is written until every thread is halted, so the removed
+    // targets are most likely still hooked. Keep them.
+    std::vector<std::size_t> all(removed._names.size());
+    std::iota(all.begin(), all.end(), 0);
+    takeTargets(removed, all);
+    return result;
+  }
+  removed.finishRollback();
+
+  if (additions != nullptr) {
+    Transaction *const pair[] = {this, additions};
+    const auto known = mergePageRanges(pair);
+
+    std::vector<std::size_t> all(additions->_names.size());
+    std::iota(all.begin(), all.end(), 0);
+    takeTargets(*additions, all);
+    additions->_pageRanges.clear();
+    additions->_state = TxnAborted;
+    _pageRanges = targetPageRanges(known);
+  } else {
+    _pageRanges = targetPageRanges(_pageRanges);
+  }
+  return Success;
+}
+
+Transaction::ResultCode
+Transaction::retargetSlot(const std::string_view &name,
+                          std::uintptr_t addr) noexcept {
+  if (_state != TxnCommitted) {
+    return ErrorInvalidState;
+  }
+
+  const auto it = std::find(_names.begin(), _names.end(), name);
+  if (it == _names.end()) {
+    return ErrorSymbolNotFound;
+  }
+
+  const auto slot = _slots[it - _names.begin()];
+  if (slot == 0) {
+    return ErrorInvalidState; // not built with retargetable()
+  }
+
+  // Every reader of the slot is a jump, so the new address takes effect on
+  // the next call on any core without flushing any cache.
+  __atomic_store_n(reinterpret_cast<std::uintptr_t *>(slot), addr,
+                   __ATOMIC_RELEASE);
+  return Success;
+}
+
+Transaction::ResultCode
+Transaction::disable(const std::string_view &name) noexcept {
+  if (_state != TxnCommitted) {
+    return ErrorInvalidState;
+  }
+
+  const auto it = std::find(_names.begin(), _names.end(), name);
+  if (it == _names.end()) {
+    return ErrorSymbolNotFound;
+  }
+  return retargetSlot(name, _originals[it - _names.begin()]);
+}
+
+template <typename Fn>
+Transaction::ResultCode Transaction::measure(Operation operation, Fn &&fn) {
+  _stats = Stats{};
+  _stats.operation = operation;
+
+  const auto start = std::chrono::steady_clock::now();
+  _stats.result = fn();
+  _stats.total = std::chrono::steady_clock::now() - start;
+
+  if (_statsCallback) {
+    _statsCallback(_stats);
+  }
+  return _stats.result;
+}
+
+Transaction::ResultCode Transaction::prepare() {
+  return measure(OpPrepare, [this]() { return prepareTargets(); });
+}
+
+Transaction::ResultCode Transaction::commit() {
+  return measure(OpCommit, [this]() { return applyHooks(); });
+}
+
+Transaction::ResultCode Transaction::rollback() {
+  return measure(OpRollback, [this]() { return restoreTargets(); });
+}
+
+Transaction::ResultCode
+Transaction::update(Transaction *additions,
+                    std::span<const std::string_view> removals) {
+  return measure(OpUpdate, [&]() {
+    return updateTargets(additions, removals);
+  });
+}
+
+template <typename Fn>
+Transaction::ResultCode Transaction::measureAll(Batch txns, Operation operation,
+                                                Fn &&fn) {
+  for (const auto txn : txns) {
+    txn->_stats = Stats{};
+    txn->_stats.operation = operation;
+  }
+
+  // Costs shared by the batch are recorded once and reported by every
+  // transaction in it.
+  Stats shared;
+  const auto start = std::chrono::steady_clock::now();
+  const ResultCode result = fn(shared);
+  const auto total = std::chrono::steady_clock::now() - start;
+
+  for (const auto txn : txns) {
+    auto &stats = txn->_stats;
+    stats.result = result;
+    stats.total = total;
+    stats.protect = shared.protect;
+    stats.threadHalts = shared.threadHalts;
+    stats.stopped = shared.stopped;
+    if (txn->_statsCallback) {
+      txn->_statsCallback(stats);
+    }
+  }
+  return result;
+}
+
+Transaction::ResultCode Transaction::commitAll(Batch txns) {
+  return measureAll(txns, OpCommit, [txns](Stats &stats) {
+    for (const auto txn : txns) {
+      if (txn->_state != TxnPrepared) {
+        return ErrorInvalidState;
+      }
+    }
+    if (hasConflicts(txns)) {
+      return ErrorConflictingTargets;
+    }
+
+    for (const auto txn : txns) {
+      txn->publishOriginals();
+    }
+
+    const ResultCode result = patch(txns, Apply, stats);
+    if (result == Success) {
+      for (const auto txn : txns) {
+        txn->_state = TxnCommitted;
+      }
+    }
+    return result;
+  });
+}
+
+Transaction::ResultCode Transaction::rollbackAll(Batch txns) {
+  return measureAll(txns, OpRollback, [txns](Stats &stats) {
+    for (const auto txn : txns) {
+      if (txn->_state != TxnCommitted) {
+        return ErrorInvalidState;
+      }
+    }
+
+    const ResultCode result = patch(txns, Restore, stats);
+    if (result != Success) {
+      return result;
+    }
+
+    for (const auto txn : txns) {
+      txn->finishRollback();
+    }
+    return Success;
+  });
 }
 
 }; // namespace Interject
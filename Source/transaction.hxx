@@ -14,12 +14,19 @@
  * limitations under the License.
  */
 
+#pragma once
+
+#include "code_writer.hxx"
 #include "event.hxx"
 #include "symbols.hxx"
 
+#include <chrono>
 #include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
 #include <string_view>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -39,10 +46,95 @@ public:
     ErrorSignalActionFailure,
     ErrorFunctionBodyTooSmall,
     ErrorTimedOut,
+    ErrorTrampolineAllocationFailure,
+    ErrorUnsupportedInstructions,
+    ErrorConflictingTargets,
+  };
+
+  // How targets are patched when they have no -fpatchable-function-entry pad.
+  // Targets with a usable pad are always patched without halting threads.
+  enum Engine {
+    // Halt every thread with a signal and patch once none of them is executing
+    // a target.
+    EngineHalting = 0,
+    // Patch with the breakpoint protocol used by the kernel's text_poke_bp: an
+    // int3 is written over the first byte so threads reaching the target while
+    // it is modified take a SIGTRAP and are redirected, and no thread is
+    // halted. Only targets whose first instruction fits a jump are patched
+    // this way; the rest fall back to halting. x86_64 only.
+    EngineBreakpoint,
+  };
+
+  // How a halted thread is checked for executing a target. Whichever of these
+  // is chosen, a halt uses HaltCheckBacktrace when the instructions displaced
+  // from a target include a call, since a thread deep in the callee returns
+  // into them.
+  enum HaltCheck {
+    // Read the interrupted PC and the return address of a thread stopped in
+    // a function's prologue from the signal context. A few loads per thread.
+    HaltCheckContext = 0,
+    // Also follow a bounded number of frame pointers.
+    HaltCheckFramePointers,
+    // Unwind the whole stack with the C library's unwinder. Microseconds per
+    // thread; meant for diagnostics.
+    HaltCheckBacktrace,
+  };
+
+  enum Operation {
+    OpPrepare = 0,
+    OpCommit,
+    OpRollback,
+    OpUpdate,
   };
 
+  // Where the most recent operation spent its time,
+  // measured with a monotonic clock. Fields not applicable to the operation
+  // are left zero or empty. Nothing is allocated to record timings while
+  // threads are halted.
+  struct Stats {
+    using Duration = std::chrono::nanoseconds;
+
+    struct ModuleLookup {
+      std::string name;
+      Duration elapsed{}; // summed over every pass over the module
+    };
+
+    struct ThreadHalt {
+      pid_t tid;
+      // From signalling the thread to its acknowledgement, for the attempt
+      // that halted it.
+      Duration latency{};
+      // Times the thread was found executing a target and signalled again.
+      std::uint32_t retries = 0;
+      // Moved to the same instruction in a trampoline rather than retried.
+      bool relocated = false;
+    };
+
+    Operation operation = OpPrepare;
+    ResultCode result = Success;
+    Duration total{};
+
+    // prepare()
+    std::vector<ModuleLookup> symbolLookup;
+    Duration memoryMap{};
+
+    // commit(), rollback() and update()
+    CodeWriter::ProtectStats protect;
+    std::vector<ThreadHalt> threadHalts;
+    Duration stopped{}; // first thread signalled until all are released
+    Duration icacheFlush{}; // including serializing every core
+  };
+
+  // Called at the end of every prepare(), commit(), rollback() and update(),
+  // once no thread is halted.
+  using StatsCallback = std::function<void(const Stats &)>;
+
   class Builder {
   public:
+    // Hook the function name. Once committed, *trampoline is the address to
+    // call the original function through. If trampoline is nullptr the hook
+    // cannot call the original, and unless the transaction is retargetable()
+    // the instructions the hook displaces are only saved, not relocated.
     template <typename T>
     Builder &add(const std::string_view &name, T *hook, T **trampoline) {
       names.emplace_back(name);
@@ -52,22 +144,122 @@ public:
       return *this;
     }
 
+    template <typename T>
+    Builder &add(const std::string_view &name, T *hook) {
+      return add(name, hook, static_cast<T **>(nullptr));
+    }
+
+    Builder &engine(Engine engine) {
+      patch_engine = engine;
+      return *this;
+    }
+
+    Builder &haltCheck(HaltCheck check) {
+      halt_check = check;
+      return *this;
+    }
+
+    // Move a thread halted inside the instructions a commit displaces to the
+    // same instruction in the trampoline, which runs them and continues in the
+    // original function, instead of releasing it and retrying after a
+    // backoff. Commits then take a bounded time however hot the targets are.
+    // Threads whose return address lies in a target, or that are halted in a
+    // target added without a trampoline, are still retried.
+    Builder &relocateThreads() {
+      relocate_threads = true;
+      return *this;
+    }
+
+    // Route every hook through a pointer slot so it can be swapped with
+    // retarget() or disable() after commit without patching code again.
+    Builder &retargetable() {
+      retargetable_hooks = true;
+      return *this;
+    }
+
+    // Search the module files that prepare() must parse in parallel on
+    // executor, e.g. Symbols::parallelExecutor(). Targets resolve to the same
+    // functions as without one.
+    Builder &lookupExecutor(Symbols::Executor executor) {
+      lookup_executor = std::move(executor);
+      return *this;
+    }
+
+    Builder &onStats(StatsCallback callback) {
+      stats_callback = std::move(callback);
+      return *this;
+    }
+
     Transaction build() const {
-      return Transaction(std::move(names), std::move(hooks));
+      return Transaction(std::move(names), std::move(hooks),
+                         std::move(trampoline_addrs), patch_engine,
+                         halt_check, relocate_threads, retargetable_hooks,
+                         lookup_executor, std::move(stats_callback));
     }
 
   private:
     std::vector<std::string_view> names;
     std::vector<std::uintptr_t> hooks;
     std::vector<std::uintptr_t *> trampoline_addrs;
+    Engine patch_engine = EngineHalting;
+    HaltCheck halt_check = HaltCheckContext;
+    bool relocate_threads = false;
+    bool retargetable_hooks = false;
+    Symbols::Executor lookup_executor;
+    StatsCallback stats_callback;
   };
 
+  ~Transaction();
+
   ResultCode prepare();
 
+  // Apply every hook. Each caller-supplied trampoline pointer is set to a
+  // trampoline that calls the original function before the hooks go live.
   ResultCode commit();
 
+  // Restore every hooked function. Trampoline pointers are reset to the
+  // original function address. The trampolines are never freed, since a hook
+  // may still be about to call through one, but are reused by a later prepare
+  // of the same target.
   ResultCode rollback();
 
+  // Change the hooks of a committed transaction without touching the others,
+  // which stay live throughout. The targets of additions, if given, must be
+  // prepared and are moved into this transaction; additions is left empty.
+  // The targets named in removals are restored. Only the changed targets are
+  // patched, under a single halt when any of them needs one. Fails with
+  // ErrorConflictingTargets if an addition overlaps a target of this
+  // transaction, including one being removed, since it was prepared while
+  // that hook was installed.
+  ResultCode update(Transaction *additions,
+                    std::span<const std::string_view> removals = {});
+
+  // Point the hook of a committed, retargetable transaction at another
+  // function. The entry of the target jumps through a slot holding the hook
+  // address, so this is a single atomic store: no thread is halted and no code
+  // is modified. Calls already in the previous hook finish there.
+  template <typename T>
+  ResultCode retarget(const std::string_view &name, T *hook) noexcept {
+    return retargetSlot(name, reinterpret_cast<std::uintptr_t>(hook));
+  }
+
+  // Send calls to a retargetable target straight to the original function
+  // until it is retargeted again, without restoring its code.
+  ResultCode disable(const std::string_view &name) noexcept;
+
+  // Commit several prepared transactions together, e.g. the hooks of
+  // independent components, halting threads at most once for all of them
+  // rather than once per transaction. Nothing is patched if two of the
+  // transactions patch overlapping code.
+  static ResultCode commitAll(std::span<Transaction *const> txns);
+
+  // Roll back several transactions committed together or separately, halting
+  // threads at most once.
+  static ResultCode rollbackAll(std::span<Transaction *const> txns);
+
+  // Timings of the most recent operation.
+  const Stats &stats() const noexcept { return _stats; }
+
 private:
   enum State {
     TxnInitialized = 0,
@@ -81,50 +273,292 @@ private:
     Restore = 1,
   };
 
-  struct ThreadControlBlock {
+  enum PatchMode {
+    ModeHalting = 0,
+    ModeEntryPad,
+    ModeBreakpoint,
+  };
+
+  // Written by the signaller and by the one thread it halts. Blocks start on
+  // their own cache line so threads acknowledging at the same time do not
+  // contend for one.
+  struct alignas(64) ThreadControlBlock {
     static constexpr size_t MAX_FRAME_COUNT = 64;
-    pid_t tid;
-    Event handlerWork;
-    Event handlerExit;
+    static constexpr size_t MAX_FRAME_POINTERS = 16;
+    pid_t tid = 0;
+    std::uint32_t signalled = 0; // sequence number of the latest signal
+    std::uint32_t released = 0;  // latest signal the handler may return from
+    bool acknowledged = false;
+    CountdownLatch *acknowledgements = nullptr; // shared by a batch
+    Generation *releases = nullptr;             // shared by the whole halt
+    HaltCheck check = HaltCheckContext;
+    std::uintptr_t pc;           // where the thread was interrupted
+    std::uintptr_t resumeAt = 0; // where to move it on release, if anywhere
     size_t frameCount;
+    bool needRetry = false;
+    std::uint32_t retries = 0;
+    std::chrono::steady_clock::time_point signalTime;
+    std::chrono::steady_clock::time_point acknowledgeTime;
+    Stats::Duration latency{};
     void *frames[MAX_FRAME_COUNT];
   };
 
   Transaction(const std::vector<std::string_view> &&names,
-              const std::vector<std::uintptr_t> hooks)
-      : _state(TxnInitialized), _names(std::move(names)),
-        _hooks(std::move(hooks)) {}
+              const std::vector<std::uintptr_t> hooks,
+              const std::vector<std::uintptr_t *> trampolineAddrs,
+              Engine engine, HaltCheck haltCheck, bool relocateThreads,
+              bool retargetable, Symbols::Executor lookupExecutor,
+              StatsCallback statsCallback)
+      : _state(TxnInitialized), _engine(engine), _haltCheck(haltCheck),
+        _relocateThreads(relocateThreads), _retargetable(retargetable),
+        _names(std::move(names)),
+        _hooks(std::move(hooks)), _trampolineAddrs(std::move(trampolineAddrs)),
+        _lookupExecutor(std::move(lookupExecutor)),
+        _statsCallback(std::move(statsCallback)) {}
+
+  ResultCode prepareTargets();
+
+  ResultCode applyHooks();
+
+  ResultCode restoreTargets();
+
+  [[nodiscard]]
+  ResultCode retargetSlot(const std::string_view &name,
+                          std::uintptr_t addr) noexcept;
+
+  ResultCode updateTargets(Transaction *additions,
+                           std::span<const std::string_view> removals);
+
+  // Move the targets of from at indices to the end of this transaction.
+  void takeTargets(Transaction &from, std::span<const std::size_t> indices);
+
+  // The bytes [first, second) overwritten when target idx is patched.
+  [[nodiscard]]
+  std::pair<std::uintptr_t, std::uintptr_t>
+  patchedBytes(std::size_t idx) const noexcept;
+
+  // The pages of known holding the patched bytes of every target.
+  [[nodiscard]]
+  std::vector<CodeWriter::PageRange>
+  targetPageRanges(std::span<const CodeWriter::PageRange> known) const;
+
+  // Run an operation with a fresh set of stats and report them when it ends.
+  template <typename Fn> ResultCode measure(Operation operation, Fn &&fn);
+
+  void flushInstructionCache(std::uintptr_t addr, std::size_t size) noexcept;
+
+  [[nodiscard]]
+  bool syncCores() noexcept;
 
   Transaction(const Transaction&) = delete;
   Transaction &operator=(const Transaction&) = delete;
 
+  // Transactions patched under a single halt of every thread.
+  using Batch = std::span<Transaction *const>;
+
+  // Like measure() for every transaction in txns. Costs shared by the batch
+  // are reported by each of them.
+  template <typename Fn>
+  static ResultCode measureAll(Batch txns, Operation operation, Fn &&fn);
+
   [[nodiscard]]
   bool isPatchTarget(std::uintptr_t addr) const noexcept;
 
   [[nodiscard]]
-  ResultCode preparePagesForWrite() const noexcept;
+  static bool isPatchTarget(Batch txns, std::uintptr_t addr) noexcept;
+
+  // Where a thread interrupted at pc inside a target or its trampoline can
+  // resume once the command is applied without being retried, with
+  // relocateThreads(): the entry itself, or the same instruction in the
+  // trampoline when hooking and back in the target when unhooking. Returns
+  // nothing if pc is elsewhere or the thread must be retried.
+  [[nodiscard]]
+  std::optional<std::uintptr_t> resumeAt(PatchCommand command,
+                                         std::uintptr_t pc) const noexcept;
+
+  [[nodiscard]]
+  bool hasHaltingTargets() const noexcept;
+
+  [[nodiscard]]
+  static bool hasConflicts(Batch txns);
+
+  // The most thorough check asked for by any transaction in txns.
+  [[nodiscard]]
+  static HaltCheck haltCheck(Batch txns) noexcept;
+
+  [[nodiscard]]
+  static std::vector<CodeWriter::PageRange> mergePageRanges(Batch txns);
+
+  [[nodiscard]]
+  static ResultCode signalThread(pid_t targetTid,
+                                 ThreadControlBlock &controlBlock) noexcept;
+
+  // Count the acknowledgement of the latest signal once, whether the handler
+  // or the signaller gets there first. Returns false if already counted.
+  static bool acknowledge(ThreadControlBlock &controlBlock) noexcept;
+
+  // Let the handler for the latest signal return.
+  static void release(ThreadControlBlock &controlBlock) noexcept;
+
+  [[nodiscard]]
+  static ResultCode awaitThreads(std::span<const pid_t> targetTids,
+                                 std::span<ThreadControlBlock> controlBlocks,
+                                 CountdownLatch &acknowledgements) noexcept;
+
+  [[nodiscard]]
+  static bool needsRetry(Batch txns, std::span<const PatchCommand> commands,
+                         pid_t targetTid,
+                         ThreadControlBlock &controlBlock) noexcept;
+
+  [[nodiscard]]
+  static ResultCode haltThread(Batch txns,
+                               std::span<const PatchCommand> commands,
+                               pid_t targetTid,
+                               ThreadControlBlock &controlBlock) noexcept;
+
+  [[nodiscard]]
+  static ResultCode haltThreads(Batch txns,
+                                std::span<const PatchCommand> commands,
+                                std::span<const pid_t> targetTids,
+                                std::span<ThreadControlBlock> controlBlocks)
+      noexcept;
+
+  [[nodiscard]]
+  static ResultCode haltAllThreads(Batch txns,
+                                   std::span<const PatchCommand> commands,
+                                   std::span<pid_t> snapshotTids,
+                                   std::span<pid_t> haltedTids,
+                                   std::span<ThreadControlBlock> controlBlocks,
+                                   bool &overflow) noexcept;
 
+  // Patch every transaction in txns with the matching command. Costs shared by
+  // the whole batch, such as halting threads, are recorded in stats. A failure
+  // puts back whatever was already written.
   [[nodiscard]]
-  ResultCode restorePagePermissions() const noexcept;
+  static ResultCode patch(Batch txns, std::span<const PatchCommand> commands,
+                          Stats &stats);
 
   [[nodiscard]]
-  ResultCode haltThread(pid_t targetTid,
-                        ThreadControlBlock &controlBlock) const noexcept;
+  static ResultCode patch(Batch txns, PatchCommand command, Stats &stats);
 
   [[nodiscard]]
-  ResultCode patch(PatchCommand command);
+  static ResultCode patchHalting(Batch txns,
+                                 std::span<const PatchCommand> commands,
+                                 CodeWriter &writer, Stats &stats);
+
+  [[nodiscard]]
+  ResultCode writeHaltingPatches(CodeWriter &writer, PatchCommand command);
+
+  // Point the caller's trampoline pointers at the originals before a commit.
+  void publishOriginals() noexcept;
+
+  // Reset the caller's trampoline pointers once targets are restored.
+  void finishRollback() noexcept;
+
+  [[nodiscard]]
+  ResultCode patchEntryPads(CodeWriter &writer, PatchCommand command);
+
+  [[nodiscard]]
+  ResultCode patchBreakpoints(CodeWriter &writer, PatchCommand command);
+
+  void retireTrampolines() noexcept;
+
+  void releaseSlots() noexcept;
+
+  // Install backtraceHandler for SIGUSR1 unless it already is.
+  [[nodiscard]]
+  static bool installHaltHandler() noexcept;
+
+  // Whether a SIGUSR1 was sent by a recent halt, and which control block of it
+  // the signal is for.
+  static bool isHaltSignal(const siginfo_t &info, std::uint32_t &generation,
+                           std::size_t &idx) noexcept;
+
+  // The control block of the active halt that a SIGUSR1 is for, if any.
+  static ThreadControlBlock *haltControlBlock(const siginfo_t &info) noexcept;
 
   static void backtraceHandler(int signal, siginfo_t *info,
                                void *context) noexcept;
 
+  static void breakpointHandler(int signal, siginfo_t *info,
+                                void *context) noexcept;
+
+  static bool isBreakpointSite(std::uintptr_t addr) noexcept;
+
+  // Functions built with -fpatchable-function-entry have NOP pads before and
+  // at their entry. They are patched without halting any thread: the jump to
+  // the hook is written into the unused pad before the entry, then the entry
+  // NOPs are replaced by a short jump into the pad with a single atomic store.
+  struct EntryPad {
+    std::uintptr_t addr = 0;
+    std::vector<uint8_t> code;
+  };
+
+  // Where the breakpoint handler sends a thread that hit the int3 at addr:
+  // the hook while the target is being patched, and the trampoline running
+  // the original instruction while it is being restored.
+  struct BreakpointSite {
+    std::uintptr_t addr;
+    std::uintptr_t hook;
+    std::uintptr_t original;
+  };
+
+  struct BreakpointTable {
+    std::span<const BreakpointSite> sites;
+    PatchCommand command;
+  };
+
+  // Every address a breakpoint was ever written to. A trap can be delivered
+  // after its breakpoint was replaced, so addresses are never removed. Each
+  // block is published once filled and is then read without a lock.
+  struct BreakpointHistory {
+    std::vector<std::uintptr_t> addrs;
+    const BreakpointHistory *next;
+  };
+
+  // The halt in progress. Signals name it by generation and their control
+  // block by index, so a signal left pending by an earlier halt that failed is
+  // told apart instead of touching memory that was freed.
+  struct HaltState {
+    std::uint32_t generation;
+    std::span<ThreadControlBlock> controlBlocks;
+  };
+
+  static HaltState *_activeHalt;
+  static unsigned _haltHandlers; // handlers that may read the active halt
+  static std::uint32_t _haltGeneration;
+  static constexpr std::uint32_t recentHalts = 1u << 16;
+  static const struct sigaction *_previousHaltAction;
+
+  static BreakpointTable *_activeBreakpoints;
+  static unsigned _breakpointHandlers; // handlers that may read the table
+  static const BreakpointHistory *_breakpointHistory;
+  static const struct sigaction *_previousTrapAction;
+
   static std::size_t _pageSize;
 
   State _state;
+  Engine _engine;
+  HaltCheck _haltCheck;
+  bool _relocateThreads;
+  bool _retargetable;
   std::vector<std::string_view> _names;
   std::vector<std::uintptr_t> _hooks;
+  std::vector<std::uintptr_t *> _trampolineAddrs;
+  std::vector<std::uintptr_t> _trampolines; // 0 for a target without one
+  std::vector<std::uintptr_t> _stubs;       // 0 for a target without one
+  std::vector<std::uintptr_t> _originals;
+  std::vector<std::uintptr_t> _slots; // 0 for a target hooked directly
+  std::vector<PatchMode> _modes;
+  std::vector<EntryPad> _entryPads;
+  std::vector<BreakpointSite> _breakpointSites;
   std::vector<Symbols::Descriptor> _descriptors;
-  std::unordered_map<uintptr_t, int> _pagePermissions;
+  std::vector<CodeWriter::PageRange> _pageRanges;
   std::vector<std::vector<uint8_t>> _origInstrs;
+  std::vector<std::vector<uint8_t>> _patchInstrs;
+  Symbols::Executor _lookupExecutor;
+  StatsCallback _statsCallback;
+  Stats _stats;
 };
 
 }; // namespace Interject
@@ -17,6 +17,8 @@
 #include "unwind.hxx"
 
 #include <execinfo.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #if defined(__ANDROID__)
 #include <unwind.h>
@@ -68,4 +70,60 @@ std::size_t backtrace(std::span<void *> stackFrames) {
 std::size_t backtrace(std::span<void *> stackFrames) { return 0; }
 #endif
 
+// Copy size bytes at addr in this process to out, failing rather than
+// faulting if any of them are not mapped.
+static bool readSafely(std::uintptr_t addr, void *out, std::size_t size) {
+  struct iovec local = {.iov_base = out, .iov_len = size};
+  struct iovec remote = {.iov_base = reinterpret_cast<void *>(addr),
+                         .iov_len = size};
+  return ::process_vm_readv(::getpid(), &local, 1, &remote, 1, 0) ==
+         static_cast<ssize_t>(size);
+}
+
+std::size_t fromContext(const ucontext_t &context,
+                        std::span<void *> stackFrames,
+                        std::size_t framePointers) {
+#if defined(__x86_64__)
+  const std::uintptr_t pc = context.uc_mcontext.gregs[REG_RIP];
+  const std::uintptr_t sp = context.uc_mcontext.gregs[REG_RSP];
+  std::uintptr_t fp = context.uc_mcontext.gregs[REG_RBP];
+  // The kernel pushed the signal frame just below the stack pointer, so the
+  // word it points at is mapped.
+  const std::uintptr_t ret = *reinterpret_cast<const std::uintptr_t *>(sp);
+#elif defined(__aarch64__)
+  const std::uintptr_t pc = context.uc_mcontext.pc;
+  const std::uintptr_t sp = context.uc_mcontext.sp;
+  std::uintptr_t fp = context.uc_mcontext.regs[29];
+  const std::uintptr_t ret = context.uc_mcontext.regs[30];
+#else
+  return 0;
+#endif
+
+  std::size_t count = 0;
+  for (const std::uintptr_t frame : {pc, ret}) {
+    if (count < stackFrames.size()) {
+      stackFrames[count++] = reinterpret_cast<void *>(frame);
+    }
+  }
+
+  // Each frame record holds the caller's frame pointer followed by the return
+  // address. Records only ever move toward the top of the stack.
+  for (std::size_t depth = 0;
+       depth < framePointers && count < stackFrames.size(); depth++) {
+    if (fp < sp || fp % sizeof(std::uintptr_t) != 0) {
+      break;
+    }
+    std::uintptr_t record[2];
+    if (!readSafely(fp, record, sizeof(record)) || record[1] == 0) {
+      break;
+    }
+    stackFrames[count++] = reinterpret_cast<void *>(record[1]);
+    if (record[0] <= fp) {
+      break;
+    }
+    fp = record[0];
+  }
+  return count;
+}
+
 }; // namespace Interject::Unwind
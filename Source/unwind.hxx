@@ -19,8 +19,22 @@
 #include <cstdint>
 #include <span>
 
+#include <ucontext.h>
+
 namespace Interject::Unwind {
 
 std::size_t backtrace(std::span<void *> stackFrames);
 
+// Capture the frames of a thread interrupted by a signal from the context
+// passed to its handler, without unwinding. The first frame is the interrupted
+// PC and the second the return address in use if the thread was stopped
+// before setting up a frame: the top of the stack on x86_64, the link register
+// on arm64. Then up to framePointers return addresses are found by following
+// the frame pointer chain, read with a fault-safe copy so functions built
+// without frame pointers end the walk instead of crashing it.
+// Async-signal-safe.
+std::size_t fromContext(const ucontext_t &context,
+                        std::span<void *> stackFrames,
+                        std::size_t framePointers = 0);
+
 }; // namespace Interject::Unwind
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <code_writer.hxx>
+#include <memory_map.hxx>
+
+using namespace Interject;
+
+TEST_CASE("Write to read-only pages", "[code_writer]") {
+  const size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  void *page = ::mmap(nullptr, pageSize * 2, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  REQUIRE(page != MAP_FAILED);
+
+  const uintptr_t start = reinterpret_cast<uintptr_t>(page);
+  const CodeWriter::PageRange ranges[] = {
+      {start, pageSize * 2, PROT_READ | PROT_EXEC},
+  };
+
+  // Write a sequence spanning the page boundary.
+  const uint8_t bytes[] = {1, 2, 3, 4, 5, 6, 7, 8};
+  const uintptr_t addr = start + pageSize - sizeof(bytes) / 2;
+  bool changedPermissions;
+  {
+    CodeWriter writer(ranges);
+    REQUIRE(writer.write(addr, bytes));
+    changedPermissions = writer.changedPermissions();
+  }
+
+  CHECK(std::memcmp(reinterpret_cast<void *>(addr), bytes, sizeof(bytes)) ==
+        0);
+
+  // Whichever way the bytes were written, the original protections remain.
+  MemoryMap map;
+  REQUIRE(map.load());
+  const auto region = map.find(start);
+  REQUIRE(region);
+  CHECK(region->permissions == (PROT_READ | PROT_EXEC));
+  if (!changedPermissions) {
+    // Nothing should have split the mapping either.
+    CHECK(region->end - region->start >= pageSize * 2);
+  }
+
+  ::munmap(page, pageSize * 2);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Built into one shared library per kind of separate debug information, each
+// stripped so FIXTURE_NAME(hidden) is only found through that information.
+// FIXTURE names the library so every copy defines different symbols.
+
+#include <stddef.h>
+
+#define FIXTURE_CONCAT(prefix, name) prefix##_##name
+#define FIXTURE_EXPAND(prefix, name) FIXTURE_CONCAT(prefix, name)
+#define FIXTURE_NAME(name) FIXTURE_EXPAND(FIXTURE, name)
+
+__attribute__((noinline, used))
+static size_t FIXTURE_NAME(hidden)(size_t n) {
+  return n * 7;
+}
+
+// Exported so a test can compare the address it looked up.
+void *FIXTURE_NAME(hidden_address)(void) {
+  return (void *)&FIXTURE_NAME(hidden);
+}
@@ -0,0 +1,85 @@
+#
+# Copyright 2025 Andrew Rogers
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# Strip the shared library INPUT into OUTPUT_DIR, keeping its symbols in the
+# separate debug information named by KIND:
+#   debuglink            a debug file next to it named by .gnu_debuglink
+#   buildid              a debug file under OUTPUT_DIR/debug/.build-id
+#   debugdata            MiniDebugInfo in .gnu_debugdata
+#   empty_debugdata      an empty .gnu_debugdata
+#   truncated_debugdata  the first half of the MiniDebugInfo xz stream
+# Run with cmake -P, given OBJCOPY, READELF and, for the .gnu_debugdata kinds,
+# XZ.
+
+get_filename_component(name ${INPUT} NAME)
+get_filename_component(stem ${INPUT} NAME_WE)
+set(output ${OUTPUT_DIR}/${name})
+file(MAKE_DIRECTORY ${OUTPUT_DIR})
+
+if(KIND STREQUAL "debuglink")
+  set(debug ${OUTPUT_DIR}/${stem}.debug)
+  execute_process(COMMAND ${OBJCOPY} --only-keep-debug ${INPUT} ${debug}
+                  COMMAND_ERROR_IS_FATAL ANY)
+  execute_process(COMMAND ${OBJCOPY} --strip-all
+                          --add-gnu-debuglink=${debug} ${INPUT} ${output}
+                  COMMAND_ERROR_IS_FATAL ANY)
+
+elseif(KIND STREQUAL "buildid")
+  execute_process(COMMAND ${READELF} --notes ${INPUT}
+                  OUTPUT_VARIABLE notes COMMAND_ERROR_IS_FATAL ANY)
+  if(NOT notes MATCHES "Build ID: ([0-9a-f][0-9a-f])([0-9a-f]+)")
+    message(FATAL_ERROR "${INPUT} has no build-id")
+  endif()
+  set(debug ${OUTPUT_DIR}/debug/.build-id/${CMAKE_MATCH_1}/${CMAKE_MATCH_2}.debug)
+  get_filename_component(debugDir ${debug} DIRECTORY)
+  file(MAKE_DIRECTORY ${debugDir})
+  execute_process(COMMAND ${OBJCOPY} --only-keep-debug ${INPUT} ${debug}
+                  COMMAND_ERROR_IS_FATAL ANY)
+  execute_process(COMMAND ${OBJCOPY} --strip-all ${INPUT} ${output}
+                  COMMAND_ERROR_IS_FATAL ANY)
+
+elseif(KIND MATCHES "debugdata$")
+  # MiniDebugInfo is the symbol table without the DWARF, compressed with xz.
+  set(work ${OUTPUT_DIR}/${stem}.work)
+  file(MAKE_DIRECTORY ${work})
+  set(mini ${work}/mini_debuginfo)
+  execute_process(COMMAND ${OBJCOPY} --only-keep-debug ${INPUT} ${mini}
+                  COMMAND_ERROR_IS_FATAL ANY)
+  execute_process(COMMAND ${OBJCOPY} --strip-debug --remove-section .comment
+                          ${mini}
+                  COMMAND_ERROR_IS_FATAL ANY)
+  execute_process(COMMAND ${XZ} --force ${mini} COMMAND_ERROR_IS_FATAL ANY)
+
+  set(section ${mini}.xz)
+  if(KIND STREQUAL "empty_debugdata")
+    set(section ${work}/empty)
+    file(WRITE ${section} "")
+  elseif(KIND STREQUAL "truncated_debugdata")
+    file(SIZE ${mini}.xz size)
+    math(EXPR half "${size} / 2")
+    set(section ${work}/truncated.xz)
+    execute_process(COMMAND head -c ${half} ${mini}.xz OUTPUT_FILE ${section}
+                    COMMAND_ERROR_IS_FATAL ANY)
+  endif()
+
+  execute_process(COMMAND ${OBJCOPY} --strip-all
+                          --add-section .gnu_debugdata=${section}
+                          ${INPUT} ${output}
+                  COMMAND_ERROR_IS_FATAL ANY)
+
+else()
+  message(FATAL_ERROR "unknown debug fixture kind ${KIND}")
+endif()
@@ -0,0 +1,313 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch_test_macros.hpp>
+
+#include <array>
+#include <cstring>
+#include <vector>
+
+#include <disassembler.hxx>
+
+using namespace Interject;
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+template <typename T> static std::uintptr_t addressOf(const T &code) {
+  return reinterpret_cast<std::uintptr_t>(code.data());
+}
+
+TEST_CASE("Decode x86-64 instruction lengths", "[disassembler]") {
+  const std::vector<std::vector<uint8_t>> instrs = {
+      {0x55},                                           // push rbp
+      {0x48, 0x89, 0xe5},                               // mov rbp, rsp
+      {0x48, 0x83, 0xec, 0x10},                         // sub rsp, 0x10
+      {0x48, 0x89, 0x7c, 0x24, 0xf8},                   // mov [rsp-8], rdi
+      {0x48, 0xb8, 1, 2, 3, 4, 5, 6, 7, 8},             // movabs rax, imm64
+      {0x66, 0xb8, 0x34, 0x12},                         // mov ax, 0x1234
+      {0x48, 0x8d, 0x05, 0x10, 0x00, 0x00, 0x00},       // lea rax, [rip+0x10]
+      {0xc5, 0xfe, 0x6f, 0x07},                         // vmovdqu ymm0, [rdi]
+      {0xc4, 0xe3, 0x7d, 0x18, 0xc1, 0x01},             // vinsertf128
+      {0x62, 0xf1, 0xfe, 0x48, 0x6f, 0x07},             // vmovdqu64 zmm0, [rdi]
+      {0xf3, 0x0f, 0x1e, 0xfa},                         // endbr64
+      {0x0f, 0x1f, 0x44, 0x00, 0x00},                   // nop [rax+rax]
+      {0x66, 0x0f, 0x3a, 0x0f, 0xc1, 0x08},             // palignr xmm0, xmm1, 8
+      {0xf6, 0xc1, 0x01},                               // test cl, 1
+      {0xf7, 0xc1, 0x01, 0x00, 0x00, 0x00},             // test ecx, 1
+      {0xf7, 0xd9},                                     // neg ecx
+      {0x64, 0x48, 0x8b, 0x04, 0x25, 0x28, 0, 0, 0},    // mov rax, fs:0x28
+      {0xc7, 0x44, 0x24, 0x08, 0x01, 0x00, 0x00, 0x00}, // mov [rsp+8], 1
+      {0x0f, 0x84, 0x00, 0x01, 0x00, 0x00},             // je rel32
+      {0xe8, 0x00, 0x01, 0x00, 0x00},                   // call rel32
+      {0xc3},                                           // ret
+  };
+
+  for (const auto &instr : instrs) {
+    std::vector<uint8_t> code(instr);
+    code.push_back(0xcc);
+
+    // Copying a single byte rounds up to the whole instruction.
+    const auto copied = Disassembler::copyInstrs(addressOf(code), code.size(), 1);
+    REQUIRE(copied);
+    CHECK(copied->size() == instr.size());
+  }
+}
+
+TEST_CASE("Copy whole x86-64 instructions", "[disassembler]") {
+  const std::array<uint8_t, 16> code = {
+      0x55,                         // push rbp
+      0x48, 0x89, 0xe5,             // mov rbp, rsp
+      0x48, 0x83, 0xec, 0x10,       // sub rsp, 0x10
+      0x48, 0x89, 0x7d, 0xf8,       // mov [rbp-8], rdi
+      0xc9,                         // leave
+      0xc3,                         // ret
+      0xcc, 0xcc,
+  };
+
+  const auto copied = Disassembler::copyInstrs(addressOf(code), code.size(), 10);
+  REQUIRE(copied);
+  CHECK(copied->data() == code.data());
+  CHECK(copied->size() == 12);
+
+  // The copy must not extend past the end of the function.
+  CHECK_FALSE(Disassembler::copyInstrs(addressOf(code), 10, 10));
+}
+
+TEST_CASE("Refuse branches into copied x86-64 instructions", "[disassembler]") {
+  const std::array<uint8_t, 12> code = {
+      0x31, 0xc0,             // xor eax, eax
+      0x48, 0xff, 0xc0,       // loop: inc rax
+      0x48, 0x83, 0xf8, 0x0a, // cmp rax, 10
+      0x75, 0xf7,             // jne loop
+      0xc3,                   // ret
+  };
+
+  CHECK(Disassembler::copyInstrs(addressOf(code), code.size(), 2));
+  CHECK_FALSE(Disassembler::copyInstrs(addressOf(code), code.size(), 3));
+}
+
+TEST_CASE("Find calls in copied x86-64 instructions", "[disassembler]") {
+  const std::array<uint8_t, 8> prologue = {
+      0x55,             // push rbp
+      0x48, 0x89, 0xe5, // mov rbp, rsp
+      0x48, 0xff, 0xc0, // inc rax
+      0xc3,             // ret
+  };
+  const std::array<uint8_t, 6> direct = {
+      0x55,                         // push rbp
+      0xe8, 0x00, 0x01, 0x00, 0x00, // call rel32
+  };
+  const std::array<uint8_t, 7> indirect = {
+      0x41, 0xff, 0xd3,       // call r11
+      0xff, 0x50, 0x08,       // call [rax+8]
+      0xc3,                   // ret
+  };
+
+  CHECK_FALSE(Disassembler::containsCalls(prologue));
+  CHECK(Disassembler::containsCalls(direct));
+  CHECK(Disassembler::containsCalls(std::span(indirect).first(3)));
+  CHECK(Disassembler::containsCalls(std::span(indirect).subspan(3)));
+}
+
+TEST_CASE("Relocate x86-64 instructions", "[disassembler]") {
+  const std::array<uint8_t, 18> code = {
+      0x48, 0x8d, 0x05, 0x10, 0x00, 0x00, 0x00, // lea rax, [rip+0x10]
+      0x74, 0x20,                               // je +0x20
+      0xe8, 0x00, 0x01, 0x00, 0x00,             // call +0x100
+      0xeb, 0x10,                               // jmp +0x10
+      0xcc, 0xcc,
+  };
+  const auto srcAddr = addressOf(code);
+  const auto dstAddr = srcAddr + 0x1000;
+  const auto instrs = std::span(code).first(16);
+
+  std::array<uint8_t, 64> out;
+  const auto size = Disassembler::relocateInstrs(srcAddr, instrs, dstAddr, out);
+  REQUIRE(size);
+  REQUIRE(*size == 7 + 6 + 5 + 5);
+
+  const auto readRel32 = [&](std::size_t offset) {
+    int32_t rel;
+    std::memcpy(&rel, out.data() + offset, sizeof(rel));
+    return rel;
+  };
+
+  // The RIP-relative operand still addresses the same memory.
+  CHECK(std::equal(code.begin(), code.begin() + 3, out.begin()));
+  CHECK(dstAddr + 7 + readRel32(3) == srcAddr + 7 + 0x10);
+
+  // The short conditional branch is widened to rel32.
+  CHECK(out[7] == 0x0f);
+  CHECK(out[8] == 0x84);
+  CHECK(dstAddr + 13 + readRel32(9) == srcAddr + 9 + 0x20);
+
+  CHECK(out[13] == 0xe8);
+  CHECK(dstAddr + 18 + readRel32(14) == srcAddr + 14 + 0x100);
+
+  CHECK(out[18] == 0xe9);
+  CHECK(dstAddr + 23 + readRel32(19) == srcAddr + 16 + 0x10);
+
+  // Instructions after a widened branch start further into the copy.
+  CHECK(Disassembler::relocatedOffset(instrs, 0) == 0);
+  CHECK(Disassembler::relocatedOffset(instrs, 7) == 7);
+  CHECK(Disassembler::relocatedOffset(instrs, 9) == 13);
+  CHECK(Disassembler::relocatedOffset(instrs, 14) == 18);
+  CHECK(Disassembler::relocatedOffset(instrs, 16) == 23);
+  CHECK_FALSE(Disassembler::relocatedOffset(instrs, 8));
+  CHECK_FALSE(Disassembler::relocatedOffset(instrs, 17));
+
+  // The relocated code must fit in the output.
+  CHECK_FALSE(Disassembler::relocateInstrs(srcAddr, instrs, dstAddr,
+                                           std::span(out).first(20)));
+
+  // Branches within the relocated instructions cannot be relocated.
+  const std::array<uint8_t, 3> loop = {0xeb, 0x00, 0x90}; // jmp +0; nop
+  CHECK_FALSE(Disassembler::relocateInstrs(addressOf(loop), loop, dstAddr, out));
+}
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+
+template <typename T> static std::uintptr_t addressOf(const T &code) {
+  return reinterpret_cast<std::uintptr_t>(code.data());
+}
+
+template <typename T> static std::span<const uint8_t> bytesOf(const T &code) {
+  return {reinterpret_cast<const uint8_t *>(code.data()), sizeof(code)};
+}
+
+static uint32_t instrAt(std::span<const uint8_t> out, std::size_t offset) {
+  uint32_t instr;
+  std::memcpy(&instr, out.data() + offset, sizeof(instr));
+  return instr;
+}
+
+// The register and address set by movz and three movk at offset in out.
+static std::pair<uint32_t, std::uintptr_t>
+movAddrAt(std::span<const uint8_t> out, std::size_t offset) {
+  const uint32_t reg = instrAt(out, offset) & 0x1f;
+  std::uintptr_t addr = 0;
+  for (uint32_t hw = 0; hw < 4; hw++) {
+    const uint32_t instr = instrAt(out, offset + hw * 4);
+    CHECK((instr & 0xff800000) == (hw == 0 ? 0xd2800000 : 0xf2800000));
+    CHECK(((instr >> 21) & 3) == hw);
+    CHECK((instr & 0x1f) == reg);
+    addr |= std::uintptr_t((instr >> 5) & 0xffff) << (16 * hw);
+  }
+  return {reg, addr};
+}
+
+TEST_CASE("Relocate arm64 prologues that load addresses", "[disassembler]") {
+  const std::array<uint32_t, 6> code = {
+      0xa9bf7bfd, // stp x29, x30, [sp, #-16]!
+      0x910003fd, // mov x29, sp
+      0xb0000088, // adrp x8, #0x11000
+      0xf9400908, // ldr x8, [x8, #0x10]
+      0xd65f03c0, // ret
+      0xd503201f, // nop
+  };
+  const auto srcAddr = addressOf(code);
+  const auto copied = Disassembler::copyInstrs(srcAddr, sizeof(code), 16);
+  REQUIRE(copied);
+  REQUIRE(copied->size() == 16);
+
+  std::array<uint8_t, 64> out;
+  const auto size =
+      Disassembler::relocateInstrs(srcAddr, *copied, srcAddr + 0x1000, out);
+  REQUIRE(size);
+  REQUIRE(*size == 4 + 4 + 16 + 4);
+
+  // Only the adrp changes, into x8 holding the same page.
+  CHECK(instrAt(out, 0) == code[0]);
+  CHECK(instrAt(out, 4) == code[1]);
+  const auto [reg, addr] = movAddrAt(out, 8);
+  CHECK(reg == 8);
+  CHECK(addr == ((srcAddr + 8) & ~std::uintptr_t(0xfff)) + 0x11000);
+  CHECK(instrAt(out, 24) == code[3]);
+
+  CHECK(Disassembler::relocatedOffset(*copied, 8) == 8);
+  CHECK(Disassembler::relocatedOffset(*copied, 12) == 24);
+  CHECK(Disassembler::relocatedOffset(*copied, 16) == 28);
+  CHECK_FALSE(Disassembler::relocatedOffset(*copied, 10));
+
+  // The jump back to the original function clobbers x16, which would lose
+  // the address.
+  const std::array<uint32_t, 4> intoX16 = {
+      0xb0000090, // adrp x16, #0x11000
+      0xf9400a10, // ldr x16, [x16, #0x10]
+      0xd61f0200, // br x16
+      0xd503201f, // nop
+  };
+  CHECK_FALSE(Disassembler::copyInstrs(addressOf(intoX16), sizeof(intoX16), 4));
+}
+
+TEST_CASE("Relocate arm64 branches and literal loads", "[disassembler]") {
+  const std::array<uint32_t, 6> code = {
+      0xb4000200, // cbz x0, #0x40
+      0x94000040, // bl #0x100
+      0x18000101, // ldr w1, #0x20
+      0x54000401, // b.ne #0x80
+      0xd65f03c0, // ret
+      0xd503201f, // nop
+  };
+  const auto srcAddr = addressOf(code);
+  const auto copied = Disassembler::copyInstrs(srcAddr, sizeof(code), 16);
+  REQUIRE(copied);
+  CHECK(Disassembler::containsCalls(*copied));
+
+  std::array<uint8_t, 128> out;
+  const auto size =
+      Disassembler::relocateInstrs(srcAddr, *copied, srcAddr + 0x1000, out);
+  REQUIRE(size);
+  REQUIRE(*size == 24 + 20 + 20 + 24);
+
+  // cbnz x0 over an absolute branch through x16 to the original target.
+  CHECK(instrAt(out, 0) == 0xb50000c0);
+  CHECK(movAddrAt(out, 4) == std::pair<uint32_t, std::uintptr_t>(
+                                 16, srcAddr + 0x40));
+  CHECK(instrAt(out, 20) == 0xd61f0200); // br x16
+
+  // A call through x16.
+  CHECK(movAddrAt(out, 24) == std::pair<uint32_t, std::uintptr_t>(
+                                  16, srcAddr + 4 + 0x100));
+  CHECK(instrAt(out, 40) == 0xd63f0200); // blr x16
+
+  // The literal is loaded from its address built in w1's register.
+  CHECK(movAddrAt(out, 44) == std::pair<uint32_t, std::uintptr_t>(
+                                  1, srcAddr + 8 + 0x20));
+  CHECK(instrAt(out, 60) == 0xb9400021); // ldr w1, [x1]
+
+  CHECK(instrAt(out, 64) == 0x540000c0); // b.eq over the branch
+  CHECK(movAddrAt(out, 68) == std::pair<uint32_t, std::uintptr_t>(
+                                  16, srcAddr + 12 + 0x80));
+  CHECK(instrAt(out, 84) == 0xd61f0200);
+
+  CHECK(Disassembler::relocatedOffset(*copied, 12) == 64);
+
+  // The relocated code must fit in the output.
+  CHECK_FALSE(Disassembler::relocateInstrs(srcAddr, *copied, srcAddr + 0x1000,
+                                           std::span(out).first(80)));
+
+  // Branches within the relocated instructions cannot be relocated.
+  const std::array<uint32_t, 2> loop = {
+      0x14000000, // b #0
+      0xd503201f, // nop
+  };
+  CHECK_FALSE(Disassembler::relocateInstrs(addressOf(loop), bytesOf(loop),
+                                           addressOf(loop) + 0x1000, out));
+}
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <event.hxx>
+
+using namespace Interject;
+
+static constexpr size_t THREAD_COUNT = 8;
+
+TEST_CASE("Set an event with a sleeping waiter", "[event]") {
+  Event event;
+  struct timespec timeout = {.tv_sec = 0, .tv_nsec = 1000000};
+  CHECK_FALSE(event.Wait(&timeout));
+
+  pthread_t threadId;
+  REQUIRE_FALSE(pthread_create(
+      &threadId, nullptr,
+      [](void *arg) -> void * {
+        ::usleep(10000); // long enough for the waiter to stop spinning
+        reinterpret_cast<Event *>(arg)->Set();
+        return nullptr;
+      },
+      &event));
+  event.Wait();
+  CHECK_FALSE(pthread_join(threadId, nullptr));
+
+  event.Reset();
+  CHECK_FALSE(event.Wait(&timeout));
+}
+
+TEST_CASE("Wait once for every acknowledgement", "[event]") {
+  CountdownLatch latch(THREAD_COUNT);
+  struct timespec timeout = {.tv_sec = 0, .tv_nsec = 1000000};
+  CHECK_FALSE(latch.Wait(&timeout));
+
+  pthread_t threadIds[THREAD_COUNT];
+  for (auto &threadId : threadIds) {
+    REQUIRE_FALSE(pthread_create(
+        &threadId, nullptr,
+        [](void *arg) -> void * {
+          ::usleep(1000);
+          reinterpret_cast<CountdownLatch *>(arg)->CountDown();
+          return nullptr;
+        },
+        &latch));
+  }
+  latch.Wait();
+  for (auto &threadId : threadIds) {
+    CHECK_FALSE(pthread_join(threadId, nullptr));
+  }
+
+  latch.Reset(0);
+  CHECK(latch.Wait(&timeout));
+}
+
+struct Waiters {
+  Generation generation;
+  std::uint32_t observed;
+  std::uint32_t waiting = 0;
+  std::uint32_t released = 0;
+};
+
+static void *waitingThread(void *arg) {
+  auto *waiters = reinterpret_cast<Waiters *>(arg);
+  __atomic_add_fetch(&waiters->waiting, 1, __ATOMIC_RELEASE);
+  waiters->generation.WaitPast(waiters->observed);
+  __atomic_add_fetch(&waiters->released, 1, __ATOMIC_RELEASE);
+  return nullptr;
+}
+
+TEST_CASE("Release every waiter by advancing the generation", "[event]") {
+  Waiters waiters;
+  waiters.observed = waiters.generation.Current();
+  struct timespec timeout = {.tv_sec = 0, .tv_nsec = 1000000};
+  CHECK_FALSE(waiters.generation.WaitPast(waiters.observed, &timeout));
+
+  pthread_t threadIds[THREAD_COUNT];
+  for (auto &threadId : threadIds) {
+    REQUIRE_FALSE(pthread_create(&threadId, nullptr, waitingThread, &waiters));
+  }
+  while (__atomic_load_n(&waiters.waiting, __ATOMIC_ACQUIRE) != THREAD_COUNT) {
+    ::usleep(1000);
+  }
+  ::usleep(10000); // let the waiters fall asleep
+  CHECK(__atomic_load_n(&waiters.released, __ATOMIC_ACQUIRE) == 0);
+
+  waiters.generation.Advance();
+  for (auto &threadId : threadIds) {
+    CHECK_FALSE(pthread_join(threadId, nullptr));
+  }
+  CHECK(waiters.released == THREAD_COUNT);
+  CHECK(waiters.generation.Current() != waiters.observed);
+  CHECK(waiters.generation.WaitPast(waiters.observed, &timeout));
+}
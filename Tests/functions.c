@@ -85,6 +85,163 @@ size_t factorial(size_t n) {
   return result;
 }
 
+// Functions with NOP pads reserved before and at their entry. The first pad
+// fits an absolute jump while the second only fits a near jump. They are
+// aligned so the entry NOPs never straddle a cache line, which would prevent
+// patching them with a single atomic store. On x86_64 they are written by
+// hand so their bodies are long enough to be patched by halting threads at
+// any optimization level.
+#if defined(__x86_64__)
+__asm__(".text\n\t"
+        ".p2align 4\n"
+        ".Lpadded_triple_pad:\n\t"
+        ".fill 14, 1, 0x90\n\t"
+        ".globl padded_triple\n\t"
+        ".type padded_triple, @function\n"
+        "padded_triple:\n\t"
+        ".fill 2, 1, 0x90\n\t"
+        "lea (%rdi,%rdi,2), %rax\n\t"
+        "nopw 0x8(%rax,%rax,1)\n\t"
+        "ret\n\t"
+        ".size padded_triple, .-padded_triple\n\t"
+        ".section __patchable_function_entries,\"awo\",@progbits,"
+        "padded_triple\n\t"
+        ".p2align 3\n\t"
+        ".quad .Lpadded_triple_pad\n\t"
+        ".text\n\t"
+        ".p2align 4\n"
+        ".Lpadded_quintuple_pad:\n\t"
+        ".fill 5, 1, 0x90\n\t"
+        ".globl padded_quintuple\n\t"
+        ".type padded_quintuple, @function\n"
+        "padded_quintuple:\n\t"
+        ".fill 2, 1, 0x90\n\t"
+        "lea (%rdi,%rdi,4), %rax\n\t"
+        "nopw 0x8(%rax,%rax,1)\n\t"
+        "ret\n\t"
+        ".size padded_quintuple, .-padded_quintuple\n\t"
+        ".section __patchable_function_entries,\"awo\",@progbits,"
+        "padded_quintuple\n\t"
+        ".p2align 3\n\t"
+        ".quad .Lpadded_quintuple_pad\n\t"
+        ".text\n\t");
+#else
+__attribute__((noinline, used, aligned(16), patchable_function_entry(16, 14)))
+size_t padded_triple(size_t n) {
+  return n * 3;
+}
+
+__attribute__((noinline, used, aligned(16), patchable_function_entry(7, 5)))
+size_t padded_quintuple(size_t n) {
+  return n * 5;
+}
+#endif
+
+// The same, but entered through a single NOP as wide as the jump written over
+// it, so no thread can be part way through the entry when it is replaced.
+// GCC pads x86_64 entries with one-byte NOPs, so these are written by hand
+// there, along with their __patchable_function_entries records.
+#if defined(__x86_64__)
+__asm__(".text\n\t"
+        ".p2align 4\n"
+        ".Lwide_padded_triple_pad:\n\t"
+        ".fill 14, 1, 0x90\n\t"
+        ".globl wide_padded_triple\n\t"
+        ".type wide_padded_triple, @function\n"
+        "wide_padded_triple:\n\t"
+        "xchg %ax, %ax\n\t"
+        "lea (%rdi,%rdi,2), %rax\n\t"
+        "ret\n\t"
+        ".size wide_padded_triple, .-wide_padded_triple\n\t"
+        ".section __patchable_function_entries,\"awo\",@progbits,"
+        "wide_padded_triple\n\t"
+        ".p2align 3\n\t"
+        ".quad .Lwide_padded_triple_pad\n\t"
+        ".text\n\t"
+        ".p2align 4\n"
+        ".Lwide_padded_quintuple_pad:\n\t"
+        ".fill 5, 1, 0x90\n\t"
+        ".globl wide_padded_quintuple\n\t"
+        ".type wide_padded_quintuple, @function\n"
+        "wide_padded_quintuple:\n\t"
+        "xchg %ax, %ax\n\t"
+        "lea (%rdi,%rdi,4), %rax\n\t"
+        "ret\n\t"
+        ".size wide_padded_quintuple, .-wide_padded_quintuple\n\t"
+        ".section __patchable_function_entries,\"awo\",@progbits,"
+        "wide_padded_quintuple\n\t"
+        ".p2align 3\n\t"
+        ".quad .Lwide_padded_quintuple_pad\n\t"
+        ".text\n\t");
+#else
+__attribute__((noinline, used, aligned(16), patchable_function_entry(16, 15)))
+size_t wide_padded_triple(size_t n) {
+  return n * 3;
+}
+
+__attribute__((noinline, used, aligned(16), patchable_function_entry(8, 7)))
+size_t wide_padded_quintuple(size_t n) {
+  return n * 5;
+}
+#endif
+
+#if defined(__x86_64__)
+// Begins with a single instruction long enough to be replaced by a jump, as
+// required to patch it with breakpoints.
+__attribute__((naked, noinline, used))
+size_t times_thousand(__attribute__((unused)) size_t n) {
+  __asm__("imul $1000, %rdi, %rax\n\t"
+          "nopw 0x0(%rax,%rax,1)\n\t"
+          "ret\n\t");
+}
+
+// Spends most of its time in the instructions a patch displaces, so a thread
+// calling it in a loop is usually halted inside the patch target.
+__attribute__((naked, noinline, used))
+size_t pause_plus_one(__attribute__((unused)) size_t n) {
+  __asm__("pause\n\t"
+          "pause\n\t"
+          "pause\n\t"
+          "pause\n\t"
+          "pause\n\t"
+          "pause\n\t"
+          "pause\n\t"
+          "pause\n\t"
+          "lea 1(%rdi), %rax\n\t"
+          "ret\n\t");
+}
+
+// Branches back into the instructions a patch displaces, so it cannot be
+// patched while a thread might take that branch.
+__attribute__((naked, noinline, used))
+size_t looped_triple(__attribute__((unused)) size_t n) {
+  __asm__("xor %eax, %eax\n\t"
+          "test %rdi, %rdi\n\t"
+          "jz 2f\n"
+          "1:\n\t"
+          "add $3, %rax\n\t"
+          "sub $1, %rdi\n\t"
+          "jnz 1b\n"
+          "2:\n\t"
+          "ret\n\t");
+}
+
+// Calls fn within the instructions a patch displaces, so a thread waiting in
+// fn has a return address inside the patch target.
+__attribute__((naked, noinline, used))
+size_t call_plus_one(__attribute__((unused)) size_t n,
+                     __attribute__((unused)) void (*fn)(void)) {
+  __asm__("push %rdi\n\t"
+          ".cfi_adjust_cfa_offset 8\n\t"
+          "call *%rsi\n\t"
+          "pop %rdi\n\t"
+          ".cfi_adjust_cfa_offset -8\n\t"
+          "lea 1(%rdi), %rax\n\t"
+          "nopl 0x0(%rax,%rax,1)\n\t"
+          "ret\n\t");
+}
+#endif
+
 // disable optimizations so that these functions are large enough to be patched
 #pragma clang optimize off
 __attribute__((noinline, used))
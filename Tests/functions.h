@@ -20,6 +20,16 @@ extern "C" size_t isqrt(size_t n);
 extern "C" size_t sum_of_digits(size_t n);
 extern "C" size_t reverse_digits(size_t n);
 extern "C" size_t factorial(size_t n);
+extern "C" size_t padded_triple(size_t n);
+extern "C" size_t padded_quintuple(size_t n);
+extern "C" size_t wide_padded_triple(size_t n);
+extern "C" size_t wide_padded_quintuple(size_t n);
+#if defined(__x86_64__)
+extern "C" size_t times_thousand(size_t n);
+extern "C" size_t pause_plus_one(size_t n);
+extern "C" size_t call_plus_one(size_t n, void (*fn)(void));
+extern "C" size_t looped_triple(size_t n);
+#endif
 
 extern "C" bool test_fn_return_bool(bool value);
 extern "C" bool test_fn_return_not_bool(bool value);
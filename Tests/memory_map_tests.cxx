@@ -17,7 +17,12 @@
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch_test_macros.hpp>
 
+#include <cstdlib>
+#include <string_view>
+#include <vector>
+
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <memory_map.hxx>
 
@@ -59,3 +64,100 @@ TEST_CASE("Reload /proc/self/maps", "[memory_map]") {
   REQUIRE(map.load());
   REQUIRE(map.load());
 }
+
+TEST_CASE("Discard regions of a map that fails to parse", "[memory_map]") {
+  char path[] = "/tmp/interject-maps-XXXXXX";
+  const int fd = ::mkstemp(path);
+  REQUIRE(fd != -1);
+  const std::string_view contents =
+      "00400000-00452000 r-xp 00000000 08:02 173521 /usr/bin/true\n"
+      "not a memory map entry\n";
+  REQUIRE(::write(fd, contents.data(), contents.size()) ==
+          static_cast<ssize_t>(contents.size()));
+  ::close(fd);
+
+  MemoryMap map;
+  REQUIRE(map.load());
+  CHECK_FALSE(map.load(path));
+  CHECK(map.regions().empty());
+  ::unlink(path);
+}
+
+TEST_CASE("Find regions in /proc/self/maps", "[memory_map]") {
+  MemoryMap map;
+  REQUIRE(map.load());
+
+  const std::uintptr_t return_addr =
+      reinterpret_cast<std::uintptr_t>(__builtin_return_address(0));
+  const auto region = map.find(return_addr);
+  REQUIRE(region);
+  CHECK(region->start <= return_addr);
+  CHECK(return_addr < region->end);
+  CHECK(region->permissions & PROT_EXEC);
+  CHECK(region->inode != 0);
+  CHECK_FALSE(region->pathname.empty());
+
+  CHECK_FALSE(map.find(0));
+
+  for (auto &region : map.regions()) {
+    auto found = map.find(region.start);
+    REQUIRE(found);
+    CHECK(found->start == region.start);
+    found = map.find(region.end - 1);
+    REQUIRE(found);
+    CHECK(found->end == region.end);
+  }
+}
+
+TEST_CASE("Find many addresses in /proc/self/maps", "[memory_map]") {
+  MemoryMap map;
+  REQUIRE(map.load());
+
+  std::vector<std::uintptr_t> addrs = {0};
+  for (auto &region : map.regions()) {
+    addrs.push_back(region.start);
+    addrs.push_back(region.end - 1);
+  }
+
+  std::vector<const MemoryMap::Region *> results(addrs.size());
+  map.findAll(addrs, results);
+
+  CHECK(results[0] == nullptr);
+  for (size_t idx = 1; idx < addrs.size(); idx++) {
+    REQUIRE(results[idx] != nullptr);
+    CHECK(results[idx]->start <= addrs[idx]);
+    CHECK(addrs[idx] < results[idx]->end);
+  }
+}
+
+TEST_CASE("Query regions of the current process", "[memory_map]") {
+  MemoryMap map;
+  REQUIRE(map.load());
+
+  MemoryMapQuery query;
+  REQUIRE(query.open());
+
+  // Every region found by parsing the map should be found by a point query.
+  // Skip regions that may have changed between loading the map and querying,
+  // like the stack and heap.
+  for (auto &region : map.regions()) {
+    if (region.pathname.starts_with("[")) {
+      continue;
+    }
+
+    const auto found = query.find(region.start);
+    REQUIRE(found);
+    CHECK(found->start == region.start);
+    CHECK(found->end == region.end);
+    CHECK(found->permissions == region.permissions);
+    CHECK(found->inode == region.inode);
+    CHECK(found->pathname == region.pathname);
+  }
+
+  CHECK_FALSE(query.find(0));
+}
+
+TEST_CASE("Query non-existent file", "[memory_map]") {
+  MemoryMapQuery query;
+  REQUIRE_FALSE(query.open("/does/not/exist"));
+}
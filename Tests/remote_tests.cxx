@@ -0,0 +1,197 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <remote.hxx>
+
+#include "functions.h"
+
+using namespace Interject;
+
+#if defined(__x86_64__)
+
+// Found by name in the child processes, which are copies of this one.
+extern "C" {
+size_t (*remote_isqrt_trampoline)(size_t) = nullptr;
+size_t remote_isqrt_plus_one(size_t n) { return remote_isqrt_trampoline(n) + 1; }
+}
+
+// A forked child and the parent's ends of its pipes. The child is killed and
+// reaped when this goes out of scope, so a failed REQUIRE cannot leave it
+// running.
+struct Child {
+  Child() = default;
+  Child(pid_t pid, int request, int response)
+      : pid(pid), request(request), response(response) {}
+  Child(Child &&other) noexcept
+      : pid(std::exchange(other.pid, -1)),
+        request(std::exchange(other.request, -1)),
+        response(std::exchange(other.response, -1)) {}
+  Child &operator=(Child &&) = delete;
+  Child(const Child &) = delete;
+  Child &operator=(const Child &) = delete;
+
+  ~Child() {
+    if (pid > 0) {
+      ::kill(pid, SIGKILL);
+      ::waitpid(pid, nullptr, 0);
+    }
+    if (request >= 0) {
+      ::close(request);
+    }
+    if (response >= 0) {
+      ::close(response);
+    }
+  }
+
+  pid_t pid = -1;
+  int request = -1;
+  int response = -1;
+};
+
+static void *callIsqrt(void *) {
+  for (;;) {
+    volatile size_t result = isqrt(1000);
+    (void)result;
+  }
+  return nullptr;
+}
+
+// Fork a child that answers each request with isqrt(1000) while another of its
+// threads calls isqrt without pause.
+static Child spawnChild() {
+  int requests[2];
+  if (::pipe(requests) != 0) {
+    return {};
+  }
+  int responses[2];
+  if (::pipe(responses) != 0) {
+    ::close(requests[0]);
+    ::close(requests[1]);
+    return {};
+  }
+
+  const pid_t pid = ::fork();
+  if (pid == 0) {
+    // Keep only this child's ends of its own pipes, moved over stdin and
+    // stdout. Everything else, including the pipes of earlier children and
+    // the test runner's stdout, would otherwise stay open for as long as this
+    // child runs.
+    if (::dup2(requests[0], STDIN_FILENO) < 0 ||
+        ::dup2(responses[1], STDOUT_FILENO) < 0) {
+      ::_exit(1);
+    }
+    ::syscall(SYS_close_range, 3u, ~0u, 0u);
+    requests[0] = STDIN_FILENO;
+    responses[1] = STDOUT_FILENO;
+
+    pthread_t thread;
+    ::pthread_create(&thread, nullptr, callIsqrt, nullptr);
+    char request;
+    while (::read(requests[0], &request, 1) == 1) {
+      const size_t result = isqrt(1000);
+      if (::write(responses[1], &result, sizeof(result)) != sizeof(result)) {
+        break;
+      }
+    }
+    ::_exit(0);
+  }
+
+  ::close(requests[0]);
+  ::close(responses[1]);
+  if (pid < 0) {
+    ::close(requests[1]);
+    ::close(responses[0]);
+    return {};
+  }
+  return {pid, requests[1], responses[0]};
+}
+
+static size_t ask(const Child &child) {
+  const char request = 0;
+  size_t result = 0;
+  if (::write(child.request, &request, 1) != 1 ||
+      ::read(child.response, &result, sizeof(result)) != sizeof(result)) {
+    return 0;
+  }
+  return result;
+}
+
+TEST_CASE("Hook functions in other processes", "[remote]") {
+  const auto expected = isqrt(1000);
+  std::vector<Child> children;
+  std::vector<pid_t> pids;
+  for (size_t i = 0; i < 4; i++) {
+    children.push_back(spawnChild());
+    REQUIRE(children.back().pid > 0);
+    pids.push_back(children.back().pid);
+    CHECK(ask(children.back()) == expected);
+  }
+
+  RemoteTransaction txn =
+      RemoteTransaction::Builder()
+          .add("isqrt", "remote_isqrt_plus_one", "remote_isqrt_trampoline")
+          .processes(pids)
+          .concurrency(2)
+          .build();
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+  for (const auto &child : children) {
+    CHECK(ask(child) == expected + 1);
+  }
+  CHECK(isqrt(1000) == expected); // only the other processes are hooked
+  CHECK(remote_isqrt_trampoline == nullptr);
+
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  for (const auto &child : children) {
+    CHECK(ask(child) == expected);
+  }
+  REQUIRE(txn.results().size() == pids.size());
+  for (size_t i = 0; i < pids.size(); i++) {
+    CHECK(txn.results()[i].pid == pids[i]);
+    CHECK(txn.results()[i].result == Transaction::ResultCode::Success);
+  }
+}
+
+TEST_CASE("Leave processes that cannot be hooked unchanged", "[remote]") {
+  const auto expected = isqrt(1000);
+  const Child child = spawnChild();
+  REQUIRE(child.pid > 0);
+  CHECK(ask(child) == expected);
+
+  RemoteTransaction txn =
+      RemoteTransaction::Builder()
+          .add("isqrt", "no_such_hook", "remote_isqrt_trampoline")
+          .process(child.pid)
+          .build();
+  CHECK(txn.prepare() == Transaction::ResultCode::ErrorSymbolNotFound);
+  CHECK(txn.commit() == Transaction::ResultCode::ErrorInvalidState);
+  REQUIRE(txn.results().size() == 1);
+  CHECK(txn.results()[0].result == Transaction::ResultCode::ErrorInvalidState);
+  CHECK(ask(child) == expected);
+}
+
+#endif
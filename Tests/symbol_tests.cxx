@@ -17,8 +17,14 @@
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch_test_macros.hpp>
 
+#include <string>
+
 #include <dlfcn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <scope_guard.hxx>
 #include <symbols.hxx>
 
 using namespace Interject;
@@ -87,3 +93,171 @@ TEST_CASE("Lookup non-existent symbols", "[symbol]") {
   CHECK(desc.size == 0);
   CHECK(desc.addr == 0);
 }
+
+TEST_CASE("Repeat lookup returns identical results", "[symbol]") {
+  constexpr std::string_view names[] = {
+      "malloc",
+      "test_function_1",
+      "kwyjibo",
+  };
+  Symbols::Descriptor first[std::span(names).size()];
+  Symbols::Descriptor second[std::span(names).size()];
+
+  Symbols::lookup(std::span(names), std::span(first));
+  Symbols::lookup(std::span(names), std::span(second));
+
+  for (size_t idx = 0; idx < std::span(names).size(); idx++) {
+    CHECK(first[idx].addr == second[idx].addr);
+    CHECK(first[idx].size == second[idx].size);
+  }
+  CHECK(first[1].addr == reinterpret_cast<uintptr_t>(test_function_1));
+}
+
+TEST_CASE("Parallel lookup matches sequential lookup", "[symbol]") {
+  constexpr std::string_view names[] = {
+      "malloc",
+      "test_function_1",
+      "test_array_2",
+      "kwyjibo",
+  };
+  Symbols::Descriptor sequential[std::span(names).size()];
+  Symbols::lookup(std::span(names), std::span(sequential));
+
+  // Results must not depend on the order modules are searched in, so also
+  // search them backwards.
+  const Symbols::Executor executors[] = {
+      Symbols::parallelExecutor(4),
+      [](size_t count, const std::function<void(size_t)> &task) {
+        for (size_t idx = count; idx > 0; idx--) {
+          task(idx - 1);
+        }
+      },
+  };
+  for (const auto &executor : executors) {
+    Symbols::Descriptor parallel[std::span(names).size()];
+    const auto caller = ::gettid();
+    size_t timed = 0;
+    Symbols::lookup(
+        std::span(names), std::span(parallel),
+        [&](std::string_view, std::chrono::nanoseconds) {
+          CHECK(::gettid() == caller);
+          timed++;
+        },
+        executor);
+
+    for (size_t idx = 0; idx < std::span(names).size(); idx++) {
+      CHECK(sequential[idx].addr == parallel[idx].addr);
+      CHECK(sequential[idx].size == parallel[idx].size);
+    }
+    CHECK(parallel[1].addr == reinterpret_cast<uintptr_t>(test_function_1));
+    CHECK(parallel[3].addr == 0);
+    CHECK(timed > 0);
+  }
+}
+
+TEST_CASE("Lookup versioned exported symbols", "[symbol]") {
+  // These have both a default and an older non-default version in glibc on
+  // some architectures. The default version is expected, matching dlsym.
+  constexpr std::string_view names[] = {
+      "realpath",
+      "pthread_cond_wait",
+  };
+  Symbols::Descriptor descriptors[std::span(names).size()];
+
+  Symbols::lookup(std::span(names), std::span(descriptors));
+
+  for (size_t idx = 0; idx < std::span(names).size(); idx++) {
+    auto &name = names[idx];
+    auto &desc = descriptors[idx];
+    REQUIRE(desc.module_handle != nullptr);
+    const uintptr_t sym = (uintptr_t)dlsym(desc.module_handle, name.data());
+    CHECK(sym == desc.addr);
+  }
+}
+
+TEST_CASE("Lookup symbols in another process", "[symbol]") {
+  constexpr std::string_view names[] = {
+      "malloc",
+      "test_function_1",
+      "test_array_2",
+      "no_such_symbol",
+  };
+
+  // A forked child maps everything at the same addresses as this process.
+  const pid_t pid = ::fork();
+  REQUIRE(pid != -1);
+  if (pid == 0) {
+    for (;;) {
+      ::pause();
+    }
+  }
+
+  Symbols::RemoteSymbol symbols[std::span(names).size()];
+  CHECK(Symbols::lookupRemote(pid, std::span(names), std::span(symbols)));
+  Symbols::RemoteSymbol parallel[std::span(names).size()];
+  CHECK(Symbols::lookupRemote(pid, std::span(names), std::span(parallel),
+                              nullptr, Symbols::parallelExecutor(4)));
+  ::kill(pid, SIGKILL);
+  ::waitpid(pid, nullptr, 0);
+
+  CHECK(symbols[0].addr == reinterpret_cast<uintptr_t>(dlsym(RTLD_DEFAULT, "malloc")));
+  CHECK(symbols[1].addr == reinterpret_cast<uintptr_t>(test_function_1));
+  CHECK(symbols[2].addr == reinterpret_cast<uintptr_t>(test_array_2));
+  CHECK(symbols[2].size == sizeof(test_array_2));
+  CHECK(symbols[3].addr == 0);
+  for (size_t idx = 0; idx < std::span(names).size(); idx++) {
+    CHECK(parallel[idx].addr == symbols[idx].addr);
+    CHECK(parallel[idx].size == symbols[idx].size);
+  }
+}
+
+// Look up the static function of the debug fixture library of kind, which is
+// stripped so it can only be found through separate debug information.
+static void checkFixtureLookup(std::string_view kind, bool resolvable) {
+  const std::string path =
+      std::string(DEBUG_FIXTURES_DIR) + "/lib" + std::string(kind) +
+      "_fixture.so";
+  void *handle = ::dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  REQUIRE(handle != nullptr);
+  const auto handleGuard = ScopeGuard::create([&]() { ::dlclose(handle); });
+
+  const std::string name = std::string(kind) + "_hidden";
+  const auto hiddenAddress = reinterpret_cast<void *(*)()>(
+      ::dlsym(handle, (name + "_address").c_str()));
+  REQUIRE(hiddenAddress != nullptr);
+
+  const std::string_view names[] = {name};
+  Symbols::Descriptor descriptors[std::span(names).size()];
+  Symbols::lookup(std::span(names), std::span(descriptors));
+
+  if (resolvable) {
+    CHECK(descriptors[0].addr ==
+          reinterpret_cast<uintptr_t>(hiddenAddress()));
+    CHECK(descriptors[0].size > 0);
+  } else {
+    CHECK(descriptors[0].addr == 0);
+  }
+}
+
+TEST_CASE("Lookup local symbols through .gnu_debuglink", "[symbol]") {
+  checkFixtureLookup("debuglink", true);
+}
+
+TEST_CASE("Lookup local symbols through the build-id debug path", "[symbol]") {
+  Symbols::setDebugRoot(std::string(DEBUG_FIXTURES_DIR) + "/debug");
+  const auto rootGuard =
+      ScopeGuard::create([]() { Symbols::setDebugRoot("/usr/lib/debug"); });
+  checkFixtureLookup("buildid", true);
+}
+
+#if defined(HAVE_DEBUGDATA_FIXTURES)
+TEST_CASE("Lookup local symbols through .gnu_debugdata", "[symbol]") {
+  checkFixtureLookup("debugdata", true);
+}
+
+TEST_CASE("Ignore .gnu_debugdata that is not a whole xz stream", "[symbol]") {
+  // Neither may stop the lookup from finishing.
+  checkFixtureLookup("empty_debugdata", false);
+  checkFixtureLookup("truncated_debugdata", false);
+}
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <tracer.hxx>
+
+#include "functions.h"
+
+using namespace Interject;
+
+#if defined(__x86_64__)
+
+static std::vector<Tracer::Record> readAll(TraceReader &reader) {
+  std::vector<Tracer::Record> records;
+  reader.consume([&](std::span<const Tracer::Record> batch) {
+    records.insert(records.end(), batch.begin(), batch.end());
+  });
+  return records;
+}
+
+static pid_t tracedTid = 0;
+
+static void *tracedThread(void *arg) {
+  __atomic_store_n(&tracedTid, ::gettid(), __ATOMIC_RELEASE);
+  return reinterpret_cast<void *>(fibonacci(20));
+}
+
+TEST_CASE("Trace entry and exit of functions", "[tracer]") {
+  const auto isqrtResult = isqrt(1000);
+  const auto fibonacciResult = fibonacci(10);
+  const auto threadExpected = fibonacci(20);
+  Tracer tracer = Tracer::Builder().add("isqrt").add("fibonacci").build();
+  REQUIRE(tracer.start() == Transaction::ResultCode::Success);
+
+  for (size_t i = 0; i < 3; i++) {
+    CHECK(isqrt(1000) == isqrtResult);
+    CHECK(fibonacci(10) == fibonacciResult);
+  }
+
+  pthread_t threadId;
+  REQUIRE_FALSE(pthread_create(&threadId, nullptr, tracedThread, nullptr));
+  void *threadResult = nullptr;
+  CHECK_FALSE(pthread_join(threadId, &threadResult));
+  CHECK(reinterpret_cast<size_t>(threadResult) == threadExpected);
+
+  REQUIRE(tracer.stop() == Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult); // no longer traced
+
+  auto reader = TraceReader::open(tracer.fd());
+  REQUIRE(reader);
+  const auto records = readAll(*reader);
+  CHECK(reader->dropped() == 0);
+
+  // This thread called each target three times, alternating between them.
+  std::vector<Tracer::Record> own;
+  std::copy_if(records.begin(), records.end(), std::back_inserter(own),
+               [](const auto &record) { return record.tid == ::gettid(); });
+  REQUIRE(own.size() == 12);
+  for (size_t i = 0; i < own.size(); i += 4) {
+    CHECK(own[i].kind == Tracer::KindEntry);
+    CHECK(own[i].target == 0);
+    CHECK(own[i].value == 1000);
+    CHECK(own[i + 1].kind == Tracer::KindExit);
+    CHECK(own[i + 1].target == 0);
+    CHECK(own[i + 1].value == isqrtResult);
+    CHECK(own[i + 2].kind == Tracer::KindEntry);
+    CHECK(own[i + 2].target == 1);
+    CHECK(own[i + 2].value == 10);
+    CHECK(own[i + 3].kind == Tracer::KindExit);
+    CHECK(own[i + 3].value == fibonacciResult);
+  }
+  CHECK(std::is_sorted(own.begin(), own.end(),
+                       [](const auto &lhs, const auto &rhs) {
+                         return lhs.timestamp < rhs.timestamp;
+                       }));
+
+  // The other thread recorded into a ring of its own.
+  const auto others = std::count_if(
+      records.begin(), records.end(),
+      [](const auto &record) { return record.tid == tracedTid; });
+  CHECK(others == 2);
+
+  // Everything was consumed.
+  CHECK(readAll(*reader).empty());
+}
+
+TEST_CASE("Drop records when a ring is full", "[tracer]") {
+  const auto isqrtResult = isqrt(1000);
+  Tracer tracer = Tracer::Builder().add("isqrt").ringRecords(8).build();
+  REQUIRE(tracer.start() == Transaction::ResultCode::Success);
+  auto reader = TraceReader::open(tracer.fd());
+  REQUIRE(reader);
+
+  // Exits are still traced while records are dropped.
+  for (size_t i = 0; i < 100; i++) {
+    CHECK(isqrt(1000) == isqrtResult);
+  }
+  CHECK(readAll(*reader).size() == 8);
+  CHECK(reader->dropped() == 192);
+
+  // Reading frees the ring for more records.
+  CHECK(isqrt(1000) == isqrtResult);
+  CHECK(readAll(*reader).size() == 2);
+
+  REQUIRE(tracer.stop() == Transaction::ResultCode::Success);
+}
+
+TEST_CASE("Hand the ring of an exited thread to a new one", "[tracer]") {
+  const auto threadExpected = fibonacci(20);
+  Tracer tracer = Tracer::Builder().add("fibonacci").maxThreads(1).build();
+  REQUIRE(tracer.start() == Transaction::ResultCode::Success);
+  auto reader = TraceReader::open(tracer.fd());
+  REQUIRE(reader);
+
+  // Only these threads call the target, one after the other.
+  std::vector<pid_t> tids;
+  for (size_t i = 0; i < 3; i++) {
+    pthread_t threadId;
+    REQUIRE_FALSE(pthread_create(&threadId, nullptr, tracedThread, nullptr));
+    void *threadResult = nullptr;
+    CHECK_FALSE(pthread_join(threadId, &threadResult));
+    CHECK(reinterpret_cast<size_t>(threadResult) == threadExpected);
+    tids.push_back(__atomic_load_n(&tracedTid, __ATOMIC_ACQUIRE));
+
+    // The tid can outlive pthread_join for a moment.
+    while (::syscall(SYS_tgkill, ::getpid(), tids.back(), 0) == 0) {
+      ::usleep(100);
+    }
+  }
+
+  REQUIRE(tracer.stop() == Transaction::ResultCode::Success);
+  const auto records = readAll(*reader);
+  CHECK(reader->dropped() == 0);
+  for (const auto tid : tids) {
+    CHECK(std::count_if(records.begin(), records.end(), [&](const auto &record) {
+            return record.tid == tid;
+          }) == 2);
+  }
+}
+
+TEST_CASE("Reject memory that does not hold trace rings", "[tracer]") {
+  const int fd = ::memfd_create("not-a-trace", MFD_CLOEXEC);
+  REQUIRE(fd != -1);
+  REQUIRE(::ftruncate(fd, 4096) == 0);
+  CHECK_FALSE(TraceReader::open(fd));
+  ::close(fd);
+}
+
+TEST_CASE("Reject trace rings that do not fit", "[tracer]") {
+  const auto isqrtResult = isqrt(1000);
+  Tracer tracer = Tracer::Builder().add("isqrt").ringRecords(8).build();
+  REQUIRE(tracer.start() == Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult); // claims the first ring
+  REQUIRE(tracer.stop() == Transaction::ResultCode::Success);
+
+  // Mirrors the start of the header the tracer writes.
+  struct Header {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t ringCount;
+    std::uint32_t ringRecords;
+    std::uint64_t ringStride;
+    std::uint64_t ringsOffset;
+  };
+  const size_t size = 4096;
+  auto header = static_cast<Header *>(::mmap(
+      nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, tracer.fd(), 0));
+  REQUIRE(header != MAP_FAILED);
+  const Header original = *header;
+
+  // Wraps around when the end of the rings is computed.
+  header->ringStride = UINT64_MAX / 2 + 1;
+  header->ringCount = 2;
+  CHECK_FALSE(TraceReader::open(tracer.fd()));
+  *header = original;
+
+  header->ringRecords = 6;
+  CHECK_FALSE(TraceReader::open(tracer.fd()));
+  header->ringRecords = original.ringRecords * 2;
+  CHECK_FALSE(TraceReader::open(tracer.fd()));
+  *header = original;
+
+  // A head further ahead than the ring holds only yields a ring's worth.
+  auto reader = TraceReader::open(tracer.fd());
+  REQUIRE(reader);
+  auto head = reinterpret_cast<std::uint64_t *>(
+      reinterpret_cast<std::uintptr_t>(header) + original.ringsOffset);
+  __atomic_store_n(head, 1000, __ATOMIC_RELEASE);
+  CHECK(readAll(*reader).size() == original.ringRecords);
+  CHECK(readAll(*reader).empty());
+
+  ::munmap(header, size);
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch_test_macros.hpp>
+
+#include <set>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include <memory_map.hxx>
+#include <trampolines.hxx>
+
+#include "functions.h"
+
+using namespace Interject;
+
+TEST_CASE("Allocate trampolines near target", "[trampolines]") {
+  const uintptr_t target = reinterpret_cast<uintptr_t>(fibonacci);
+
+  // Allocate more slots than fit in a single page.
+  std::vector<uintptr_t> slots;
+  for (size_t idx = 0; idx < 100; idx++) {
+    const auto slot = Trampolines::allocate(target);
+    REQUIRE(slot);
+    CHECK(*slot % Trampolines::SLOT_SIZE == 0);
+    const uintptr_t distance =
+        *slot > target ? *slot - target : target - *slot;
+    CHECK(distance < Trampolines::MAX_DISTANCE);
+    slots.push_back(*slot);
+  }
+
+  CHECK(std::set<uintptr_t>(slots.begin(), slots.end()).size() ==
+        slots.size());
+
+  MemoryMap map;
+  REQUIRE(map.load());
+  for (const auto slot : slots) {
+    const auto region = map.find(slot);
+    REQUIRE(region);
+    CHECK(region->permissions == (PROT_READ | PROT_EXEC));
+  }
+
+  // A freed slot is reused by the next allocation.
+  Trampolines::release(slots[42]);
+  const auto slot = Trampolines::allocate(target);
+  REQUIRE(slot);
+  CHECK(*slot == slots[42]);
+
+  for (const auto slot : slots) {
+    Trampolines::release(slot);
+  }
+}
+
+TEST_CASE("Write trampoline code", "[trampolines]") {
+  const auto slot =
+      Trampolines::allocate(reinterpret_cast<uintptr_t>(fibonacci));
+  REQUIRE(slot);
+
+  const uint8_t code[] = {0xde, 0xad, 0xbe, 0xef};
+  REQUIRE(Trampolines::write(*slot, code));
+  CHECK(std::equal(std::begin(code), std::end(code),
+                   reinterpret_cast<const uint8_t *>(*slot)));
+
+  uint8_t tooLarge[Trampolines::SLOT_SIZE + 1] = {};
+  CHECK_FALSE(Trampolines::write(*slot, tooLarge));
+
+  Trampolines::release(*slot);
+}
+
+TEST_CASE("Allocate pointer slots near target", "[trampolines]") {
+  const uintptr_t target = reinterpret_cast<uintptr_t>(fibonacci);
+
+  std::vector<uintptr_t> slots;
+  for (size_t idx = 0; idx < 100; idx++) {
+    const auto slot = Trampolines::allocatePointer(target);
+    REQUIRE(slot);
+    CHECK(*slot % Trampolines::POINTER_SLOT_SIZE == 0);
+    const uintptr_t distance =
+        *slot > target ? *slot - target : target - *slot;
+    CHECK(distance < Trampolines::MAX_DISTANCE);
+    slots.push_back(*slot);
+  }
+
+  CHECK(std::set<uintptr_t>(slots.begin(), slots.end()).size() ==
+        slots.size());
+
+  // Slots are plain data, never in the same pages as code.
+  MemoryMap map;
+  REQUIRE(map.load());
+  for (const auto slot : slots) {
+    const auto region = map.find(slot);
+    REQUIRE(region);
+    CHECK(region->permissions == (PROT_READ | PROT_WRITE));
+  }
+
+  for (const auto slot : slots) {
+    Trampolines::releasePointer(slot);
+  }
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2025 Andrew Rogers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <memory>
+#include <vector>
+
+#include <pthread.h>
+
+#include <transaction.hxx>
+
+#include "functions.h"
+
+using namespace Interject;
+
+#if defined(__x86_64__)
+
+static size_t (*times_thousand_trampoline)(size_t) = nullptr;
+
+static size_t times_thousand_hook(size_t n) {
+  return times_thousand_trampoline(n) + 1;
+}
+
+static bool running = true;
+
+static void *busyThread(void *) {
+  size_t value = 0;
+  while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+    value += fibonacci(20);
+  }
+  return nullptr;
+}
+
+// Measure commit and rollback of a single target while other threads are
+// busy. The halting engine interrupts every one of them on each call while
+// the breakpoint engine leaves them running.
+static void benchmarkEngine(Catch::Benchmark::Chronometer &meter,
+                            Transaction::Engine engine) {
+  std::vector<std::unique_ptr<Transaction>> txns;
+  for (int run = 0; run < meter.runs(); run++) {
+    txns.emplace_back(new Transaction(
+        Transaction::Builder()
+            .add("times_thousand", times_thousand_hook,
+                 &times_thousand_trampoline)
+            .engine(engine)
+            .build()));
+    REQUIRE(txns.back()->prepare() == Transaction::ResultCode::Success);
+  }
+
+  // Results are checked once timing ends, so a failed commit is not timed as
+  // a fast no-op and a breakpoint commit that fell back to halting threads is
+  // not mistaken for one that halted none.
+  std::vector<Transaction::ResultCode> commits(meter.runs());
+  std::vector<Transaction::ResultCode> rollbacks(meter.runs());
+  std::vector<size_t> halted(meter.runs());
+  meter.measure([&](int run) {
+    commits[run] = txns[run]->commit();
+    halted[run] = txns[run]->stats().threadHalts.size();
+    if (commits[run] == Transaction::ResultCode::Success) {
+      rollbacks[run] = txns[run]->rollback();
+    }
+  });
+
+  for (int run = 0; run < meter.runs(); run++) {
+    REQUIRE(commits[run] == Transaction::ResultCode::Success);
+    REQUIRE(rollbacks[run] == Transaction::ResultCode::Success);
+    if (engine == Transaction::EngineBreakpoint) {
+      REQUIRE(halted[run] == 0);
+    }
+  }
+}
+
+TEST_CASE("Commit pause by engine", "[.][benchmark]") {
+  constexpr size_t threadCount = 16;
+  pthread_t threadIds[threadCount];
+  __atomic_store_n(&running, true, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < threadCount; i++) {
+    REQUIRE_FALSE(pthread_create(&threadIds[i], nullptr, busyThread, nullptr));
+  }
+
+  BENCHMARK_ADVANCED("halting")(Catch::Benchmark::Chronometer meter) {
+    benchmarkEngine(meter, Transaction::EngineHalting);
+  };
+
+  BENCHMARK_ADVANCED("breakpoint")(Catch::Benchmark::Chronometer meter) {
+    benchmarkEngine(meter, Transaction::EngineBreakpoint);
+  };
+
+  __atomic_store_n(&running, false, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < threadCount; i++) {
+    CHECK_FALSE(pthread_join(threadIds[i], nullptr));
+  }
+}
+
+#endif
@@ -17,8 +17,11 @@
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch_test_macros.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <pthread.h>
+#include <vector>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <transaction.hxx>
@@ -52,6 +55,775 @@ TEST_CASE("Create and abort transaction", "[transaction]") {
   CHECK(isqrt(64) == isqrtResult);
 }
 
+TEST_CASE("Trampoline pointers follow transaction state", "[transaction]") {
+  size_t (*trampoline)(size_t) = nullptr;
+  Interject::Transaction txn =
+      Transaction::Builder()
+          .add("reverse_digits", sum_of_digits, &trampoline)
+          .build();
+
+  // Committing or rolling back out of order is rejected.
+  CHECK(txn.commit() == Transaction::ResultCode::ErrorInvalidState);
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+  CHECK(txn.rollback() == Transaction::ResultCode::ErrorInvalidState);
+  CHECK(trampoline == nullptr);
+
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+  CHECK(trampoline != nullptr);
+  CHECK(trampoline != reverse_digits);
+
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  CHECK(trampoline == reverse_digits);
+  CHECK(txn.commit() == Transaction::ResultCode::ErrorInvalidState);
+}
+
+static size_t (*isqrt_trampoline)(size_t) = nullptr;
+
+static size_t isqrt_plus_one(size_t n) { return isqrt_trampoline(n) + 1; }
+
+TEST_CASE("Call original function through trampoline", "[transaction]") {
+  const auto isqrtResult = isqrt(1000);
+  Interject::Transaction txn =
+      Transaction::Builder()
+          .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+          .build();
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+
+  CHECK(isqrt(1000) == isqrtResult + 1);
+  CHECK(isqrt(0) == 1);
+
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult);
+}
+
+TEST_CASE("Reuse trampolines across commits of a target", "[transaction]") {
+  const auto isqrtResult = isqrt(1000);
+  size_t (*first)(size_t) = nullptr;
+  for (size_t i = 0; i < 100; i++) {
+    Interject::Transaction txn =
+        Transaction::Builder()
+            .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+            .build();
+    REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+    REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+    CHECK(isqrt(1000) == isqrtResult + 1);
+
+    // Each cycle runs the original through the trampoline of the first.
+    if (first == nullptr) {
+      first = isqrt_trampoline;
+    }
+    CHECK(isqrt_trampoline == first);
+
+    REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+    CHECK(isqrt(1000) == isqrtResult);
+  }
+}
+
+TEST_CASE("Hook a function without a trampoline", "[transaction]") {
+  const auto reverseDigitsResult = reverse_digits(1234);
+  Interject::Transaction txn =
+      Transaction::Builder().add("reverse_digits", sum_of_digits).build();
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+  CHECK(reverse_digits(1234) == sum_of_digits(1234));
+
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  CHECK(reverse_digits(1234) == reverseDigitsResult);
+}
+
+#if defined(__x86_64__)
+TEST_CASE("Refuse functions that branch into the patched instructions",
+          "[transaction]") {
+  // A branch in looped_triple targets the instructions the patch displaces.
+  // A thread halted on that branch would jump into the middle of the patch,
+  // so the function is refused whether or not a trampoline is asked for.
+  size_t (*trampoline)(size_t) = nullptr;
+  Interject::Transaction relocated =
+      Transaction::Builder()
+          .add("looped_triple", sum_of_digits, &trampoline)
+          .build();
+  CHECK(relocated.prepare() ==
+        Transaction::ResultCode::ErrorUnsupportedInstructions);
+
+  Interject::Transaction txn =
+      Transaction::Builder().add("looped_triple", sum_of_digits).build();
+  CHECK(txn.prepare() == Transaction::ResultCode::ErrorUnsupportedInstructions);
+  CHECK(looped_triple(7) == 21);
+}
+#endif
+
+static pid_t sleepingTid = 0;
+static bool sleeping = true;
+
+static void *sleepingThread(void *arg) {
+  __atomic_store_n(&sleepingTid, ::gettid(), __ATOMIC_RELEASE);
+  while (__atomic_load_n(&sleeping, __ATOMIC_RELAXED)) {
+    ::usleep(100);
+  }
+  return nullptr;
+}
+
+TEST_CASE("Report per-phase transaction stats", "[transaction]") {
+  std::vector<Transaction::Operation> reported;
+  Interject::Transaction txn =
+      Transaction::Builder()
+          .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+          .onStats([&](const Transaction::Stats &stats) {
+            reported.push_back(stats.operation);
+          })
+          .build();
+
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+  CHECK(txn.stats().operation == Transaction::OpPrepare);
+  CHECK_FALSE(txn.stats().symbolLookup.empty());
+  CHECK(txn.stats().memoryMap.count() > 0);
+  CHECK(txn.stats().total >= txn.stats().memoryMap);
+
+  __atomic_store_n(&sleeping, true, __ATOMIC_RELAXED);
+  __atomic_store_n(&sleepingTid, 0, __ATOMIC_RELAXED);
+  pthread_t threadId;
+  REQUIRE_FALSE(pthread_create(&threadId, nullptr, sleepingThread, nullptr));
+  while (__atomic_load_n(&sleepingTid, __ATOMIC_ACQUIRE) == 0) {
+    ::usleep(100);
+  }
+
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+  const auto &stats = txn.stats();
+  CHECK(stats.operation == Transaction::OpCommit);
+  CHECK(stats.result == Transaction::ResultCode::Success);
+  CHECK(stats.symbolLookup.empty());
+  CHECK(stats.stopped.count() > 0);
+  CHECK(stats.total >= stats.stopped);
+
+  // The sleeping thread was halted; the committing thread never is.
+  const auto halted = [&](pid_t tid) {
+    return std::any_of(stats.threadHalts.begin(), stats.threadHalts.end(),
+                       [&](const auto &halt) { return halt.tid == tid; });
+  };
+  CHECK(halted(sleepingTid));
+  CHECK_FALSE(halted(::gettid()));
+
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  CHECK(txn.stats().operation == Transaction::OpRollback);
+
+  __atomic_store_n(&sleeping, false, __ATOMIC_RELAXED);
+  CHECK_FALSE(pthread_join(threadId, nullptr));
+
+  const std::vector<Transaction::Operation> expected = {
+      Transaction::OpPrepare, Transaction::OpCommit, Transaction::OpRollback};
+  CHECK(reported == expected);
+}
+
+static size_t (*fibonacci_trampoline)(size_t) = nullptr;
+
+static size_t fibonacci_plus_one(size_t n) {
+  return fibonacci_trampoline(n) + 1;
+}
+
+TEST_CASE("Commit several transactions under one halt", "[transaction]") {
+  const auto isqrtResult = isqrt(1000);
+  const auto fibonacciResult = fibonacci(10);
+  Interject::Transaction isqrtTxn =
+      Transaction::Builder()
+          .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+          .build();
+  Interject::Transaction fibonacciTxn =
+      Transaction::Builder()
+          .add("fibonacci", fibonacci_plus_one, &fibonacci_trampoline)
+          .build();
+  REQUIRE(isqrtTxn.prepare() == Transaction::ResultCode::Success);
+  REQUIRE(fibonacciTxn.prepare() == Transaction::ResultCode::Success);
+
+  __atomic_store_n(&sleeping, true, __ATOMIC_RELAXED);
+  __atomic_store_n(&sleepingTid, 0, __ATOMIC_RELAXED);
+  pthread_t threadId;
+  REQUIRE_FALSE(pthread_create(&threadId, nullptr, sleepingThread, nullptr));
+  while (__atomic_load_n(&sleepingTid, __ATOMIC_ACQUIRE) == 0) {
+    ::usleep(100);
+  }
+
+  Transaction *const txns[] = {&isqrtTxn, &fibonacciTxn};
+  REQUIRE(Transaction::commitAll(txns) == Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult + 1);
+  CHECK(fibonacci(10) == fibonacciResult + 1);
+
+  // Both transactions report the same single halt of the sleeping thread.
+  const auto halts = [&](const Transaction &txn) {
+    const auto &threadHalts = txn.stats().threadHalts;
+    return std::count_if(
+        threadHalts.begin(), threadHalts.end(),
+        [&](const auto &halt) { return halt.tid == sleepingTid; });
+  };
+  CHECK(halts(isqrtTxn) == 1);
+  CHECK(halts(fibonacciTxn) == 1);
+  CHECK(isqrtTxn.stats().stopped == fibonacciTxn.stats().stopped);
+
+  // Committing again is rejected without touching either transaction.
+  CHECK(Transaction::commitAll(txns) ==
+        Transaction::ResultCode::ErrorInvalidState);
+
+  REQUIRE(Transaction::rollbackAll(txns) == Transaction::ResultCode::Success);
+  CHECK(isqrtTxn.stats().operation == Transaction::OpRollback);
+  CHECK(isqrt(1000) == isqrtResult);
+  CHECK(fibonacci(10) == fibonacciResult);
+
+  __atomic_store_n(&sleeping, false, __ATOMIC_RELAXED);
+  CHECK_FALSE(pthread_join(threadId, nullptr));
+}
+
+TEST_CASE("Reject transactions patching the same target", "[transaction]") {
+  const auto isqrtResult = isqrt(1000);
+  size_t (*trampoline)(size_t) = nullptr;
+  Interject::Transaction first =
+      Transaction::Builder()
+          .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+          .build();
+  Interject::Transaction second =
+      Transaction::Builder().add("isqrt", factorial, &trampoline).build();
+  REQUIRE(first.prepare() == Transaction::ResultCode::Success);
+  REQUIRE(second.prepare() == Transaction::ResultCode::Success);
+
+  Transaction *const txns[] = {&first, &second};
+  CHECK(Transaction::commitAll(txns) ==
+        Transaction::ResultCode::ErrorConflictingTargets);
+  CHECK(isqrt(1000) == isqrtResult);
+
+  // Neither was committed, so each can still be committed on its own.
+  REQUIRE(first.commit() == Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult + 1);
+  REQUIRE(first.rollback() == Transaction::ResultCode::Success);
+}
+
+TEST_CASE("Update hooks of a committed transaction", "[transaction]") {
+  const auto isqrtResult = isqrt(1000);
+  const auto fibonacciResult = fibonacci(10);
+  const auto reverseDigitsResult = reverse_digits(1234);
+  Interject::Transaction txn =
+      Transaction::Builder()
+          .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+          .add("fibonacci", fibonacci_plus_one, &fibonacci_trampoline)
+          .build();
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+
+  // Swap the fibonacci hook for a reverse_digits one. The isqrt hook stays.
+  size_t (*trampoline)(size_t) = nullptr;
+  Interject::Transaction additions =
+      Transaction::Builder()
+          .add("reverse_digits", sum_of_digits, &trampoline)
+          .build();
+  REQUIRE(additions.prepare() == Transaction::ResultCode::Success);
+  const std::string_view removals[] = {"fibonacci"};
+  REQUIRE(txn.update(&additions, removals) ==
+          Transaction::ResultCode::Success);
+  CHECK(txn.stats().operation == Transaction::OpUpdate);
+  CHECK(isqrt(1000) == isqrtResult + 1);
+  CHECK(fibonacci(10) == fibonacciResult);
+  CHECK(fibonacci_trampoline == fibonacci);
+  CHECK(reverse_digits(1234) == sum_of_digits(1234));
+
+  // A target that is already hooked cannot be added again.
+  size_t (*isqrtAgain)(size_t) = nullptr;
+  Interject::Transaction conflicting =
+      Transaction::Builder().add("isqrt", factorial, &isqrtAgain).build();
+  REQUIRE(conflicting.prepare() == Transaction::ResultCode::Success);
+  CHECK(txn.update(&conflicting) ==
+        Transaction::ResultCode::ErrorConflictingTargets);
+
+  const std::string_view unknown[] = {"count_set_bits"};
+  CHECK(txn.update(nullptr, unknown) ==
+        Transaction::ResultCode::ErrorSymbolNotFound);
+  CHECK(isqrt(1000) == isqrtResult + 1);
+
+  // Rolling back restores the added target along with the original one.
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult);
+  CHECK(reverse_digits(1234) == reverseDigitsResult);
+}
+
+static size_t isqrt_times_two(size_t n) { return isqrt_trampoline(n) * 2; }
+
+static bool retargeting = true;
+static size_t unexpectedResults = 0;
+
+static void *retargetedThread(void *arg) {
+  const size_t expected = *reinterpret_cast<size_t *>(arg);
+  while (__atomic_load_n(&retargeting, __ATOMIC_RELAXED)) {
+    const size_t result = isqrt(1000);
+    if (result != expected && result != expected + 1 &&
+        result != expected * 2) {
+      __atomic_add_fetch(&unexpectedResults, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return nullptr;
+}
+
+TEST_CASE("Retarget hooks with a single store", "[transaction]") {
+  size_t isqrtResult = isqrt(1000);
+  Interject::Transaction txn =
+      Transaction::Builder()
+          .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+          .retargetable()
+          .build();
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+  CHECK(txn.retarget("isqrt", isqrt_times_two) ==
+        Transaction::ResultCode::ErrorInvalidState);
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult + 1);
+
+  // Threads calling the target see one of the hooks or the original function
+  // on every call while it is swapped.
+  __atomic_store_n(&retargeting, true, __ATOMIC_RELAXED);
+  __atomic_store_n(&unexpectedResults, 0, __ATOMIC_RELAXED);
+  pthread_t threadId;
+  REQUIRE_FALSE(
+      pthread_create(&threadId, nullptr, retargetedThread, &isqrtResult));
+  for (size_t i = 0; i < 1000; i++) {
+    REQUIRE(txn.retarget("isqrt", isqrt_times_two) ==
+            Transaction::ResultCode::Success);
+    REQUIRE(txn.disable("isqrt") == Transaction::ResultCode::Success);
+    REQUIRE(txn.retarget("isqrt", isqrt_plus_one) ==
+            Transaction::ResultCode::Success);
+  }
+  __atomic_store_n(&retargeting, false, __ATOMIC_RELAXED);
+  CHECK_FALSE(pthread_join(threadId, nullptr));
+  CHECK(unexpectedResults == 0);
+
+  REQUIRE(txn.retarget("isqrt", isqrt_times_two) ==
+          Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult * 2);
+  REQUIRE(txn.disable("isqrt") == Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult);
+  CHECK(txn.retarget("fibonacci", isqrt_times_two) ==
+        Transaction::ResultCode::ErrorSymbolNotFound);
+
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  CHECK(isqrt(1000) == isqrtResult);
+  CHECK(txn.disable("isqrt") == Transaction::ResultCode::ErrorInvalidState);
+}
+
+TEST_CASE("Halt a busy thread with every halt check", "[transaction]") {
+  size_t isqrtResult = isqrt(1000);
+  __atomic_store_n(&retargeting, true, __ATOMIC_RELAXED);
+  __atomic_store_n(&unexpectedResults, 0, __ATOMIC_RELAXED);
+  pthread_t threadId;
+  REQUIRE_FALSE(
+      pthread_create(&threadId, nullptr, retargetedThread, &isqrtResult));
+
+  // The thread is calling the target throughout, so it is often caught in it.
+  for (const auto check :
+       {Transaction::HaltCheckContext, Transaction::HaltCheckFramePointers,
+        Transaction::HaltCheckBacktrace}) {
+    for (size_t i = 0; i < 20; i++) {
+      Interject::Transaction txn =
+          Transaction::Builder()
+              .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+              .haltCheck(check)
+              .build();
+      REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+      REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+      CHECK(isqrt(1000) == isqrtResult + 1);
+      REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+      CHECK(isqrt(1000) == isqrtResult);
+    }
+  }
+
+  __atomic_store_n(&retargeting, false, __ATOMIC_RELAXED);
+  CHECK_FALSE(pthread_join(threadId, nullptr));
+  CHECK(unexpectedResults == 0);
+}
+
+static size_t (*padded_triple_trampoline)(size_t) = nullptr;
+static size_t (*padded_quintuple_trampoline)(size_t) = nullptr;
+
+static size_t padded_triple_plus_one(size_t n) {
+  return padded_triple_trampoline(n) + 1;
+}
+
+static size_t padded_quintuple_plus_one(size_t n) {
+  return padded_quintuple_trampoline(n) + 1;
+}
+
+static size_t (*padded)(size_t) = nullptr;
+static bool paddedRunning = true;
+
+static void *paddedThread(void *) {
+  // Halting this thread would time out since it never handles SIGUSR1.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  // Run until the padded function is patched.
+  while (__atomic_load_n(&paddedRunning, __ATOMIC_RELAXED) && padded(1) == 3) {
+  }
+  return nullptr;
+}
+
+TEST_CASE("Patch entry pads without halting threads", "[transaction]") {
+  Interject::Transaction txn =
+      Transaction::Builder()
+          .add("wide_padded_triple", padded_triple_plus_one,
+               &padded_triple_trampoline)
+          .add("wide_padded_quintuple", padded_quintuple_plus_one,
+               &padded_quintuple_trampoline)
+          .build();
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+
+  padded = wide_padded_triple;
+  __atomic_store_n(&paddedRunning, true, __ATOMIC_RELAXED);
+  pthread_t threadId;
+  REQUIRE_FALSE(pthread_create(&threadId, nullptr, paddedThread, nullptr));
+  ::usleep(1000);
+
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+  CHECK_FALSE(pthread_join(threadId, nullptr));
+
+  CHECK(wide_padded_triple(2) == 7);
+  CHECK(wide_padded_quintuple(2) == 11);
+
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  CHECK(wide_padded_triple(2) == 6);
+  CHECK(wide_padded_quintuple(2) == 10);
+}
+
+TEST_CASE("Halt threads to patch entries of several NOPs", "[transaction]") {
+  // A thread may be stopped between the NOPs at the entry, so the jump cannot
+  // be written over them while it runs and the thread must be halted.
+  Interject::Transaction txn =
+      Transaction::Builder()
+          .add("padded_triple", padded_triple_plus_one,
+               &padded_triple_trampoline)
+          .build();
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+
+  padded = padded_triple;
+  __atomic_store_n(&paddedRunning, true, __ATOMIC_RELAXED);
+  pthread_t threadId;
+  REQUIRE_FALSE(pthread_create(&threadId, nullptr, paddedThread, nullptr));
+  ::usleep(1000);
+
+  CHECK(txn.commit() == Transaction::ResultCode::ErrorTimedOut);
+  CHECK(padded_triple(1) == 3);
+
+  // Once the thread that cannot be halted is gone the commit goes through.
+  __atomic_store_n(&paddedRunning, false, __ATOMIC_RELAXED);
+  CHECK_FALSE(pthread_join(threadId, nullptr));
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+  CHECK(padded_triple(2) == 7);
+
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  CHECK(padded_triple(2) == 6);
+}
+
+#if defined(__x86_64__)
+static size_t (*times_thousand_trampoline)(size_t) = nullptr;
+
+static size_t times_thousand_plus_one(size_t n) {
+  return times_thousand_trampoline(n) + 1;
+}
+
+static void *breakpointThread(void *arg) {
+  // Halting this thread would time out since it never handles SIGUSR1.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  // Run until times_thousand is patched.
+  while (times_thousand(1) == 1000) {
+  }
+  return nullptr;
+}
+
+TEST_CASE("Patch with breakpoints without halting threads", "[transaction]") {
+  Interject::Transaction txn =
+      Transaction::Builder()
+          .add("times_thousand", times_thousand_plus_one,
+               &times_thousand_trampoline)
+          .engine(Transaction::EngineBreakpoint)
+          .build();
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+
+  // Threads reaching the target while it is patched are redirected by the
+  // breakpoint handler.
+  constexpr size_t threadCount = 8;
+  pthread_t threadIds[threadCount];
+  for (size_t i = 0; i < threadCount; i++) {
+    REQUIRE_FALSE(
+        pthread_create(&threadIds[i], nullptr, breakpointThread, nullptr));
+  }
+  ::usleep(1000);
+
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+  for (size_t i = 0; i < threadCount; i++) {
+    CHECK_FALSE(pthread_join(threadIds[i], nullptr));
+  }
+  CHECK(times_thousand(2) == 2001);
+
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  CHECK(times_thousand(2) == 2000);
+}
+
+TEST_CASE("Pass on traps that are not breakpoints", "[transaction]") {
+  // A SIGTRAP sent with kill() is not an int3, so the breakpoint handler must
+  // neither rewind the thread nor swallow it. It takes the default action
+  // installed before the handler, which ends the process.
+  const pid_t pid = ::fork();
+  REQUIRE(pid != -1);
+  if (pid == 0) {
+    Interject::Transaction txn =
+        Transaction::Builder()
+            .add("times_thousand", times_thousand_plus_one,
+                 &times_thousand_trampoline)
+            .engine(Transaction::EngineBreakpoint)
+            .build();
+    if (txn.prepare() != Transaction::ResultCode::Success ||
+        txn.commit() != Transaction::ResultCode::Success ||
+        txn.rollback() != Transaction::ResultCode::Success) {
+      ::_exit(1);
+    }
+    ::raise(SIGTRAP);
+    ::_exit(0);
+  }
+
+  int status = 0;
+  REQUIRE(::waitpid(pid, &status, 0) == pid);
+  CHECK(WIFSIGNALED(status));
+  CHECK(WTERMSIG(status) == SIGTRAP);
+}
+
+static bool blocking = true;
+static bool blocked = false;
+
+static void *blockingThread(void *arg) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  ::pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+  __atomic_store_n(&blocked, true, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&blocking, __ATOMIC_RELAXED)) {
+    ::usleep(100);
+  }
+  ::pthread_sigmask(SIG_UNBLOCK, &mask, nullptr);
+  return nullptr;
+}
+
+TEST_CASE("Ignore halt signals delivered after a halt fails",
+          "[transaction]") {
+  // A thread that blocks SIGUSR1 times out the halt, and only takes the
+  // signal once the commit has returned and its control blocks are gone. It
+  // must neither kill the process nor touch the freed blocks.
+  const pid_t pid = ::fork();
+  REQUIRE(pid != -1);
+  if (pid == 0) {
+    pthread_t threadId;
+    if (pthread_create(&threadId, nullptr, blockingThread, nullptr) != 0) {
+      ::_exit(1);
+    }
+    while (!__atomic_load_n(&blocked, __ATOMIC_ACQUIRE)) {
+      ::usleep(100);
+    }
+    Interject::Transaction txn =
+        Transaction::Builder()
+            .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+            .build();
+    if (txn.prepare() != Transaction::ResultCode::Success ||
+        txn.commit() != Transaction::ResultCode::ErrorTimedOut) {
+      ::_exit(2);
+    }
+    __atomic_store_n(&blocking, false, __ATOMIC_RELAXED);
+    pthread_join(threadId, nullptr);
+
+    if (txn.commit() != Transaction::ResultCode::Success ||
+        txn.rollback() != Transaction::ResultCode::Success) {
+      ::_exit(3);
+    }
+    ::_exit(0);
+  }
+
+  int status = 0;
+  REQUIRE(::waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  CHECK(WEXITSTATUS(status) == 0);
+}
+
+static void *queuedValue = nullptr;
+
+static void applicationHandler(int signal, siginfo_t *info, void *context) {
+  queuedValue = info->si_value.sival_ptr;
+}
+
+TEST_CASE("Pass application halt signals to their handler", "[transaction]") {
+  // A pointer queued with SIGUSR1 by the application reaches the handler it
+  // installed, even once a halt has installed its own.
+  const pid_t pid = ::fork();
+  REQUIRE(pid != -1);
+  if (pid == 0) {
+    struct sigaction action = {};
+    action.sa_sigaction = applicationHandler;
+    action.sa_flags = SA_SIGINFO;
+    if (::sigaction(SIGUSR1, &action, nullptr) != 0) {
+      ::_exit(1);
+    }
+
+    Interject::Transaction txn =
+        Transaction::Builder()
+            .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+            .build();
+    if (txn.prepare() != Transaction::ResultCode::Success ||
+        txn.commit() != Transaction::ResultCode::Success ||
+        txn.rollback() != Transaction::ResultCode::Success) {
+      ::_exit(2);
+    }
+
+    static int payload;
+    union sigval value;
+    value.sival_ptr = &payload;
+    if (::sigqueue(::getpid(), SIGUSR1, value) != 0 ||
+        queuedValue != &payload) {
+      ::_exit(3);
+    }
+    ::_exit(0);
+  }
+
+  int status = 0;
+  REQUIRE(::waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  CHECK(WEXITSTATUS(status) == 0);
+}
+
+static size_t (*pause_plus_one_trampoline)(size_t) = nullptr;
+
+static size_t pause_plus_two(size_t n) {
+  return pause_plus_one_trampoline(n) + 1;
+}
+
+static bool pausing = true;
+
+static void *pausingThread(void *arg) {
+  while (__atomic_load_n(&pausing, __ATOMIC_RELAXED)) {
+    const size_t result = pause_plus_one(1);
+    if (result != 2 && result != 3) {
+      __atomic_add_fetch(&unexpectedResults, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return nullptr;
+}
+
+TEST_CASE("Relocate threads halted inside a target", "[transaction]") {
+  __atomic_store_n(&pausing, true, __ATOMIC_RELAXED);
+  __atomic_store_n(&unexpectedResults, 0, __ATOMIC_RELAXED);
+  pthread_t threadId;
+  REQUIRE_FALSE(pthread_create(&threadId, nullptr, pausingThread, nullptr));
+  ::usleep(1000);
+
+  // The thread is moved into the trampoline on commit and left there on
+  // rollback, so it is never retried however often it is caught in the target.
+  size_t relocated = 0;
+  for (size_t i = 0; i < 20; i++) {
+    Interject::Transaction txn =
+        Transaction::Builder()
+            .add("pause_plus_one", pause_plus_two, &pause_plus_one_trampoline)
+            .relocateThreads()
+            .build();
+    REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+    REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+    for (const auto &halt : txn.stats().threadHalts) {
+      CHECK(halt.retries == 0);
+      relocated += halt.relocated;
+    }
+    CHECK(pause_plus_one(1) == 3);
+
+    REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+    for (const auto &halt : txn.stats().threadHalts) {
+      CHECK(halt.retries == 0);
+      relocated += halt.relocated;
+    }
+    CHECK(pause_plus_one(1) == 2);
+  }
+  CHECK(relocated > 0);
+
+  __atomic_store_n(&pausing, false, __ATOMIC_RELAXED);
+  CHECK_FALSE(pthread_join(threadId, nullptr));
+  CHECK(unexpectedResults == 0);
+}
+
+static size_t (*call_plus_one_trampoline)(size_t, void (*)(void)) = nullptr;
+
+static size_t call_plus_two(size_t n, void (*fn)(void)) {
+  return call_plus_one_trampoline(n, fn) + 1;
+}
+
+static bool holdCall = false;
+static bool callHeld = false;
+
+static void waitWhileHeld() {
+  __atomic_store_n(&callHeld, true, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&holdCall, __ATOMIC_ACQUIRE)) {
+    ::usleep(100);
+  }
+}
+
+static void noWait() {}
+
+static void *callingThread(void *arg) {
+  return reinterpret_cast<void *>(call_plus_one(1, waitWhileHeld));
+}
+
+TEST_CASE("Leave threads in place when a commit fails", "[transaction]") {
+  __atomic_store_n(&pausing, true, __ATOMIC_RELAXED);
+  __atomic_store_n(&unexpectedResults, 0, __ATOMIC_RELAXED);
+  pthread_t pausingId;
+  REQUIRE_FALSE(pthread_create(&pausingId, nullptr, pausingThread, nullptr));
+
+  // This thread waits with a return address in call_plus_one, so commit
+  // retries it until it times out. The other thread is meanwhile usually
+  // halted in pause_plus_one, and must not be moved into its trampoline,
+  // which is freed with the transaction.
+  __atomic_store_n(&holdCall, true, __ATOMIC_RELEASE);
+  __atomic_store_n(&callHeld, false, __ATOMIC_RELEASE);
+  pthread_t callingId;
+  REQUIRE_FALSE(pthread_create(&callingId, nullptr, callingThread, nullptr));
+  while (!__atomic_load_n(&callHeld, __ATOMIC_ACQUIRE)) {
+    ::usleep(100);
+  }
+  for (size_t i = 0; i < 3; i++) {
+    Interject::Transaction txn =
+        Transaction::Builder()
+            .add("pause_plus_one", pause_plus_two, &pause_plus_one_trampoline)
+            .add("call_plus_one", call_plus_two, &call_plus_one_trampoline)
+            .relocateThreads()
+            .build();
+    REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+    REQUIRE(txn.commit() == Transaction::ResultCode::ErrorTimedOut);
+    CHECK(pause_plus_one(1) == 2);
+  }
+
+  __atomic_store_n(&holdCall, false, __ATOMIC_RELEASE);
+  void *result = nullptr;
+  CHECK_FALSE(pthread_join(callingId, &result));
+  CHECK(reinterpret_cast<size_t>(result) == 2);
+
+  Interject::Transaction txn =
+      Transaction::Builder()
+          .add("pause_plus_one", pause_plus_two, &pause_plus_one_trampoline)
+          .add("call_plus_one", call_plus_two, &call_plus_one_trampoline)
+          .relocateThreads()
+          .build();
+  REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+  REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+  CHECK(pause_plus_one(1) == 3);
+  CHECK(call_plus_one(1, noWait) == 3);
+  REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+
+  __atomic_store_n(&pausing, false, __ATOMIC_RELAXED);
+  CHECK_FALSE(pthread_join(pausingId, nullptr));
+  CHECK(unexpectedResults == 0);
+}
+#endif
+
 bool (*test_fn_return_true_trampoline)(bool);
 
 static void *testThread(void *arg) {
@@ -97,3 +869,50 @@ TEST_CASE("Multiple threads during transaction", "[thread, transaction]") {
     CHECK_FALSE(pthread_join(threadIds[i], nullptr));
   }
 }
+
+static bool spawning = true;
+
+static void *isqrtThread(void *arg) {
+  size_t value = 0;
+  for (size_t i = 0; i < 1000; i++) {
+    value += isqrt(i);
+  }
+  return nullptr;
+}
+
+static void *spawnThread(void *arg) {
+  // Keep creating short-lived threads so some are always starting while
+  // threads are being halted.
+  while (__atomic_load_n(&spawning, __ATOMIC_RELAXED)) {
+    pthread_t threadIds[8];
+    size_t threadCount = 0;
+    while (threadCount < std::size(threadIds) &&
+           pthread_create(&threadIds[threadCount], nullptr, isqrtThread,
+                          nullptr) == 0) {
+      threadCount++;
+    }
+    for (size_t i = 0; i < threadCount; i++) {
+      (void)pthread_join(threadIds[i], nullptr);
+    }
+  }
+  return nullptr;
+}
+
+TEST_CASE("Commit while threads are being created", "[thread, transaction]") {
+  __atomic_store_n(&spawning, true, __ATOMIC_RELAXED);
+  pthread_t spawnThreadId;
+  REQUIRE_FALSE(pthread_create(&spawnThreadId, nullptr, spawnThread, nullptr));
+
+  for (size_t i = 0; i < 20; i++) {
+    Interject::Transaction txn =
+        Transaction::Builder()
+            .add("isqrt", isqrt_plus_one, &isqrt_trampoline)
+            .build();
+    REQUIRE(txn.prepare() == Transaction::ResultCode::Success);
+    REQUIRE(txn.commit() == Transaction::ResultCode::Success);
+    REQUIRE(txn.rollback() == Transaction::ResultCode::Success);
+  }
+
+  __atomic_store_n(&spawning, false, __ATOMIC_RELAXED);
+  CHECK_FALSE(pthread_join(spawnThreadId, nullptr));
+}